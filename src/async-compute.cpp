@@ -0,0 +1,311 @@
+#include "async-compute.hpp"
+#include <algorithm>
+#include <chrono>
+
+namespace cgbuffer {
+
+    void AsyncCompute::Create(foray::core::Context* context)
+    {
+        Destroy();
+        mContext = context;
+
+        // vk-bootstraps DeviceBuilder creates one queue of every family, so queue 0 of each family is available. The graphics queue is the first graphics family (as selected by foray)
+        std::vector<VkQueueFamilyProperties> families = mContext->VkbPhysicalDevice->get_queue_families();
+        mGraphicsFamily                              = ~0U;
+        mComputeFamily                               = ~0U;
+        for(uint32_t family = 0; family < families.size(); family++)
+        {
+            VkQueueFlags flags = families[family].queueFlags;
+            if(mGraphicsFamily == ~0U && (flags & VK_QUEUE_GRAPHICS_BIT) > 0)
+            {
+                mGraphicsFamily = family;
+            }
+            if(mComputeFamily == ~0U && (flags & VK_QUEUE_COMPUTE_BIT) > 0 && (flags & VK_QUEUE_GRAPHICS_BIT) == 0)
+            {
+                mComputeFamily = family;
+            }
+        }
+        foray::Assert(mGraphicsFamily != ~0U, "No graphics queue family");
+        if(mComputeFamily == ~0U)
+        {
+            foray::logger()->info("AsyncCompute: No dedicated compute queue family, compute work is recorded on the graphics queue");
+            mComputeFamily = mGraphicsFamily;
+            return;
+        }
+        vkGetDeviceQueue(mContext->Device(), mGraphicsFamily, 0, &mGraphicsQueue);
+        vkGetDeviceQueue(mContext->Device(), mComputeFamily, 0, &mComputeQueue);
+
+        VkSemaphoreTypeCreateInfo timelineCi{.sType = VkStructureType::VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO, .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE, .initialValue = 0};
+        VkSemaphoreCreateInfo     semaphoreCi{.sType = VkStructureType::VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, .pNext = &timelineCi};
+        foray::AssertVkResult(vkCreateSemaphore(mContext->Device(), &semaphoreCi, nullptr, &mGraphicsTimeline));
+        foray::AssertVkResult(vkCreateSemaphore(mContext->Device(), &semaphoreCi, nullptr, &mComputeTimeline));
+
+        VkCommandPoolCreateInfo poolCi{.sType            = VkStructureType::VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                                       .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+                                       .queueFamilyIndex = mComputeFamily};
+        foray::AssertVkResult(vkCreateCommandPool(mContext->Device(), &poolCi, nullptr, &mCommandPool));
+
+        VkCommandBuffer             cmdBuffers[SLOT_COUNT] = {};
+        VkCommandBufferAllocateInfo allocInfo{.sType              = VkStructureType::VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                                              .commandPool        = mCommandPool,
+                                              .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                                              .commandBufferCount = SLOT_COUNT};
+        foray::AssertVkResult(vkAllocateCommandBuffers(mContext->Device(), &allocInfo, cmdBuffers));
+        for(uint32_t slotIndex = 0; slotIndex < SLOT_COUNT; slotIndex++)
+        {
+            mSlots[slotIndex] = Slot{.CmdBuffer = cmdBuffers[slotIndex]};
+        }
+
+        // Per slot: Graphics begin, graphics end, compute begin, compute end
+        if(families[mGraphicsFamily].timestampValidBits > 0 && families[mComputeFamily].timestampValidBits > 0)
+        {
+            VkQueryPoolCreateInfo queryCi{.sType = VkStructureType::VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, .queryType = VK_QUERY_TYPE_TIMESTAMP, .queryCount = 4 * SLOT_COUNT};
+            foray::AssertVkResult(vkCreateQueryPool(mContext->Device(), &queryCi, nullptr, &mQueryPool));
+            mTimestampPeriod = mContext->VkbPhysicalDevice->properties.limits.timestampPeriod;
+            LoadCalibration();
+        }
+    }
+
+    void AsyncCompute::LoadCalibration()
+    {
+        // Device commands of extensions not enabled resolve to nullptr
+        auto getCalibratedTimestamps = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr(mContext->Device(), "vkGetCalibratedTimestampsEXT");
+        auto getTimeDomains =
+            (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)vkGetInstanceProcAddr(mContext->Instance(), "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+        if(!getCalibratedTimestamps || !getTimeDomains)
+        {
+            foray::logger()->info("AsyncCompute: VK_EXT_calibrated_timestamps is not enabled, overlap between the queues is not measured");
+            return;
+        }
+        VkPhysicalDevice physicalDevice = mContext->VkbPhysicalDevice->physical_device;
+        uint32_t         domainCount    = 0;
+        foray::AssertVkResult(getTimeDomains(physicalDevice, &domainCount, nullptr));
+        std::vector<VkTimeDomainEXT> domains(domainCount);
+        foray::AssertVkResult(getTimeDomains(physicalDevice, &domainCount, domains.data()));
+        if(std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_EXT) == domains.end())
+        {
+            foray::logger()->info("AsyncCompute: Device time domain is not calibrateable, overlap between the queues is not measured");
+            return;
+        }
+        mGetCalibratedTimestamps = getCalibratedTimestamps;
+    }
+
+    void AsyncCompute::BeginFrame(VkCommandBuffer graphicsCmdBuffer, uint64_t frameNumber)
+    {
+        foray::Assert(!mFrameBegun, "AsyncCompute: Previous frame was not submitted");
+        mFrameNumber = frameNumber;
+        mFrameBegun  = true;
+        mGraphicsWaits.clear();
+        mReleases.clear();
+        if(!IsDedicated())
+        {
+            return;
+        }
+
+        mCurrentSlot = (uint32_t)(frameNumber % SLOT_COUNT);
+        Slot& slot   = mSlots[mCurrentSlot];
+        if(slot.Pending)
+        {
+            auto waitBegin = std::chrono::steady_clock::now();
+            WaitForFrame(slot.FrameNumber);
+            ReadTimestamps(slot, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitBegin).count());
+        }
+        slot.FrameNumber = frameNumber;
+
+        VkCommandBufferBeginInfo beginInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+        foray::AssertVkResult(vkBeginCommandBuffer(slot.CmdBuffer, &beginInfo));
+
+        if(!!mQueryPool)
+        {
+            uint32_t firstQuery = mCurrentSlot * 4;
+            vkCmdResetQueryPool(graphicsCmdBuffer, mQueryPool, firstQuery, 2);
+            vkCmdWriteTimestamp2(graphicsCmdBuffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, mQueryPool, firstQuery);
+            vkCmdResetQueryPool(slot.CmdBuffer, mQueryPool, firstQuery + 2, 2);
+            vkCmdWriteTimestamp2(slot.CmdBuffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, mQueryPool, firstQuery + 2);
+        }
+    }
+
+    void AsyncCompute::AddGraphicsWait(uint64_t computeFrameNumber, VkPipelineStageFlags2 stages)
+    {
+        if(!IsDedicated() || stages == VK_PIPELINE_STAGE_2_NONE || !mAnySubmitted || computeFrameNumber > mLastSubmitted)
+        {
+            return;
+        }
+        mGraphicsWaits.push_back(VkSemaphoreSubmitInfo{.sType     = VkStructureType::VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                                       .semaphore = mComputeTimeline,
+                                                       .value     = GetTimelineValue(computeFrameNumber),
+                                                       .stageMask = stages});
+    }
+
+    void AsyncCompute::AddRelease(const VkImageMemoryBarrier2& barrier)
+    {
+        mReleases.push_back(barrier);
+    }
+
+    void AsyncCompute::EndFrame(VkCommandBuffer graphicsCmdBuffer)
+    {
+        if(!IsDedicated())
+        {
+            return;
+        }
+        if(!!mQueryPool)
+        {
+            vkCmdWriteTimestamp2(graphicsCmdBuffer, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, mQueryPool, mCurrentSlot * 4 + 1);
+        }
+        if(!mGraphicsWaits.empty())
+        {
+            // Semaphore waits submitted with vkQueueSubmit2 also apply to all batches later in submission order, including the frames graphics command buffer
+            SubmitSemaphores(mGraphicsQueue, mGraphicsWaits, nullptr, nullptr);
+        }
+    }
+
+    void AsyncCompute::Submit()
+    {
+        foray::Assert(mFrameBegun, "AsyncCompute: BeginFrame() was not called");
+        mFrameBegun = false;
+        if(!IsDedicated())
+        {
+            return;
+        }
+        Slot& slot = mSlots[mCurrentSlot];
+
+        if(!mReleases.empty())
+        {
+            VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                     .imageMemoryBarrierCount = (uint32_t)mReleases.size(),
+                                     .pImageMemoryBarriers    = mReleases.data()};
+            vkCmdPipelineBarrier2(slot.CmdBuffer, &depInfo);
+        }
+        if(!!mQueryPool)
+        {
+            vkCmdWriteTimestamp2(slot.CmdBuffer, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, mQueryPool, mCurrentSlot * 4 + 3);
+        }
+        foray::AssertVkResult(vkEndCommandBuffer(slot.CmdBuffer));
+
+        // Semaphore signals submitted with vkQueueSubmit2 cover all batches earlier in submission order, so an empty batch signals the end of the graphics frame
+        VkSemaphoreSubmitInfo graphicsDone{.sType     = VkStructureType::VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                           .semaphore = mGraphicsTimeline,
+                                           .value     = GetTimelineValue(mFrameNumber),
+                                           .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT};
+        SubmitSemaphores(mGraphicsQueue, {}, &graphicsDone, nullptr);
+
+        // Waiting on all commands keeps the begin timestamp from being written before the graphics frame has finished
+        VkSemaphoreSubmitInfo computeWait = graphicsDone;
+        VkSemaphoreSubmitInfo computeDone{.sType     = VkStructureType::VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                          .semaphore = mComputeTimeline,
+                                          .value     = GetTimelineValue(mFrameNumber),
+                                          .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT};
+        SubmitSemaphores(mComputeQueue, {computeWait}, &computeDone, slot.CmdBuffer);
+
+        slot.Pending   = true;
+        mAnySubmitted  = true;
+        mLastSubmitted = mFrameNumber;
+    }
+
+    void AsyncCompute::SubmitSemaphores(VkQueue queue, const std::vector<VkSemaphoreSubmitInfo>& waits, const VkSemaphoreSubmitInfo* signal, VkCommandBuffer cmdBuffer)
+    {
+        VkCommandBufferSubmitInfo cmdBufferInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO, .commandBuffer = cmdBuffer};
+        VkSubmitInfo2             submitInfo{.sType                    = VkStructureType::VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                             .waitSemaphoreInfoCount   = (uint32_t)waits.size(),
+                                             .pWaitSemaphoreInfos      = waits.data(),
+                                             .commandBufferInfoCount   = !!cmdBuffer ? 1U : 0U,
+                                             .pCommandBufferInfos      = &cmdBufferInfo,
+                                             .signalSemaphoreInfoCount = !!signal ? 1U : 0U,
+                                             .pSignalSemaphoreInfos    = signal};
+        foray::AssertVkResult(vkQueueSubmit2(queue, 1, &submitInfo, nullptr));
+    }
+
+    void AsyncCompute::WaitForFrame(uint64_t frameNumber)
+    {
+        if(!IsDedicated() || !mAnySubmitted || frameNumber > mLastSubmitted)
+        {
+            return;
+        }
+        uint64_t            value = GetTimelineValue(frameNumber);
+        VkSemaphoreWaitInfo waitInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO, .semaphoreCount = 1, .pSemaphores = &mComputeTimeline, .pValues = &value};
+        foray::AssertVkResult(vkWaitSemaphores(mContext->Device(), &waitInfo, UINT64_MAX));
+    }
+
+    void AsyncCompute::ReadTimestamps(Slot& slot, double waitMs)
+    {
+        slot.Pending = false;
+        mStats       = Stats{.FrameNumber = slot.FrameNumber, .WaitMs = waitMs};
+        if(!mQueryPool)
+        {
+            return;
+        }
+        // The compute work waited for the graphics frame, so all four timestamps are available
+        uint64_t timestamps[4] = {};
+        foray::AssertVkResult(vkGetQueryPoolResults(mContext->Device(), mQueryPool, mCurrentSlot * 4, 4, sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        Interval graphics{timestamps[0], timestamps[1]};
+        Interval compute{timestamps[2], timestamps[3]};
+        mStats.GraphicsMs = (double)(graphics.End - graphics.Begin) * mTimestampPeriod * 1e-6;
+        mStats.ComputeMs  = (double)(compute.End - compute.Begin) * mTimestampPeriod * 1e-6;
+        mStats.Valid      = true;
+
+        if(!mGetCalibratedTimestamps)
+        {
+            return;
+        }
+
+        // All timestamps of the frame were written before the calibration, so an interval ending after it is not in the device time domain (e.g. wrapped)
+        VkCalibratedTimestampInfoEXT calibrationInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = VK_TIME_DOMAIN_DEVICE_EXT};
+        uint64_t                     deviceNow    = 0;
+        uint64_t                     maxDeviation = 0;
+        foray::AssertVkResult(mGetCalibratedTimestamps(mContext->Device(), 1, &calibrationInfo, &deviceNow, &maxDeviation));
+        bool onTimeline = graphics.End <= deviceNow && compute.End <= deviceNow;
+
+        if(onTimeline && mPreviousComputeFrame + 1 == slot.FrameNumber)
+        {
+            uint64_t begin      = std::max(mPreviousCompute.Begin, graphics.Begin);
+            uint64_t end        = std::min(mPreviousCompute.End, graphics.End);
+            mStats.OverlapMs    = end > begin ? (double)(end - begin) * mTimestampPeriod * 1e-6 : 0.0;
+            mStats.OverlapValid = true;
+        }
+        mPreviousCompute      = compute;
+        mPreviousComputeFrame = onTimeline ? slot.FrameNumber : ~0ULL;
+    }
+
+    void AsyncCompute::Destroy()
+    {
+        if(!mContext)
+        {
+            return;
+        }
+        VkDevice device = mContext->Device();
+        if(mAnySubmitted)
+        {
+            WaitForFrame(mLastSubmitted);
+        }
+        if(!!mQueryPool)
+        {
+            vkDestroyQueryPool(device, mQueryPool, nullptr);
+            mQueryPool = nullptr;
+        }
+        if(!!mCommandPool)
+        {
+            vkDestroyCommandPool(device, mCommandPool, nullptr);
+            mCommandPool = nullptr;
+        }
+        for(VkSemaphore* timeline : {&mGraphicsTimeline, &mComputeTimeline})
+        {
+            if(!!*timeline)
+            {
+                vkDestroySemaphore(device, *timeline, nullptr);
+                *timeline = nullptr;
+            }
+        }
+        for(Slot& slot : mSlots)
+        {
+            slot = Slot{};
+        }
+        mGetCalibratedTimestamps = nullptr;
+        mPreviousComputeFrame    = ~0ULL;
+        mGraphicsQueue           = nullptr;
+        mComputeQueue            = nullptr;
+        mAnySubmitted  = false;
+        mFrameBegun    = false;
+        mContext       = nullptr;
+    }
+}  // namespace cgbuffer
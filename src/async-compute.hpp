@@ -0,0 +1,127 @@
+#pragma once
+#include <foray_api.hpp>
+#include <vector>
+
+namespace cgbuffer {
+
+    /// @brief Runs compute work following the G-buffer (derived outputs, reductions) on a dedicated compute queue, so it overlaps with the next frames rasterization
+    /// @details
+    /// How to use: Create, then every frame: BeginFrame, record graphics work (CRaster hands its follow-up work over), EndFrame, submit the graphics command buffer, Submit
+    ///  - BeginFrame: Begins the compute command buffer of the frame. Waits on the host for the compute work recorded SLOT_COUNT frames ago, and reads back its timestamps
+    ///  - GetCommandBuffer: Compute command buffer work is recorded into. Images used must have been handed over by an ownership transfer (see CRaster::SetAsyncCompute())
+    ///  - EndFrame: Submits an empty batch to the graphics queue waiting for compute work the graphics frame depends on (see AddGraphicsWait())
+    ///  - Submit: Signals that the graphics frame has finished, submits the compute command buffer waiting for it
+    /// Both queues are synchronized with a timeline semaphore each (a single one could be signaled out of order, as the queues overlap):
+    /// Frame N signals N+1 on the graphics timeline once its graphics work has finished, and N+1 on the compute timeline once its compute work has finished.
+    /// If the device has no compute queue family separate from the graphics family, IsDedicated() is false and users record their work into the graphics command buffer instead.
+    /// Timestamps are written around the graphics and compute work of every frame. GetStats() reports the duration of both per queue, and how long the compute work
+    /// of a frame ran concurrently with the graphics work of the next. Comparing timestamps of different queues requires VK_EXT_calibrated_timestamps with the
+    /// device time domain, in which vkCmdWriteTimestamp2() values of every queue are given. Every read back is calibrated against that domain once.
+    /// Without the extension, only per queue durations are reported. GetStats() also reports how long the host waited for compute work in BeginFrame().
+    class AsyncCompute
+    {
+      public:
+        /// @brief Number of frames recorded before a command buffer and its timestamps are reused. Must be at least the renderloops in flight frame count
+        inline static constexpr uint32_t SLOT_COUNT = 3;
+
+        /// @brief Timings of a single frame, in milliseconds
+        struct Stats
+        {
+            uint64_t FrameNumber = 0;
+            /// @brief Between BeginFrame() and EndFrame() on the graphics queue
+            double GraphicsMs = 0.0;
+            /// @brief Compute command buffer of the frame
+            double ComputeMs = 0.0;
+            /// @brief Time the previous frames compute work ran concurrently with this frames graphics work. Requires OverlapValid
+            double OverlapMs = 0.0;
+            /// @brief Host time BeginFrame() waited for the compute work of the frame before reusing its slot
+            double WaitMs = 0.0;
+            /// @brief False if no timestamps are available (no dedicated queue, or the queue families do not support timestamps)
+            bool Valid = false;
+            /// @brief False if timestamps of both queues can not be placed on one timeline (see AsyncCompute), or the previous frame was not read back
+            bool OverlapValid = false;
+        };
+
+        void Create(foray::core::Context* context);
+
+        inline bool     IsDedicated() const { return mComputeFamily != mGraphicsFamily; }
+        inline uint32_t GetGraphicsFamily() const { return mGraphicsFamily; }
+        inline uint32_t GetComputeFamily() const { return mComputeFamily; }
+
+        /// @brief Value signaled on both timelines once the respective work of a frame has finished
+        static inline uint64_t GetTimelineValue(uint64_t frameNumber) { return frameNumber + 1; }
+
+        /// @param graphicsCmdBuffer Command buffer of the frame submitted to the graphics queue (timestamps are written into it)
+        void BeginFrame(VkCommandBuffer graphicsCmdBuffer, uint64_t frameNumber);
+
+        /// @brief Compute command buffer of the current frame
+        inline VkCommandBuffer GetCommandBuffer() const { return mSlots[mCurrentSlot].CmdBuffer; }
+        inline uint64_t        GetFrameNumber() const { return mFrameNumber; }
+
+        /// @brief Makes graphics work of the current frame in stages wait for the compute work of an earlier frame
+        void AddGraphicsWait(uint64_t computeFrameNumber, VkPipelineStageFlags2 stages);
+        /// @brief Queues an ownership release (compute to graphics) recorded at the end of the current frames compute work
+        void AddRelease(const VkImageMemoryBarrier2& barrier);
+
+        /// @brief Writes the graphics end timestamp and submits the graphics waits. Call before submitting graphicsCmdBuffer
+        void EndFrame(VkCommandBuffer graphicsCmdBuffer);
+        /// @brief Signals the end of the graphics frame and submits the compute work. Call after submitting graphicsCmdBuffer
+        void Submit();
+
+        /// @brief Blocks until the compute work of a frame has finished. Returns immediately for frames not submitted yet
+        void WaitForFrame(uint64_t frameNumber);
+
+        /// @brief Timings of the newest frame read back (SLOT_COUNT frames behind)
+        inline const Stats& GetStats() const { return mStats; }
+
+        void Destroy();
+
+      protected:
+        struct Slot
+        {
+            VkCommandBuffer CmdBuffer   = nullptr;
+            uint64_t        FrameNumber = 0;
+            bool            Pending     = false;
+        };
+
+        struct Interval
+        {
+            uint64_t Begin = 0;
+            uint64_t End   = 0;
+        };
+
+        /// @brief Loads VK_EXT_calibrated_timestamps if enabled and the device time domain is calibrateable
+        void LoadCalibration();
+        void ReadTimestamps(Slot& slot, double waitMs);
+        void SubmitSemaphores(VkQueue queue, const std::vector<VkSemaphoreSubmitInfo>& waits, const VkSemaphoreSubmitInfo* signal, VkCommandBuffer cmdBuffer);
+
+        foray::core::Context* mContext          = nullptr;
+        uint32_t              mGraphicsFamily   = 0;
+        uint32_t              mComputeFamily    = 0;
+        VkQueue               mGraphicsQueue    = nullptr;
+        VkQueue               mComputeQueue     = nullptr;
+        VkSemaphore           mGraphicsTimeline = nullptr;
+        VkSemaphore           mComputeTimeline  = nullptr;
+        VkCommandPool         mCommandPool      = nullptr;
+        VkQueryPool           mQueryPool        = nullptr;
+        /// @brief Nanoseconds per timestamp tick
+        double                mTimestampPeriod = 0.0;
+        /// @brief nullptr if timestamps of different queues are not comparable
+        PFN_vkGetCalibratedTimestampsEXT mGetCalibratedTimestamps = nullptr;
+
+        Slot     mSlots[SLOT_COUNT];
+        uint32_t mCurrentSlot   = 0;
+        uint64_t mFrameNumber   = 0;
+        bool     mFrameBegun    = false;
+        bool     mAnySubmitted  = false;
+        uint64_t mLastSubmitted = 0;
+
+        std::vector<VkSemaphoreSubmitInfo> mGraphicsWaits;
+        std::vector<VkImageMemoryBarrier2> mReleases;
+
+        /// @brief Compute interval of the frame read back before the newest, for the overlap with the newest frames graphics interval
+        Interval mPreviousCompute;
+        uint64_t mPreviousComputeFrame = ~0ULL;
+        Stats    mStats;
+    };
+}  // namespace cgbuffer
@@ -0,0 +1,332 @@
+#include "backend-comparison.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
+#include <scene/components/foray_meshinstance.hpp>
+#include <scene/components/foray_transform.hpp>
+#include <scene/foray_mesh.hpp>
+#include <scene/globalcomponents/foray_drawmanager.hpp>
+#include <scene/globalcomponents/foray_geometrymanager.hpp>
+#include <unordered_map>
+
+namespace cgbuffer {
+
+    void BackendComparison::Build(foray::core::Context* context, foray::scene::Scene* scene, const RecipeFile& recipe, const VkExtent2D& extent, uint32_t threadCount)
+    {
+        mContext = context;
+        mScene   = scene;
+
+        mOutputs.clear();
+        for(const RecipeFile::NamedOutput& output : recipe.Outputs)
+        {
+            EComponent component;
+            uint32_t   channels;
+            if(!CpuRaster::IsSupported(output.Recipe) || output.Recipe.Derived == CRaster::DerivedOutput::SCREENMOTION
+               || !GetFormatLayout(output.Recipe.ImageFormat, component, channels))
+            {
+                foray::logger()->info("BackendComparison: Skipping output \"{}\", not supported by both backends", output.Name);
+                continue;
+            }
+            mGpu.AddOutput(output.Name, output.Recipe);
+            mCpu.AddOutput(output.Name, output.Recipe);
+            mOutputs.emplace_back(output.Name, output.Recipe.ImageFormat);
+        }
+        if(recipe.BuiltInFeaturesFlags != 0)
+        {
+            foray::logger()->info("BackendComparison: Global features of recipe \"{}\" are not applied, the CPU backend does not implement them", recipe.Name);
+        }
+
+        // Windowless batch rendering draws through the draw list
+        mGpu.SetRenderExtent(extent);
+        mGpu.SetSortDraws(true);
+        mGpu.Build(mContext, mScene, "BackendComparison.CRaster");
+        mOutputs.emplace_back(std::string(mGpu.GetDepthOutputName()), VK_FORMAT_D32_SFLOAT);
+
+        mCpu.Build(extent, threadCount);
+        GatherScene();
+    }
+
+    void BackendComparison::GatherScene()
+    {
+        auto geometryStore = mScene->GetComponent<foray::scene::gcomp::GeometryStore>();
+        auto drawDirector  = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+
+        std::vector<uint8_t> vertexBytes;
+        std::vector<uint8_t> indexBytes;
+        Download(geometryStore->GetVerticesBuffer(), vertexBytes);
+        Download(geometryStore->GetIndicesBuffer(), indexBytes);
+
+        mCpuScene = CpuRaster::Scene{};
+        mCpuScene.Vertices.resize(vertexBytes.size() / sizeof(foray::scene::Vertex));
+        memcpy(mCpuScene.Vertices.data(), vertexBytes.data(), mCpuScene.Vertices.size() * sizeof(foray::scene::Vertex));
+        mCpuScene.Indices.resize(indexBytes.size() / sizeof(uint32_t));
+        memcpy(mCpuScene.Indices.data(), indexBytes.data(), mCpuScene.Indices.size() * sizeof(uint32_t));
+
+        for(const foray::scene::gcomp::DrawDirector::DrawOp& drawOp : drawDirector->GetDrawOps())
+        {
+            uint32_t instanceCount = (uint32_t)drawOp.Instances.size();
+            if(mCpuScene.CurrentTransforms.size() < drawOp.TransformOffset + instanceCount)
+            {
+                mCpuScene.CurrentTransforms.resize(drawOp.TransformOffset + instanceCount, glm::mat4(1.f));
+            }
+            for(uint32_t instanceIndex = 0; instanceIndex < instanceCount; instanceIndex++)
+            {
+                mCpuScene.CurrentTransforms[drawOp.TransformOffset + instanceIndex] = drawOp.Instances[instanceIndex]->GetNode()->GetTransform()->GetGlobalMatrix();
+            }
+
+            for(const foray::scene::Primitive& primitive : drawOp.Target->GetPrimitives())
+            {
+                CpuRaster::Draw draw{.FirstIndex            = primitive.First,
+                                     .IndexCount            = primitive.VertexOrIndexCount,
+                                     .MaterialIndex         = primitive.MaterialIndex,
+                                     .TransformBufferOffset = drawOp.TransformOffset,
+                                     .InstanceCount         = instanceCount};
+                if(primitive.Type != foray::scene::Primitive::EType::Index)
+                {
+                    // Non indexed primitives draw a sequential index range appended to the host indices
+                    draw.FirstIndex = (uint32_t)mCpuScene.Indices.size();
+                    for(uint32_t vertex = 0; vertex < primitive.VertexOrIndexCount; vertex++)
+                    {
+                        mCpuScene.Indices.push_back(primitive.First + vertex);
+                    }
+                }
+                mCpuScene.Draws.push_back(draw);
+            }
+        }
+    }
+
+    void BackendComparison::Run(std::span<const CRaster::PoseCamera> cameras, const Tolerance& tolerance)
+    {
+        mResults = Results{};
+        for(const auto& [name, format] : mOutputs)
+        {
+            mResults.Outputs.push_back(OutputResult{.Name = name});
+        }
+
+        // Both backends use the transforms read back by Build(), so node animation between Build() and Run() does not cause mismatches
+        std::vector<CRaster::BatchPose> poses;
+        for(const CRaster::PoseCamera& camera : cameras)
+        {
+            poses.push_back(CRaster::BatchPose{.Camera = camera, .Transforms = mCpuScene.CurrentTransforms});
+        }
+
+        std::vector<std::unordered_map<std::string, std::vector<uint8_t>>> gpuPoses(poses.size());
+
+        auto begin = std::chrono::steady_clock::now();
+        mGpu.RenderBatch(poses, [&](const CRaster::PoseReadback& pose) {
+            for(const auto& [name, data] : pose.Data)
+            {
+                gpuPoses[pose.PoseIndex][name].assign(data.begin(), data.end());
+            }
+        });
+        mResults.GpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+        for(uint32_t poseIndex = 0; poseIndex < poses.size(); poseIndex++)
+        {
+            const CRaster::PoseCamera& camera      = cameras[poseIndex];
+            mCpuScene.ProjectionViewMatrix         = camera.ProjectionMatrix * camera.ViewMatrix;
+            mCpuScene.PreviousProjectionViewMatrix = mCpuScene.ProjectionViewMatrix;
+
+            begin = std::chrono::steady_clock::now();
+            mCpu.Render(mCpuScene);
+            mResults.CpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+            for(uint32_t outputIndex = 0; outputIndex < mOutputs.size(); outputIndex++)
+            {
+                const auto& [name, format] = mOutputs[outputIndex];
+                // Depth is compared last
+                bool                        depth = outputIndex + 1 == mOutputs.size();
+                const CpuRaster::HostImage& cpu   = depth ? mCpu.GetDepthImage() : mCpu.GetOutput(name);
+                Compare(name, format, gpuPoses[poseIndex].at(name), cpu, tolerance, mResults.Outputs[outputIndex]);
+            }
+            gpuPoses[poseIndex].clear();
+        }
+    }
+
+    bool BackendComparison::GetFormatLayout(VkFormat format, EComponent& component, uint32_t& channels)
+    {
+        switch(format)
+        {
+            case VK_FORMAT_R32_SFLOAT:
+            case VK_FORMAT_D32_SFLOAT:
+                component = EComponent::FLOAT32;
+                channels  = 1;
+                return true;
+            case VK_FORMAT_R32G32_SFLOAT:
+                component = EComponent::FLOAT32;
+                channels  = 2;
+                return true;
+            case VK_FORMAT_R32G32B32A32_SFLOAT:
+                component = EComponent::FLOAT32;
+                channels  = 4;
+                return true;
+            case VK_FORMAT_R16_SFLOAT:
+                component = EComponent::FLOAT16;
+                channels  = 1;
+                return true;
+            case VK_FORMAT_R16G16_SFLOAT:
+                component = EComponent::FLOAT16;
+                channels  = 2;
+                return true;
+            case VK_FORMAT_R16G16B16A16_SFLOAT:
+                component = EComponent::FLOAT16;
+                channels  = 4;
+                return true;
+            case VK_FORMAT_R32_SINT:
+                component = EComponent::INT32;
+                channels  = 1;
+                return true;
+            case VK_FORMAT_R32G32_SINT:
+                component = EComponent::INT32;
+                channels  = 2;
+                return true;
+            case VK_FORMAT_R32G32B32A32_SINT:
+                component = EComponent::INT32;
+                channels  = 4;
+                return true;
+            case VK_FORMAT_R32_UINT:
+                component = EComponent::UINT32;
+                channels  = 1;
+                return true;
+            case VK_FORMAT_R32G32_UINT:
+                component = EComponent::UINT32;
+                channels  = 2;
+                return true;
+            case VK_FORMAT_R32G32B32A32_UINT:
+                component = EComponent::UINT32;
+                channels  = 4;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void BackendComparison::Compare(
+        const std::string& name, VkFormat format, std::span<const uint8_t> gpu, const CpuRaster::HostImage& cpu, const Tolerance& tolerance, OutputResult& result)
+    {
+        EComponent component;
+        uint32_t   channels;
+        GetFormatLayout(format, component, channels);
+        uint32_t componentSize = component == EComponent::FLOAT16 ? 2 : 4;
+        uint64_t pixelCount    = (uint64_t)cpu.Extent.width * cpu.Extent.height;
+        FORAY_ASSERTFMT(gpu.size() == pixelCount * channels * componentSize, "BackendComparison: Readback of \"{}\" does not match the extent", name);
+
+        // Formats may store fewer channels than the recipe type writes (or pad), only channels present in both are compared
+        uint32_t compared = std::min(channels, cpu.Channels);
+        for(uint64_t pixel = 0; pixel < pixelCount; pixel++)
+        {
+            bool mismatch = false;
+            for(uint32_t channel = 0; channel < compared; channel++)
+            {
+                const uint8_t* src     = gpu.data() + (pixel * channels + channel) * componentSize;
+                uint32_t       cpuBits = cpu.Texels[pixel * cpu.Channels + channel];
+                double         error   = 0.0;
+                bool           equal   = false;
+                switch(component)
+                {
+                    case EComponent::FLOAT32:
+                    case EComponent::FLOAT16: {
+                        float value;
+                        if(component == EComponent::FLOAT32)
+                        {
+                            memcpy(&value, src, sizeof(float));
+                        }
+                        else
+                        {
+                            uint16_t half;
+                            memcpy(&half, src, sizeof(uint16_t));
+                            value = glm::unpackHalf1x16(half);
+                        }
+                        float expected = std::bit_cast<float>(cpuBits);
+                        error          = std::abs((double)value - (double)expected);
+                        // NaN only matches NaN
+                        equal = (std::isnan(value) && std::isnan(expected)) || error <= tolerance.Absolute + tolerance.Relative * std::abs(value);
+                        break;
+                    }
+                    case EComponent::INT32:
+                    case EComponent::UINT32: {
+                        uint32_t value;
+                        memcpy(&value, src, sizeof(uint32_t));
+                        error = component == EComponent::INT32 ? std::abs((double)std::bit_cast<int32_t>(value) - (double)std::bit_cast<int32_t>(cpuBits))
+                                                               : std::abs((double)value - (double)cpuBits);
+                        equal = value == cpuBits;
+                        break;
+                    }
+                }
+                if(!std::isnan(error))
+                {
+                    result.MaxError = std::max(result.MaxError, error);
+                }
+                mismatch = mismatch || !equal;
+            }
+            result.MismatchCount += mismatch ? 1 : 0;
+        }
+        result.PixelCount += pixelCount;
+    }
+
+    void BackendComparison::LogResults() const
+    {
+        foray::logger()->info("BackendComparison: GPU {:.2f} ms, CPU {:.2f} ms", mResults.GpuMs, mResults.CpuMs);
+        for(const OutputResult& output : mResults.Outputs)
+        {
+            double percent = output.PixelCount > 0 ? 100.0 * (double)output.MismatchCount / (double)output.PixelCount : 0.0;
+            foray::logger()->info("BackendComparison: \"{}\": {} of {} pixels mismatch ({:.3f}%), max error {}", output.Name, output.MismatchCount, output.PixelCount, percent,
+                                  output.MaxError);
+        }
+    }
+
+    void BackendComparison::Download(foray::core::ManagedBuffer& source, std::vector<uint8_t>& out)
+    {
+        VkDeviceSize size = source.GetSize();
+        out.resize((size_t)size);
+        if(size == 0)
+        {
+            return;
+        }
+
+        foray::core::ManagedBuffer             staging;
+        foray::core::ManagedBuffer::CreateInfo stagingCi(VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                         VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, "BackendComparison.Download");
+        staging.Create(mContext, stagingCi);
+
+        foray::core::HostSyncCommandBuffer cmdBuffer;
+        cmdBuffer.Create(mContext);
+        cmdBuffer.Begin();
+        VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = size};
+        vkCmdCopyBuffer(cmdBuffer.GetCommandBuffer(), source.GetBuffer(), staging.GetBuffer(), 1, &region);
+        VkBufferMemoryBarrier2 hostBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                           .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                           .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                           .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                           .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+                                           .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                           .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                           .buffer              = staging.GetBuffer(),
+                                           .offset              = 0,
+                                           .size                = VK_WHOLE_SIZE};
+        VkDependencyInfo       depInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &hostBarrier};
+        vkCmdPipelineBarrier2(cmdBuffer.GetCommandBuffer(), &depInfo);
+        cmdBuffer.End();
+        cmdBuffer.Submit();
+        cmdBuffer.WaitForCompletion();
+
+        void* data = nullptr;
+        vmaInvalidateAllocation(mContext->Allocator, staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+        staging.Map(data);
+        memcpy(out.data(), data, (size_t)size);
+        staging.Unmap();
+
+        cmdBuffer.Destroy();
+        staging.Destroy();
+    }
+
+    void BackendComparison::Destroy()
+    {
+        mGpu.Destroy();
+        mCpu.Destroy();
+        mCpuScene = CpuRaster::Scene{};
+        mOutputs.clear();
+    }
+}  // namespace cgbuffer
@@ -0,0 +1,87 @@
+#pragma once
+#include "cpu-raster.hpp"
+#include "recipe-file.hpp"
+
+namespace cgbuffer {
+
+    /// @brief Renders the same recipe and poses with CRaster and CpuRaster and compares the outputs per pixel, to validate and benchmark the CPU backend
+    /// @details
+    /// How to use: Build, Run, Get Results
+    ///  - Build: Adds every output of the recipe both backends support to a CRaster (at a fixed render extent) and a CpuRaster, see BackendComparison::Build()
+    ///  - Run: Renders all poses with CRaster::RenderBatch() and CpuRaster::Render(), see BackendComparison::Run()
+    ///  - Get Results: Mismatching pixels and largest error per output (and depth), and the wall time of either backend
+    /// Both backends draw the scenes geometry and node transforms as read back once by Build(). Outputs the CPU backend does not support (see CpuRaster::IsSupported()),
+    /// derived SCREENMOTION outputs (not supported by batch rendering) and the recipes global features are skipped.
+    /// The raster does not match any pipeline variant compiled ahead of time, so runtime shader compilation is required.
+    class BackendComparison
+    {
+      public:
+        /// @brief A channel matches if |gpu - cpu| <= Absolute + Relative * |gpu|. Integer channels must be equal
+        struct Tolerance
+        {
+            float Absolute = 1e-3f;
+            float Relative = 1e-2f;
+        };
+
+        struct OutputResult
+        {
+            std::string Name;
+            uint64_t    PixelCount = 0;
+            /// @brief Pixels with at least one channel outside the tolerance
+            uint64_t MismatchCount = 0;
+            /// @brief Largest absolute difference of any float channel, or of any integer channel
+            double MaxError = 0.0;
+        };
+
+        struct Results
+        {
+            /// @brief One entry per compared output, the depth output last
+            std::vector<OutputResult> Outputs;
+            /// @brief Wall time of CRaster::RenderBatch(), including readback
+            double GpuMs = 0.0;
+            /// @brief Wall time of CpuRaster::Render() for all poses
+            double CpuMs = 0.0;
+        };
+
+        /// @param extent Render extent of both backends
+        /// @param threadCount CpuRaster worker count, 0 selects std::thread::hardware_concurrency()
+        void Build(foray::core::Context* context, foray::scene::Scene* scene, const RecipeFile& recipe, const VkExtent2D& extent, uint32_t threadCount = 0);
+
+        /// @brief Renders every pose with both backends and compares the results
+        /// @remarks The GPU results of all poses are held in host memory until the CPU backend has rendered them
+        void Run(std::span<const CRaster::PoseCamera> cameras, const Tolerance& tolerance = Tolerance{});
+
+        inline const Results& GetResults() const { return mResults; }
+
+        /// @brief Logs the results, one line per output
+        void LogResults() const;
+
+        void Destroy();
+
+      protected:
+        enum class EComponent
+        {
+            FLOAT32,
+            FLOAT16,
+            INT32,
+            UINT32,
+        };
+
+        /// @brief Returns false for formats the comparison can not decode
+        static bool GetFormatLayout(VkFormat format, EComponent& component, uint32_t& channels);
+
+        /// @brief Reads geometry back and gathers draws and transforms in the layout CRaster draws them in
+        void GatherScene();
+        void Download(foray::core::ManagedBuffer& source, std::vector<uint8_t>& out);
+        void Compare(const std::string& name, VkFormat format, std::span<const uint8_t> gpu, const CpuRaster::HostImage& cpu, const Tolerance& tolerance, OutputResult& result);
+
+        foray::core::Context* mContext = nullptr;
+        foray::scene::Scene*  mScene   = nullptr;
+        CRaster               mGpu;
+        CpuRaster             mCpu;
+        CpuRaster::Scene      mCpuScene;
+        /// @brief Compared outputs and their image formats
+        std::vector<std::pair<std::string, VkFormat>> mOutputs;
+        Results                                       mResults;
+    };
+}  // namespace cgbuffer
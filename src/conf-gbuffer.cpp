@@ -1,4 +1,7 @@
 #include "conf-gbuffer.hpp"
+#include "precompiled-shaders.hpp"
+#include <algorithm>
+#include <cstring>
 #include <scene/foray_geo.hpp>
 #include <scene/globalcomponents/foray_cameramanager.hpp>
 #include <scene/globalcomponents/foray_drawmanager.hpp>
@@ -23,6 +26,12 @@ namespace cgbuffer {
          .ImageFormat          = VkFormat::VK_FORMAT_R16G16B16A16_SFLOAT,
          .Result               = "normalMapped,0"};
 
+    const CRaster::OutputRecipe CRaster::Templates::VertexNormal = 
+        {.FragmentInputFlags = (uint32_t)FragmentInputFlagBits::NORMAL,
+         .Type               = FragmentOutputType::VEC4,
+         .ImageFormat        = VkFormat::VK_FORMAT_R16G16B16A16_SFLOAT,
+         .Result             = "normalize(Normal),0"};
+
     const CRaster::OutputRecipe CRaster::Templates::Albedo = 
         {.FragmentInputFlags = (uint32_t)FragmentInputFlagBits::UV,
          .BuiltInFeaturesFlags = (uint32_t)BuiltInFeaturesFlagBits::MATERIALPROBE,
@@ -68,6 +77,22 @@ namespace cgbuffer {
          .ClearValue         = {{1.f, 0.f}},
          .Calculation        = "float linearZ = DevicePos.z * DevicePos.w; float derivative = max(abs(dFdx(linearZ)), abs(dFdy(linearZ)));",
          .Result             = "linearZ, derivative"};
+
+    const CRaster::OutputRecipe CRaster::Templates::DerivedWorldPos = 
+        {.Type        = FragmentOutputType::VEC4,
+         .ImageFormat = VkFormat::VK_FORMAT_R16G16B16A16_SFLOAT,
+         .Derived     = DerivedOutput::WORLDPOS};
+
+    const CRaster::OutputRecipe CRaster::Templates::DerivedDepthAndDerivative = 
+        {.Type        = FragmentOutputType::VEC2,
+         .ImageFormat = VkFormat::VK_FORMAT_R16G16_SFLOAT,
+         .ClearValue  = {{1.f, 0.f}},
+         .Derived     = DerivedOutput::DEPTHANDDERIVATIVE};
+
+    const CRaster::OutputRecipe CRaster::Templates::DerivedScreenMotion = 
+        {.Type        = FragmentOutputType::VEC2,
+         .ImageFormat = VkFormat::VK_FORMAT_R16G16_SFLOAT,
+         .Derived     = DerivedOutput::SCREENMOTION};
     // clang-format on
 
 
@@ -208,11 +233,29 @@ namespace cgbuffer {
         std::string keycopy(name);
         FORAY_ASSERTFMT(mOutputMap.size() < MAX_OUTPUT_COUNT, "Can not exceed maximum output count of {}", MAX_OUTPUT_COUNT);
         FORAY_ASSERTFMT(!mOutputMap.contains(keycopy), "Raster stage already configured with an output named \"{}\"", name);
-        foray::Assert(!mPipeline, "Must add outputs before building!");
+        foray::Assert(mPasses.empty(), "Must add outputs before building!");
         std::unique_ptr<Output>& output = mOutputMap[keycopy] = std::make_unique<Output>(name, recipe);
         mOutputList.push_back(output.get());
+        if(recipe.Derived == DerivedOutput::SCREENMOTION && !FindInstanceIdOutput())
+        {
+            // Motion of moved instances is reconstructed from their transforms, which requires the instance per pixel
+            AddOutput(fmt::format("{}.InstanceId", name), Templates::MeshInstanceId);
+        }
         return *this;
     }
+
+    CRaster::Output* CRaster::FindInstanceIdOutput() const
+    {
+        for(Output* output : mOutputList)
+        {
+            const OutputRecipe& recipe = output->Recipe;
+            if(recipe.Derived == DerivedOutput::NONE && recipe.ImageFormat == VK_FORMAT_R32_SINT && recipe.Result == Templates::MeshInstanceId.Result)
+            {
+                return output;
+            }
+        }
+        return nullptr;
+    }
     const CRaster::OutputRecipe& CRaster::GetOutputRecipe(std::string_view name) const
     {
         std::string               keycopy(name);
@@ -224,11 +267,21 @@ namespace cgbuffer {
         FORAY_THROWFMT("CGBuffer does not contain output \"{}\"!", name);
     }
 
+    std::vector<std::string_view> CRaster::GetOutputNames() const
+    {
+        std::vector<std::string_view> names;
+        for(Output* output : mOutputList)
+        {
+            names.push_back(output->Name);
+        }
+        return names;
+    }
+
     VkAttachmentDescription CRaster::Output::GetAttachmentDescr() const
     {
         return VkAttachmentDescription{.flags          = 0,
-                                       .format         = Image.GetFormat(),
-                                       .samples        = Image.GetSampleCount(),
+                                       .format         = Images[0].GetFormat(),
+                                       .samples        = Images[0].GetSampleCount(),
                                        .loadOp         = VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_CLEAR,
                                        .storeOp        = VkAttachmentStoreOp::VK_ATTACHMENT_STORE_OP_STORE,
                                        .stencilLoadOp  = VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_DONT_CARE,
@@ -237,9 +290,145 @@ namespace cgbuffer {
                                        .finalLayout    = VkImageLayout::VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
     }
 
+    foray::core::ManagedImage* CRaster::GetImageOutput(std::string_view name, bool noThrow)
+    {
+        FORAY_ASSERTFMT(!IsHandedToCompute(name), "Output \"{}\" is owned by the compute queue family after the raster passes, see CRaster::SetAsyncCompute()", name);
+        return RasterizedRenderStage::GetImageOutput(name, noThrow);
+    }
+
     foray::core::ManagedImage* CRaster::GetDepthImage()
     {
-        return &mDepthImage;
+        FORAY_ASSERTFMT(!IsHandedToCompute(mDepthOutputName), "Depth is owned by the compute queue family after the raster passes, see CRaster::SetAsyncCompute()");
+        return &DepthOfSet(mCurrentSet);
+    }
+
+    foray::core::ManagedImage* CRaster::GetHistoryDepthImage()
+    {
+        foray::Assert(mHistory, "History must be enabled, see CRaster::SetOutputSetCount()");
+        FORAY_ASSERTFMT(!IsComputeOwned(mDepthOutputName), "Depth stays owned by the compute queue family, see the returnStages of CRaster::SetAsyncCompute()");
+        return &DepthOfSet((mCurrentSet + mOutputSetCount - 1) % mOutputSetCount);
+    }
+
+    bool CRaster::IsComputeOwned(std::string_view name) const
+    {
+        return mAsyncReturnStages == VK_PIPELINE_STAGE_2_NONE && IsHandedToCompute(name);
+    }
+
+    bool CRaster::IsHandedToCompute(std::string_view name) const
+    {
+        if(!UsesAsyncCompute())
+        {
+            return false;
+        }
+        if(name == mDepthOutputName)
+        {
+            return !mDeriveAsync.Outputs.empty() || std::find(mAsyncInputNames.begin(), mAsyncInputNames.end(), name) != mAsyncInputNames.end();
+        }
+        return std::any_of(mDeriveAsync.Outputs.begin(), mDeriveAsync.Outputs.end(), [&](Output* output) { return output->Name == name; })
+               || std::find(mAsyncInputNames.begin(), mAsyncInputNames.end(), name) != mAsyncInputNames.end();
+    }
+
+    foray::core::ManagedImage* CRaster::GetImageOutputOfSet(std::string_view name, uint32_t set)
+    {
+        FORAY_ASSERTFMT(set < mOutputSetCount, "Output set {} out of range (configured {} sets)", set, mOutputSetCount);
+        if(name == mDepthOutputName)
+        {
+            return &DepthOfSet(set);
+        }
+        std::string         keycopy(name);
+        OutputMap::iterator iter = mOutputMap.find(keycopy);
+        if(iter != mOutputMap.end())
+        {
+            return &iter->second->Images[set];
+        }
+        FORAY_THROWFMT("CGBuffer does not contain output \"{}\"!", name);
+    }
+
+    foray::core::ManagedImage* CRaster::GetHistoryImageOutput(std::string_view name)
+    {
+        foray::Assert(mHistory, "History must be enabled, see CRaster::SetOutputSetCount()");
+        FORAY_ASSERTFMT(!IsComputeOwned(name), "Output \"{}\" stays owned by the compute queue family, see the returnStages of CRaster::SetAsyncCompute()", name);
+        return GetImageOutputOfSet(name, (mCurrentSet + mOutputSetCount - 1) % mOutputSetCount);
+    }
+
+    CRaster& CRaster::SetOutputSetCount(uint32_t count, uint32_t inFlightFrameCount, bool history)
+    {
+        foray::Assert(mPasses.empty(), "Must configure output sets before building!");
+        FORAY_ASSERTFMT(count > 0 && count <= MAX_OUTPUT_SETS, "Output set count must be in [1, {}]", MAX_OUTPUT_SETS);
+        foray::Assert(inFlightFrameCount > 0, "In flight frame count must be at least 1");
+        mOutputSetCount     = count;
+        mInFlightFrameCount = inFlightFrameCount;
+        mHistory            = history;
+        return *this;
+    }
+
+    void CRaster::SetImageOutputsToSet(uint32_t set)
+    {
+        mCurrentSet = set;
+        for(auto& pair : mOutputMap)
+        {
+            mImageOutputs[pair.first] = &pair.second->Images[set];
+        }
+        mImageOutputs[mDepthOutputName] = &DepthOfSet(set);
+    }
+
+    CRaster& CRaster::SetDepthSource(CRaster* source)
+    {
+        foray::Assert(mPasses.empty(), "Must configure depth source before building!");
+        foray::Assert(source != this, "CRaster can not use its own depth as depth source");
+        mDepthSource = source;
+        return *this;
+    }
+
+    CRaster& CRaster::SetAsyncCompute(AsyncCompute* asyncCompute, VkPipelineStageFlags2 returnStages)
+    {
+        foray::Assert(mPasses.empty(), "Must configure async compute before building!");
+        mAsyncCompute      = asyncCompute;
+        mAsyncReturnStages = returnStages;
+        return *this;
+    }
+
+    CRaster& CRaster::AddAsyncComputeInput(std::string_view name)
+    {
+        foray::Assert(!mPasses.empty(), "Must add async compute inputs after building!");
+        foray::core::ManagedImage* image = GetImageOutputOfSet(name, 0);
+        if(!UsesAsyncCompute())
+        {
+            return *this;
+        }
+        // Outputs evaluated on the compute queue are never transferred
+        bool computeOwned = std::any_of(mDeriveAsync.Outputs.begin(), mDeriveAsync.Outputs.end(), [&](Output* output) { return &output->Images[0] == image; });
+        if(!computeOwned && std::find(mAsyncInputNames.begin(), mAsyncInputNames.end(), name) == mAsyncInputNames.end())
+        {
+            mAsyncInputNames.emplace_back(name);
+        }
+        return *this;
+    }
+
+    CRaster& CRaster::SetSortDraws(bool sortDraws)
+    {
+        foray::Assert(mPasses.empty(), "Must configure draw sorting before building!");
+        mSortDraws = sortDraws;
+        return *this;
+    }
+
+    CRaster& CRaster::SetVisibleInstances(const InstanceBvh* bvh, const std::vector<uint32_t>* visible)
+    {
+        foray::Assert(mSortDraws, "Visible instance lists require draw sorting, see CRaster::SetSortDraws()");
+        mDrawList.SetVisibleInstances(bvh, visible);
+        return *this;
+    }
+
+    CRaster& CRaster::SetMeshLods(const MeshLods* lods)
+    {
+        foray::Assert(mPasses.empty(), "Must configure mesh LODs before building!");
+        mMeshLods = lods;
+        return *this;
+    }
+
+    foray::core::ManagedImage& CRaster::DepthOfSet(uint32_t set)
+    {
+        return !!mDepthSource ? *mDepthSource->GetImageOutputOfSet(mDepthSource->GetDepthOutputName(), set) : mDepthImages[set];
     }
 
     void CRaster::Build(foray::core::Context* context, foray::scene::Scene* scene, std::string_view name)
@@ -249,72 +438,293 @@ namespace cgbuffer {
         mScene   = scene;
         mName    = std::string(name);
 
-        CheckDeviceColorAttachmentCount();
-        CreateOutputs(mContext->GetSwapchainSize());
-        CreateRenderPass();
+        CreatePasses();
+        if(mOutputSetCount > 1)
+        {
+            // Writing a set waits for nothing but the in flight fence (see RecordRasterPass())
+            FORAY_ASSERTFMT(mOutputSetCount >= mInFlightFrameCount, "Output set count ({}) must be at least the in flight frame count ({})", mOutputSetCount,
+                            mInFlightFrameCount);
+        }
+        if(mHistory)
+        {
+            // Frame F reads the set of frame F-1, which frame F-1+count rewrites. Only the fence of frame F-1+count-inFlightFrameCount is waited on then, so it must not precede F
+            FORAY_ASSERTFMT(mOutputSetCount > mInFlightFrameCount, "History requires more output sets ({}) than frames in flight ({})", mOutputSetCount, mInFlightFrameCount);
+        }
+        if(UsesAsyncCompute())
+        {
+            if(mOutputSetCount < 2)
+            {
+                // Rewriting the only set waits for the compute work of the previous frame
+                foray::logger()->warn("CRaster \"{}\": Async compute with a single output set can not overlap frames, see CRaster::SetOutputSetCount()", mName);
+            }
+            foray::Assert(!mDepthSource, "Async compute does not support a depth source");
+            foray::Assert(!mTiling.has_value(), "Tiled mode does not support async compute");
+        }
+        if(!!mDepthSource)
+        {
+            foray::Assert(!mTiling.has_value(), "Tiled mode does not support a depth source");
+            foray::Assert(mDepthSource->GetPassCount() > 0, "Depth source must be built before its consumers");
+            FORAY_ASSERTFMT(mDepthSource->GetOutputSetCount() == mOutputSetCount, "Output set count ({}) must match the depth sources output set count ({})",
+                            mOutputSetCount, mDepthSource->GetOutputSetCount());
+            // The equal depth test only passes for the exact triangles the depth source rasterized
+            foray::Assert(mMeshLods == mDepthSource->mMeshLods, "Mesh LODs must match the depth sources mesh LODs");
+        }
+        foray::Assert(!mMeshLods || mSortDraws, "Mesh LODs require draw sorting, see CRaster::SetSortDraws()");
+        mDrawList.SetMeshLods(mMeshLods);
+        if(mTiling.has_value())
+        {
+            // Derived motion reads the scenes camera, not the cropped camera of a tile
+            foray::Assert(!mInstanceIdOutput, "Tiled mode does not support derived SCREENMOTION outputs, use the rasterized ScreenMotion template instead");
+            foray::Assert(!mFixedExtent.has_value(), "Tiled mode sizes the attachments by the tiling configuration, do not set a render extent");
+            CheckTilingLimits();
+            mRenderExtent = VkExtent2D{mTiling->TileExtent.width + 2 * mTiling->Border, mTiling->TileExtent.height + 2 * mTiling->Border};
+        }
+        else if(mFixedExtent.has_value())
+        {
+            mRenderExtent = *mFixedExtent;
+        }
+        else
+        {
+            mRenderExtent = mContext->GetSwapchainSize();
+        }
+        CreateOutputs(mRenderExtent);
+        for(uint32_t passIndex = 0; passIndex < mPasses.size(); passIndex++)
+        {
+            CreateRenderPass(*mPasses[passIndex], passIndex == 0 && !mDepthSource);
+        }
         CreateFrameBuffer();
         SetupDescriptors();
         CreateDescriptorSets();
         CreatePipelineLayout();
-        CreatePipeline();
+        for(uint32_t passIndex = 0; passIndex < mPasses.size(); passIndex++)
+        {
+            CreatePipeline(*mPasses[passIndex], passIndex == 0 && !mDepthSource);
+        }
+        CreateDerivePass(mDerive);
+        CreateDerivePass(mDeriveAsync);
     }
 
-    void CRaster::CheckDeviceColorAttachmentCount()
+    std::vector<CRaster::OutputList> CRaster::PartitionOutputs(uint32_t maxColorAttachments) const
     {
+        uint32_t passCapacity = std::min(maxColorAttachments, MAX_PASS_OUTPUT_COUNT);
+        FORAY_ASSERTFMT(passCapacity > 0, "Invalid color attachment limit {}", maxColorAttachments);
+
+        // Derived outputs are written by the derive compute pass and take no color attachment
+        OutputList rasterized;
+        for(Output* output : mOutputList)
+        {
+            if(output->Recipe.Derived == DerivedOutput::NONE)
+            {
+                rasterized.push_back(output);
+            }
+        }
+
+        // Spread outputs evenly instead of filling passes, so no pass ends up with a single leftover output
+        uint32_t outputCount    = (uint32_t)rasterized.size();
+        uint32_t passCount      = std::max(1U, (outputCount + passCapacity - 1) / passCapacity);
+        uint32_t outputsPerPass = std::max(1U, (outputCount + passCount - 1) / passCount);
+
+        std::vector<OutputList> partitions(passCount);
+        for(uint32_t outLocation = 0; outLocation < outputCount; outLocation++)
+        {
+            partitions[outLocation / outputsPerPass].push_back(rasterized[outLocation]);
+        }
+        return partitions;
+    }
+
+    void CRaster::CreatePasses()
+    {
+        mDerivedOutputs.clear();
+        mDerive.Outputs.clear();
+        mDeriveAsync.Outputs.clear();
+        mInstanceIdOutput = nullptr;
+        uint32_t derivedKinds = 0;
+        for(Output* output : mOutputList)
+        {
+            DerivedOutput derived = output->Recipe.Derived;
+            if(derived == DerivedOutput::NONE)
+            {
+                continue;
+            }
+            FORAY_ASSERTFMT(output->Recipe.ImageFormat == GetDerivedFormat(derived), "Derived output \"{}\" must use the format of its template", output->Name);
+            FORAY_ASSERTFMT((derivedKinds & (1U << (uint32_t)derived)) == 0, "Derived output \"{}\": Only one output per derived kind is supported", output->Name);
+            derivedKinds |= 1U << (uint32_t)derived;
+            mDerivedOutputs.push_back(output);
+            if(derived == DerivedOutput::SCREENMOTION)
+            {
+                mInstanceIdOutput = FindInstanceIdOutput();
+            }
+            // Motion reads the transform buffers and the camera, which the next frame rewrites while the compute queue may still be running
+            bool async = UsesAsyncCompute() && derived != DerivedOutput::SCREENMOTION;
+            (async ? mDeriveAsync : mDerive).Outputs.push_back(output);
+        }
+        mDeriveAsync.Async = true;
+
         mMaxColorAttachmentCount = mContext->VkbPhysicalDevice->properties.limits.maxColorAttachments;
-        FORAY_ASSERTFMT(mOutputList.size() <= mMaxColorAttachmentCount,
-                        "Physical Device supports max of {} color attachments! As configured requires {}. See VkPhysicalDeviceLimits::maxColorAttachments.",
-                        mMaxColorAttachmentCount, mOutputList.size())
+        for(OutputList& outputs : PartitionOutputs(mMaxColorAttachmentCount))
+        {
+            std::unique_ptr<Pass>& pass = mPasses.emplace_back(std::make_unique<Pass>());
+            pass->Outputs               = std::move(outputs);
+        }
+        if(mPasses.size() > 1)
+        {
+            foray::logger()->info("{}: {} outputs exceed the device limit of {} color attachments, drawing in {} passes", mName,
+                                  mOutputList.size() - mDerivedOutputs.size(), mMaxColorAttachmentCount, mPasses.size());
+        }
+    }
+
+    CRaster& CRaster::SetTiling(const TilingConfig& tiling)
+    {
+        foray::Assert(mPasses.empty(), "Must configure tiling before building!");
+        FORAY_ASSERTFMT(tiling.TileExtent.width % 2 == 0 && tiling.TileExtent.height % 2 == 0 && tiling.Border % 2 == 0,
+                        "Tile extent and border must be even to keep derivative quads aligned across tiles (Tile {}x{}, Border {})", tiling.TileExtent.width,
+                        tiling.TileExtent.height, tiling.Border);
+        mTiling = tiling;
+        return *this;
+    }
+
+    CRaster& CRaster::SetRenderExtent(const VkExtent2D& extent)
+    {
+        foray::Assert(mPasses.empty(), "Must configure the render extent before building!");
+        foray::Assert(extent.width > 0 && extent.height > 0, "Render extent must not be empty");
+        mFixedExtent = extent;
+        return *this;
+    }
+
+    void CRaster::CheckTilingLimits()
+    {
+        // Every tile is rendered with a viewport of its own (bordered) size and a projection cropped to it, so only the framebuffer limits apply
+        const VkPhysicalDeviceLimits& limits = mContext->VkbPhysicalDevice->properties.limits;
+        const TilingConfig&           tiling = *mTiling;
+        FORAY_ASSERTFMT(tiling.TileExtent.width + 2 * tiling.Border <= limits.maxFramebufferWidth && tiling.TileExtent.height + 2 * tiling.Border <= limits.maxFramebufferHeight,
+                        "Tile size plus border exceeds maxFramebufferWidth/Height ({}x{})", limits.maxFramebufferWidth, limits.maxFramebufferHeight);
+    }
+
+    VkFormat CRaster::GetDerivedFormat(DerivedOutput derived)
+    {
+        // Storage image formats declared in cgbufderive.comp
+        switch(derived)
+        {
+            case DerivedOutput::WORLDPOS:
+                return VK_FORMAT_R16G16B16A16_SFLOAT;
+            case DerivedOutput::DEPTHANDDERIVATIVE:
+            case DerivedOutput::SCREENMOTION:
+                return VK_FORMAT_R16G16_SFLOAT;
+            default:
+                FORAY_THROWFMT("Unhandled DerivedOutput value {}", (uint32_t)derived);
+        }
+    }
+
+    uint32_t CRaster::GetTexelSize(VkFormat format)
+    {
+        switch(format)
+        {
+            case VK_FORMAT_R8_UNORM:
+            case VK_FORMAT_R8_SNORM:
+            case VK_FORMAT_R8_UINT:
+            case VK_FORMAT_R8_SINT:
+                return 1;
+            case VK_FORMAT_R8G8_UNORM:
+            case VK_FORMAT_R8G8_SNORM:
+            case VK_FORMAT_R8G8_UINT:
+            case VK_FORMAT_R8G8_SINT:
+            case VK_FORMAT_R16_UNORM:
+            case VK_FORMAT_R16_SNORM:
+            case VK_FORMAT_R16_UINT:
+            case VK_FORMAT_R16_SINT:
+            case VK_FORMAT_R16_SFLOAT:
+                return 2;
+            case VK_FORMAT_R8G8B8A8_UNORM:
+            case VK_FORMAT_R8G8B8A8_SNORM:
+            case VK_FORMAT_R8G8B8A8_UINT:
+            case VK_FORMAT_R8G8B8A8_SINT:
+            case VK_FORMAT_R8G8B8A8_SRGB:
+            case VK_FORMAT_R16G16_UNORM:
+            case VK_FORMAT_R16G16_SNORM:
+            case VK_FORMAT_R16G16_UINT:
+            case VK_FORMAT_R16G16_SINT:
+            case VK_FORMAT_R16G16_SFLOAT:
+            case VK_FORMAT_R32_UINT:
+            case VK_FORMAT_R32_SINT:
+            case VK_FORMAT_R32_SFLOAT:
+            case VK_FORMAT_D32_SFLOAT:
+            case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+            case VK_FORMAT_B10G11R11_UFLOAT_PACK32:
+                return 4;
+            case VK_FORMAT_R16G16B16A16_UNORM:
+            case VK_FORMAT_R16G16B16A16_SNORM:
+            case VK_FORMAT_R16G16B16A16_UINT:
+            case VK_FORMAT_R16G16B16A16_SINT:
+            case VK_FORMAT_R16G16B16A16_SFLOAT:
+            case VK_FORMAT_R32G32_UINT:
+            case VK_FORMAT_R32G32_SINT:
+            case VK_FORMAT_R32G32_SFLOAT:
+                return 8;
+            case VK_FORMAT_R32G32B32A32_UINT:
+            case VK_FORMAT_R32G32B32A32_SINT:
+            case VK_FORMAT_R32G32B32A32_SFLOAT:
+                return 16;
+            default:
+                FORAY_THROWFMT("Unhandled VkFormat value {} for texel readback", (uint32_t)format);
+        }
     }
 
     void CRaster::CreateOutputs(const VkExtent2D& size)
     {
-        for(auto& pair : mOutputMap)
+        mDepthOutputName = fmt::format("{}.Depth", mName);
+        for(uint32_t set = 0; set < mOutputSetCount; set++)
         {
-            foray::core::ManagedImage& image  = pair.second->Image;
-            OutputRecipe&              recipe = pair.second->Recipe;
-            std::string_view           name   = pair.second->Name;
+            for(auto& pair : mOutputMap)
+            {
+                foray::core::ManagedImage& image  = pair.second->Images[set];
+                OutputRecipe&              recipe = pair.second->Recipe;
+                std::string_view           name   = pair.second->Name;
 
-            image.Destroy();
+                image.Destroy();
 
-            foray::core::ManagedImage::CreateInfo ci(VkImageUsageFlagBits::VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_SAMPLED_BIT
-                                                         | VkImageUsageFlagBits::VK_IMAGE_USAGE_STORAGE_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-                                                     recipe.ImageFormat, size, name);
-            image.Create(mContext, ci);
-            std::string keycopy(name);
-            mImageOutputs[keycopy] = &image;
+                std::string                           imageName = mOutputSetCount > 1 ? fmt::format("{}[{}]", name, set) : std::string(name);
+                foray::core::ManagedImage::CreateInfo ci(VkImageUsageFlagBits::VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_SAMPLED_BIT
+                                                             | VkImageUsageFlagBits::VK_IMAGE_USAGE_STORAGE_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                                                         recipe.ImageFormat, size, imageName);
+                image.Create(mContext, ci);
+            }
+            mDepthImages[set].Destroy();
+            if(!!mDepthSource)
+            {
+                continue;
+            }
+            VkImageUsageFlags depthUsage =
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            std::string                           depthName = mOutputSetCount > 1 ? fmt::format("{}[{}]", mDepthOutputName, set) : mDepthOutputName;
+            foray::core::ManagedImage::CreateInfo ci(depthUsage, VK_FORMAT_D32_SFLOAT, size, depthName);
+            ci.ImageViewCI.subresourceRange.aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_DEPTH_BIT;
+            mDepthImages[set].Create(mContext, ci);
         }
-        mDepthImage.Destroy();
-        mDepthOutputName = fmt::format("{}.Depth", mName);
-        VkImageUsageFlags depthUsage =
-            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-        foray::core::ManagedImage::CreateInfo ci(depthUsage, VK_FORMAT_D32_SFLOAT, size, mDepthOutputName);
-        ci.ImageViewCI.subresourceRange.aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_DEPTH_BIT;
-        mDepthImage.Create(mContext, ci);
-        mImageOutputs[mDepthOutputName] = &mDepthImage;
+        SetImageOutputsToSet(0);
     }
 
-    void CRaster::CreateRenderPass()
+    void CRaster::CreateRenderPass(Pass& pass, bool writesDepth)
     {
         std::vector<VkAttachmentReference>   colorAttachmentRefs;
         std::vector<VkAttachmentDescription> attachmentDescr;
 
-        for(uint32_t outLocation = 0; outLocation < mOutputList.size(); outLocation++)
+        for(uint32_t outLocation = 0; outLocation < pass.Outputs.size(); outLocation++)
         {
             colorAttachmentRefs.push_back({outLocation, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL});
-            attachmentDescr.push_back(mOutputList[outLocation]->GetAttachmentDescr());
+            attachmentDescr.push_back(pass.Outputs[outLocation]->GetAttachmentDescr());
         }
 
-        uint32_t              depthLocation = mOutputList.size();
+        // Only the first pass clears and writes depth, later passes (and all passes with a depth source) load it for the equal test
+        uint32_t              depthLocation = pass.Outputs.size();
         VkAttachmentReference depthAttachmentRef{depthLocation, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
         attachmentDescr.push_back(VkAttachmentDescription{.flags          = 0,
-                                                          .format         = mDepthImage.GetFormat(),
-                                                          .samples        = mDepthImage.GetSampleCount(),
-                                                          .loadOp         = VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_CLEAR,
+                                                          .format         = DepthOfSet(0).GetFormat(),
+                                                          .samples        = DepthOfSet(0).GetSampleCount(),
+                                                          .loadOp         = writesDepth ? VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_CLEAR : VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_LOAD,
                                                           .storeOp        = VkAttachmentStoreOp::VK_ATTACHMENT_STORE_OP_STORE,
                                                           .stencilLoadOp  = VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_DONT_CARE,
                                                           .stencilStoreOp = VkAttachmentStoreOp::VK_ATTACHMENT_STORE_OP_STORE,
-                                                          .initialLayout  = VkImageLayout::VK_IMAGE_LAYOUT_UNDEFINED,
+                                                          .initialLayout  = writesDepth ? VkImageLayout::VK_IMAGE_LAYOUT_UNDEFINED : VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
                                                           .finalLayout    = VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL});
 
         // Subpass description
@@ -349,28 +759,49 @@ namespace cgbuffer {
         renderPassInfo.pSubpasses             = &subpass;
         renderPassInfo.dependencyCount        = 2;
         renderPassInfo.pDependencies          = subPassDependencies;
-        foray::AssertVkResult(vkCreateRenderPass(mContext->Device(), &renderPassInfo, nullptr, &mRenderpass));
+        foray::AssertVkResult(vkCreateRenderPass(mContext->Device(), &renderPassInfo, nullptr, &pass.Renderpass));
     }
     void CRaster::CreateFrameBuffer()
     {
-        std::vector<VkImageView> attachmentViews;
-
-        for(uint32_t outLocation = 0; outLocation < mOutputList.size(); outLocation++)
+        for(std::unique_ptr<Pass>& pass : mPasses)
         {
-            attachmentViews.push_back(mOutputList[outLocation]->Image.GetImageView());
+            for(uint32_t set = 0; set < mOutputSetCount; set++)
+            {
+                std::vector<VkImageView> attachmentViews;
+
+                for(Output* output : pass->Outputs)
+                {
+                    attachmentViews.push_back(output->Images[set].GetImageView());
+                }
+                attachmentViews.push_back(DepthOfSet(set).GetImageView());
+
+                VkFramebufferCreateInfo fbufCreateInfo = {};
+                fbufCreateInfo.sType                   = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+                fbufCreateInfo.pNext                   = NULL;
+                fbufCreateInfo.renderPass              = pass->Renderpass;
+                fbufCreateInfo.pAttachments            = attachmentViews.data();
+                fbufCreateInfo.attachmentCount         = (uint32_t)attachmentViews.size();
+                fbufCreateInfo.width                   = mRenderExtent.width;
+                fbufCreateInfo.height                  = mRenderExtent.height;
+                fbufCreateInfo.layers                  = 1;
+                foray::AssertVkResult(vkCreateFramebuffer(mContext->Device(), &fbufCreateInfo, nullptr, &pass->FrameBuffers[set]));
+            }
         }
-        attachmentViews.push_back(mDepthImage.GetImageView());
+    }
 
-        VkFramebufferCreateInfo fbufCreateInfo = {};
-        fbufCreateInfo.sType                   = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        fbufCreateInfo.pNext                   = NULL;
-        fbufCreateInfo.renderPass              = mRenderpass;
-        fbufCreateInfo.pAttachments            = attachmentViews.data();
-        fbufCreateInfo.attachmentCount         = (uint32_t)attachmentViews.size();
-        fbufCreateInfo.width                   = mContext->GetSwapchainSize().width;
-        fbufCreateInfo.height                  = mContext->GetSwapchainSize().height;
-        fbufCreateInfo.layers                  = 1;
-        foray::AssertVkResult(vkCreateFramebuffer(mContext->Device(), &fbufCreateInfo, nullptr, &mFrameBuffer));
+    void CRaster::DestroyFrameBuffers()
+    {
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            for(VkFramebuffer& frameBuffer : pass->FrameBuffers)
+            {
+                if(!!frameBuffer)
+                {
+                    vkDestroyFramebuffer(mContext->Device(), frameBuffer, nullptr);
+                    frameBuffer = nullptr;
+                }
+            }
+        }
     }
 
     void CRaster::SetupDescriptors()
@@ -399,18 +830,76 @@ namespace cgbuffer {
         mPipelineLayout.Build(mContext);
     }
 
-    void CRaster::CreatePipeline()
+    std::vector<std::vector<std::string>> CRaster::GetShaderDefinitions(uint32_t maxColorAttachments) const
+    {
+        std::vector<std::vector<std::string>> result;
+        std::vector<OutputList>               partitions = PartitionOutputs(maxColorAttachments);
+        for(uint32_t passIndex = 0; passIndex < partitions.size(); passIndex++)
+        {
+            result.push_back(GetPassShaderDefinitions(partitions[passIndex], passIndex == 0 && !mDepthSource));
+        }
+        return result;
+    }
+
+    std::vector<std::vector<std::string>> CRaster::GetDeriveShaderDefinitions() const
+    {
+        uint32_t derivedKinds = 0;
+        for(Output* output : mOutputList)
+        {
+            if(output->Recipe.Derived != DerivedOutput::NONE)
+            {
+                derivedKinds |= 1U << (uint32_t)output->Recipe.Derived;
+            }
+        }
+        // Motion is never evaluated on the compute queue (see CreatePasses())
+        uint32_t motion = 1U << (uint32_t)DerivedOutput::SCREENMOTION;
+
+        std::vector<std::vector<std::string>> result;
+        for(uint32_t passKinds : {derivedKinds, derivedKinds & motion, derivedKinds & ~motion})
+        {
+            if(passKinds == 0)
+            {
+                continue;
+            }
+            std::vector<std::string> definitions = GetDerivePassShaderDefinitions(passKinds);
+            if(std::find(result.begin(), result.end(), definitions) == result.end())
+            {
+                result.push_back(std::move(definitions));
+            }
+        }
+        return result;
+    }
+
+    std::vector<std::string> CRaster::GetDerivePassShaderDefinitions(uint32_t derivedKinds)
+    {
+        // Fixed order, so the definitions identify the variant independent of the order outputs were added in
+        std::vector<std::string> definitions;
+        if((derivedKinds & (1U << (uint32_t)DerivedOutput::WORLDPOS)) > 0)
+        {
+            definitions.push_back("DERIVE_WORLDPOS=1");
+        }
+        if((derivedKinds & (1U << (uint32_t)DerivedOutput::DEPTHANDDERIVATIVE)) > 0)
+        {
+            definitions.push_back("DERIVE_DEPTH=1");
+        }
+        if((derivedKinds & (1U << (uint32_t)DerivedOutput::SCREENMOTION)) > 0)
+        {
+            definitions.push_back("DERIVE_MOTION=1");
+        }
+        return definitions;
+    }
+
+    std::vector<std::string> CRaster::GetPassShaderDefinitions(const OutputList& outputs, bool writesDepth) const
     {
-        foray::core::ShaderCompilerConfig shaderConfig;
-        shaderConfig.IncludeDirs.push_back(FORAY_SHADER_DIR);
+        std::vector<std::string> definitions;
 
         uint32_t interfaceFlags = mInterfaceFlagsGlobal;
         uint32_t featuresFlags  = mBuiltInFeaturesFlagsGlobal;
 
-        for(uint32_t outLocation = 0; outLocation < mOutputList.size(); outLocation++)
+        for(Output* output : outputs)
         {
-            interfaceFlags |= mOutputList[outLocation]->Recipe.FragmentInputFlags;
-            featuresFlags |= mOutputList[outLocation]->Recipe.BuiltInFeaturesFlags;
+            interfaceFlags |= output->Recipe.FragmentInputFlags;
+            featuresFlags |= output->Recipe.BuiltInFeaturesFlags;
         }
 
         // Add interface and feature flags
@@ -419,7 +908,7 @@ namespace cgbuffer {
         {
             if((interfaceFlags & flag) > 0)
             {
-                shaderConfig.Definitions.push_back(fmt::format("{}=1", ToString((FragmentInputFlagBits)flag)));
+                definitions.push_back(fmt::format("{}=1", ToString((FragmentInputFlagBits)flag)));
             }
         }
 
@@ -427,23 +916,53 @@ namespace cgbuffer {
         {
             if((featuresFlags & flag) > 0)
             {
-                shaderConfig.Definitions.push_back(fmt::format("{}=1", ToString((BuiltInFeaturesFlagBits)flag)));
+                definitions.push_back(fmt::format("{}=1", ToString((BuiltInFeaturesFlagBits)flag)));
             }
         }
 
-        for(uint32_t outLocation = 0; outLocation < mOutputList.size(); outLocation++)
+        if(!writesDepth)
+        {
+            definitions.push_back("DEPTH_EQUAL_PASS=1");
+        }
+
+        for(uint32_t outLocation = 0; outLocation < outputs.size(); outLocation++)
         {
-            OutputRecipe& recipe = mOutputList[outLocation]->Recipe;
-            shaderConfig.Definitions.push_back(fmt::format("OUT_{}=1", outLocation));
-            shaderConfig.Definitions.push_back(fmt::format("OUT_{}_TYPE={}", outLocation, ToString(recipe.Type)));
-            shaderConfig.Definitions.push_back(fmt::format("OUT_{}_RESULT=\"{}\"", outLocation, recipe.Result));
-            shaderConfig.Definitions.push_back(fmt::format("OUT_{}_CALC=\"{}\"", outLocation, recipe.Calculation));
+            const OutputRecipe& recipe = outputs[outLocation]->Recipe;
+            definitions.push_back(fmt::format("OUT_{}=1", outLocation));
+            definitions.push_back(fmt::format("OUT_{}_TYPE={}", outLocation, ToString(recipe.Type)));
+            definitions.push_back(fmt::format("OUT_{}_RESULT=\"{}\"", outLocation, recipe.Result));
+            definitions.push_back(fmt::format("OUT_{}_CALC=\"{}\"", outLocation, recipe.Calculation));
         }
+        return definitions;
+    }
+
+    void CRaster::CreatePipeline(Pass& pass, bool writesDepth)
+    {
+        std::vector<std::string> definitions = GetPassShaderDefinitions(pass.Outputs, writesDepth);
 
-        mShaderKeys.push_back(mContext->ShaderMan->CompileShader("src/shaders/cgbuf.vert", mVertexShaderModule, shaderConfig));
-        mShaderKeys.push_back(mContext->ShaderMan->CompileShader("src/shaders/cgbuf.frag", mFragmentShaderModule, shaderConfig));
+        const PrecompiledShaders* precompiled = PrecompiledShaderRegistry::Find(definitions);
+        if(!!precompiled)
+        {
+            // Embedded at build time by cgbuffer-recipec, no shader compilation required
+            pass.VertexShaderModule.LoadFromBinary(mContext, reinterpret_cast<const uint8_t*>(precompiled->VertexSpirv.data()), precompiled->VertexSpirv.size_bytes());
+            pass.FragmentShaderModule.LoadFromBinary(mContext, reinterpret_cast<const uint8_t*>(precompiled->FragmentSpirv.data()), precompiled->FragmentSpirv.size_bytes());
+        }
+        else
+        {
+#ifdef CGBUFFER_NO_RUNTIME_SHADER_COMPILE
+            FORAY_THROWFMT("No precompiled shaders embedded for the configured layout of \"{}\", and runtime shader compilation is disabled. Add its recipe file to CGBUFFER_RECIPE_FILES",
+                           mName);
+#else
+            foray::core::ShaderCompilerConfig shaderConfig;
+            shaderConfig.IncludeDirs.push_back(FORAY_SHADER_DIR);
+            shaderConfig.Definitions = std::move(definitions);
+
+            mShaderKeys.push_back(mContext->ShaderMan->CompileShader("src/shaders/cgbuf.vert", pass.VertexShaderModule, shaderConfig));
+            mShaderKeys.push_back(mContext->ShaderMan->CompileShader("src/shaders/cgbuf.frag", pass.FragmentShaderModule, shaderConfig));
+#endif
+        }
         foray::util::ShaderStageCreateInfos shaderStageCreateInfos;
-        shaderStageCreateInfos.Add(VK_SHADER_STAGE_VERTEX_BIT, mVertexShaderModule).Add(VK_SHADER_STAGE_FRAGMENT_BIT, mFragmentShaderModule);
+        shaderStageCreateInfos.Add(VK_SHADER_STAGE_VERTEX_BIT, pass.VertexShaderModule).Add(VK_SHADER_STAGE_FRAGMENT_BIT, pass.FragmentShaderModule);
 
         // vertex layout
         foray::scene::VertexInputStateBuilder vertexInputStateBuilder;
@@ -454,27 +973,391 @@ namespace cgbuffer {
         vertexInputStateBuilder.Build();
 
         // clang-format off
-        mPipeline = foray::util::PipelineBuilder()
+        pass.Pipeline = foray::util::PipelineBuilder()
             .SetContext(mContext)
             // Blend attachment states required for all color attachments
             // This is important, as color write mask will otherwise be 0x0 and you
             // won't see anything rendered to the attachment
-            .SetColorAttachmentBlendCount(mOutputList.size())
+            .SetColorAttachmentBlendCount(pass.Outputs.size())
             .SetPipelineLayout(mPipelineLayout.GetPipelineLayout())
             .SetVertexInputStateBuilder(&vertexInputStateBuilder)
             .SetShaderStageCreateInfos(shaderStageCreateInfos.Get())
             .SetPipelineCache(mContext->PipelineCache)
-            .SetRenderPass(mRenderpass)
+            .SetRenderPass(pass.Renderpass)
+            // Later passes only shade fragments matching the depth written by the first pass
+            .SetDepthWriteEnable(writesDepth ? VK_TRUE : VK_FALSE)
+            .SetDepthCompareOp(writesDepth ? VK_COMPARE_OP_LESS : VK_COMPARE_OP_EQUAL)
             .Build();
         // clang-format on
     }
 
+    void CRaster::CreateDerivePass(DerivePass& pass)
+    {
+        if(pass.Outputs.empty())
+        {
+            return;
+        }
+        CreateDeriveDescriptorSets(pass);
+
+        uint32_t derivedKinds = 0;
+        for(Output* output : pass.Outputs)
+        {
+            derivedKinds |= 1U << (uint32_t)output->Recipe.Derived;
+        }
+        std::vector<std::string> definitions = GetDerivePassShaderDefinitions(derivedKinds);
+
+        const PrecompiledShaders* precompiled = PrecompiledShaderRegistry::Find(definitions, "cgbufderive.comp");
+        if(!!precompiled)
+        {
+            pass.Shader.LoadFromBinary(mContext, reinterpret_cast<const uint8_t*>(precompiled->ComputeSpirv.data()), precompiled->ComputeSpirv.size_bytes());
+        }
+        else
+        {
+#ifdef CGBUFFER_NO_RUNTIME_SHADER_COMPILE
+            FORAY_THROWFMT("No precompiled derive shader embedded for the derived outputs of \"{}\", and runtime shader compilation is disabled. Add its recipe file to CGBUFFER_RECIPE_FILES",
+                           mName);
+#else
+            foray::core::ShaderCompilerConfig shaderConfig;
+            shaderConfig.IncludeDirs.push_back(FORAY_SHADER_DIR);
+            shaderConfig.Definitions = std::move(definitions);
+            mShaderKeys.push_back(mContext->ShaderMan->CompileShader("src/shaders/cgbufderive.comp", pass.Shader, shaderConfig));
+#endif
+        }
+
+        pass.PipelineLayout.AddDescriptorSetLayout(pass.DescriptorSets[0].GetDescriptorSetLayout());  // All sets share the same bindings
+        pass.PipelineLayout.AddPushConstantRange<DerivePushConstant>(VK_SHADER_STAGE_COMPUTE_BIT);
+        pass.PipelineLayout.Build(mContext);
+
+        VkComputePipelineCreateInfo pipelineCi{.sType  = VkStructureType::VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+                                               .stage  = VkPipelineShaderStageCreateInfo{.sType  = VkStructureType::VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                                                                                         .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+                                                                                         .module = pass.Shader.GetShaderModule(),
+                                                                                         .pName  = "main"},
+                                               .layout = pass.PipelineLayout.GetPipelineLayout()};
+        foray::AssertVkResult(vkCreateComputePipelines(mContext->Device(), mContext->PipelineCache, 1, &pipelineCi, nullptr, &pass.Pipeline));
+    }
+
+    void CRaster::CreateDeriveDescriptorSets(DerivePass& pass)
+    {
+        auto cameraManager = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+        auto drawDirector  = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+        bool motion        = std::any_of(pass.Outputs.begin(), pass.Outputs.end(), [](Output* output) { return output->Recipe.Derived == DerivedOutput::SCREENMOTION; });
+        // Images handed to the compute queue are all kept in GENERAL
+        VkImageLayout depthLayout = pass.Async ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        for(uint32_t set = 0; set < mOutputSetCount; set++)
+        {
+            // Bindings as declared in cgbufderive.comp
+            foray::core::DescriptorSetHelper& descriptorSet = pass.DescriptorSets[set];
+            descriptorSet.Destroy();
+            descriptorSet.SetDescriptorAt(3, VkDescriptorImageInfo{.imageView = DepthOfSet(set).GetImageView(), .imageLayout = depthLayout},
+                                          VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
+            if(motion)
+            {
+                descriptorSet.SetDescriptorAt(0, cameraManager->GetVkDescriptorInfo(), VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+                descriptorSet.SetDescriptorAt(1, drawDirector->GetCurrentTransformsDescriptorInfo(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+                descriptorSet.SetDescriptorAt(2, drawDirector->GetPreviousTransformsDescriptorInfo(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+                descriptorSet.SetDescriptorAt(4,
+                                              VkDescriptorImageInfo{.imageView   = mInstanceIdOutput->Images[set].GetImageView(),
+                                                                    .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+                                              VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
+            }
+            for(Output* output : pass.Outputs)
+            {
+                uint32_t binding = output->Recipe.Derived == DerivedOutput::WORLDPOS ? 5 : output->Recipe.Derived == DerivedOutput::DEPTHANDDERIVATIVE ? 6 : 7;
+                descriptorSet.SetDescriptorAt(binding, VkDescriptorImageInfo{.imageView = output->Images[set].GetImageView(), .imageLayout = VK_IMAGE_LAYOUT_GENERAL},
+                                              VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
+            }
+            descriptorSet.Create(mContext, fmt::format("{}.{}.DescriptorSet.{}", mName, pass.Async ? "AsyncDerive" : "Derive", set));
+        }
+    }
+
+    void CRaster::RecordDerivePass(VkCommandBuffer cmdBuffer, DerivePass& pass, const VkViewport& viewport)
+    {
+        // Pixel centers map to the same device coordinates as in the raster passes, including the cropped projection of tiled mode
+        auto               cameraManager  = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+        glm::mat4          projectionView = !!mPose ? mPose->ProjectionMatrix * mPose->ViewMatrix : cameraManager->GetUbo().GetData().ProjectionViewMatrix;
+        DerivePushConstant pushC{.InverseProjectionView = glm::inverse(projectionView),
+                                 .Viewport              = glm::vec4(viewport.x, viewport.y, 2.f / viewport.width, 2.f / viewport.height)};
+
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pass.Pipeline);
+        VkDescriptorSet descriptorSet = pass.DescriptorSets[mCurrentSet].GetDescriptorSet();
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pass.PipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+        vkCmdPushConstants(cmdBuffer, pass.PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(DerivePushConstant), &pushC);
+        vkCmdDispatch(cmdBuffer, (mRenderExtent.width + 15) / 16, (mRenderExtent.height + 15) / 16, 1);
+    }
+
+    void CRaster::RecordDeriveGraphics(VkCommandBuffer cmdBuffer, foray::core::ImageLayoutCache& layoutCache, const VkViewport& viewport)
+    {
+        // Depth and instance ids were written by the raster passes. Derived outputs were transitioned to GENERAL before them
+        foray::core::ManagedImage& depthImage = DepthOfSet(mCurrentSet);
+        // Motion is never moved to the compute queue, so the instance id is always read here
+        bool                       motion     = !!mInstanceIdOutput;
+
+        std::vector<VkImageMemoryBarrier2> imgBarriers;
+        imgBarriers.push_back(VkImageMemoryBarrier2{
+            .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+            .srcAccessMask       = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask       = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+            .oldLayout           = VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .newLayout           = VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = depthImage.GetImage(),
+            .subresourceRange =
+                VkImageSubresourceRange{.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT, .baseMipLevel = 0, .levelCount = 1, .baseArrayLayer = 0, .layerCount = 1},
+        });
+        if(motion)
+        {
+            imgBarriers.push_back(VkImageMemoryBarrier2{
+                .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                .srcAccessMask       = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .dstAccessMask       = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                .oldLayout           = VkImageLayout::VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                .newLayout           = VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = mInstanceIdOutput->Images[mCurrentSet].GetImage(),
+                .subresourceRange =
+                    VkImageSubresourceRange{.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .baseMipLevel = 0, .levelCount = 1, .baseArrayLayer = 0, .layerCount = 1},
+            });
+        }
+        VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                 .imageMemoryBarrierCount = (uint32_t)imgBarriers.size(),
+                                 .pImageMemoryBarriers    = imgBarriers.data()};
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+        RecordDerivePass(cmdBuffer, mDerive, viewport);
+
+        layoutCache.Set(depthImage, VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+        if(motion)
+        {
+            layoutCache.Set(mInstanceIdOutput->Images[mCurrentSet], VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        }
+    }
+
+    void CRaster::DestroyDerivePass(DerivePass& pass)
+    {
+        if(!!pass.Pipeline)
+        {
+            vkDestroyPipeline(mContext->Device(), pass.Pipeline, nullptr);
+            pass.Pipeline = nullptr;
+        }
+        pass.Shader.Destroy();
+        pass.PipelineLayout.Destroy();
+        for(foray::core::DescriptorSetHelper& descriptorSet : pass.DescriptorSets)
+        {
+            descriptorSet.Destroy();
+        }
+        pass.Outputs.clear();
+    }
+
+    void CRaster::RecordAsyncHandover(VkCommandBuffer cmdBuffer, foray::base::FrameRenderInfo& renderInfo, const VkViewport& viewport)
+    {
+        // Depth is read by the async derive pass. Registered inputs are read by compute work recorded after this stage
+        std::vector<foray::core::ManagedImage*> images;
+        foray::core::ManagedImage*              depthImage = &DepthOfSet(mCurrentSet);
+        if(!mDeriveAsync.Outputs.empty())
+        {
+            images.push_back(depthImage);
+        }
+        for(const std::string& name : mAsyncInputNames)
+        {
+            foray::core::ManagedImage* image = GetImageOutputOfSet(name, mCurrentSet);
+            if(std::find(images.begin(), images.end(), image) == images.end())
+            {
+                images.push_back(image);
+            }
+        }
+        if(images.empty() && mDeriveAsync.Outputs.empty())
+        {
+            return;
+        }
+
+        const uint32_t graphicsFamily = mAsyncCompute->GetGraphicsFamily();
+        const uint32_t computeFamily  = mAsyncCompute->GetComputeFamily();
+
+        // Release on the graphics queue, acquire on the compute queue. Both sides must describe the same layout transition
+        // The graphics derive pass samples depth, its reads must complete before the layout transition
+        VkPipelineStageFlags2 depthSrcStage =
+            mDerive.Outputs.empty() ? VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT : VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+
+        std::vector<VkImageMemoryBarrier2> releases;
+        std::vector<VkImageMemoryBarrier2> computeBarriers;
+        for(foray::core::ManagedImage* image : images)
+        {
+            bool                  isDepth = image == depthImage;
+            VkImageMemoryBarrier2 release{
+                .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = isDepth ? depthSrcStage : VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .srcAccessMask       = isDepth ? VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_NONE,
+                .dstAccessMask       = VK_ACCESS_2_NONE,
+                .oldLayout           = renderInfo.GetImageLayoutCache().Get(*image),
+                .newLayout           = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL,
+                .srcQueueFamilyIndex = graphicsFamily,
+                .dstQueueFamilyIndex = computeFamily,
+                .image               = image->GetImage(),
+                .subresourceRange    = VkImageSubresourceRange{.aspectMask     = isDepth ? VkImageAspectFlags(VK_IMAGE_ASPECT_DEPTH_BIT) : VkImageAspectFlags(VK_IMAGE_ASPECT_COLOR_BIT),
+                                                               .baseMipLevel   = 0,
+                                                               .levelCount     = 1,
+                                                               .baseArrayLayer = 0,
+                                                               .layerCount     = 1},
+            };
+            releases.push_back(release);
+
+            VkImageMemoryBarrier2& acquire = computeBarriers.emplace_back(release);
+            acquire.srcStageMask           = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            acquire.srcAccessMask          = VK_ACCESS_2_NONE;
+            acquire.dstStageMask           = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            acquire.dstAccessMask          = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+
+            renderInfo.GetImageLayoutCache().Set(*image, VkImageLayout::VK_IMAGE_LAYOUT_GENERAL);
+        }
+        for(Output* output : mDeriveAsync.Outputs)
+        {
+            // Contents are discarded, so no transfer is required. Earlier compute work on the set is complete in queue order
+            computeBarriers.push_back(VkImageMemoryBarrier2{
+                .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .srcAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                .oldLayout           = VkImageLayout::VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout           = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = output->Images[mCurrentSet].GetImage(),
+                .subresourceRange =
+                    VkImageSubresourceRange{.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .baseMipLevel = 0, .levelCount = 1, .baseArrayLayer = 0, .layerCount = 1},
+            });
+        }
+
+        if(!releases.empty())
+        {
+            VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                     .imageMemoryBarrierCount = (uint32_t)releases.size(),
+                                     .pImageMemoryBarriers    = releases.data()};
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+        }
+
+        VkCommandBuffer  computeCmdBuffer = mAsyncCompute->GetCommandBuffer();
+        VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                 .imageMemoryBarrierCount = (uint32_t)computeBarriers.size(),
+                                 .pImageMemoryBarriers    = computeBarriers.data()};
+        vkCmdPipelineBarrier2(computeCmdBuffer, &depInfo);
+
+        if(!mDeriveAsync.Outputs.empty())
+        {
+            RecordDerivePass(computeCmdBuffer, mDeriveAsync, viewport);
+        }
+
+        if(mAsyncReturnStages == VK_PIPELINE_STAGE_2_NONE)
+        {
+            return;
+        }
+
+        // Transfer back after all compute work of the frame, acquired by the graphics queue at the start of the next frame
+        for(Output* output : mDeriveAsync.Outputs)
+        {
+            images.push_back(&output->Images[mCurrentSet]);
+        }
+        mPendingAcquires.clear();
+        for(foray::core::ManagedImage* image : images)
+        {
+            VkImageMemoryBarrier2 release{
+                .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .srcAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_NONE,
+                .dstAccessMask       = VK_ACCESS_2_NONE,
+                .oldLayout           = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL,
+                .newLayout           = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL,
+                .srcQueueFamilyIndex = computeFamily,
+                .dstQueueFamilyIndex = graphicsFamily,
+                .image               = image->GetImage(),
+                .subresourceRange    = VkImageSubresourceRange{.aspectMask     = image == depthImage ? VkImageAspectFlags(VK_IMAGE_ASPECT_DEPTH_BIT) : VkImageAspectFlags(VK_IMAGE_ASPECT_COLOR_BIT),
+                                                               .baseMipLevel   = 0,
+                                                               .levelCount     = 1,
+                                                               .baseArrayLayer = 0,
+                                                               .layerCount     = 1},
+            };
+            mAsyncCompute->AddRelease(release);
+
+            VkImageMemoryBarrier2& acquire = mPendingAcquires.emplace_back(release);
+            acquire.srcStageMask           = mAsyncReturnStages;
+            acquire.srcAccessMask          = VK_ACCESS_2_NONE;
+            acquire.dstStageMask           = mAsyncReturnStages;
+            acquire.dstAccessMask          = VK_ACCESS_2_MEMORY_READ_BIT;
+        }
+        mPendingAcquiresFrame = renderInfo.GetFrameNumber();
+    }
+
     void CRaster::RecordFrame(VkCommandBuffer cmdBuffer, foray::base::FrameRenderInfo& renderInfo)
     {
+        foray::Assert(!mTiling.has_value(), "CRaster is configured for tiled mode, use CRaster::RenderTiled()");
+
+        SetImageOutputsToSet((uint32_t)(renderInfo.GetFrameNumber() % mOutputSetCount));
+
+        VkViewport viewport{0.f, 0.f, (float)mRenderExtent.width, (float)mRenderExtent.height, 0.0f, 1.0f};
+        VkRect2D   scissor{VkOffset2D{}, mRenderExtent};
+        RecordRasterPass(cmdBuffer, &renderInfo, renderInfo.GetImageLayoutCache(), viewport, scissor);
+    }
+
+    void CRaster::RecordRasterPass(VkCommandBuffer                cmdBuffer,
+                                   foray::base::FrameRenderInfo*  renderInfo,
+                                   foray::core::ImageLayoutCache& layoutCache,
+                                   const VkViewport&              viewport,
+                                   const VkRect2D&                scissor)
+    {
+        // Stages writing the output set, which compute work of the frame last writing the set may still be reading
+        const VkPipelineStageFlags2 asyncReuseStages = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT
+                                                       | VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        if(UsesAsyncCompute())
         {
+            foray::Assert(!!renderInfo, "Async compute requires a renderloop");
+            uint64_t frameNumber = renderInfo->GetFrameNumber();
+            FORAY_ASSERTFMT(mAsyncCompute->GetFrameNumber() == frameNumber, "AsyncCompute is at frame {}, but frame {} is recorded. See AsyncCompute::BeginFrame()",
+                            mAsyncCompute->GetFrameNumber(), frameNumber);
+            if(!mPendingAcquires.empty())
+            {
+                // Images handed to the compute queue last frame return to the graphics queue
+                VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                         .imageMemoryBarrierCount = (uint32_t)mPendingAcquires.size(),
+                                         .pImageMemoryBarriers    = mPendingAcquires.data()};
+                vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+                mAsyncCompute->AddGraphicsWait(mPendingAcquiresFrame, mAsyncReturnStages);
+                mPendingAcquires.clear();
+            }
+            if(frameNumber >= mOutputSetCount)
+            {
+                // The in flight fence only covers the graphics queue
+                mAsyncCompute->AddGraphicsWait(frameNumber - mOutputSetCount, asyncReuseStages);
+            }
+        }
+
+        {
+            // With a single output set, the attachments may still be read by previous commands and the pass must wait for all of them.
+            // With multiple sets, the set written here was last used output set count frames ago, which the in flight fence already covers
+            // (Build() asserts count >= frames in flight, and count > frames in flight if the previous set is read as history).
+            VkPipelineStageFlags2 attachmentSrcStage = mOutputSetCount > 1 ? VK_PIPELINE_STAGE_2_NONE : VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            if(UsesAsyncCompute())
+            {
+                // Chains the transitions with the wait for compute work on the set
+                attachmentSrcStage |= asyncReuseStages;
+            }
+            if(!!mPose)
+            {
+                // Earlier poses of the batch may still be copying the set to staging memory
+                attachmentSrcStage |= VK_PIPELINE_STAGE_2_COPY_BIT;
+            }
+
             VkImageMemoryBarrier2 attachmentMemBarrier{
                 .sType         = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
-                .srcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                .srcStageMask  = attachmentSrcStage,
                 .srcAccessMask = VK_ACCESS_2_NONE,
                 .dstStageMask  = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
                 .dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
@@ -492,30 +1375,56 @@ namespace cgbuffer {
                     },
             };
 
-            std::vector<VkImageMemoryBarrier2> imgBarriers(mOutputList.size() + 1);
+            std::vector<VkImageMemoryBarrier2> imgBarriers;
 
             for(uint32_t i = 0; i < mOutputList.size(); i++)
             {
-                Output&                info    = *mOutputList[i];
-                VkImageMemoryBarrier2& barrier = imgBarriers[i];
-
-                barrier       = attachmentMemBarrier;
-                barrier.image = info.Image.GetImage();
+                Output& info = *mOutputList[i];
+                if(std::find(mDeriveAsync.Outputs.begin(), mDeriveAsync.Outputs.end(), &info) != mDeriveAsync.Outputs.end())
+                {
+                    // Transitioned on the compute queue
+                    continue;
+                }
+                VkImageMemoryBarrier2& barrier = imgBarriers.emplace_back(attachmentMemBarrier);
+                barrier.image                  = info.Images[mCurrentSet].GetImage();
+                if(info.Recipe.Derived != DerivedOutput::NONE)
+                {
+                    // Written as storage image by the derive pass
+                    barrier.dstStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+                    barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+                    barrier.newLayout     = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL;
+                }
             }
-            VkImageMemoryBarrier2& depthBarrier      = imgBarriers.back();
-            depthBarrier                             = attachmentMemBarrier;
+            VkImageMemoryBarrier2& depthBarrier      = imgBarriers.emplace_back(attachmentMemBarrier);
             depthBarrier.dstStageMask                = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
             depthBarrier.dstAccessMask               = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR;
             depthBarrier.newLayout                   = VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
             depthBarrier.subresourceRange.aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_DEPTH_BIT;
-            depthBarrier.image                       = mDepthImage.GetImage();
+            depthBarrier.image                       = DepthOfSet(mCurrentSet).GetImage();
+            if(!!mDepthSource)
+            {
+                // Shared depth is final, wait for the depth source to have written it and keep its contents.
+                // Derive passes of the depth source or earlier consumers may have sampled it in a read only layout
+                depthBarrier.srcStageMask  = VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+                depthBarrier.srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+                depthBarrier.dstStageMask  = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+                depthBarrier.dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+                depthBarrier.oldLayout     = layoutCache.Get(DepthOfSet(mCurrentSet));
+            }
 
             std::vector<VkBufferMemoryBarrier2> bufferBarriers;
 
+            // Scene buffers are only written by uploads. Waiting on those instead of all commands lets this pass overlap consumers of the previous output set
+            VkPipelineStageFlags2 bufferSrcStage = mOutputSetCount > 1 ? VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT | VK_PIPELINE_STAGE_2_HOST_BIT : VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+            // The graphics derive pass reads camera and transforms as well
+            VkPipelineStageFlags2 bufferDstStage =
+                mDerive.Outputs.empty() ? VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT : VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+
             VkBufferMemoryBarrier2 bufferBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
-                                                 .srcStageMask        = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                 .srcStageMask        = bufferSrcStage,
                                                  .srcAccessMask       = VK_ACCESS_2_MEMORY_WRITE_BIT,
-                                                 .dstStageMask        = VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+                                                 .dstStageMask        = bufferDstStage,
                                                  .dstAccessMask       = VK_ACCESS_2_SHADER_READ_BIT,
                                                  .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
                                                  .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
@@ -528,7 +1437,7 @@ namespace cgbuffer {
 
             bufferBarrier.buffer = materialBuffer->GetVkBuffer();
             bufferBarriers.push_back(bufferBarrier);
-            bufferBarriers.push_back(cameraManager->GetUbo().MakeBarrierPrepareForRead(VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT));
+            bufferBarriers.push_back(cameraManager->GetUbo().MakeBarrierPrepareForRead(bufferDstStage, VK_ACCESS_2_SHADER_READ_BIT));
             bufferBarrier.buffer = drawDirector->GetCurrentTransformsVkBuffer();
             bufferBarriers.push_back(bufferBarrier);
             bufferBarrier.buffer = drawDirector->GetPreviousTransformsVkBuffer();
@@ -546,67 +1455,689 @@ namespace cgbuffer {
             vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
         }
 
-        std::vector<VkClearValue> clearValues(mOutputList.size() + 1);
+        VkDescriptorSet descriptorSet = !!mPose ? mPose->DescriptorSet : mDescriptorSet.GetDescriptorSet();
 
-        for(uint32_t i = 0; i < mOutputList.size(); i++)
+        if(mSortDraws)
         {
-            clearValues[i].color = mOutputList[i]->Recipe.ClearValue;
+            // With a depth source, depth order does not matter anymore, only state changes do
+            auto                cameraManager = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+            DrawList::ESortMode sortMode      = !!mDepthSource ? DrawList::ESortMode::MATERIAL : DrawList::ESortMode::FRONTTOBACK;
+            DrawList::View      view{.ViewMatrix       = !!mPose ? mPose->ViewMatrix : cameraManager->GetUbo().GetData().ViewMatrix,
+                                     .ProjectionMatrix = !!mPose ? mPose->ProjectionMatrix : cameraManager->GetUbo().GetData().ProjectionMatrix,
+                                     .ViewportHeight   = std::abs(viewport.height)};
+            mDrawList.Build(mScene, view, sortMode);
         }
-        clearValues.back().depthStencil = VkClearDepthStencilValue{1.f, 0};
 
-        VkRenderPassBeginInfo renderPassBeginInfo{};
-        renderPassBeginInfo.sType             = VkStructureType::VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassBeginInfo.renderPass        = mRenderpass;
-        renderPassBeginInfo.framebuffer       = mFrameBuffer;
-        renderPassBeginInfo.renderArea.extent = mContext->GetSwapchainSize();
-        renderPassBeginInfo.clearValueCount   = static_cast<uint32_t>(clearValues.size());
-        renderPassBeginInfo.pClearValues      = clearValues.data();
+        for(uint32_t passIndex = 0; passIndex < mPasses.size(); passIndex++)
+        {
+            Pass& pass = *mPasses[passIndex];
+
+            if(passIndex > 0)
+            {
+                // Depth written by the first pass is read by the equal test
+                VkMemoryBarrier2 depthBarrier{.sType         = VkStructureType::VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                                              .srcStageMask  = VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                                              .srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                              .dstStageMask  = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                                              .dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT};
+                VkDependencyInfo depInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .memoryBarrierCount = 1, .pMemoryBarriers = &depthBarrier};
+                vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+            }
 
-        vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+            std::vector<VkClearValue> clearValues(pass.Outputs.size() + 1);
 
-        VkViewport viewport{0.f, 0.f, (float)mContext->GetSwapchainSize().width, (float)mContext->GetSwapchainSize().height, 0.0f, 1.0f};
-        vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+            for(uint32_t i = 0; i < pass.Outputs.size(); i++)
+            {
+                clearValues[i].color = pass.Outputs[i]->Recipe.ClearValue;
+            }
+            clearValues.back().depthStencil = VkClearDepthStencilValue{1.f, 0};
 
-        VkRect2D scissor{VkOffset2D{}, VkExtent2D{mContext->GetSwapchainSize()}};
-        vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+            VkRenderPassBeginInfo renderPassBeginInfo{};
+            renderPassBeginInfo.sType             = VkStructureType::VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+            renderPassBeginInfo.renderPass        = pass.Renderpass;
+            renderPassBeginInfo.framebuffer       = pass.FrameBuffers[mCurrentSet];
+            renderPassBeginInfo.renderArea.extent = mRenderExtent;
+            renderPassBeginInfo.clearValueCount   = static_cast<uint32_t>(clearValues.size());
+            renderPassBeginInfo.pClearValues      = clearValues.data();
 
-        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mPipeline);
+            vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-        VkDescriptorSet descriptorSet = mDescriptorSet.GetDescriptorSet();
-        // Instanced object
-        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+            vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+            vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
 
-        mScene->Draw(renderInfo, mPipelineLayout, cmdBuffer);
+            vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.Pipeline);
 
-        vkCmdEndRenderPass(cmdBuffer);
+            // Instanced object
+            vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+
+            if(mSortDraws)
+            {
+                mDrawList.CmdDraw(cmdBuffer, mPipelineLayout);
+            }
+            else
+            {
+                foray::Assert(!!renderInfo, "Scene::Draw() requires a renderloop, see CRaster::SetSortDraws()");
+                mScene->Draw(*renderInfo, mPipelineLayout, cmdBuffer);
+            }
+
+            vkCmdEndRenderPass(cmdBuffer);
+        }
 
         // The GBuffer determines the images layouts
 
         for(uint32_t i = 0; i < mOutputList.size(); i++)
         {
-            renderInfo.GetImageLayoutCache().Set(mOutputList[i]->Image, VkImageLayout::VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+            VkImageLayout layout = mOutputList[i]->Recipe.Derived != DerivedOutput::NONE ? VkImageLayout::VK_IMAGE_LAYOUT_GENERAL
+                                                                                         : VkImageLayout::VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            layoutCache.Set(mOutputList[i]->Images[mCurrentSet], layout);
+        }
+        layoutCache.Set(DepthOfSet(mCurrentSet), VkImageLayout::VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+
+        if(!mDerive.Outputs.empty())
+        {
+            RecordDeriveGraphics(cmdBuffer, layoutCache, viewport);
+        }
+        if(UsesAsyncCompute())
+        {
+            RecordAsyncHandover(cmdBuffer, *renderInfo, viewport);
+        }
+    }
+
+    void CRaster::SetupPoseDescriptors(foray::core::DescriptorSetHelper& descriptorSet,
+                                       const VkDescriptorBufferInfo&     camera,
+                                       const VkDescriptorBufferInfo*     transforms,
+                                       const VkDescriptorBufferInfo*     previousTransforms)
+    {
+        // Bindings as in SetupDescriptors(), so the sets are compatible with the pipeline layout
+        auto materialBuffer = mScene->GetComponent<foray::scene::gcomp::MaterialManager>();
+        auto textureStore   = mScene->GetComponent<foray::scene::gcomp::TextureManager>();
+        auto drawDirector   = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+        descriptorSet.SetDescriptorAt(0, materialBuffer->GetVkDescriptorInfo(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT);
+        descriptorSet.SetDescriptorAt(1, textureStore->GetDescriptorInfos(), VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT);
+        descriptorSet.SetDescriptorAt(2, camera, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+        if(!!transforms)
+        {
+            descriptorSet.SetDescriptorAt(3, *transforms, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+            descriptorSet.SetDescriptorAt(4, *previousTransforms, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+        }
+        else
+        {
+            descriptorSet.SetDescriptorAt(3, drawDirector->GetCurrentTransformsDescriptorInfo(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+            descriptorSet.SetDescriptorAt(4, drawDirector->GetPreviousTransformsDescriptorInfo(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+        }
+    }
+
+    VkDeviceSize CRaster::GetPoseCameraStride() const
+    {
+        auto                          cameraManager = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+        const VkPhysicalDeviceLimits& limits        = mContext->VkbPhysicalDevice->properties.limits;
+        VkDeviceSize                  blockSize     = sizeof(cameraManager->GetUbo().GetData());
+        return (blockSize + limits.minUniformBufferOffsetAlignment - 1) / limits.minUniformBufferOffsetAlignment * limits.minUniformBufferOffsetAlignment;
+    }
+
+    void CRaster::WritePoseCamera(void* dst, const PoseCamera& camera, const PoseCamera& previous, const glm::mat4& crop) const
+    {
+        // Everything but the matrices (e.g. near and far plane) is taken from the scenes camera.
+        // cgbuf.vert rasterizes with ProjectionMatrix * ViewMatrix, the projection view matrices stay uncropped for the device position varyings
+        auto cameraManager                 = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+        auto block                         = cameraManager->GetUbo().GetData();
+        block.ViewMatrix                   = camera.ViewMatrix;
+        block.ProjectionMatrix             = crop * camera.ProjectionMatrix;
+        block.ProjectionViewMatrix         = camera.ProjectionMatrix * camera.ViewMatrix;
+        block.InverseViewMatrix            = glm::inverse(camera.ViewMatrix);
+        block.InverseProjectionMatrix      = glm::inverse(block.ProjectionMatrix);
+        block.PreviousViewMatrix           = previous.ViewMatrix;
+        block.PreviousProjectionMatrix     = crop * previous.ProjectionMatrix;
+        block.PreviousProjectionViewMatrix = previous.ProjectionMatrix * previous.ViewMatrix;
+        memcpy(dst, &block, sizeof(block));
+    }
+
+    void CRaster::RenderTiled(foray::base::FrameRenderInfo& renderInfo, const TileCallback& callback)
+    {
+        foray::Assert(mTiling.has_value(), "CRaster is not configured for tiled mode, see CRaster::SetTiling()");
+        const TilingConfig& tiling        = *mTiling;
+        auto                cameraManager = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+
+        // Staging layout: One tightly packed region per output, depth last
+
+        std::vector<foray::core::ManagedImage*> images;
+        std::vector<std::string_view>           names;
+        for(Output* output : mOutputList)
+        {
+            images.push_back(&output->Images[mCurrentSet]);
+            names.push_back(output->Name);
+        }
+        images.push_back(&mDepthImages[mCurrentSet]);
+        names.push_back(mDepthOutputName);
+
+        std::vector<VkDeviceSize> regionOffsets;
+        VkDeviceSize              stagingSize = 0;
+        for(foray::core::ManagedImage* image : images)
+        {
+            regionOffsets.push_back(stagingSize);
+            stagingSize += (VkDeviceSize)tiling.TileExtent.width * tiling.TileExtent.height * GetTexelSize(image->GetFormat());
+            stagingSize = (stagingSize + 15) & ~(VkDeviceSize)15;
+        }
+
+        // Every tile slot has its own camera block with the projection cropped to the tile, bound by its own descriptor set
+
+        VkDeviceSize cameraStride = GetPoseCameraStride();
+
+        struct TileSlot
+        {
+            foray::core::ManagedBuffer         Staging;
+            foray::core::ManagedBuffer         Camera;
+            foray::core::DescriptorSetHelper   DescriptorSet;
+            foray::core::HostSyncCommandBuffer CmdBuffer;
+            PoseBinding                        Binding;
+            TileReadback                       Readback;
+            bool                               InFlight = false;
+        };
+        TileSlot slots[2];
+        for(uint32_t slotIndex = 0; slotIndex < 2; slotIndex++)
+        {
+            TileSlot& slot = slots[slotIndex];
+
+            foray::core::ManagedBuffer::CreateInfo stagingCi(VK_BUFFER_USAGE_TRANSFER_DST_BIT, stagingSize, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                             VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, fmt::format("{}.TileStaging.{}", mName, slotIndex));
+            slot.Staging.Create(mContext, stagingCi);
+            foray::core::ManagedBuffer::CreateInfo cameraCi(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, cameraStride, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                                                            VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, fmt::format("{}.TileCamera.{}", mName, slotIndex));
+            slot.Camera.Create(mContext, cameraCi);
+            SetupPoseDescriptors(slot.DescriptorSet, VkDescriptorBufferInfo{.buffer = slot.Camera.GetBuffer(), .offset = 0, .range = VK_WHOLE_SIZE});
+            slot.DescriptorSet.Create(mContext, fmt::format("{}.TileDescriptorSet.{}", mName, slotIndex));
+            slot.CmdBuffer.Create(mContext);
+        }
+
+        auto deliver = [&](TileSlot& slot) {
+            slot.CmdBuffer.WaitForCompletion();
+            void* data = nullptr;
+            vmaInvalidateAllocation(mContext->Allocator, slot.Staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+            slot.Staging.Map(data);
+            slot.Readback.Data.clear();
+            for(uint32_t i = 0; i < images.size(); i++)
+            {
+                size_t size = (size_t)slot.Readback.Extent.width * slot.Readback.Extent.height * GetTexelSize(images[i]->GetFormat());
+                slot.Readback.Data[std::string(names[i])] = std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(data) + regionOffsets[i], size);
+            }
+            callback(slot.Readback);
+            slot.Staging.Unmap();
+            slot.InFlight = false;
+        };
+
+        uint32_t tileCountX = (tiling.OutputExtent.width + tiling.TileExtent.width - 1) / tiling.TileExtent.width;
+        uint32_t tileCountY = (tiling.OutputExtent.height + tiling.TileExtent.height - 1) / tiling.TileExtent.height;
+
+        for(uint32_t tileIndex = 0; tileIndex < tileCountX * tileCountY; tileIndex++)
+        {
+            TileSlot& slot = slots[tileIndex % 2];
+            if(slot.InFlight)
+            {
+                deliver(slot);
+            }
+
+            VkOffset2D origin{(int32_t)((tileIndex % tileCountX) * tiling.TileExtent.width), (int32_t)((tileIndex / tileCountX) * tiling.TileExtent.height)};
+            VkExtent2D extent{std::min(tiling.TileExtent.width, tiling.OutputExtent.width - (uint32_t)origin.x),
+                              std::min(tiling.TileExtent.height, tiling.OutputExtent.height - (uint32_t)origin.y)};
+            slot.Readback.Offset = origin;
+            slot.Readback.Extent = extent;
+
+            // Cropped projection: Device coordinates of the full output are scaled and offset in clip space, so the tile (plus border) covers the attachments.
+            // The viewport stays at attachment size, independent of the output extent
+            glm::vec2 tileMin  = glm::vec2((float)origin.x - (float)tiling.Border, (float)origin.y - (float)tiling.Border);
+            glm::vec2 output   = glm::vec2((float)tiling.OutputExtent.width, (float)tiling.OutputExtent.height);
+            glm::vec2 attached = glm::vec2((float)mRenderExtent.width, (float)mRenderExtent.height);
+            glm::mat4 crop     = glm::mat4(1.f);
+            crop[0][0]         = output.x / attached.x;
+            crop[1][1]         = output.y / attached.y;
+            crop[3][0]         = (output.x - 2.f * tileMin.x) / attached.x - 1.f;
+            crop[3][1]         = (output.y - 2.f * tileMin.y) / attached.y - 1.f;
+
+            // Device positions (and so ScreenMotion) are computed with the uncropped matrices, as in a render of the full output
+            const auto& ubo = cameraManager->GetUbo().GetData();
+            PoseCamera  camera{.ViewMatrix = ubo.ViewMatrix, .ProjectionMatrix = ubo.ProjectionMatrix};
+            PoseCamera  previous{.ViewMatrix = ubo.PreviousViewMatrix, .ProjectionMatrix = ubo.PreviousProjectionMatrix};
+            void*       cameraData = nullptr;
+            slot.Camera.Map(cameraData);
+            WritePoseCamera(cameraData, camera, previous, crop);
+            vmaFlushAllocation(mContext->Allocator, slot.Camera.GetAllocation(), 0, VK_WHOLE_SIZE);
+            slot.Camera.Unmap();
+            slot.Binding = PoseBinding{.DescriptorSet = slot.DescriptorSet.GetDescriptorSet(), .ViewMatrix = camera.ViewMatrix, .ProjectionMatrix = crop * camera.ProjectionMatrix};
+
+            VkViewport viewport{0.f, 0.f, attached.x, attached.y, 0.f, 1.f};
+            VkRect2D   scissor{VkOffset2D{}, VkExtent2D{std::min(mRenderExtent.width, extent.width + 2 * tiling.Border),
+                                                        std::min(mRenderExtent.height, extent.height + 2 * tiling.Border)}};
+
+            VkCommandBuffer cmdBuffer = slot.CmdBuffer.GetCommandBuffer();
+            slot.CmdBuffer.Begin();
+            mPose = &slot.Binding;
+            RecordRasterPass(cmdBuffer, &renderInfo, renderInfo.GetImageLayoutCache(), viewport, scissor);
+            mPose = nullptr;
+
+            // Copy the tile (without border) to the staging buffer
+            RecordCopyToStaging(cmdBuffer, renderInfo.GetImageLayoutCache(), mCurrentSet, slot.Staging.GetBuffer(), 0, regionOffsets, VkOffset2D{(int32_t)tiling.Border, (int32_t)tiling.Border}, extent);
+
+            VkBufferMemoryBarrier2 hostBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                               .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                               .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                               .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                               .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+                                               .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                               .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                               .buffer              = slot.Staging.GetBuffer(),
+                                               .offset              = 0,
+                                               .size                = VK_WHOLE_SIZE};
+            VkDependencyInfo depInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &hostBarrier};
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+            slot.CmdBuffer.End();
+            slot.CmdBuffer.Submit();
+            slot.InFlight = true;
+        }
+
+        // Deliver the remaining tiles in submission order
+        uint32_t tileCount = tileCountX * tileCountY;
+        for(uint32_t tileIndex = tileCount > 2 ? tileCount - 2 : 0; tileIndex < tileCount; tileIndex++)
+        {
+            if(slots[tileIndex % 2].InFlight)
+            {
+                deliver(slots[tileIndex % 2]);
+            }
+        }
+
+        for(TileSlot& slot : slots)
+        {
+            slot.CmdBuffer.Destroy();
+            slot.DescriptorSet.Destroy();
+            slot.Camera.Destroy();
+            slot.Staging.Destroy();
+        }
+    }
+
+    void CRaster::RecordCopyToStaging(VkCommandBuffer                  cmdBuffer,
+                                      foray::core::ImageLayoutCache&   layoutCache,
+                                      uint32_t                         set,
+                                      VkBuffer                         staging,
+                                      VkDeviceSize                     stagingOffset,
+                                      const std::vector<VkDeviceSize>& regionOffsets,
+                                      const VkOffset2D&                imageOffset,
+                                      const VkExtent2D&                extent)
+    {
+        std::vector<foray::core::ManagedImage*> images;
+        for(Output* output : mOutputList)
+        {
+            images.push_back(&output->Images[set]);
+        }
+        foray::core::ManagedImage* depthImage = &DepthOfSet(set);
+        images.push_back(depthImage);
+
+        std::vector<VkImageMemoryBarrier2> imgBarriers;
+        for(foray::core::ManagedImage* image : images)
+        {
+            bool isDepth = image == depthImage;
+            // Derived outputs are written (and depth is read) by the derive pass
+            VkPipelineStageFlags2 srcStage  = (isDepth ? VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT : VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT) | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            VkAccessFlags2        srcAccess = isDepth ? VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            imgBarriers.push_back(VkImageMemoryBarrier2{
+                .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = srcStage,
+                .srcAccessMask       = srcAccess,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                .dstAccessMask       = VK_ACCESS_2_TRANSFER_READ_BIT,
+                .oldLayout           = layoutCache.Get(*image),
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = image->GetImage(),
+                .subresourceRange    = VkImageSubresourceRange{.aspectMask     = isDepth ? VkImageAspectFlags(VK_IMAGE_ASPECT_DEPTH_BIT) : VkImageAspectFlags(VK_IMAGE_ASPECT_COLOR_BIT),
+                                                               .baseMipLevel   = 0,
+                                                               .levelCount     = 1,
+                                                               .baseArrayLayer = 0,
+                                                               .layerCount     = 1},
+            });
+        }
+        VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                 .imageMemoryBarrierCount = (uint32_t)imgBarriers.size(),
+                                 .pImageMemoryBarriers    = imgBarriers.data()};
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+        for(uint32_t i = 0; i < images.size(); i++)
+        {
+            bool              isDepth = images[i] == depthImage;
+            VkBufferImageCopy region{.bufferOffset      = stagingOffset + regionOffsets[i],
+                                     .bufferRowLength   = 0,
+                                     .bufferImageHeight = 0,
+                                     .imageSubresource  = VkImageSubresourceLayers{.aspectMask     = isDepth ? VkImageAspectFlags(VK_IMAGE_ASPECT_DEPTH_BIT) : VkImageAspectFlags(VK_IMAGE_ASPECT_COLOR_BIT),
+                                                                                   .mipLevel       = 0,
+                                                                                   .baseArrayLayer = 0,
+                                                                                   .layerCount     = 1},
+                                     .imageOffset       = VkOffset3D{imageOffset.x, imageOffset.y, 0},
+                                     .imageExtent       = VkExtent3D{extent.width, extent.height, 1}};
+            vkCmdCopyImageToBuffer(cmdBuffer, images[i]->GetImage(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, staging, 1, &region);
+            layoutCache.Set(*images[i], VkImageLayout::VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        }
+    }
+
+    void CRaster::RenderBatch(foray::base::FrameRenderInfo& renderInfo,
+                              std::span<const BatchPose>    poses,
+                              const BatchCallback&          callback,
+                              uint32_t                      posesPerSubmission,
+                              InstanceBvh*                  bvh)
+    {
+        RenderPoses(&renderInfo, renderInfo.GetImageLayoutCache(), poses, callback, posesPerSubmission, bvh);
+    }
+
+    void CRaster::RenderBatch(std::span<const BatchPose> poses, const BatchCallback& callback, uint32_t posesPerSubmission, InstanceBvh* bvh)
+    {
+        // Attachments are transitioned from VK_IMAGE_LAYOUT_UNDEFINED by every raster pass, so an empty cache suffices
+        foray::Assert(mSortDraws, "Batch rendering without a renderloop requires draw sorting, see CRaster::SetSortDraws()");
+        foray::core::ImageLayoutCache layoutCache;
+        RenderPoses(nullptr, layoutCache, poses, callback, posesPerSubmission, bvh);
+    }
+
+    void CRaster::RenderPoses(foray::base::FrameRenderInfo*  renderInfo,
+                              foray::core::ImageLayoutCache& layoutCache,
+                              std::span<const BatchPose>     poses,
+                              const BatchCallback&           callback,
+                              uint32_t                       posesPerSubmission,
+                              InstanceBvh*                   bvh)
+    {
+        foray::Assert(!mTiling.has_value(), "CRaster is configured for tiled mode, use CRaster::RenderTiled()");
+        foray::Assert(!mDepthSource, "Batch rendering does not support a depth source");
+        foray::Assert(!UsesAsyncCompute(), "Batch rendering does not support async compute");
+        foray::Assert(!mInstanceIdOutput, "Batch rendering does not support derived SCREENMOTION outputs, use the rasterized ScreenMotion template instead");
+        foray::Assert(posesPerSubmission > 0, "At least one pose must be recorded per submission");
+        foray::Assert(!bvh || mSortDraws, "Visible instance lists require draw sorting, see CRaster::SetSortDraws()");
+        if(poses.empty())
+        {
+            return;
+        }
+        posesPerSubmission = std::min(posesPerSubmission, (uint32_t)poses.size());
+
+        auto drawDirector = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+
+        // Transform snapshots replace the DrawDirectors buffers, so they must cover every transform index drawn
+
+        bool     snapshots      = !poses[0].Transforms.empty();
+        uint32_t transformCount = 0;
+        for(const foray::scene::gcomp::DrawDirector::DrawOp& drawOp : drawDirector->GetDrawOps())
+        {
+            transformCount = std::max(transformCount, drawOp.TransformOffset + (uint32_t)drawOp.Instances.size());
+        }
+        for(uint32_t poseIndex = 0; poseIndex < poses.size(); poseIndex++)
+        {
+            const BatchPose& pose = poses[poseIndex];
+            foray::Assert(!pose.Transforms.empty() == snapshots, "Either all or no poses must carry transform snapshots");
+            // The hierarchy is fitted to the scenes transforms
+            foray::Assert(!bvh || !snapshots, "Per pose culling does not support transform snapshots");
+            if(snapshots)
+            {
+                FORAY_ASSERTFMT(pose.Transforms.size() >= transformCount && (pose.PreviousTransforms.empty() || pose.PreviousTransforms.size() >= transformCount),
+                                "Transform snapshot of pose {} holds less than the scenes {} transforms", poseIndex, transformCount);
+            }
+        }
+
+        // Staging layout: One block per pose, holding one tightly packed region per output, depth last
+
+        std::vector<std::string_view> names;
+        std::vector<VkDeviceSize>     regionSizes;
+        for(Output* output : mOutputList)
+        {
+            names.push_back(output->Name);
+            regionSizes.push_back((VkDeviceSize)mRenderExtent.width * mRenderExtent.height * GetTexelSize(output->Images[0].GetFormat()));
+        }
+        names.push_back(mDepthOutputName);
+        regionSizes.push_back((VkDeviceSize)mRenderExtent.width * mRenderExtent.height * GetTexelSize(mDepthImages[0].GetFormat()));
+
+        std::vector<VkDeviceSize> regionOffsets;
+        VkDeviceSize              poseSize = 0;
+        for(VkDeviceSize regionSize : regionSizes)
+        {
+            regionOffsets.push_back(poseSize);
+            poseSize = (poseSize + regionSize + 15) & ~(VkDeviceSize)15;
+        }
+
+        // Every pose slot of a submission has its own camera block (and transform snapshots), bound by its own descriptor set
+
+        const VkPhysicalDeviceLimits& limits = mContext->VkbPhysicalDevice->properties.limits;
+        VkDeviceSize cameraStride    = GetPoseCameraStride();
+        VkDeviceSize transformSize   = (VkDeviceSize)transformCount * sizeof(glm::mat4);
+        VkDeviceSize transformStride = (transformSize + limits.minStorageBufferOffsetAlignment - 1) / limits.minStorageBufferOffsetAlignment * limits.minStorageBufferOffsetAlignment;
+
+        struct BatchSlot
+        {
+            foray::core::ManagedBuffer                          Staging;
+            foray::core::ManagedBuffer                          Cameras;
+            foray::core::ManagedBuffer                          Transforms;
+            foray::core::HostSyncCommandBuffer                  CmdBuffer;
+            std::unique_ptr<foray::core::DescriptorSetHelper[]> DescriptorSets;
+            std::vector<PoseBinding>                            Bindings;
+            /// @brief Visible instances per pose slot, if culled
+            std::vector<std::vector<uint32_t>>                  Visible;
+            uint32_t                                            FirstPose = 0;
+            uint32_t                                            PoseCount = 0;
+            bool                                                InFlight  = false;
+        };
+        BatchSlot slots[2];
+        for(uint32_t slotIndex = 0; slotIndex < 2; slotIndex++)
+        {
+            BatchSlot& slot = slots[slotIndex];
+
+            foray::core::ManagedBuffer::CreateInfo stagingCi(VK_BUFFER_USAGE_TRANSFER_DST_BIT, poseSize * posesPerSubmission, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                             VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, fmt::format("{}.BatchStaging.{}", mName, slotIndex));
+            slot.Staging.Create(mContext, stagingCi);
+            foray::core::ManagedBuffer::CreateInfo camerasCi(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, cameraStride * posesPerSubmission, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                                                             VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, fmt::format("{}.BatchCameras.{}", mName, slotIndex));
+            slot.Cameras.Create(mContext, camerasCi);
+            if(snapshots)
+            {
+                // Current and previous snapshot per pose
+                foray::core::ManagedBuffer::CreateInfo transformsCi(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, transformStride * 2 * posesPerSubmission, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                                                                    VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, fmt::format("{}.BatchTransforms.{}", mName, slotIndex));
+                slot.Transforms.Create(mContext, transformsCi);
+            }
+            slot.CmdBuffer.Create(mContext);
+
+            slot.DescriptorSets = std::make_unique<foray::core::DescriptorSetHelper[]>(posesPerSubmission);
+            slot.Bindings.resize(posesPerSubmission);
+            for(uint32_t poseSlot = 0; poseSlot < posesPerSubmission; poseSlot++)
+            {
+                foray::core::DescriptorSetHelper& descriptorSet = slot.DescriptorSets[poseSlot];
+                VkDescriptorBufferInfo            camera{.buffer = slot.Cameras.GetBuffer(), .offset = poseSlot * cameraStride, .range = cameraStride};
+                VkDescriptorBufferInfo            transforms{.buffer = slot.Transforms.GetBuffer(), .offset = (2 * poseSlot) * transformStride, .range = transformSize};
+                VkDescriptorBufferInfo            previousTransforms{.buffer = slot.Transforms.GetBuffer(), .offset = (2 * poseSlot + 1) * transformStride, .range = transformSize};
+                SetupPoseDescriptors(descriptorSet, camera, snapshots ? &transforms : nullptr, snapshots ? &previousTransforms : nullptr);
+                descriptorSet.Create(mContext, fmt::format("{}.BatchDescriptorSet.{}.{}", mName, slotIndex, poseSlot));
+            }
+        }
+
+        auto deliver = [&](BatchSlot& slot) {
+            slot.CmdBuffer.WaitForCompletion();
+            void* data = nullptr;
+            vmaInvalidateAllocation(mContext->Allocator, slot.Staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+            slot.Staging.Map(data);
+            PoseReadback readback{.Extent = mRenderExtent};
+            for(uint32_t poseSlot = 0; poseSlot < slot.PoseCount; poseSlot++)
+            {
+                const uint8_t* poseData = reinterpret_cast<const uint8_t*>(data) + poseSlot * poseSize;
+                readback.PoseIndex      = slot.FirstPose + poseSlot;
+                for(uint32_t i = 0; i < names.size(); i++)
+                {
+                    readback.Data[std::string(names[i])] = std::span<const uint8_t>(poseData + regionOffsets[i], (size_t)regionSizes[i]);
+                }
+                callback(readback);
+            }
+            slot.Staging.Unmap();
+            slot.InFlight = false;
+        };
+
+        VkViewport viewport{0.f, 0.f, (float)mRenderExtent.width, (float)mRenderExtent.height, 0.0f, 1.0f};
+        VkRect2D   scissor{VkOffset2D{}, mRenderExtent};
+
+        // A list culled for the frames camera does not apply to the poses. Without a hierarchy, every pose draws all instances
+        mDrawList.SetVisibleInstances(nullptr, nullptr);
+        std::vector<glm::mat4> projectionViews;
+
+        uint32_t submissionCount = ((uint32_t)poses.size() + posesPerSubmission - 1) / posesPerSubmission;
+        for(uint32_t submission = 0; submission < submissionCount; submission++)
+        {
+            BatchSlot& slot = slots[submission % 2];
+            if(slot.InFlight)
+            {
+                deliver(slot);
+            }
+            slot.FirstPose = submission * posesPerSubmission;
+            slot.PoseCount = std::min(posesPerSubmission, (uint32_t)poses.size() - slot.FirstPose);
+
+            // Cameras and snapshots are written on the host before submitting, which makes them visible to the device
+
+            void* cameraData    = nullptr;
+            void* transformData = nullptr;
+            slot.Cameras.Map(cameraData);
+            if(snapshots)
+            {
+                slot.Transforms.Map(transformData);
+            }
+            for(uint32_t poseSlot = 0; poseSlot < slot.PoseCount; poseSlot++)
+            {
+                const BatchPose&  pose     = poses[slot.FirstPose + poseSlot];
+                const PoseCamera& previous = pose.PreviousCamera.value_or(pose.Camera);
+
+                WritePoseCamera(reinterpret_cast<uint8_t*>(cameraData) + poseSlot * cameraStride, pose.Camera, previous);
+
+                if(snapshots)
+                {
+                    std::span<const glm::mat4> previousTransforms = pose.PreviousTransforms.empty() ? pose.Transforms : pose.PreviousTransforms;
+                    memcpy(reinterpret_cast<uint8_t*>(transformData) + (2 * poseSlot) * transformStride, pose.Transforms.data(), (size_t)transformSize);
+                    memcpy(reinterpret_cast<uint8_t*>(transformData) + (2 * poseSlot + 1) * transformStride, previousTransforms.data(), (size_t)transformSize);
+                }
+
+                slot.Bindings[poseSlot] = PoseBinding{.DescriptorSet    = slot.DescriptorSets[poseSlot].GetDescriptorSet(),
+                                                      .ViewMatrix       = pose.Camera.ViewMatrix,
+                                                      .ProjectionMatrix = pose.Camera.ProjectionMatrix};
+            }
+            vmaFlushAllocation(mContext->Allocator, slot.Cameras.GetAllocation(), 0, VK_WHOLE_SIZE);
+            slot.Cameras.Unmap();
+            if(!!bvh)
+            {
+                // All poses of the submission are culled in a single query, one camera per SIMD lane
+                projectionViews.clear();
+                for(uint32_t poseSlot = 0; poseSlot < slot.PoseCount; poseSlot++)
+                {
+                    projectionViews.push_back(slot.Bindings[poseSlot].ProjectionMatrix * slot.Bindings[poseSlot].ViewMatrix);
+                }
+                bvh->Query(projectionViews, slot.Visible);
+            }
+            if(snapshots)
+            {
+                vmaFlushAllocation(mContext->Allocator, slot.Transforms.GetAllocation(), 0, VK_WHOLE_SIZE);
+                slot.Transforms.Unmap();
+            }
+
+            VkCommandBuffer cmdBuffer = slot.CmdBuffer.GetCommandBuffer();
+            slot.CmdBuffer.Begin();
+
+            // Waves of one pose per output set: Rasterized back to back, so the GPU overlaps them, then copied to staging together
+            for(uint32_t waveFirst = 0; waveFirst < slot.PoseCount; waveFirst += mOutputSetCount)
+            {
+                uint32_t waveCount = std::min(mOutputSetCount, slot.PoseCount - waveFirst);
+                for(uint32_t set = 0; set < waveCount; set++)
+                {
+                    SetImageOutputsToSet(set);
+                    mPose = &slot.Bindings[waveFirst + set];
+                    if(!!bvh)
+                    {
+                        mDrawList.SetVisibleInstances(bvh, &slot.Visible[waveFirst + set]);
+                    }
+                    RecordRasterPass(cmdBuffer, renderInfo, layoutCache, viewport, scissor);
+                }
+                mPose = nullptr;
+                for(uint32_t set = 0; set < waveCount; set++)
+                {
+                    RecordCopyToStaging(cmdBuffer, layoutCache, set, slot.Staging.GetBuffer(), (waveFirst + set) * poseSize, regionOffsets, VkOffset2D{}, mRenderExtent);
+                }
+            }
+
+            VkBufferMemoryBarrier2 hostBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                               .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                               .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                               .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                               .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+                                               .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                               .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                               .buffer              = slot.Staging.GetBuffer(),
+                                               .offset              = 0,
+                                               .size                = VK_WHOLE_SIZE};
+            VkDependencyInfo depInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &hostBarrier};
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+            slot.CmdBuffer.End();
+            slot.CmdBuffer.Submit();
+            slot.InFlight = true;
+        }
+
+        // Lists of the slots are destroyed below
+        mDrawList.SetVisibleInstances(nullptr, nullptr);
+
+        // Deliver the remaining poses in submission order
+        for(uint32_t submission = submissionCount > 2 ? submissionCount - 2 : 0; submission < submissionCount; submission++)
+        {
+            if(slots[submission % 2].InFlight)
+            {
+                deliver(slots[submission % 2]);
+            }
+        }
+
+        for(BatchSlot& slot : slots)
+        {
+            slot.CmdBuffer.Destroy();
+            if(!!slot.DescriptorSets)
+            {
+                for(uint32_t poseSlot = 0; poseSlot < posesPerSubmission; poseSlot++)
+                {
+                    slot.DescriptorSets[poseSlot].Destroy();
+                }
+            }
+            slot.Transforms.Destroy();
+            slot.Cameras.Destroy();
+            slot.Staging.Destroy();
         }
     }
 
     void CRaster::Resize(const VkExtent2D& extent)
     {
-        if(!!mFrameBuffer)
+        if(mTiling.has_value() || mFixedExtent.has_value())
         {
-            vkDestroyFramebuffer(mContext->Device(), mFrameBuffer, nullptr);
-            mFrameBuffer = nullptr;
+            // Attachments are sized by the tiling configuration or the fixed render extent, independent of the swapchain
+            return;
         }
+        mRenderExtent = extent;
+        DestroyFrameBuffers();
 
-        for(auto& pair : mOutputMap)
+        for(uint32_t set = 0; set < mOutputSetCount; set++)
         {
-            foray::core::ManagedImage& image = pair.second->Image;
-            if(image.Exists())
+            for(auto& pair : mOutputMap)
+            {
+                foray::core::ManagedImage& image = pair.second->Images[set];
+                if(image.Exists())
+                {
+                    image.Resize(extent);
+                }
+            }
+            if(!mDepthSource)
             {
-                image.Resize(extent);
+                mDepthImages[set].Resize(extent);
             }
         }
-        mDepthImage.Resize(extent);
 
         CreateFrameBuffer();
+        for(DerivePass* pass : {&mDerive, &mDeriveAsync})
+        {
+            if(!!pass->Pipeline)
+            {
+                CreateDeriveDescriptorSets(*pass);
+            }
+        }
     }
 
     void CRaster::Destroy()
@@ -616,27 +2147,43 @@ namespace cgbuffer {
             return;
         }
         VkDevice device = mContext->Device();
-        if(mPipeline)
+        for(std::unique_ptr<Pass>& pass : mPasses)
         {
-            vkDestroyPipeline(device, mPipeline, nullptr);
-            mPipeline = nullptr;
+            if(pass->Pipeline)
+            {
+                vkDestroyPipeline(device, pass->Pipeline, nullptr);
+                pass->Pipeline = nullptr;
+            }
+            pass->VertexShaderModule.Destroy();
+            pass->FragmentShaderModule.Destroy();
         }
         mPipelineLayout.Destroy();
         mDescriptorSet.Destroy();
-        mVertexShaderModule.Destroy();
-        mFragmentShaderModule.Destroy();
-        RenderStage::DestroyOutputImages();
-        mDepthImage.Destroy();
-        if(mFrameBuffer)
+        DestroyDerivePass(mDerive);
+        DestroyDerivePass(mDeriveAsync);
+        for(uint32_t set = 0; set < MAX_OUTPUT_SETS; set++)
         {
-            vkDestroyFramebuffer(device, mFrameBuffer, nullptr);
-            mFrameBuffer = nullptr;
+            for(auto& pair : mOutputMap)
+            {
+                pair.second->Images[set].Destroy();
+            }
+            mDepthImages[set].Destroy();
         }
-        if(mRenderpass)
+        mImageOutputs.clear();
+        DestroyFrameBuffers();
+        for(std::unique_ptr<Pass>& pass : mPasses)
         {
-            vkDestroyRenderPass(device, mRenderpass, nullptr);
-            mRenderpass = nullptr;
+            if(pass->Renderpass)
+            {
+                vkDestroyRenderPass(device, pass->Renderpass, nullptr);
+                pass->Renderpass = nullptr;
+            }
         }
+        mPasses.clear();
+        mDerivedOutputs.clear();
+        mInstanceIdOutput = nullptr;
+        mAsyncInputNames.clear();
+        mPendingAcquires.clear();
         mOutputList.clear();
         mOutputMap.clear();
     }
@@ -1,5 +1,10 @@
 #pragma once
+#include "async-compute.hpp"
+#include "draw-list.hpp"
 #include <foray_api.hpp>
+#include <functional>
+#include <optional>
+#include <span>
 
 namespace cgbuffer {
 
@@ -9,10 +14,18 @@ namespace cgbuffer {
     ///  - Add Outputs: See documentation of CRaster::OutputRecipe and CRaster::AddOutput()
     ///  - Build: See CRaster::Build()
     ///  - Get Outputs: See RenderStage::GetImageOutput()
+    /// If more outputs are configured than the device supports color attachments (VkPhysicalDeviceLimits::maxColorAttachments), the scene is drawn in
+    /// multiple passes. The first pass writes depth, later passes test against it with VK_COMPARE_OP_EQUAL and depth writes disabled,
+    /// so every pass shades close to one fragment per pixel.
+    /// Derived outputs (see OutputRecipe::Derived) are not rasterized, but reconstructed from depth by a compute pass recorded after the raster passes.
+    /// With an AsyncCompute (see SetAsyncCompute()), derived outputs not depending on per frame scene buffers are evaluated on the compute queue instead.
     class CRaster : public foray::stages::RasterizedRenderStage
     {
       public:
-        inline static constexpr uint32_t MAX_OUTPUT_COUNT = 16;
+        inline static constexpr uint32_t MAX_OUTPUT_COUNT      = 64;
+        /// @brief Max outputs written by a single pass (output locations declared in cgbuf.frag)
+        inline static constexpr uint32_t MAX_PASS_OUTPUT_COUNT = 16;
+        inline static constexpr uint32_t MAX_OUTPUT_SETS       = 4;
 
         enum class FragmentInputFlagBits : uint32_t
         {
@@ -82,6 +95,19 @@ namespace cgbuffer {
             UVEC4,
         };
 
+        /// @brief Outputs reconstructed from depth and camera by a compute pass after rasterization, instead of being written per fragment
+        enum class DerivedOutput
+        {
+            /// @brief Rasterized output, evaluated from Calculation and Result in the fragment shader
+            NONE,
+            /// @brief vec4(WorldPos, 0), rgba16f, cleared to (0,0,0,0)
+            WORLDPOS,
+            /// @brief vec2(linearZ, derivative) as DepthAndDerivative, rg16f, cleared to (1,0). Derivatives are differences within 2x2 pixel quads, 0 across silhouettes
+            DEPTHANDDERIVATIVE,
+            /// @brief ScreenSpace Motion Vectors as ScreenMotion, rg16f, cleared to (0,0). Reads the mesh instance id per pixel to account for moving instances
+            SCREENMOTION,
+        };
+
         /// @brief Defines the custom GBuffer output to generate
         struct OutputRecipe
         {
@@ -99,6 +125,8 @@ namespace cgbuffer {
             std::string Calculation = "";
             /// @brief Result assignment. Pasted to "output = TYPE(RESULT);"
             std::string Result = "0";
+            /// @brief If set, the output is evaluated by the derive compute pass. Inputs, features, calculation and result are ignored and the format is fixed
+            DerivedOutput Derived = DerivedOutput::NONE;
 
             /// @brief Add a flag to FragmentInputFlags member
             OutputRecipe& AddFragmentInput(FragmentInputFlagBits input);
@@ -113,6 +141,8 @@ namespace cgbuffer {
             static const OutputRecipe WorldPos;
             /// @brief WorldSpace Normals, rgba16f, cleared to (0,0,0,0)
             static const OutputRecipe WorldNormal;
+            /// @brief WorldSpace interpolated vertex normals (no normal mapping), rgba16f, cleared to (0,0,0,0)
+            static const OutputRecipe VertexNormal;
             /// @brief Material BaseColor, rgba16f, cleared to (0,0,0,1) (alpha always 1)
             static const OutputRecipe Albedo;
             /// @brief Material Id, r32i, cleared to (-1)
@@ -127,36 +157,217 @@ namespace cgbuffer {
             static const OutputRecipe WorldMotion;
             /// @brief Linearized depth and derivative, rg16f, cleared to (1,0)
             static const OutputRecipe DepthAndDerivative;
+            /// @brief WorldPos reconstructed from depth (see DerivedOutput::WORLDPOS)
+            static const OutputRecipe DerivedWorldPos;
+            /// @brief DepthAndDerivative reconstructed from depth (see DerivedOutput::DEPTHANDDERIVATIVE)
+            static const OutputRecipe DerivedDepthAndDerivative;
+            /// @brief ScreenMotion reconstructed from depth and instance transforms (see DerivedOutput::SCREENMOTION)
+            static const OutputRecipe DerivedScreenMotion;
+        };
+
+        /// @brief Configures tiled mode, rendering outputs larger than framebuffer limits or the memory budget (see CRaster::RenderTiled())
+        struct TilingConfig
+        {
+            /// @brief Full resolution of the outputs
+            VkExtent2D OutputExtent = {};
+            /// @brief Size of a single tile. Width and height must be even
+            VkExtent2D TileExtent = {};
+            /// @brief Overlap rendered around every tile and discarded. Keeps derivative based outputs (DepthAndDerivative) correct at tile seams. Must be even
+            uint32_t Border = 0;
+        };
+
+        /// @brief Finished tile passed to a TileCallback
+        struct TileReadback
+        {
+            /// @brief Offset of the tile within the full resolution output
+            VkOffset2D Offset = {};
+            /// @brief Extent of the tile (cut off at the right and bottom output edge)
+            VkExtent2D Extent = {};
+            /// @brief Tightly packed texel data (row pitch = Extent.width * texel size) per output name, including the depth output
+            std::unordered_map<std::string, std::span<const uint8_t>> Data;
         };
+        using TileCallback = std::function<void(const TileReadback& tile)>;
+
+        /// @brief Camera matrices of a pose rendered by RenderBatch()
+        struct PoseCamera
+        {
+            glm::mat4 ViewMatrix       = glm::mat4(1.f);
+            glm::mat4 ProjectionMatrix = glm::mat4(1.f);
+        };
+
+        /// @brief Single image rendered by RenderBatch()
+        struct BatchPose
+        {
+            PoseCamera Camera;
+            /// @brief Camera of the previous image, for motion outputs. If not set, the pose has no camera motion
+            std::optional<PoseCamera> PreviousCamera;
+            /// @brief Snapshot of the transform buffer, indexed like the DrawDirectors transform buffers. Empty to use the scenes current transforms
+            std::span<const glm::mat4> Transforms;
+            /// @brief Snapshot of the previous transform buffer, for motion outputs. Empty to use Transforms (no object motion)
+            std::span<const glm::mat4> PreviousTransforms;
+        };
+
+        /// @brief Finished pose passed to a BatchCallback
+        struct PoseReadback
+        {
+            /// @brief Index into the poses passed to RenderBatch()
+            uint32_t   PoseIndex = 0;
+            VkExtent2D Extent    = {};
+            /// @brief Tightly packed texel data (row pitch = Extent.width * texel size) per output name, including the depth output
+            std::unordered_map<std::string, std::span<const uint8_t>> Data;
+        };
+        using BatchCallback = std::function<void(const PoseReadback& pose)>;
 
         /// @brief Enable a builtin feature (such as ALPHATEST) regardless of outputs generated
         CRaster& EnableBuiltInFeature(BuiltInFeaturesFlagBits feature);
 
+        /// @brief Allocates count sets of output and depth images, cycled per frame. Lets the next frames G-buffer pass start while consumers of the previous frames outputs are still running.
+        /// @param inFlightFrameCount The renderloops in flight frame count. With multiple sets, reuse of a set relies on the in flight fence, so Build() asserts count >= inFlightFrameCount
+        /// @param history Set if consumers read the previous frames set (see GetHistoryImageOutput()). A set is then read until the frame after the one writing it
+        /// has finished, so Build() asserts count > inFlightFrameCount
+        /// @remarks MUST be called before Build(), max MAX_OUTPUT_SETS. GetImageOutput() returns the set of the frame recorded last, so consumers must query it every frame instead of caching the pointer.
+        CRaster& SetOutputSetCount(uint32_t count, uint32_t inFlightFrameCount, bool history = false);
+
+        /// @brief Shares the depth image of another CRaster (typically a DepthPrepass) instead of rasterizing depth
+        /// @details All passes load the shared depth and test with VK_COMPARE_OP_EQUAL without writing it, so only the visible fragment per pixel is shaded.
+        /// Output recipes should not rely on alpha testing, as the depth source decides visibility.
+        /// @remarks MUST be called before Build(). The source must be built before this stage with the same output set count and extent,
+        /// and must be recorded (and resized) before it every frame. Not supported in tiled mode
+        CRaster& SetDepthSource(CRaster* source);
+
+        /// @brief Records draws through a per frame sorted DrawList instead of Scene::Draw()
+        /// @details Draws are sorted front to back for early depth rejection, or by material if a depth source resolves visibility.
+        /// Instances of the same primitive adjacent after sorting are merged into instanced calls.
+        /// @remarks MUST be called before Build()
+        CRaster& SetSortDraws(bool sortDraws);
+
+        /// @brief Draws every instance at a level of detail chosen from its projected bounding sphere size
+        /// @remarks MUST be called before Build(). Requires SetSortDraws(true). The MeshLods must be built for the same scene and outlive this stage
+        CRaster& SetMeshLods(const MeshLods* lods);
+
+        /// @brief Restricts the draws of the next frames to a list of visible instances (see InstanceBvh::Query()). Call every frame before RecordFrame()
+        /// @details A CRaster using a depth source must be given the same list as its depth source.
+        /// @remarks Requires SetSortDraws(true). The list must stay valid until the next call. Set bvh to nullptr to draw all instances again
+        CRaster& SetVisibleInstances(const InstanceBvh* bvh, const std::vector<uint32_t>* visible);
+
+        /// @brief Hands compute work following the raster passes over to a dedicated compute queue, overlapping it with the next frames rasterization
+        /// @details Depth derived outputs (WORLDPOS, DEPTHANDDERIVATIVE) are evaluated on the compute queue. SCREENMOTION stays on the graphics queue,
+        /// as it reads transform buffers the next frame rewrites. Depth and the outputs registered with AddAsyncComputeInput() are transferred to the
+        /// compute queue family in VK_IMAGE_LAYOUT_GENERAL after the raster passes, and must not be used on the graphics queue in the same frame.
+        /// If asyncCompute has no dedicated compute queue (see AsyncCompute::IsDedicated()), all work is recorded on the graphics queue as before.
+        /// @param returnStages Handed images are transferred back to the graphics queue family at the start of the next frame, and graphics work of these stages
+        /// waits for the compute work (e.g. for history reads). Pass VK_PIPELINE_STAGE_2_NONE if no graphics work reads them, so the next frames rasterization
+        /// does not wait: Images then stay owned by the compute queue family until rewritten, and the history getters assert for them.
+        /// Overlap with the next frame requires at least 2 output sets, as rewriting a set waits for the compute work reading it.
+        /// @remarks MUST be called before Build(). Every frame, AsyncCompute::BeginFrame() must be called before RecordFrame(). Not supported with a depth source or in tiled mode
+        CRaster& SetAsyncCompute(AsyncCompute* asyncCompute, VkPipelineStageFlags2 returnStages = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+        /// @brief Transfers an output (or the depth image) to the compute queue family every frame, for compute work recorded into AsyncCompute::GetCommandBuffer()
+        /// @remarks Call after Build(). Outputs evaluated on the compute queue are available there without a transfer
+        CRaster& AddAsyncComputeInput(std::string_view name);
+        /// @brief AsyncCompute work following RecordFrame() is recorded into. nullptr if not configured or no dedicated compute queue exists
+        inline AsyncCompute* GetAsyncCompute() const { return UsesAsyncCompute() ? mAsyncCompute : nullptr; }
+
+        /// @brief Enables tiled mode: Attachments are allocated at tile size (plus border) instead of swapchain size
+        /// @remarks MUST be called before Build(). In tiled mode, render via RenderTiled() instead of RecordFrame()
+        CRaster& SetTiling(const TilingConfig& tiling);
+
+        /// @brief Allocates the attachments at a fixed size instead of the swapchain size (e.g. the resolution of a dataset rendered with RenderBatch())
+        /// @remarks MUST be called before Build(). Resize() is ignored afterwards. Required if the context has no swapchain. Not supported in tiled mode
+        CRaster& SetRenderExtent(const VkExtent2D& extent);
+
         /// @brief Add an Output to the GBuffer
-        /// @remarks MUST be called before Build(), ONLY MAX CGBuffer::MAX_OUTPUT_COUNT may be set!
+        /// @remarks MUST be called before Build(), ONLY MAX CGBuffer::MAX_OUTPUT_COUNT may be set! Outputs beyond the devices color attachment limit are written by additional passes
         /// @param name Identifier (access the generated image via GetImageOutput(name))
         /// @param recipe Information for layout and type of data generated and calculation
+        /// @details A DerivedOutput::SCREENMOTION output requires a MeshInstanceId output. If none has been added before, one named "<name>.InstanceId" is added
         CRaster& AddOutput(std::string_view name, const OutputRecipe& recipe);
         /// @brief Readonly access to an output recipe
         const OutputRecipe& GetOutputRecipe(std::string_view name) const;
+        /// @brief Names of all outputs, in the order they were added
+        std::vector<std::string_view> GetOutputNames() const;
+        /// @brief Preprocessor definitions (NAME=VALUE) the cgbuf shaders are compiled with, per pass, for the configured outputs and features
+        /// @details Also identifies the pipeline variants when looking up shaders compiled ahead of time (see PrecompiledShaderRegistry)
+        /// @param maxColorAttachments Device limit the outputs are partitioned into passes by
+        std::vector<std::vector<std::string>> GetShaderDefinitions(uint32_t maxColorAttachments) const;
+        /// @brief Definitions cgbufderive.comp is compiled with, for every split of the derived outputs between the graphics and the compute queue
+        /// (all on the graphics queue, or SCREENMOTION on the graphics queue and the others on the compute queue, see SetAsyncCompute())
+        std::vector<std::vector<std::string>> GetDeriveShaderDefinitions() const;
 
         /// @brief Builds the GBuffer. Make sure to add all outputs before!
         virtual void Build(foray::core::Context* context, foray::scene::Scene* scene, std::string_view name = "CRaster");
 
         virtual void RecordFrame(VkCommandBuffer cmdBuffer, foray::base::FrameRenderInfo& renderInfo) override;
 
+        /// @brief Renders the full TilingConfig::OutputExtent tile by tile, using a projection cropped to the tile and a scissor per tile
+        /// @details Every tile is submitted separately and copied to a host visible staging buffer. Two tiles are kept in flight, so the callback
+        /// (e.g. writing to disk) overlaps with rendering of the next tile. Tiles are passed to the callback in row major order.
+        /// Every tile gets its own camera block (see RenderBatch()), with the scenes projection scaled and offset in clip space to the bordered tile.
+        /// The viewport covers the attachments only, so the output extent is not limited by maxViewportDimensions. Only the rasterized position is cropped,
+        /// device coordinates (DevicePos, DevicePosOld) are those of the full output, so ScreenMotion matches a render of the full output extent.
+        /// Scene buffers (materials, transforms) must already be up to date on the device. Derived SCREENMOTION outputs are not supported.
+        void RenderTiled(foray::base::FrameRenderInfo& renderInfo, const TileCallback& callback);
+
+        /// @brief Renders a list of poses (e.g. for dataset generation) and reads every pose back to the host, without presenting anything
+        /// @details posesPerSubmission poses are recorded into a single command buffer, cycling through the output sets: The poses of a wave
+        /// (one per output set) are rasterized back to back, then copied to a host visible staging buffer together. Every pose gets its own
+        /// camera buffer and descriptor set, so poses of a wave do not wait for each other. Two submissions are kept in flight, so recording and the callback
+        /// overlap with the GPU work of the other. Poses are passed to the callback in order, at the render extent (see GetRenderExtent() and SetRenderExtent()).
+        /// Draw sorting and LOD selection (see SetSortDraws()) use the pose camera, but the scenes node transforms, also for poses with transform snapshots.
+        /// If bvh is set, the poses of every submission are culled in a single InstanceBvh::Query(), and every pose draws its own visible list.
+        /// Otherwise every pose draws all instances. Clears the visible instance list (see SetVisibleInstances()).
+        /// Scene buffers (materials, and transforms of poses without snapshot) must be up to date on the device.
+        /// @param bvh Updated to the scenes current transforms. Requires SetSortDraws(true) and poses without transform snapshots
+        /// @remarks Either all or no poses must carry transform snapshots. Not supported in tiled mode, with a depth source, async compute or derived SCREENMOTION outputs
+        /// (use the rasterized ScreenMotion template instead)
+        void RenderBatch(foray::base::FrameRenderInfo& renderInfo,
+                         std::span<const BatchPose>    poses,
+                         const BatchCallback&          callback,
+                         uint32_t                      posesPerSubmission = 16,
+                         InstanceBvh*                  bvh                = nullptr);
+        /// @brief Renders a list of poses as RenderBatch() above, without a renderloop (e.g. with a windowless context, see SetRenderExtent())
+        /// @details Image layouts are tracked in a local cache, so layouts recorded in a renderloops cache are stale for the outputs afterwards.
+        /// @remarks Requires SetSortDraws(true), as Scene::Draw() requires a renderloop
+        void RenderBatch(std::span<const BatchPose> poses, const BatchCallback& callback, uint32_t posesPerSubmission = 16, InstanceBvh* bvh = nullptr);
+
         virtual void Resize(const VkExtent2D& extent) override;
 
         virtual void Destroy() override;
 
-        /// @brief Gets the depth image
+        /// @brief Gets an output (or the depth image) of the current output set
+        /// @remarks Asserts for images handed to the compute queue family (see SetAsyncCompute()), graphics work can not read them without an acquire.
+        /// Compute work recorded into AsyncCompute::GetCommandBuffer() accesses those via GetImageOutputOfSet()
+        virtual foray::core::ManagedImage* GetImageOutput(std::string_view name, bool noThrow = false) override;
+        /// @brief Gets the depth image (of the current output set)
+        /// @remarks Asserts if depth is handed to the compute queue family, see GetImageOutput()
         foray::core::ManagedImage* GetDepthImage();
+        /// @brief Gets the depth image written by the previous frame. Requires history to be enabled (see SetOutputSetCount())
+        foray::core::ManagedImage* GetHistoryDepthImage();
+        /// @brief Gets an output (or the depth image) of a specific output set
+        foray::core::ManagedImage* GetImageOutputOfSet(std::string_view name, uint32_t set);
+        /// @brief Gets an output written by the previous frame (e.g. for temporal accumulation), without copying. Requires history to be enabled (see SetOutputSetCount())
+        foray::core::ManagedImage* GetHistoryImageOutput(std::string_view name);
+
+        inline uint32_t         GetOutputSetCount() const { return mOutputSetCount; }
+        /// @brief Output set written by the frame recorded last
+        inline uint32_t         GetCurrentOutputSet() const { return mCurrentSet; }
+        inline std::string_view GetDepthOutputName() const { return mDepthOutputName; }
+
+        /// @brief Number of passes the outputs were split into by Build()
+        inline uint32_t GetPassCount() const { return (uint32_t)mPasses.size(); }
+        /// @brief Number of outputs evaluated by the derive compute pass instead of being rasterized
+        inline uint32_t GetDerivedOutputCount() const { return (uint32_t)mDerivedOutputs.size(); }
+
+        /// @brief Draw list used if SetSortDraws() is enabled (e.g. for its statistics or to set a variant classifier)
+        inline DrawList& GetDrawList() { return mDrawList; }
+
+        /// @brief Size of the attachments (swapchain size, the fixed extent of SetRenderExtent(), or tile size plus border in tiled mode)
+        inline VkExtent2D GetRenderExtent() const { return mRenderExtent; }
 
       protected:
         struct Output
         {
             std::string               Name;
-            foray::core::ManagedImage Image;
+            foray::core::ManagedImage Images[MAX_OUTPUT_SETS];
             OutputRecipe              Recipe;
 
             inline Output(std::string_view name, const OutputRecipe& recipe) : Name(name), Recipe(recipe) {}
@@ -165,33 +376,162 @@ namespace cgbuffer {
         using OutputMap  = std::unordered_map<std::string, std::unique_ptr<Output>>;
         using OutputList = std::vector<Output*>;
 
-        OutputMap                 mOutputMap;
-        OutputList                mOutputList;
-        foray::core::ManagedImage mDepthImage;
-        foray::scene::Scene*      mScene = nullptr;
+        /// @brief Draws the scene once, writing a group of outputs fitting the color attachment limit
+        struct Pass
+        {
+            OutputList                Outputs;
+            VkRenderPass              Renderpass                    = nullptr;
+            VkFramebuffer             FrameBuffers[MAX_OUTPUT_SETS] = {};
+            foray::core::ShaderModule VertexShaderModule;
+            foray::core::ShaderModule FragmentShaderModule;
+            VkPipeline                Pipeline = nullptr;
+        };
+
+        /// @brief Compute pass evaluating a group of derived outputs in a single dispatch
+        struct DerivePass
+        {
+            OutputList                       Outputs;
+            /// @brief Recorded into the AsyncCompute command buffer, reading depth in VK_IMAGE_LAYOUT_GENERAL
+            bool                             Async = false;
+            foray::core::DescriptorSetHelper DescriptorSets[MAX_OUTPUT_SETS];
+            foray::core::ShaderModule        Shader;
+            foray::util::PipelineLayout      PipelineLayout;
+            VkPipeline                       Pipeline = nullptr;
+        };
+
+        /// @brief Camera and descriptor set of a pose recorded by RenderBatch() or a tile recorded by RenderTiled(), replacing the scenes camera and transform buffers
+        struct PoseBinding
+        {
+            VkDescriptorSet DescriptorSet    = nullptr;
+            glm::mat4       ViewMatrix       = glm::mat4(1.f);
+            glm::mat4       ProjectionMatrix = glm::mat4(1.f);
+        };
+
+        struct DerivePushConstant
+        {
+            glm::mat4 InverseProjectionView = glm::mat4(1.f);
+            /// @brief Viewport origin (xy) and 2 / viewport size (zw)
+            glm::vec4 Viewport = glm::vec4(0.f);
+        };
+
+        OutputMap                          mOutputMap;
+        OutputList                         mOutputList;
+        std::vector<std::unique_ptr<Pass>> mPasses;
+        /// @brief Outputs with OutputRecipe::Derived set, and the instance id output read for SCREENMOTION (nullptr if not required)
+        OutputList                         mDerivedOutputs;
+        Output*                            mInstanceIdOutput = nullptr;
+        /// @brief Derived outputs evaluated on the graphics queue, and on the compute queue
+        DerivePass                         mDerive;
+        DerivePass                         mDeriveAsync;
+        foray::core::ManagedImage          mDepthImages[MAX_OUTPUT_SETS];
+        foray::scene::Scene*               mScene = nullptr;
+
+        uint32_t mOutputSetCount     = 1;
+        uint32_t mInFlightFrameCount = 1;
+        bool     mHistory            = false;
+        uint32_t mCurrentSet         = 0;
+
+        CRaster* mDepthSource = nullptr;
+
+        bool            mSortDraws = false;
+        DrawList        mDrawList;
+        const MeshLods* mMeshLods = nullptr;
 
         uint32_t mBuiltInFeaturesFlagsGlobal = 0;
         uint32_t mInterfaceFlagsGlobal       = 0;
 
-        foray::core::ShaderModule mVertexShaderModule;
-        foray::core::ShaderModule mFragmentShaderModule;
-
         std::string mDepthOutputName = "";
         std::string mName            = "";
 
         uint32_t mMaxColorAttachmentCount = 0U;
 
+        std::optional<TilingConfig> mTiling;
+        std::optional<VkExtent2D>   mFixedExtent;
+        VkExtent2D                  mRenderExtent = {};
+
+        /// @brief Pose recorded by RenderBatch() or RenderTiled(), nullptr outside of them
+        const PoseBinding* mPose = nullptr;
+
+        AsyncCompute*            mAsyncCompute      = nullptr;
+        VkPipelineStageFlags2    mAsyncReturnStages = VK_PIPELINE_STAGE_2_NONE;
+        std::vector<std::string> mAsyncInputNames;
+        /// @brief Graphics side of the transfers back from the compute queue family, recorded at the start of the next frame
+        std::vector<VkImageMemoryBarrier2> mPendingAcquires;
+        uint64_t                           mPendingAcquiresFrame = 0;
+
+        inline bool UsesAsyncCompute() const { return !!mAsyncCompute && mAsyncCompute->IsDedicated(); }
+        /// @brief True if an output (or the depth image) is handed to the compute queue family after the raster passes every frame
+        bool        IsHandedToCompute(std::string_view name) const;
+        /// @brief True if an output (or the depth image) is handed to the compute queue family every frame and not returned
+        bool        IsComputeOwned(std::string_view name) const;
+
         static std::string ToString(FragmentOutputType type);
         static std::string ToString(BuiltInFeaturesFlagBits feature);
         static std::string ToString(FragmentInputFlagBits input);
+        static uint32_t    GetTexelSize(VkFormat format);
+        static VkFormat    GetDerivedFormat(DerivedOutput derived);
+
+        /// @brief First rasterized output writing the mesh instance id (as the MeshInstanceId template), nullptr if none
+        Output* FindInstanceIdOutput() const;
+
+        std::vector<OutputList>  PartitionOutputs(uint32_t maxColorAttachments) const;
+        std::vector<std::string> GetPassShaderDefinitions(const OutputList& outputs, bool writesDepth) const;
+        /// @param derivedKinds Bit (1 << DerivedOutput) set for every derived kind evaluated by the pass
+        static std::vector<std::string> GetDerivePassShaderDefinitions(uint32_t derivedKinds);
 
-        void         CheckDeviceColorAttachmentCount();
+        void         CreatePasses();
+        void         CheckTilingLimits();
         void         CreateOutputs(const VkExtent2D& size);
-        void         CreateRenderPass();
+        void         CreateRenderPass(Pass& pass, bool writesDepth);
         void         CreateFrameBuffer();
+        void         DestroyFrameBuffers();
+        void         SetImageOutputsToSet(uint32_t set);
+        /// @brief Own depth image of the set, or the depth sources
+        foray::core::ManagedImage& DepthOfSet(uint32_t set);
         virtual void SetupDescriptors() override;
         virtual void CreateDescriptorSets() override;
         virtual void CreatePipelineLayout() override;
-        void         CreatePipeline();
+        void         CreatePipeline(Pass& pass, bool writesDepth);
+        void         CreateDerivePass(DerivePass& pass);
+        void         CreateDeriveDescriptorSets(DerivePass& pass);
+        void         DestroyDerivePass(DerivePass& pass);
+        void         RecordDerivePass(VkCommandBuffer cmdBuffer, DerivePass& pass, const VkViewport& viewport);
+        /// @brief Sets the bindings of SetupDescriptors() on a descriptor set of a PoseBinding. Transforms default to the DrawDirectors buffers
+        void         SetupPoseDescriptors(foray::core::DescriptorSetHelper& descriptorSet,
+                                          const VkDescriptorBufferInfo&     camera,
+                                          const VkDescriptorBufferInfo*     transforms         = nullptr,
+                                          const VkDescriptorBufferInfo*     previousTransforms = nullptr);
+        /// @brief Size of a camera block in a pose camera buffer, aligned for use as uniform buffer offset
+        VkDeviceSize GetPoseCameraStride() const;
+        /// @brief Writes the scenes camera block, with the matrices replaced by the poses, to dst
+        /// @param crop Clip space transform applied to the projection matrices only. The projection view matrices the device position varyings
+        /// are computed with stay uncropped (see cgbuf.vert)
+        void         WritePoseCamera(void* dst, const PoseCamera& camera, const PoseCamera& previous, const glm::mat4& crop = glm::mat4(1.f)) const;
+        /// @brief Transitions depth (and instance ids) for sampling and records mDerive on the graphics queue
+        void         RecordDeriveGraphics(VkCommandBuffer cmdBuffer, foray::core::ImageLayoutCache& layoutCache, const VkViewport& viewport);
+        /// @brief Transfers depth and the async inputs to the compute queue family and records mDeriveAsync into the AsyncCompute command buffer
+        void         RecordAsyncHandover(VkCommandBuffer cmdBuffer, foray::base::FrameRenderInfo& renderInfo, const VkViewport& viewport);
+        /// @param renderInfo nullptr outside of a renderloop (windowless batch rendering). Required for async compute and unsorted draws
+        void         RecordRasterPass(VkCommandBuffer                cmdBuffer,
+                                      foray::base::FrameRenderInfo*  renderInfo,
+                                      foray::core::ImageLayoutCache& layoutCache,
+                                      const VkViewport&              viewport,
+                                      const VkRect2D&                scissor);
+        /// @brief Implements both RenderBatch() overloads. renderInfo is nullptr without a renderloop
+        void         RenderPoses(foray::base::FrameRenderInfo*  renderInfo,
+                                 foray::core::ImageLayoutCache& layoutCache,
+                                 std::span<const BatchPose>     poses,
+                                 const BatchCallback&           callback,
+                                 uint32_t                       posesPerSubmission,
+                                 InstanceBvh*                   bvh);
+        /// @brief Transitions the outputs and depth of a set for transfer, and copies a region of each to staging at stagingOffset + regionOffsets[i] (output list order, depth last)
+        void         RecordCopyToStaging(VkCommandBuffer                  cmdBuffer,
+                                         foray::core::ImageLayoutCache&   layoutCache,
+                                         uint32_t                         set,
+                                         VkBuffer                         staging,
+                                         VkDeviceSize                     stagingOffset,
+                                         const std::vector<VkDeviceSize>& regionOffsets,
+                                         const VkOffset2D&                imageOffset,
+                                         const VkExtent2D&                extent);
     };
 }  // namespace cgbuffer
\ No newline at end of file
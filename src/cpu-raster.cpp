@@ -0,0 +1,722 @@
+#include "cpu-raster.hpp"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace cgbuffer {
+
+    namespace {
+        // Lane abstraction for the edge function loop. Masks are represented as all-ones / all-zero bit patterns in float lanes, like the SIMD compare results.
+#if defined(__AVX2__)
+        struct Lanes
+        {
+            static constexpr uint32_t Count = 8;
+            using F                         = __m256;
+
+            static inline F    Set1(float v) { return _mm256_set1_ps(v); }
+            static inline F    SetBits(uint32_t v) { return _mm256_castsi256_ps(_mm256_set1_epi32((int32_t)v)); }
+            static inline F    Ramp() { return _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f); }
+            static inline F    Add(F a, F b) { return _mm256_add_ps(a, b); }
+            static inline F    Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+            static inline F    Ge(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+            static inline F    Gt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+            static inline F    Lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+            static inline F    Le(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+            static inline F    And(F a, F b) { return _mm256_and_ps(a, b); }
+            static inline F    Select(F mask, F a, F b) { return _mm256_blendv_ps(b, a, mask); }
+            static inline int  MoveMask(F a) { return _mm256_movemask_ps(a); }
+            static inline F    Load(const float* p) { return _mm256_loadu_ps(p); }
+            static inline void Store(float* p, F v) { _mm256_storeu_ps(p, v); }
+            static inline F    LoadBits(const uint32_t* p) { return _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))); }
+            static inline void StoreBits(uint32_t* p, F v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm256_castps_si256(v)); }
+        };
+#elif defined(__SSE2__) || defined(_M_X64)
+        struct Lanes
+        {
+            static constexpr uint32_t Count = 4;
+            using F                         = __m128;
+
+            static inline F    Set1(float v) { return _mm_set1_ps(v); }
+            static inline F    SetBits(uint32_t v) { return _mm_castsi128_ps(_mm_set1_epi32((int32_t)v)); }
+            static inline F    Ramp() { return _mm_setr_ps(0.f, 1.f, 2.f, 3.f); }
+            static inline F    Add(F a, F b) { return _mm_add_ps(a, b); }
+            static inline F    Mul(F a, F b) { return _mm_mul_ps(a, b); }
+            static inline F    Ge(F a, F b) { return _mm_cmpge_ps(a, b); }
+            static inline F    Gt(F a, F b) { return _mm_cmpgt_ps(a, b); }
+            static inline F    Lt(F a, F b) { return _mm_cmplt_ps(a, b); }
+            static inline F    Le(F a, F b) { return _mm_cmple_ps(a, b); }
+            static inline F    And(F a, F b) { return _mm_and_ps(a, b); }
+            static inline F    Select(F mask, F a, F b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+            static inline int  MoveMask(F a) { return _mm_movemask_ps(a); }
+            static inline F    Load(const float* p) { return _mm_loadu_ps(p); }
+            static inline void Store(float* p, F v) { _mm_storeu_ps(p, v); }
+            static inline F    LoadBits(const uint32_t* p) { return _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+            static inline void StoreBits(uint32_t* p, F v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_castps_si128(v)); }
+        };
+#else
+        struct Lanes
+        {
+            static constexpr uint32_t Count = 1;
+            using F                         = float;
+
+            static inline F    Bits(uint32_t v) { return std::bit_cast<float>(v); }
+            static inline F    Mask(bool v) { return Bits(v ? ~0U : 0U); }
+            static inline F    Set1(float v) { return v; }
+            static inline F    SetBits(uint32_t v) { return Bits(v); }
+            static inline F    Ramp() { return 0.f; }
+            static inline F    Add(F a, F b) { return a + b; }
+            static inline F    Mul(F a, F b) { return a * b; }
+            static inline F    Ge(F a, F b) { return Mask(a >= b); }
+            static inline F    Gt(F a, F b) { return Mask(a > b); }
+            static inline F    Lt(F a, F b) { return Mask(a < b); }
+            static inline F    Le(F a, F b) { return Mask(a <= b); }
+            static inline F    And(F a, F b) { return Bits(std::bit_cast<uint32_t>(a) & std::bit_cast<uint32_t>(b)); }
+            static inline F    Select(F mask, F a, F b) { return std::bit_cast<uint32_t>(mask) ? a : b; }
+            static inline int  MoveMask(F a) { return std::bit_cast<uint32_t>(a) >> 31; }
+            static inline F    Load(const float* p) { return *p; }
+            static inline void Store(float* p, F v) { *p = v; }
+            static inline F    LoadBits(const uint32_t* p) { return Bits(*p); }
+            static inline void StoreBits(uint32_t* p, F v) { *p = std::bit_cast<uint32_t>(v); }
+        };
+#endif
+
+        struct ClipVertex
+        {
+            glm::vec4 Clip;
+            glm::vec3 Bary;
+        };
+
+        /// @brief Fragment inputs, named and computed like the interface variables in cgbuf.vert
+        struct Fragment
+        {
+            glm::vec3 WorldPos       = {};
+            glm::vec3 WorldPosOld    = {};
+            glm::vec4 DevicePos      = {};
+            glm::vec4 DevicePosOld   = {};
+            glm::vec3 Normal         = {};
+            glm::vec3 Tangent        = {};
+            glm::vec2 UV             = {};
+            uint32_t  MeshInstanceId = 0;
+        };
+
+        /// @brief Perspective correct barycentric coordinates of a pixel position relative to the setup triangle vertices.
+        /// Positions outside of the triangle extrapolate (as required for derivatives).
+        template <typename T_TRIANGLE>
+        glm::vec3 PerspectiveBary(const T_TRIANGLE& tri, float px, float py)
+        {
+            glm::vec3 persp;
+            for(uint32_t e = 0; e < 3; e++)
+            {
+                uint32_t a = (e + 1) % 3;
+                uint32_t b = (e + 2) % 3;
+                float    w = (tri.Y[a] - tri.Y[b]) * px + (tri.X[b] - tri.X[a]) * py + (tri.X[a] * tri.Y[b] - tri.Y[a] * tri.X[b]);
+                persp[e]   = w * tri.InvW[e];
+            }
+            return persp / (persp.x + persp.y + persp.z);
+        }
+    }  // namespace
+
+    bool CpuRaster::TryClassify(const OutputRecipe& recipe, EKind& kind)
+    {
+        // Derived templates are evaluated like the rasterized template they reconstruct
+        const std::pair<const OutputRecipe*, EKind> supported[] = {
+            {&CRaster::Templates::WorldPos, EKind::WorldPos},
+            {&CRaster::Templates::VertexNormal, EKind::VertexNormal},
+            {&CRaster::Templates::MaterialId, EKind::MaterialId},
+            {&CRaster::Templates::MeshInstanceId, EKind::MeshInstanceId},
+            {&CRaster::Templates::UV, EKind::UV},
+            {&CRaster::Templates::ScreenMotion, EKind::ScreenMotion},
+            {&CRaster::Templates::WorldMotion, EKind::WorldMotion},
+            {&CRaster::Templates::DepthAndDerivative, EKind::DepthAndDerivative},
+            {&CRaster::Templates::DerivedWorldPos, EKind::WorldPos},
+            {&CRaster::Templates::DerivedDepthAndDerivative, EKind::DepthAndDerivative},
+            {&CRaster::Templates::DerivedScreenMotion, EKind::ScreenMotion},
+        };
+        for(const auto& [templ, templKind] : supported)
+        {
+            if(templ->Derived != recipe.Derived || templ->Type != recipe.Type || templ->ImageFormat != recipe.ImageFormat)
+            {
+                continue;
+            }
+            // Derived outputs ignore inputs, features, calculation and result
+            if(recipe.Derived == CRaster::DerivedOutput::NONE
+               && (templ->FragmentInputFlags != recipe.FragmentInputFlags || templ->BuiltInFeaturesFlags != recipe.BuiltInFeaturesFlags
+                   || templ->Calculation != recipe.Calculation || templ->Result != recipe.Result))
+            {
+                continue;
+            }
+            kind = templKind;
+            return true;
+        }
+        return false;
+    }
+
+    CpuRaster::EKind CpuRaster::Classify(const OutputRecipe& recipe)
+    {
+        EKind kind;
+        if(!TryClassify(recipe, kind))
+        {
+            FORAY_THROWFMT("CpuRaster only supports unmodified CRaster::Templates recipes (except Albedo and WorldNormal). Unsupported result expression \"{}\"", recipe.Result);
+        }
+        return kind;
+    }
+
+    bool CpuRaster::IsSupported(const OutputRecipe& recipe)
+    {
+        EKind kind;
+        return TryClassify(recipe, kind);
+    }
+
+    uint32_t CpuRaster::GetInputFlags(EKind kind)
+    {
+        switch(kind)
+        {
+            case EKind::WorldPos:
+                return CRaster::Templates::WorldPos.FragmentInputFlags;
+            case EKind::VertexNormal:
+                return CRaster::Templates::VertexNormal.FragmentInputFlags;
+            case EKind::MaterialId:
+                return CRaster::Templates::MaterialId.FragmentInputFlags;
+            case EKind::MeshInstanceId:
+                return CRaster::Templates::MeshInstanceId.FragmentInputFlags;
+            case EKind::UV:
+                return CRaster::Templates::UV.FragmentInputFlags;
+            case EKind::ScreenMotion:
+                return CRaster::Templates::ScreenMotion.FragmentInputFlags;
+            case EKind::WorldMotion:
+                return CRaster::Templates::WorldMotion.FragmentInputFlags;
+            case EKind::DepthAndDerivative:
+                return CRaster::Templates::DepthAndDerivative.FragmentInputFlags;
+        }
+        return 0;
+    }
+
+    uint32_t CpuRaster::GetChannelCount(CRaster::FragmentOutputType type)
+    {
+        switch(type)
+        {
+            case CRaster::FragmentOutputType::FLOAT:
+            case CRaster::FragmentOutputType::INT:
+            case CRaster::FragmentOutputType::UINT:
+                return 1;
+            case CRaster::FragmentOutputType::VEC2:
+            case CRaster::FragmentOutputType::IVEC2:
+            case CRaster::FragmentOutputType::UVEC2:
+                return 2;
+            case CRaster::FragmentOutputType::VEC3:
+            case CRaster::FragmentOutputType::IVEC3:
+            case CRaster::FragmentOutputType::UVEC3:
+                return 3;
+            default:
+                return 4;
+        }
+    }
+
+    bool CpuRaster::IsIntegerType(CRaster::FragmentOutputType type)
+    {
+        switch(type)
+        {
+            case CRaster::FragmentOutputType::FLOAT:
+            case CRaster::FragmentOutputType::VEC2:
+            case CRaster::FragmentOutputType::VEC3:
+            case CRaster::FragmentOutputType::VEC4:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    CpuRaster& CpuRaster::AddOutput(std::string_view name, const OutputRecipe& recipe)
+    {
+        for(const std::unique_ptr<Output>& output : mOutputs)
+        {
+            FORAY_ASSERTFMT(output->Name != name, "CpuRaster already configured with an output named \"{}\"", name);
+        }
+        foray::Assert(!mPool, "Must add outputs before building!");
+        mOutputs.push_back(std::make_unique<Output>(Output{.Name = std::string(name), .Recipe = recipe, .Kind = Classify(recipe)}));
+        return *this;
+    }
+
+    const CpuRaster::HostImage& CpuRaster::GetOutput(std::string_view name) const
+    {
+        for(const std::unique_ptr<Output>& output : mOutputs)
+        {
+            if(output->Name == name)
+            {
+                return output->Image;
+            }
+        }
+        FORAY_THROWFMT("CpuRaster does not contain output \"{}\"!", name);
+    }
+
+    const CpuRaster::HostImage& CpuRaster::GetDepthImage() const
+    {
+        return mDepthImage;
+    }
+
+    void CpuRaster::Build(const VkExtent2D& extent, uint32_t threadCount)
+    {
+        mInterfaceFlags = 0;
+        for(const std::unique_ptr<Output>& output : mOutputs)
+        {
+            mInterfaceFlags |= GetInputFlags(output->Kind);
+        }
+        mPool = std::make_unique<WorkerPool>(threadCount);
+        Resize(extent);
+    }
+
+    void CpuRaster::Resize(const VkExtent2D& extent)
+    {
+        mExtent     = extent;
+        mTileCountX = (extent.width + TILE_SIZE - 1) / TILE_SIZE;
+        mTileCountY = (extent.height + TILE_SIZE - 1) / TILE_SIZE;
+        mVisStride  = (extent.width + Lanes::Count - 1) / Lanes::Count * Lanes::Count;
+        mVisDepth.assign((size_t)mVisStride * extent.height, 1.f);
+        mVisTriangle.assign((size_t)mVisStride * extent.height, INVALID_TRIANGLE);
+        mChunks.clear();
+        CreateImages();
+    }
+
+    void CpuRaster::CreateImages()
+    {
+        size_t pixelCount = (size_t)mExtent.width * mExtent.height;
+        for(std::unique_ptr<Output>& output : mOutputs)
+        {
+            HostImage& image = output->Image;
+            image.Extent     = mExtent;
+            image.Channels   = GetChannelCount(output->Recipe.Type);
+            image.IsInteger  = IsIntegerType(output->Recipe.Type);
+            image.Texels.assign(pixelCount * image.Channels, 0U);
+        }
+        mDepthImage.Extent    = mExtent;
+        mDepthImage.Channels  = 1;
+        mDepthImage.IsInteger = false;
+        mDepthImage.Texels.assign(pixelCount, std::bit_cast<uint32_t>(1.f));
+    }
+
+    void CpuRaster::Destroy()
+    {
+        mPool = nullptr;
+        mOutputs.clear();
+        mChunks.clear();
+        mInstances.clear();
+        mVisDepth.clear();
+        mVisTriangle.clear();
+        mDepthImage = HostImage{};
+    }
+
+
+    void CpuRaster::Render(const Scene& scene)
+    {
+        foray::Assert(!!mPool, "Must build before rendering!");
+
+        mInstances.clear();
+        uint32_t triangleCount = 0;
+        for(uint32_t drawIndex = 0; drawIndex < scene.Draws.size(); drawIndex++)
+        {
+            const Draw& draw = scene.Draws[drawIndex];
+            for(uint32_t instance = 0; instance < draw.InstanceCount; instance++)
+            {
+                mInstances.push_back(InstanceRef{.DrawIndex = drawIndex, .Instance = instance, .FirstTriangle = triangleCount});
+                triangleCount += draw.IndexCount / 3;
+            }
+        }
+
+        mChunkCount = (triangleCount + TRIANGLES_PER_CHUNK - 1) / TRIANGLES_PER_CHUNK;
+        if(mChunks.size() < mChunkCount)
+        {
+            mChunks.resize(mChunkCount);
+        }
+
+        // Per instance matrices, shared by all triangles and pixels of the instance
+        const std::vector<glm::mat4>& previousTransforms = scene.PreviousTransforms.empty() ? scene.CurrentTransforms : scene.PreviousTransforms;
+        const bool                    needsNormalMatrix  = (mInterfaceFlags & ((uint32_t)CRaster::FragmentInputFlagBits::NORMAL | (uint32_t)CRaster::FragmentInputFlagBits::TANGENT)) > 0;
+        mPool->ParallelFor((uint32_t)mInstances.size(), [&](uint32_t instanceIndex, uint32_t) {
+            InstanceRef&     inst           = mInstances[instanceIndex];
+            uint32_t         transformIndex = scene.Draws[inst.DrawIndex].TransformBufferOffset + inst.Instance;
+            const glm::mat4& model          = scene.CurrentTransforms[transformIndex];
+            inst.ProjectionViewModel        = scene.ProjectionViewMatrix * model;
+            inst.ProjectionViewModelOld     = scene.PreviousProjectionViewMatrix * previousTransforms[transformIndex];
+            if(needsNormalMatrix)
+            {
+                inst.NormalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+            }
+        });
+
+        mPool->ParallelFor(mChunkCount, [&](uint32_t chunkIndex, uint32_t) { SetupTriangles(scene, chunkIndex); });
+        mPool->ParallelFor(mTileCountX * mTileCountY, [&](uint32_t tileIndex, uint32_t) {
+            RasterizeTile(tileIndex);
+            ResolveTile(scene, tileIndex);
+        });
+    }
+
+    void CpuRaster::SetupTriangles(const Scene& scene, uint32_t chunkIndex)
+    {
+        Chunk& chunk = mChunks[chunkIndex];
+        chunk.Triangles.clear();
+        chunk.Bins.resize(mTileCountX * mTileCountY);
+        for(std::vector<uint32_t>& bin : chunk.Bins)
+        {
+            bin.clear();
+        }
+
+        uint32_t first = chunkIndex * TRIANGLES_PER_CHUNK;
+        uint32_t last  = first + TRIANGLES_PER_CHUNK;
+
+        // Locate the instance containing the first triangle of this chunk
+        auto     iter          = std::upper_bound(mInstances.begin(), mInstances.end(), first, [](uint32_t tri, const InstanceRef& inst) { return tri < inst.FirstTriangle; });
+        uint32_t instanceIndex = (uint32_t)(iter - mInstances.begin()) - 1;
+
+        const float width  = (float)mExtent.width;
+        const float height = (float)mExtent.height;
+
+        for(; instanceIndex < mInstances.size() && mInstances[instanceIndex].FirstTriangle < last; instanceIndex++)
+        {
+            const InstanceRef& inst          = mInstances[instanceIndex];
+            const Draw&        draw          = scene.Draws[inst.DrawIndex];
+            const glm::mat4&   mvp           = inst.ProjectionViewModel;
+            uint32_t           drawTriangles = draw.IndexCount / 3;
+            uint32_t           triangleBegin = first > inst.FirstTriangle ? first - inst.FirstTriangle : 0;
+            uint32_t           triangleEnd   = std::min(drawTriangles, last - inst.FirstTriangle);
+
+            for(uint32_t triangle = triangleBegin; triangle < triangleEnd; triangle++)
+            {
+                ClipVertex in[3];
+                for(uint32_t v = 0; v < 3; v++)
+                {
+                    const foray::scene::Vertex& vertex = scene.Vertices[scene.Indices[draw.FirstIndex + triangle * 3 + v]];
+                    in[v].Clip                         = mvp * glm::vec4(vertex.Pos, 1.f);
+                    in[v].Bary                         = glm::vec3(0.f);
+                    in[v].Bary[v]                      = 1.f;
+                }
+
+                // Trivial frustum rejection
+                if((in[0].Clip.x > in[0].Clip.w && in[1].Clip.x > in[1].Clip.w && in[2].Clip.x > in[2].Clip.w)
+                   || (in[0].Clip.x < -in[0].Clip.w && in[1].Clip.x < -in[1].Clip.w && in[2].Clip.x < -in[2].Clip.w)
+                   || (in[0].Clip.y > in[0].Clip.w && in[1].Clip.y > in[1].Clip.w && in[2].Clip.y > in[2].Clip.w)
+                   || (in[0].Clip.y < -in[0].Clip.w && in[1].Clip.y < -in[1].Clip.w && in[2].Clip.y < -in[2].Clip.w)
+                   || (in[0].Clip.z > in[0].Clip.w && in[1].Clip.z > in[1].Clip.w && in[2].Clip.z > in[2].Clip.w))
+                {
+                    continue;
+                }
+
+                // Clip against the near plane (z >= 0). Far, left, right, top and bottom are handled per pixel / by the bounding box
+                ClipVertex out[4];
+                uint32_t   outCount = 0;
+                for(uint32_t v = 0; v < 3; v++)
+                {
+                    const ClipVertex& cur  = in[v];
+                    const ClipVertex& next = in[(v + 1) % 3];
+                    if(cur.Clip.z >= 0.f)
+                    {
+                        out[outCount++] = cur;
+                    }
+                    if((cur.Clip.z >= 0.f) != (next.Clip.z >= 0.f))
+                    {
+                        float t         = cur.Clip.z / (cur.Clip.z - next.Clip.z);
+                        out[outCount++] = ClipVertex{glm::mix(cur.Clip, next.Clip, t), glm::mix(cur.Bary, next.Bary, t)};
+                    }
+                }
+
+                for(uint32_t fan = 1; fan + 1 < outCount; fan++)
+                {
+                    const ClipVertex* verts[3] = {&out[0], &out[fan], &out[fan + 1]};
+                    SetupTriangle     setup;
+                    bool              valid = true;
+                    for(uint32_t v = 0; v < 3; v++)
+                    {
+                        const glm::vec4& clip = verts[v]->Clip;
+                        if(clip.w <= 0.f)
+                        {
+                            valid = false;
+                            break;
+                        }
+                        float invW       = 1.f / clip.w;
+                        setup.X[v]       = (clip.x * invW * 0.5f + 0.5f) * width;
+                        setup.Y[v]       = (clip.y * invW * 0.5f + 0.5f) * height;
+                        setup.Z[v]       = clip.z * invW;
+                        setup.InvW[v]    = invW;
+                        setup.SrcBary[v] = verts[v]->Bary;
+                    }
+                    if(!valid)
+                    {
+                        continue;
+                    }
+
+                    // Vulkan: a = -0.5 * orient, counter clockwise front face -> orient < 0
+                    float orient = (setup.X[1] - setup.X[0]) * (setup.Y[2] - setup.Y[0]) - (setup.Y[1] - setup.Y[0]) * (setup.X[2] - setup.X[0]);
+                    if(!(std::abs(orient) > 0.f) || (mCullBackFaces && orient > 0.f))
+                    {
+                        continue;
+                    }
+                    if(orient < 0.f)
+                    {
+                        std::swap(setup.X[1], setup.X[2]);
+                        std::swap(setup.Y[1], setup.Y[2]);
+                        std::swap(setup.Z[1], setup.Z[2]);
+                        std::swap(setup.InvW[1], setup.InvW[2]);
+                        std::swap(setup.SrcBary[1], setup.SrcBary[2]);
+                    }
+
+                    setup.MinX = std::max(0, (int32_t)std::floor(std::min({setup.X[0], setup.X[1], setup.X[2]})));
+                    setup.MinY = std::max(0, (int32_t)std::floor(std::min({setup.Y[0], setup.Y[1], setup.Y[2]})));
+                    setup.MaxX = std::min((int32_t)mExtent.width - 1, (int32_t)std::ceil(std::max({setup.X[0], setup.X[1], setup.X[2]})));
+                    setup.MaxY = std::min((int32_t)mExtent.height - 1, (int32_t)std::ceil(std::max({setup.Y[0], setup.Y[1], setup.Y[2]})));
+                    if(setup.MinX > setup.MaxX || setup.MinY > setup.MaxY)
+                    {
+                        continue;
+                    }
+                    setup.Instance = instanceIndex;
+                    setup.Triangle = triangle;
+
+                    uint32_t localIndex = (uint32_t)chunk.Triangles.size();
+                    chunk.Triangles.push_back(setup);
+                    for(int32_t tileY = setup.MinY / (int32_t)TILE_SIZE; tileY <= setup.MaxY / (int32_t)TILE_SIZE; tileY++)
+                    {
+                        for(int32_t tileX = setup.MinX / (int32_t)TILE_SIZE; tileX <= setup.MaxX / (int32_t)TILE_SIZE; tileX++)
+                        {
+                            chunk.Bins[tileY * mTileCountX + tileX].push_back(localIndex);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void CpuRaster::RasterizeTile(uint32_t tileIndex)
+    {
+        using F = Lanes::F;
+
+        const int32_t tileX0 = (int32_t)((tileIndex % mTileCountX) * TILE_SIZE);
+        const int32_t tileY0 = (int32_t)((tileIndex / mTileCountX) * TILE_SIZE);
+        const int32_t tileX1 = std::min(tileX0 + (int32_t)TILE_SIZE, (int32_t)mExtent.width) - 1;
+        const int32_t tileY1 = std::min(tileY0 + (int32_t)TILE_SIZE, (int32_t)mExtent.height) - 1;
+
+        for(int32_t y = tileY0; y <= tileY1; y++)
+        {
+            size_t row = (size_t)y * mVisStride;
+            std::fill(mVisDepth.begin() + row + tileX0, mVisDepth.begin() + row + tileX1 + 1, 1.f);
+            std::fill(mVisTriangle.begin() + row + tileX0, mVisTriangle.begin() + row + tileX1 + 1, INVALID_TRIANGLE);
+        }
+
+        const F zero = Lanes::Set1(0.f);
+        const F one  = Lanes::Set1(1.f);
+        const F ramp = Lanes::Ramp();
+
+        for(uint32_t chunkIndex = 0; chunkIndex < mChunkCount; chunkIndex++)
+        {
+            const Chunk& chunk = mChunks[chunkIndex];
+            for(uint32_t localIndex : chunk.Bins[tileIndex])
+            {
+                const SetupTriangle& tri = chunk.Triangles[localIndex];
+
+                int32_t minX = std::max(tri.MinX, tileX0);
+                int32_t minY = std::max(tri.MinY, tileY0);
+                int32_t maxX = std::min(tri.MaxX, tileX1);
+                int32_t maxY = std::min(tri.MaxY, tileY1);
+
+                // Edge functions w_e(p) = A * px + B * py + C for the edge opposite of vertex e.
+                // C is computed such that adjacent triangles evaluate shared edges to exactly negated values (watertight).
+                float A[3], B[3], C[3];
+                bool  topLeft[3];
+                for(uint32_t e = 0; e < 3; e++)
+                {
+                    uint32_t a = (e + 1) % 3;
+                    uint32_t b = (e + 2) % 3;
+                    A[e]       = tri.Y[a] - tri.Y[b];
+                    B[e]       = tri.X[b] - tri.X[a];
+                    C[e]       = tri.X[a] * tri.Y[b] - tri.Y[a] * tri.X[b];
+                    topLeft[e] = A[e] > 0.f || (A[e] == 0.f && B[e] > 0.f);
+                }
+                float invArea = 1.f / (A[0] * tri.X[0] + B[0] * tri.Y[0] + C[0]);
+
+                // Device depth is linear in screen space
+                float zA = (A[0] * tri.Z[0] + A[1] * tri.Z[1] + A[2] * tri.Z[2]) * invArea;
+                float zB = (B[0] * tri.Z[0] + B[1] * tri.Z[1] + B[2] * tri.Z[2]) * invArea;
+                float zC = (C[0] * tri.Z[0] + C[1] * tri.Z[1] + C[2] * tri.Z[2]) * invArea;
+
+                const F       triangleBits = Lanes::SetBits(chunkIndex * CHUNK_ID_STRIDE + localIndex);
+                const F       boundMin     = Lanes::Set1((float)minX);
+                const F       boundMax     = Lanes::Set1((float)maxX);
+                const int32_t xStart       = minX / (int32_t)Lanes::Count * (int32_t)Lanes::Count;
+
+                for(int32_t y = minY; y <= maxY; y++)
+                {
+                    float py = (float)y + 0.5f;
+                    F     rowW[3];
+                    for(uint32_t e = 0; e < 3; e++)
+                    {
+                        rowW[e] = Lanes::Set1(B[e] * py + C[e]);
+                    }
+                    F rowZ = Lanes::Set1(zB * py + zC);
+
+                    float*    depthRow    = mVisDepth.data() + (size_t)y * mVisStride;
+                    uint32_t* triangleRow = mVisTriangle.data() + (size_t)y * mVisStride;
+
+                    for(int32_t x = xStart; x <= maxX; x += (int32_t)Lanes::Count)
+                    {
+                        F pixelX = Lanes::Add(Lanes::Set1((float)x), ramp);
+                        F px     = Lanes::Add(pixelX, Lanes::Set1(0.5f));
+                        F mask   = Lanes::And(Lanes::Ge(pixelX, boundMin), Lanes::Le(pixelX, boundMax));
+                        for(uint32_t e = 0; e < 3; e++)
+                        {
+                            F w  = Lanes::Add(Lanes::Mul(Lanes::Set1(A[e]), px), rowW[e]);
+                            mask = Lanes::And(mask, topLeft[e] ? Lanes::Ge(w, zero) : Lanes::Gt(w, zero));
+                        }
+                        if(!Lanes::MoveMask(mask))
+                        {
+                            continue;
+                        }
+                        F z     = Lanes::Add(Lanes::Mul(Lanes::Set1(zA), px), rowZ);
+                        F depth = Lanes::Load(depthRow + x);
+                        mask    = Lanes::And(mask, Lanes::And(Lanes::Lt(z, depth), Lanes::And(Lanes::Ge(z, zero), Lanes::Le(z, one))));
+                        if(!Lanes::MoveMask(mask))
+                        {
+                            continue;
+                        }
+                        Lanes::Store(depthRow + x, Lanes::Select(mask, z, depth));
+                        Lanes::StoreBits(triangleRow + x, Lanes::Select(mask, triangleBits, Lanes::LoadBits(triangleRow + x)));
+                    }
+                }
+            }
+        }
+    }
+
+    void CpuRaster::ResolveTile(const Scene& scene, uint32_t tileIndex)
+    {
+        const uint32_t tileX0 = (tileIndex % mTileCountX) * TILE_SIZE;
+        const uint32_t tileY0 = (tileIndex / mTileCountX) * TILE_SIZE;
+        const uint32_t tileX1 = std::min(tileX0 + TILE_SIZE, mExtent.width);
+        const uint32_t tileY1 = std::min(tileY0 + TILE_SIZE, mExtent.height);
+
+        const std::vector<glm::mat4>& previousTransforms = scene.PreviousTransforms.empty() ? scene.CurrentTransforms : scene.PreviousTransforms;
+
+        const bool needsWorldPos     = (mInterfaceFlags & (uint32_t)CRaster::FragmentInputFlagBits::WORLDPOS) > 0;
+        const bool needsWorldPosOld  = (mInterfaceFlags & (uint32_t)CRaster::FragmentInputFlagBits::WORLDPOSOLD) > 0;
+        const bool needsDevicePos    = (mInterfaceFlags & (uint32_t)CRaster::FragmentInputFlagBits::DEVICEPOS) > 0;
+        const bool needsDevicePosOld = (mInterfaceFlags & (uint32_t)CRaster::FragmentInputFlagBits::DEVICEPOSOLD) > 0;
+        const bool needsNormal       = (mInterfaceFlags & ((uint32_t)CRaster::FragmentInputFlagBits::NORMAL | (uint32_t)CRaster::FragmentInputFlagBits::TANGENT)) > 0;
+
+        for(uint32_t y = tileY0; y < tileY1; y++)
+        {
+            for(uint32_t x = tileX0; x < tileX1; x++)
+            {
+                size_t   visIndex   = (size_t)y * mVisStride + x;
+                size_t   pixelIndex = (size_t)y * mExtent.width + x;
+                uint32_t triangleId = mVisTriangle[visIndex];
+                mDepthImage.Texels[pixelIndex] = std::bit_cast<uint32_t>(mVisDepth[visIndex]);
+
+                if(triangleId == INVALID_TRIANGLE)
+                {
+                    for(std::unique_ptr<Output>& output : mOutputs)
+                    {
+                        HostImage& image = output->Image;
+                        for(uint32_t channel = 0; channel < image.Channels; channel++)
+                        {
+                            image.Texels[pixelIndex * image.Channels + channel] = output->Recipe.ClearValue.uint32[channel];
+                        }
+                    }
+                    continue;
+                }
+
+                const SetupTriangle& tri  = mChunks[triangleId / CHUNK_ID_STRIDE].Triangles[triangleId % CHUNK_ID_STRIDE];
+                const InstanceRef&   inst = mInstances[tri.Instance];
+                const Draw&          draw = scene.Draws[inst.DrawIndex];
+
+                uint32_t                    transformIndex = draw.TransformBufferOffset + inst.Instance;
+                const glm::mat4&            model          = scene.CurrentTransforms[transformIndex];
+                const foray::scene::Vertex* verts[3];
+                for(uint32_t v = 0; v < 3; v++)
+                {
+                    verts[v] = &scene.Vertices[scene.Indices[draw.FirstIndex + tri.Triangle * 3 + v]];
+                }
+
+                // Maps a screen position to the interpolated model space position of the source triangle
+                auto localPosAt = [&](float px, float py) {
+                    glm::vec3 bary = PerspectiveBary(tri, px, py);
+                    glm::vec3 src  = bary.x * tri.SrcBary[0] + bary.y * tri.SrcBary[1] + bary.z * tri.SrcBary[2];
+                    return std::make_pair(src, glm::vec4(src.x * verts[0]->Pos + src.y * verts[1]->Pos + src.z * verts[2]->Pos, 1.f));
+                };
+
+                auto [src, localPos] = localPosAt((float)x + 0.5f, (float)y + 0.5f);
+
+                Fragment frag;
+                frag.MeshInstanceId = transformIndex;
+                frag.UV             = src.x * verts[0]->Uv + src.y * verts[1]->Uv + src.z * verts[2]->Uv;
+                if(needsWorldPos)
+                {
+                    frag.WorldPos = glm::vec3(model * localPos);
+                }
+                if(needsWorldPosOld)
+                {
+                    frag.WorldPosOld = glm::vec3(previousTransforms[transformIndex] * localPos);
+                }
+                if(needsDevicePos)
+                {
+                    frag.DevicePos = inst.ProjectionViewModel * localPos;
+                }
+                if(needsDevicePosOld)
+                {
+                    frag.DevicePosOld = inst.ProjectionViewModelOld * localPos;
+                }
+                if(needsNormal)
+                {
+                    frag.Normal  = inst.NormalMatrix * (src.x * verts[0]->Normal + src.y * verts[1]->Normal + src.z * verts[2]->Normal);
+                    frag.Tangent = inst.NormalMatrix * (src.x * verts[0]->Tangent + src.y * verts[1]->Tangent + src.z * verts[2]->Tangent);
+                }
+
+                for(std::unique_ptr<Output>& output : mOutputs)
+                {
+                    HostImage& image = output->Image;
+                    glm::vec4  floats(0.f);
+                    glm::ivec4 ints(0);
+                    switch(output->Kind)
+                    {
+                        case EKind::WorldPos:
+                            floats = glm::vec4(frag.WorldPos, 0.f);
+                            break;
+                        case EKind::VertexNormal:
+                            floats = glm::vec4(glm::normalize(frag.Normal), 0.f);
+                            break;
+                        case EKind::MaterialId:
+                            ints.x = draw.MaterialIndex;
+                            break;
+                        case EKind::MeshInstanceId:
+                            ints.x = (int32_t)frag.MeshInstanceId;
+                            break;
+                        case EKind::UV:
+                            floats = glm::vec4(frag.UV, 0.f, 0.f);
+                            break;
+                        case EKind::ScreenMotion: {
+                            glm::vec2 motion = (glm::vec2(frag.DevicePosOld) / frag.DevicePosOld.w - glm::vec2(frag.DevicePos) / frag.DevicePos.w) * 0.5f;
+                            floats           = glm::vec4(motion, 0.f, 0.f);
+                            break;
+                        }
+                        case EKind::WorldMotion:
+                            floats = glm::vec4(frag.WorldPosOld - frag.WorldPos, 0.f);
+                            break;
+                        case EKind::DepthAndDerivative: {
+                            // Derivatives of the same primitive at the neighbouring pixels, like dFdx / dFdy
+                            glm::vec4 devX       = inst.ProjectionViewModel * localPosAt((float)x + 1.5f, (float)y + 0.5f).second;
+                            glm::vec4 devY       = inst.ProjectionViewModel * localPosAt((float)x + 0.5f, (float)y + 1.5f).second;
+                            float     linearZ    = frag.DevicePos.z * frag.DevicePos.w;
+                            float     derivative = std::max(std::abs(devX.z * devX.w - linearZ), std::abs(devY.z * devY.w - linearZ));
+                            floats               = glm::vec4(linearZ, derivative, 0.f, 0.f);
+                            break;
+                        }
+                    }
+                    for(uint32_t channel = 0; channel < image.Channels; channel++)
+                    {
+                        image.Texels[pixelIndex * image.Channels + channel] = image.IsInteger ? std::bit_cast<uint32_t>(ints[channel]) : std::bit_cast<uint32_t>(floats[channel]);
+                    }
+                }
+            }
+        }
+    }
+
+}  // namespace cgbuffer
@@ -0,0 +1,190 @@
+#pragma once
+#include "conf-gbuffer.hpp"
+#include "worker-pool.hpp"
+#include <bit>
+#include <scene/foray_geo.hpp>
+
+namespace cgbuffer {
+
+    /// @brief CPU backend for CRaster output recipes. Bins triangles into screen tiles and rasterizes them on a WorkerPool
+    /// @details
+    /// How to use: Add Outputs, Build, Render, Get Outputs
+    ///  - Add Outputs: Only recipes equal to one of the CRaster::Templates (inputs, features, type, format, calculation and result) are supported.
+    ///    Templates requiring material textures (Albedo, WorldNormal) are rejected. The Derived* templates are evaluated like the template they reconstruct.
+    ///  - Build: Allocates the host side images, see CpuRaster::Build()
+    ///  - Render: Rasterizes a CpuRaster::Scene, see CpuRaster::Render()
+    ///  - Get Outputs: See CpuRaster::GetOutput()
+    /// Rasterization writes depth and a triangle id per pixel only (visibility buffer). Outputs are evaluated once per visible pixel afterwards,
+    /// interpolating the same FragmentInputFlagBits attributes as the vertex shader of CRaster.
+    /// Edge functions are evaluated 8 pixels at a time with AVX2 (CGBUFFER_CPURASTER_AVX2 cmake option), 4 pixels at a time with SSE2 otherwise.
+    /// BackendComparison renders the same recipe with CRaster and reports the per pixel differences (run the demo with --compare-backends).
+    class CpuRaster
+    {
+      public:
+        using OutputRecipe = CRaster::OutputRecipe;
+
+        inline static constexpr uint32_t TILE_SIZE = 64;
+
+        /// @brief Indexed draw, instanced analogous to DrawDirector draw ops
+        struct Draw
+        {
+            /// @brief First index into Scene::Indices
+            uint32_t FirstIndex = 0;
+            /// @brief Index count (multiple of 3)
+            uint32_t IndexCount = 0;
+            /// @brief Material index, written by the MaterialId template
+            int32_t MaterialIndex = -1;
+            /// @brief Index of the first instance's transform (MeshInstanceId = TransformBufferOffset + instance)
+            uint32_t TransformBufferOffset = 0;
+            /// @brief Number of instances drawn
+            uint32_t InstanceCount = 1;
+        };
+
+        /// @brief Host side scene description. Mirrors the layout of the geometry store and transform buffers used by CRaster
+        struct Scene
+        {
+            std::vector<foray::scene::Vertex> Vertices;
+            std::vector<uint32_t>             Indices;
+            std::vector<Draw>                 Draws;
+            /// @brief Model matrices, indexed by TransformBufferOffset + instance
+            std::vector<glm::mat4> CurrentTransforms;
+            /// @brief Model matrices of the previous frame. If empty, CurrentTransforms are used
+            std::vector<glm::mat4> PreviousTransforms;
+            glm::mat4              ProjectionViewMatrix         = glm::mat4(1.f);
+            glm::mat4              PreviousProjectionViewMatrix = glm::mat4(1.f);
+        };
+
+        /// @brief Host side output image. Stores one 32 bit value per channel (float or int, depending on the recipe type), tightly packed rows
+        struct HostImage
+        {
+            VkExtent2D            Extent    = {};
+            uint32_t              Channels  = 1;
+            bool                  IsInteger = false;
+            std::vector<uint32_t> Texels;
+
+            inline float   GetFloat(uint32_t x, uint32_t y, uint32_t channel = 0) const { return std::bit_cast<float>(Texels[(y * Extent.width + x) * Channels + channel]); }
+            inline int32_t GetInt(uint32_t x, uint32_t y, uint32_t channel = 0) const { return std::bit_cast<int32_t>(Texels[(y * Extent.width + x) * Channels + channel]); }
+        };
+
+        /// @brief Add an Output
+        /// @remarks MUST be called before Build(). Throws if the recipe is not one of the supported CRaster::Templates
+        CpuRaster& AddOutput(std::string_view name, const OutputRecipe& recipe);
+        /// @brief True if AddOutput() accepts the recipe
+        static bool IsSupported(const OutputRecipe& recipe);
+
+        /// @brief Allocates output images and worker threads
+        /// @param threadCount Worker count including the calling thread. 0 selects std::thread::hardware_concurrency()
+        void Build(const VkExtent2D& extent, uint32_t threadCount = 0);
+
+        /// @brief Cull triangles facing away (counter clockwise front face). Disabled by default
+        inline CpuRaster& SetCullBackFaces(bool cull)
+        {
+            mCullBackFaces = cull;
+            return *this;
+        }
+
+        /// @brief Rasterizes the scene and evaluates all outputs
+        void Render(const Scene& scene);
+
+        void Resize(const VkExtent2D& extent);
+
+        void Destroy();
+
+        /// @brief Access an output image
+        const HostImage& GetOutput(std::string_view name) const;
+        /// @brief Device depth (0 near, 1 far), cleared to 1
+        const HostImage& GetDepthImage() const;
+
+        inline VkExtent2D GetExtent() const { return mExtent; }
+
+      protected:
+        enum class EKind
+        {
+            WorldPos,
+            VertexNormal,
+            MaterialId,
+            MeshInstanceId,
+            UV,
+            ScreenMotion,
+            WorldMotion,
+            DepthAndDerivative,
+        };
+
+        struct Output
+        {
+            std::string  Name;
+            OutputRecipe Recipe;
+            EKind        Kind;
+            HostImage    Image;
+        };
+
+        /// @brief Draw instance, maps setup triangles back to scene data
+        struct InstanceRef
+        {
+            uint32_t DrawIndex;
+            uint32_t Instance;
+            uint32_t FirstTriangle;
+            /// @brief Matrices of the instance, computed once per Render() instead of per triangle or pixel
+            glm::mat4 ProjectionViewModel    = glm::mat4(1.f);
+            glm::mat4 ProjectionViewModelOld = glm::mat4(1.f);
+            /// @brief Inverse transpose of the models upper 3x3, only computed if normals or tangents are interpolated
+            glm::mat3 NormalMatrix = glm::mat3(1.f);
+        };
+
+        /// @brief Screen space triangle after near plane clipping, oriented to positive area
+        struct SetupTriangle
+        {
+            float     X[3];
+            float     Y[3];
+            float     Z[3];
+            float     InvW[3];
+            /// @brief Barycentric coordinates of the (clipped) vertices relative to the source triangle
+            glm::vec3 SrcBary[3];
+            uint32_t  Instance;
+            uint32_t  Triangle;
+            int32_t   MinX, MinY, MaxX, MaxY;
+        };
+
+        /// @brief Triangles set up by one chunk of the geometry stage, with per tile bins. Processed in chunk order to keep depth ties deterministic
+        struct Chunk
+        {
+            std::vector<SetupTriangle>         Triangles;
+            std::vector<std::vector<uint32_t>> Bins;
+        };
+
+        static bool     TryClassify(const OutputRecipe& recipe, EKind& kind);
+        static EKind    Classify(const OutputRecipe& recipe);
+        /// @brief Fragment inputs interpolated for the kind, as required by its rasterized template
+        static uint32_t GetInputFlags(EKind kind);
+        static uint32_t GetChannelCount(CRaster::FragmentOutputType type);
+        static bool     IsIntegerType(CRaster::FragmentOutputType type);
+
+        void CreateImages();
+        void SetupTriangles(const Scene& scene, uint32_t chunkIndex);
+        void RasterizeTile(uint32_t tileIndex);
+        void ResolveTile(const Scene& scene, uint32_t tileIndex);
+
+        std::vector<std::unique_ptr<Output>> mOutputs;
+        HostImage                            mDepthImage;
+        VkExtent2D                           mExtent         = {};
+        uint32_t                             mTileCountX     = 0;
+        uint32_t                             mTileCountY     = 0;
+        uint32_t                             mInterfaceFlags = 0;
+        bool                                 mCullBackFaces  = false;
+
+        std::unique_ptr<WorkerPool> mPool;
+
+        /// @brief Visibility buffer row stride (width rounded up to SIMD lane count)
+        uint32_t              mVisStride = 0;
+        std::vector<float>    mVisDepth;
+        std::vector<uint32_t> mVisTriangle;
+
+        std::vector<InstanceRef> mInstances;
+        std::vector<Chunk>       mChunks;
+        uint32_t                 mChunkCount = 0;
+        /// @brief Visibility buffer triangle ids are encoded as chunkIndex * CHUNK_ID_STRIDE + triangle index within the chunk
+        inline static constexpr uint32_t TRIANGLES_PER_CHUNK = 4096;
+        inline static constexpr uint32_t CHUNK_ID_STRIDE     = TRIANGLES_PER_CHUNK * 2;  // Near plane clipping emits at most 2 triangles per source triangle
+        inline static constexpr uint32_t INVALID_TRIANGLE    = ~0U;
+    };
+}  // namespace cgbuffer
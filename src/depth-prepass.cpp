@@ -0,0 +1,24 @@
+#include "depth-prepass.hpp"
+
+namespace cgbuffer {
+    DepthPrepass& DepthPrepass::SetAlphaTest(bool alphaTest)
+    {
+        foray::Assert(mPasses.empty(), "Must configure alpha test before building!");
+        mAlphaTest = alphaTest;
+        return *this;
+    }
+
+    void DepthPrepass::Build(foray::core::Context* context, foray::scene::Scene* scene, std::string_view name)
+    {
+        foray::Assert(mOutputList.empty(), "DepthPrepass does not support outputs");
+        foray::Assert(!mTiling.has_value() && !mDepthSource, "DepthPrepass does not support tiled mode or a depth source");
+
+        // Without outputs, the alpha test is the only fragment work left
+        mBuiltInFeaturesFlagsGlobal &= ~(uint32_t)BuiltInFeaturesFlagBits::ALPHATEST;
+        if(mAlphaTest)
+        {
+            EnableBuiltInFeature(BuiltInFeaturesFlagBits::ALPHATEST);
+        }
+        CRaster::Build(context, scene, name);
+    }
+}  // namespace cgbuffer
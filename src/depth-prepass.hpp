@@ -0,0 +1,27 @@
+#pragma once
+#include "conf-gbuffer.hpp"
+
+namespace cgbuffer {
+
+    /// @brief Depth only pre-pass, whose depth image is shared by any number of CRaster stages (see CRaster::SetDepthSource())
+    /// @details
+    /// How to use: Configure, Build, Set as depth source, Record before all consumers
+    ///  - Configure: Alpha testing is enabled by default, so alpha masked geometry does not occlude (see SetAlphaTest()).
+    ///    Output set count must match the consumers (see CRaster::SetOutputSetCount())
+    ///  - Build: Before building any consumer
+    ///  - Record: The pre-pass rasterizes the scene once with depth writes. Consumers load its depth and shade with an equal depth test,
+    ///    so the scene's overdraw is paid once instead of per G-buffer stage
+    /// Adding outputs is not supported, use a CRaster for that.
+    class DepthPrepass : public CRaster
+    {
+      public:
+        /// @brief Discard fragments of alpha masked materials (see BuiltInFeaturesFlagBits::ALPHATEST). Enabled by default
+        /// @remarks MUST be called before Build()
+        DepthPrepass& SetAlphaTest(bool alphaTest);
+
+        virtual void Build(foray::core::Context* context, foray::scene::Scene* scene, std::string_view name = "DepthPrepass") override;
+
+      protected:
+        bool mAlphaTest = true;
+    };
+}  // namespace cgbuffer
@@ -0,0 +1,385 @@
+#include "draw-list.hpp"
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <scene/components/foray_meshinstance.hpp>
+#include <scene/components/foray_transform.hpp>
+#include <scene/foray_mesh.hpp>
+#include <scene/globalcomponents/foray_drawmanager.hpp>
+#include <scene/globalcomponents/foray_geometrymanager.hpp>
+
+namespace cgbuffer {
+
+    namespace {
+        // FNV-1a, mixed per 32 bit word
+        inline void HashCombine(uint64_t& hash, uint32_t value)
+        {
+            hash ^= value;
+            hash *= 0x100000001B3ULL;
+        }
+
+        inline constexpr uint32_t VARIANT_BITS   = 4;
+        inline constexpr uint32_t MATERIAL_BITS  = 16;
+        inline constexpr uint32_t PRIMITIVE_BITS = 64 - VARIANT_BITS - MATERIAL_BITS - DrawList::DEPTH_BITS;
+
+        // A previous order with more than 1 / INSERTION_SORT_RATIO items out of place is radix sorted instead
+        inline constexpr uint32_t INSERTION_SORT_RATIO = 32;
+        // The insertion sort is abandoned for the radix sort once it has shifted more than this many keys per item, bounding it to O(n).
+        // Few descents can still hide long displacements (e.g. one item moving from the back to the front of the list)
+        inline constexpr uint64_t INSERTION_SORT_MOVES_PER_ITEM = 4;
+    }  // namespace
+
+    uint64_t DrawList::QuantizeDepth(float distance)
+    {
+        constexpr uint64_t maxValue = (1ULL << DEPTH_BITS) - 1;
+        if(!(distance > DEPTH_NEAR))  // Also catches NaN
+        {
+            return 0;
+        }
+        float normalized = std::log(distance / DEPTH_NEAR) / std::log(DEPTH_FAR / DEPTH_NEAR);
+        return std::min(maxValue, (uint64_t)(normalized * (float)maxValue));
+    }
+
+    void DrawList::Build(foray::scene::Scene* scene, const View& view, ESortMode mode)
+    {
+        uint64_t signature = Gather(scene);
+
+        mStats           = Stats{};
+        mStats.ItemCount = (uint32_t)mItems.size();
+
+        if(signature != mSignature || mKeys.size() != mItems.size())
+        {
+            // Item set changed (e.g. visibility): Carry last frames order and LOD levels over for items still present, append new ones in gathering order
+            mSignature = signature;
+
+            std::unordered_map<uint64_t, uint32_t> newIndices;
+            newIndices.reserve(mItems.size());
+            for(uint32_t i = 0; i < mItems.size(); i++)
+            {
+                newIndices[ItemId(mItems[i])] = i;
+            }
+
+            std::vector<KeyIndex> keys;
+            std::vector<uint32_t> previousLods(mItems.size(), ~0U);
+            std::vector<bool>     placed(mItems.size(), false);
+            keys.reserve(mItems.size());
+            for(const KeyIndex& keyIndex : mKeys)
+            {
+                auto iter = newIndices.find(mItemIds[keyIndex.Index]);
+                if(iter != newIndices.end())
+                {
+                    keys.push_back(KeyIndex{0, iter->second});
+                    previousLods[iter->second] = mPreviousLods[keyIndex.Index];
+                    placed[iter->second]       = true;
+                }
+            }
+            for(uint32_t i = 0; i < mItems.size(); i++)
+            {
+                if(!placed[i])
+                {
+                    keys.push_back(KeyIndex{0, i});
+                }
+            }
+            mKeys         = std::move(keys);
+            mPreviousLods = std::move(previousLods);
+
+            mItemIds.resize(mItems.size());
+            for(uint32_t i = 0; i < mItems.size(); i++)
+            {
+                mItemIds[i] = ItemId(mItems[i]);
+            }
+        }
+
+        SelectLods(view);
+
+        // Rekey in last frames order and count how far off it is
+        for(uint32_t i = 0; i < mKeys.size(); i++)
+        {
+            mKeys[i].Key = MakeKey(mItems[mKeys[i].Index], view.ViewMatrix, mode);
+            if(i > 0 && mKeys[i].Key < mKeys[i - 1].Key)
+            {
+                mStats.Descents++;
+            }
+        }
+
+        if(mStats.Descents > 0)
+        {
+            bool sorted = mStats.Descents * INSERTION_SORT_RATIO <= mKeys.size() && InsertionSort(mKeys.size() * INSERTION_SORT_MOVES_PER_ITEM);
+            if(!sorted)
+            {
+                // Restart from gathering order, so equal keys end up with ascending transform indices and merge
+                mScratch.resize(mKeys.size());
+                for(const KeyIndex& keyIndex : mKeys)
+                {
+                    mScratch[keyIndex.Index] = keyIndex;
+                }
+                std::swap(mKeys, mScratch);
+                RadixSort();
+                mStats.FullSort = true;
+            }
+        }
+
+        Merge();
+        mStats.DrawCount = (uint32_t)mDrawCalls.size();
+    }
+
+    uint64_t DrawList::Gather(foray::scene::Scene* scene)
+    {
+        mItems.clear();
+        mGeometryStore = scene->GetComponent<foray::scene::gcomp::GeometryStore>();
+
+        uint64_t signature = 0xCBF29CE484222325ULL;
+
+        auto        drawDirector = scene->GetComponent<foray::scene::gcomp::DrawDirector>();
+        const auto& drawOps      = drawDirector->GetDrawOps();
+
+        // Primitive ids are running indices over all draw ops, independent of visibility
+        mPrimitiveOffsets.resize(drawOps.size());
+        uint32_t primitiveCount = 0;
+        for(uint32_t opIndex = 0; opIndex < drawOps.size(); opIndex++)
+        {
+            mPrimitiveOffsets[opIndex] = primitiveCount;
+            primitiveCount += (uint32_t)drawOps[opIndex].Target->GetPrimitives().size();
+        }
+
+        auto gatherInstance = [&](uint32_t opIndex, uint32_t instanceIndex) {
+            const foray::scene::gcomp::DrawDirector::DrawOp& drawOp     = drawOps[opIndex];
+            const std::vector<foray::scene::Primitive>&      primitives = drawOp.Target->GetPrimitives();
+
+            foray::scene::ncomp::MeshInstance* instance = drawOp.Instances[instanceIndex];
+            const glm::mat4&                   model    = instance->GetNode()->GetTransform()->GetGlobalMatrix();
+            float                              scale    = std::max({glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))});
+
+            for(uint32_t primitiveIndex = 0; primitiveIndex < primitives.size(); primitiveIndex++)
+            {
+                const foray::scene::Primitive& primitive = primitives[primitiveIndex];
+
+                Item item{
+                    .PrimitiveId    = mPrimitiveOffsets[opIndex] + primitiveIndex,
+                    .First          = primitive.First,
+                    .Count          = primitive.VertexOrIndexCount,
+                    .Indexed        = primitive.Type == foray::scene::Primitive::EType::Index,
+                    .MaterialIndex  = primitive.MaterialIndex,
+                    .TransformIndex = drawOp.TransformOffset + instanceIndex,
+                    .Variant        = !!mVariantClassifier ? std::min(mVariantClassifier(primitive.MaterialIndex), (1U << VARIANT_BITS) - 1) : 0,
+                    .Position       = glm::vec3(model[3]),
+                };
+                if(!!mMeshLods && item.Indexed)
+                {
+                    item.Lods = mMeshLods->Find(drawOp.Target, primitiveIndex);
+                }
+                if(!!item.Lods)
+                {
+                    item.Position = glm::vec3(model * glm::vec4(item.Lods->Center, 1.f));
+                    item.Radius   = item.Lods->Radius * scale;
+                }
+
+                HashCombine(signature, item.PrimitiveId);
+                HashCombine(signature, item.TransformIndex);
+                HashCombine(signature, (uint32_t)item.MaterialIndex);
+                HashCombine(signature, item.Variant);
+                mItems.push_back(item);
+            }
+        };
+
+        if(!!mVisibleInstances)
+        {
+            const std::vector<InstanceBvh::Instance>& instances = mInstanceBvh->GetInstances();
+            for(uint32_t visible : *mVisibleInstances)
+            {
+                gatherInstance(instances[visible].DrawOpIndex, instances[visible].InstanceIndex);
+            }
+        }
+        else
+        {
+            for(uint32_t opIndex = 0; opIndex < drawOps.size(); opIndex++)
+            {
+                for(uint32_t instanceIndex = 0; instanceIndex < drawOps[opIndex].Instances.size(); instanceIndex++)
+                {
+                    gatherInstance(opIndex, instanceIndex);
+                }
+            }
+        }
+        return signature;
+    }
+
+    void DrawList::SelectLods(const View& view)
+    {
+        if(!mMeshLods)
+        {
+            return;
+        }
+        float projectionScale = std::abs(view.ProjectionMatrix[1][1]) * view.ViewportHeight * 0.5f;
+        for(uint32_t i = 0; i < mItems.size(); i++)
+        {
+            Item& item = mItems[i];
+            if(!item.Lods)
+            {
+                continue;
+            }
+            item.Lod         = mMeshLods->SelectLod(*item.Lods, item.Position, item.Radius, view.ViewMatrix, projectionScale, mPreviousLods[i]);
+            item.First       = item.Lods->Levels[item.Lod].FirstIndex;
+            item.Count       = item.Lods->Levels[item.Lod].IndexCount;
+            mPreviousLods[i] = item.Lod;
+            mStats.LodItemCounts[item.Lod]++;
+        }
+    }
+
+    uint64_t DrawList::MakeKey(const Item& item, const glm::mat4& viewMatrix, ESortMode mode) const
+    {
+        uint64_t variant   = item.Variant;
+        uint64_t material  = (uint64_t)(item.MaterialIndex + 1) & ((1ULL << MATERIAL_BITS) - 1);  // -1 (no material) sorts first
+        uint64_t primitive = ((uint64_t)item.PrimitiveId * MeshLods::MAX_LOD_COUNT + item.Lod) & ((1ULL << PRIMITIVE_BITS) - 1);
+
+        if(mode == ESortMode::FRONTTOBACK)
+        {
+            // View space looks down -z
+            float    distance = -(viewMatrix * glm::vec4(item.Position, 1.f)).z;
+            uint64_t depth    = QuantizeDepth(distance);
+            return (variant << (64 - VARIANT_BITS)) | (depth << (MATERIAL_BITS + PRIMITIVE_BITS)) | (material << PRIMITIVE_BITS) | primitive;
+        }
+        // Depth is resolved already. Leaving it out keeps all instances of a primitive together, so they merge into a single instanced call
+        return (variant << (64 - VARIANT_BITS)) | (material << (PRIMITIVE_BITS + DEPTH_BITS)) | (primitive << DEPTH_BITS);
+    }
+
+    void DrawList::RadixSort()
+    {
+        // LSD radix sort, 8 bits per pass. Stable, so items with equal keys keep ascending transform indices from gathering
+        mScratch.resize(mKeys.size());
+
+        KeyIndex* src   = mKeys.data();
+        KeyIndex* dst   = mScratch.data();
+        uint32_t  count = (uint32_t)mKeys.size();
+
+        for(uint32_t shift = 0; shift < 64; shift += 8)
+        {
+            uint32_t histogram[256] = {};
+            for(uint32_t i = 0; i < count; i++)
+            {
+                histogram[(src[i].Key >> shift) & 0xFF]++;
+            }
+
+            // All keys share this byte (common for unused variant / material bits), pass would not change the order
+            if(histogram[(src[0].Key >> shift) & 0xFF] == count)
+            {
+                continue;
+            }
+
+            uint32_t offset = 0;
+            for(uint32_t& bucket : histogram)
+            {
+                uint32_t size = bucket;
+                bucket        = offset;
+                offset += size;
+            }
+            for(uint32_t i = 0; i < count; i++)
+            {
+                dst[histogram[(src[i].Key >> shift) & 0xFF]++] = src[i];
+            }
+            std::swap(src, dst);
+        }
+
+        if(src != mKeys.data())
+        {
+            std::copy(src, src + count, mKeys.data());
+        }
+    }
+
+    bool DrawList::InsertionSort(uint64_t maxMoves)
+    {
+        uint64_t moves = 0;
+        for(uint32_t i = 1; i < mKeys.size(); i++)
+        {
+            KeyIndex current = mKeys[i];
+            uint32_t j       = i;
+            for(; j > 0 && mKeys[j - 1].Key > current.Key; j--)
+            {
+                mKeys[j] = mKeys[j - 1];
+            }
+            mKeys[j] = current;
+            moves += i - j;
+            if(moves > maxMoves)
+            {
+                // Keys are left a valid permutation, the caller sorts them from scratch
+                mStats.Moves = (uint32_t)moves;
+                return false;
+            }
+        }
+        mStats.Moves = (uint32_t)moves;
+        return true;
+    }
+
+    void DrawList::Merge()
+    {
+        mDrawCalls.clear();
+
+        const Item* previous = nullptr;
+        for(const KeyIndex& keyIndex : mKeys)
+        {
+            const Item& item = mItems[keyIndex.Index];
+            if(!!previous && previous->PrimitiveId == item.PrimitiveId && previous->Lod == item.Lod && previous->TransformIndex + 1 == item.TransformIndex)
+            {
+                // Same primitive (and therefore material) and level, transforms adjacent in the transform buffer
+                mDrawCalls.back().InstanceCount++;
+            }
+            else
+            {
+                mDrawCalls.push_back(DrawCall{
+                    .First                 = item.First,
+                    .Count                 = item.Count,
+                    .Indexed               = item.Indexed,
+                    .MaterialIndex         = item.MaterialIndex,
+                    .LodIndices            = !!item.Lods,
+                    .TransformBufferOffset = item.TransformIndex,
+                    .InstanceCount         = 1,
+                });
+            }
+            previous = &item;
+        }
+    }
+
+    void DrawList::CmdDraw(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout) const
+    {
+        if(mDrawCalls.empty())
+        {
+            return;
+        }
+
+        mGeometryStore->CmdBindBuffers(cmdBuffer);
+        bool lodIndicesBound = false;
+
+        foray::scene::DrawPushConstant pushConstant{};
+        bool                           pushed = false;
+        for(const DrawCall& drawCall : mDrawCalls)
+        {
+            if(drawCall.Indexed && drawCall.LodIndices != lodIndicesBound)
+            {
+                // Vertex buffer is shared, only the index buffer changes
+                if(drawCall.LodIndices)
+                {
+                    vkCmdBindIndexBuffer(cmdBuffer, mMeshLods->GetIndexBuffer(), 0, VK_INDEX_TYPE_UINT32);
+                }
+                else
+                {
+                    mGeometryStore->CmdBindBuffers(cmdBuffer);
+                }
+                lodIndicesBound = drawCall.LodIndices;
+            }
+            if(!pushed || pushConstant.TransformBufferOffset != drawCall.TransformBufferOffset || pushConstant.MaterialIndex != drawCall.MaterialIndex)
+            {
+                pushConstant.TransformBufferOffset = drawCall.TransformBufferOffset;
+                pushConstant.MaterialIndex         = drawCall.MaterialIndex;
+                vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(pushConstant), &pushConstant);
+                pushed = true;
+            }
+            if(drawCall.Indexed)
+            {
+                vkCmdDrawIndexed(cmdBuffer, drawCall.Count, drawCall.InstanceCount, drawCall.First, 0, 0);
+            }
+            else
+            {
+                vkCmdDraw(cmdBuffer, drawCall.Count, drawCall.InstanceCount, drawCall.First, 0);
+            }
+        }
+    }
+}  // namespace cgbuffer
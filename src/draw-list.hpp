@@ -0,0 +1,173 @@
+#pragma once
+#include "instance-bvh.hpp"
+#include "mesh-lod.hpp"
+#include <foray_api.hpp>
+#include <functional>
+
+namespace cgbuffer {
+
+    /// @brief Per frame sorted draw list, recorded instead of Scene::Draw()
+    /// @details
+    /// How to use: Build, Record
+    ///  - Build: Gathers one item per primitive and mesh instance from the scenes DrawDirector and sorts them by a 64 bit key. See DrawList::Build()
+    ///  - Record: Binds the geometry store and records the merged draw calls. See DrawList::CmdDraw()
+    /// Sort keys are built from (most significant first):
+    ///  - FRONTTOBACK: Pipeline variant, quantized view depth, material, primitive
+    ///  - MATERIAL: Pipeline variant, material, primitive (use when depth is already resolved, e.g. by a DepthPrepass)
+    /// Keys are sorted with an LSD radix sort. If the gathered items match last frame, the sort starts from last frames order,
+    /// which for coherent cameras is sorted or nearly sorted already and is fixed up with an insertion sort instead.
+    /// After sorting, neighbouring items drawing the same primitive with the same material and consecutive transform indices are merged into one instanced call.
+    /// If MeshLods are set, a level is selected per item from its projected bounding sphere, and items are drawn from the LOD index buffer.
+    /// If a visible instance list is set, only those instances are gathered, so the cost scales with visible instead of scene instances.
+    /// Items still visible keep their position in last frames order when the visible set changes.
+    class DrawList
+    {
+      public:
+        enum class ESortMode
+        {
+            FRONTTOBACK,
+            MATERIAL,
+        };
+
+        /// @brief Maps a material index to a pipeline variant (0 - 15). Draws are ordered by variant first, e.g. to draw alpha tested materials after opaque ones
+        using VariantClassifier = std::function<uint32_t(int32_t materialIndex)>;
+
+        /// @brief Camera the list is built for
+        struct View
+        {
+            glm::mat4 ViewMatrix       = glm::mat4(1.f);
+            glm::mat4 ProjectionMatrix = glm::mat4(1.f);
+            /// @brief Viewport height in pixels, for LOD selection
+            float ViewportHeight = 1.f;
+        };
+
+        /// @brief Draw call recorded by CmdDraw()
+        struct DrawCall
+        {
+            /// @brief First index (indexed) or vertex (non indexed)
+            uint32_t First = 0;
+            /// @brief Index or vertex count
+            uint32_t Count         = 0;
+            bool     Indexed       = true;
+            int32_t  MaterialIndex = -1;
+            /// @brief If set, First indexes into MeshLods::GetIndexBuffer() instead of the geometry stores index buffer
+            bool LodIndices = false;
+            /// @brief Transform index of the first instance (MeshInstanceId = TransformBufferOffset + instance)
+            uint32_t TransformBufferOffset = 0;
+            uint32_t InstanceCount         = 1;
+        };
+
+        /// @brief Counters of the last Build()
+        struct Stats
+        {
+            uint32_t ItemCount = 0;
+            uint32_t DrawCount = 0;
+            /// @brief Items out of order when starting from last frames order. 0 if the previous order was reused unchanged
+            uint32_t Descents = 0;
+            /// @brief Keys shifted by the insertion sort repairing last frames order
+            uint32_t Moves = 0;
+            /// @brief True if the radix sort ran (item set changed, or the previous order was too far off by descents or moves)
+            bool FullSort = false;
+            /// @brief Items drawn per LOD level (only items with a LOD chain)
+            uint32_t LodItemCounts[MeshLods::MAX_LOD_COUNT] = {};
+        };
+
+        inline DrawList& SetVariantClassifier(const VariantClassifier& classifier)
+        {
+            mVariantClassifier = classifier;
+            mSignature         = 0;
+            return *this;
+        }
+
+        /// @brief Selects a LOD level per instance and primitive. Set to nullptr to always draw the source geometry
+        inline DrawList& SetMeshLods(const MeshLods* lods)
+        {
+            mMeshLods  = lods;
+            mSignature = 0;
+            return *this;
+        }
+
+        /// @brief Restricts the next Build() calls to a list of visible instances, e.g. an InstanceBvh::Query() result
+        /// @param bvh Hierarchy the instance indices refer to
+        /// @param visible Ascending indices into bvh->GetInstances(). Set to nullptr to draw all instances. Must stay valid until the next Build()
+        inline DrawList& SetVisibleInstances(const InstanceBvh* bvh, const std::vector<uint32_t>* visible)
+        {
+            mInstanceBvh      = bvh;
+            mVisibleInstances = !!bvh ? visible : nullptr;
+            return *this;
+        }
+
+        /// @brief Gathers, selects LODs, sorts and merges the draws of the scene for the given camera
+        void Build(foray::scene::Scene* scene, const View& view, ESortMode mode);
+
+        /// @brief Binds the geometry store and records all draw calls. Push constants are only updated if they change
+        void CmdDraw(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout) const;
+
+        inline const std::vector<DrawCall>& GetDrawCalls() const { return mDrawCalls; }
+        inline const Stats&                 GetStats() const { return mStats; }
+
+        /// @brief Quantizes a view space distance to DEPTH_BITS, logarithmically distributed between DEPTH_NEAR and DEPTH_FAR
+        static uint64_t QuantizeDepth(float distance);
+
+        inline static constexpr uint32_t DEPTH_BITS = 12;
+        inline static constexpr float    DEPTH_NEAR = 0.01f;
+        inline static constexpr float    DEPTH_FAR  = 10000.f;
+
+      protected:
+        /// @brief Single primitive of a single mesh instance
+        struct Item
+        {
+            /// @brief Running index of the primitive within the scene, identifies mergeable items
+            uint32_t  PrimitiveId    = 0;
+            uint32_t  First          = 0;
+            uint32_t  Count          = 0;
+            bool      Indexed        = true;
+            int32_t   MaterialIndex  = -1;
+            uint32_t  TransformIndex = 0;
+            uint32_t  Variant        = 0;
+            /// @brief World space bounding sphere center (instance origin if no LOD chain is known)
+            glm::vec3 Position = glm::vec3(0.f);
+            float     Radius   = 0.f;
+            /// @brief LOD chain, nullptr if drawn from the geometry store
+            const MeshLods::PrimitiveLods* Lods = nullptr;
+            uint32_t                       Lod  = 0;
+        };
+
+        /// @brief Identifies an item across frames
+        static inline uint64_t ItemId(const Item& item) { return ((uint64_t)item.TransformIndex << 32) | item.PrimitiveId; }
+
+        struct KeyIndex
+        {
+            uint64_t Key;
+            uint32_t Index;
+        };
+
+        /// @brief Rebuilds mItems. Returns a hash of everything but positions, to detect whether last frames order can be reused
+        uint64_t Gather(foray::scene::Scene* scene);
+        void     SelectLods(const View& view);
+        uint64_t MakeKey(const Item& item, const glm::mat4& viewMatrix, ESortMode mode) const;
+        void     RadixSort();
+        /// @brief Sorts mKeys in place. Returns false without finishing if more than maxMoves keys would have to be shifted
+        bool     InsertionSort(uint64_t maxMoves);
+        void     Merge();
+
+        VariantClassifier            mVariantClassifier;
+        const MeshLods*              mMeshLods         = nullptr;
+        const InstanceBvh*           mInstanceBvh      = nullptr;
+        const std::vector<uint32_t>* mVisibleInstances = nullptr;
+        std::vector<Item>            mItems;
+        /// @brief ItemId() per item of the last item set
+        std::vector<uint64_t> mItemIds;
+        /// @brief LOD level selected last frame per item, for hysteresis
+        std::vector<uint32_t> mPreviousLods;
+        /// @brief First primitive id per draw op
+        std::vector<uint32_t> mPrimitiveOffsets;
+        std::vector<KeyIndex> mKeys;
+        std::vector<KeyIndex> mScratch;
+        std::vector<DrawCall> mDrawCalls;
+        uint64_t              mSignature = 0;
+        Stats                 mStats;
+
+        foray::scene::gcomp::GeometryStore* mGeometryStore = nullptr;
+    };
+}  // namespace cgbuffer
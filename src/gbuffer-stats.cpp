@@ -0,0 +1,514 @@
+#include "gbuffer-stats.hpp"
+#include "precompiled-shaders.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace cgbuffer {
+
+    uint32_t GBufferStats::AddReduction(const Reduction& reduction)
+    {
+        foray::Assert(mPasses.empty() || !mPasses.front()->Pipeline, "Must add reductions before building!");
+        FORAY_ASSERTFMT(reduction.Type != EReductionType::HISTOGRAM || (reduction.BinCount > 0 && reduction.BinCount <= MAX_HISTOGRAM_BINS),
+                        "Histogram bin count must be in [1, {}]", MAX_HISTOGRAM_BINS);
+        std::unique_ptr<Pass>& pass = mPasses.emplace_back(std::make_unique<Pass>());
+        pass->Config                = reduction;
+        return (uint32_t)mPasses.size() - 1;
+    }
+
+    void GBufferStats::Build(foray::core::Context* context, CRaster* raster, std::string_view name)
+    {
+        mContext = context;
+        mRaster  = raster;
+        mName    = std::string(name);
+
+        SetupPasses();
+        if(!!mRaster->GetAsyncCompute())
+        {
+            for(std::unique_ptr<Pass>& pass : mPasses)
+            {
+                mRaster->AddAsyncComputeInput(pass->Config.OutputName);
+            }
+        }
+        CreateBuffers();
+        CreateDescriptorSets();
+        CreatePipelines();
+    }
+
+    std::vector<std::vector<std::string>> GBufferStats::GetShaderDefinitions(const CRaster& raster)
+    {
+        // Input type and channel count of every output, depth is reduced as float
+        std::vector<std::pair<EInputType, uint32_t>> inputs{{EInputType::FLOAT, 1}};
+        for(std::string_view name : raster.GetOutputNames())
+        {
+            const CRaster::OutputRecipe& recipe = raster.GetOutputRecipe(name);
+            inputs.emplace_back(GetInputType(recipe.Type), GetChannelCount(recipe.Type));
+        }
+
+        std::vector<std::vector<std::string>> result;
+        for(const auto& [inputType, channelCount] : inputs)
+        {
+            for(EReductionType type : {EReductionType::MINMAX, EReductionType::HISTOGRAM, EReductionType::UNIQUEIDS, EReductionType::NONFINITE})
+            {
+                if((type == EReductionType::UNIQUEIDS && inputType == EInputType::FLOAT) || (type == EReductionType::NONFINITE && inputType != EInputType::FLOAT))
+                {
+                    continue;
+                }
+                std::vector<std::string> definitions = GetPassShaderDefinitions(type, inputType, channelCount);
+                if(std::find(result.begin(), result.end(), definitions) == result.end())
+                {
+                    result.push_back(std::move(definitions));
+                }
+            }
+        }
+        return result;
+    }
+
+    GBufferStats::EInputType GBufferStats::GetInputType(CRaster::FragmentOutputType type)
+    {
+        switch(type)
+        {
+            case CRaster::FragmentOutputType::INT:
+            case CRaster::FragmentOutputType::IVEC2:
+            case CRaster::FragmentOutputType::IVEC3:
+            case CRaster::FragmentOutputType::IVEC4:
+                return EInputType::INT;
+            case CRaster::FragmentOutputType::UINT:
+            case CRaster::FragmentOutputType::UVEC2:
+            case CRaster::FragmentOutputType::UVEC3:
+            case CRaster::FragmentOutputType::UVEC4:
+                return EInputType::UINT;
+            default:
+                return EInputType::FLOAT;
+        }
+    }
+
+    uint32_t GBufferStats::GetChannelCount(CRaster::FragmentOutputType type)
+    {
+        switch(type)
+        {
+            case CRaster::FragmentOutputType::VEC2:
+            case CRaster::FragmentOutputType::IVEC2:
+            case CRaster::FragmentOutputType::UVEC2:
+                return 2;
+            case CRaster::FragmentOutputType::VEC3:
+            case CRaster::FragmentOutputType::IVEC3:
+            case CRaster::FragmentOutputType::UVEC3:
+                return 3;
+            case CRaster::FragmentOutputType::VEC4:
+            case CRaster::FragmentOutputType::IVEC4:
+            case CRaster::FragmentOutputType::UVEC4:
+                return 4;
+            default:
+                return 1;
+        }
+    }
+
+    std::vector<std::string> GBufferStats::GetPassShaderDefinitions(EReductionType type, EInputType inputType, uint32_t channelCount)
+    {
+        std::vector<std::string> definitions;
+        switch(type)
+        {
+            case EReductionType::MINMAX:
+                definitions.push_back("REDUCTION_MINMAX=1");
+                break;
+            case EReductionType::HISTOGRAM:
+                definitions.push_back("REDUCTION_HISTOGRAM=1");
+                break;
+            case EReductionType::UNIQUEIDS:
+                definitions.push_back("REDUCTION_UNIQUEIDS=1");
+                break;
+            case EReductionType::NONFINITE:
+                definitions.push_back("REDUCTION_NONFINITE=1");
+                break;
+        }
+        switch(inputType)
+        {
+            case EInputType::FLOAT:
+                definitions.push_back("INPUT_FLOAT=1");
+                break;
+            case EInputType::INT:
+                definitions.push_back("INPUT_INT=1");
+                break;
+            case EInputType::UINT:
+                definitions.push_back("INPUT_UINT=1");
+                break;
+        }
+        definitions.push_back(fmt::format("CHANNEL_COUNT={}", channelCount));
+        return definitions;
+    }
+
+    void GBufferStats::SetupPasses()
+    {
+        mResultWordCount = 0;
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            const Reduction& config = pass->Config;
+            pass->IsDepth           = config.OutputName == mRaster->GetDepthOutputName();
+            for(uint32_t set = 0; set < mRaster->GetOutputSetCount(); set++)
+            {
+                pass->Images[set] = mRaster->GetImageOutputOfSet(config.OutputName, set);
+            }
+
+            VkClearColorValue clearValue{};
+            if(pass->IsDepth)
+            {
+                pass->InputType       = EInputType::FLOAT;
+                pass->ChannelCount    = 1;
+                clearValue.float32[0] = 1.f;
+            }
+            else
+            {
+                const CRaster::OutputRecipe& recipe = mRaster->GetOutputRecipe(config.OutputName);
+                clearValue                          = recipe.ClearValue;
+                pass->InputType                     = GetInputType(recipe.Type);
+                pass->ChannelCount                  = GetChannelCount(recipe.Type);
+            }
+
+            FORAY_ASSERTFMT(config.Channel < pass->ChannelCount, "Reduction of \"{}\": Channel {} out of range", config.OutputName, config.Channel);
+            FORAY_ASSERTFMT(config.Type != EReductionType::UNIQUEIDS || pass->InputType != EInputType::FLOAT, "Reduction of \"{}\": Unique ids require an integer output",
+                            config.OutputName);
+            FORAY_ASSERTFMT(config.Type != EReductionType::NONFINITE || pass->InputType == EInputType::FLOAT, "Reduction of \"{}\": Non-finite count requires a float output",
+                            config.OutputName);
+
+            switch(config.Type)
+            {
+                case EReductionType::MINMAX:
+                    pass->ResultSize = 2;
+                    break;
+                case EReductionType::HISTOGRAM:
+                    pass->ResultSize = config.BinCount;
+                    break;
+                case EReductionType::UNIQUEIDS:
+                    pass->ResultSize = (config.IdCount + 31) / 32;
+                    break;
+                case EReductionType::NONFINITE:
+                    pass->ResultSize = 1;
+                    break;
+            }
+            pass->ResultOffset = mResultWordCount;
+            mResultWordCount += pass->ResultSize;
+
+            pass->PushC = PushConstant{.ResultOffset = pass->ResultOffset,
+                                       .Channel      = config.Channel,
+                                       .Magnitude    = config.Magnitude ? 1U : 0U,
+                                       .BinCount     = config.BinCount,
+                                       .HistogramMin = config.HistogramMin,
+                                       .HistogramMax = config.HistogramMax,
+                                       .IdCount      = config.IdCount,
+                                       .IgnoreClear  = config.IgnoreClearValue ? 1U : 0U,
+                                       .ClearValue   = clearValue};
+        }
+    }
+
+    void GBufferStats::CreateBuffers()
+    {
+        VkDeviceSize size = std::max<VkDeviceSize>(mResultWordCount, 1) * sizeof(uint32_t);
+
+        foray::core::ManagedBuffer::CreateInfo deviceCi(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size,
+                                                        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0, fmt::format("{}.Results", mName));
+        mDeviceBuffer.Create(mContext, deviceCi);
+
+        for(uint32_t slotIndex = 0; slotIndex < READBACK_SLOT_COUNT; slotIndex++)
+        {
+            foray::core::ManagedBuffer::CreateInfo hostCi(VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                          VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, fmt::format("{}.Readback.{}", mName, slotIndex));
+            mSlots[slotIndex].Buffer.Create(mContext, hostCi);
+            mSlots[slotIndex].Pending = false;
+        }
+    }
+
+    void GBufferStats::CreateDescriptorSets()
+    {
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            for(uint32_t set = 0; set < mRaster->GetOutputSetCount(); set++)
+            {
+                foray::core::DescriptorSetHelper& descriptorSet = pass->DescriptorSets[set];
+                descriptorSet.Destroy();
+                descriptorSet.SetDescriptorAt(0, VkDescriptorImageInfo{.imageView = pass->Images[set]->GetImageView(), .imageLayout = VK_IMAGE_LAYOUT_GENERAL},
+                                              VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
+                descriptorSet.SetDescriptorAt(1, VkDescriptorBufferInfo{.buffer = mDeviceBuffer.GetBuffer(), .offset = 0, .range = VK_WHOLE_SIZE},
+                                              VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+                descriptorSet.Create(mContext, fmt::format("{}.{}.DescriptorSet.{}", mName, pass->Config.OutputName, set));
+            }
+        }
+    }
+
+    void GBufferStats::CreatePipelines()
+    {
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            std::vector<std::string> definitions = GetPassShaderDefinitions(pass->Config.Type, pass->InputType, pass->ChannelCount);
+
+            const PrecompiledShaders* precompiled = PrecompiledShaderRegistry::Find(definitions, "gbufstats.comp");
+            if(!!precompiled)
+            {
+                pass->Shader.LoadFromBinary(mContext, reinterpret_cast<const uint8_t*>(precompiled->ComputeSpirv.data()), precompiled->ComputeSpirv.size_bytes());
+            }
+            else
+            {
+#ifdef CGBUFFER_NO_RUNTIME_SHADER_COMPILE
+                FORAY_THROWFMT("{}: No precompiled shader embedded for the reduction of \"{}\", and runtime shader compilation is disabled. Add a recipe file containing the output to CGBUFFER_RECIPE_FILES",
+                               mName, pass->Config.OutputName);
+#else
+                foray::core::ShaderCompilerConfig shaderConfig;
+                shaderConfig.IncludeDirs.push_back(FORAY_SHADER_DIR);
+                shaderConfig.Definitions = std::move(definitions);
+                mShaderKeys.push_back(mContext->ShaderMan->CompileShader("src/shaders/gbufstats.comp", pass->Shader, shaderConfig));
+#endif
+            }
+
+            pass->PipelineLayout.AddDescriptorSetLayout(pass->DescriptorSets[0].GetDescriptorSetLayout());  // All sets share the same bindings
+            pass->PipelineLayout.AddPushConstantRange<PushConstant>(VK_SHADER_STAGE_COMPUTE_BIT);
+            pass->PipelineLayout.Build(mContext);
+
+            VkComputePipelineCreateInfo pipelineCi{.sType  = VkStructureType::VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+                                                   .stage  = VkPipelineShaderStageCreateInfo{.sType  = VkStructureType::VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                                                                                             .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+                                                                                             .module = pass->Shader.GetShaderModule(),
+                                                                                             .pName  = "main"},
+                                                   .layout = pass->PipelineLayout.GetPipelineLayout()};
+            foray::AssertVkResult(vkCreateComputePipelines(mContext->Device(), mContext->PipelineCache, 1, &pipelineCi, nullptr, &pass->Pipeline));
+        }
+    }
+
+    void GBufferStats::RecordFrame(VkCommandBuffer cmdBuffer, foray::base::FrameRenderInfo& renderInfo)
+    {
+        // The renderloop has waited for the frame previously recorded into this slot, so its results are available.
+        // On the compute queue, the in flight fence does not cover it and ReadSlot() waits for it
+        AsyncCompute* asyncCompute = mRaster->GetAsyncCompute();
+        Slot&         slot         = mSlots[renderInfo.GetFrameNumber() % READBACK_SLOT_COUNT];
+        if(slot.Pending)
+        {
+            ReadSlot(slot);
+        }
+
+        if(mPasses.empty())
+        {
+            return;
+        }
+
+        if(!!asyncCompute)
+        {
+            // The raster has transferred the reduced images to the compute queue family
+            cmdBuffer = asyncCompute->GetCommandBuffer();
+        }
+
+        // Transition reduced images for sampling, reset the result buffer
+
+        const uint32_t set = mRaster->GetCurrentOutputSet();
+
+        std::vector<VkImageMemoryBarrier2> imgBarriers;
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            foray::core::ManagedImage* image        = pass->Images[set];
+            bool                       alreadyAdded = std::any_of(imgBarriers.begin(), imgBarriers.end(), [&](const VkImageMemoryBarrier2& barrier) { return barrier.image == image->GetImage(); });
+            if(alreadyAdded)
+            {
+                continue;
+            }
+            bool isDepth = pass->IsDepth;
+            // Derived outputs are written (and depth is read) by the rasters derive compute pass
+            VkPipelineStageFlags2 srcStage  = (isDepth ? VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT : VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT) | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            VkAccessFlags2        srcAccess = isDepth ? VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            if(!!asyncCompute)
+            {
+                // Only the acquire and the async derive pass precede this on the compute queue
+                srcStage  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+                srcAccess = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            }
+            imgBarriers.push_back(VkImageMemoryBarrier2{
+                .sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = srcStage,
+                .srcAccessMask       = srcAccess,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .dstAccessMask       = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                .oldLayout           = renderInfo.GetImageLayoutCache().Get(*image),
+                .newLayout           = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = image->GetImage(),
+                .subresourceRange    = VkImageSubresourceRange{.aspectMask     = isDepth ? VkImageAspectFlags(VK_IMAGE_ASPECT_DEPTH_BIT) : VkImageAspectFlags(VK_IMAGE_ASPECT_COLOR_BIT),
+                                                               .baseMipLevel   = 0,
+                                                               .levelCount     = 1,
+                                                               .baseArrayLayer = 0,
+                                                               .layerCount     = 1},
+            });
+            renderInfo.GetImageLayoutCache().Set(*image, VkImageLayout::VK_IMAGE_LAYOUT_GENERAL);
+        }
+
+        // Previous frames readback copy must have finished reading before the buffer is reset
+        VkBufferMemoryBarrier2 resetBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                            .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                            .srcAccessMask       = VK_ACCESS_2_TRANSFER_READ_BIT,
+                                            .dstStageMask        = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                                            .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                            .buffer              = mDeviceBuffer.GetBuffer(),
+                                            .offset              = 0,
+                                            .size                = VK_WHOLE_SIZE};
+
+        VkDependencyInfo depInfo{.sType                    = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                 .bufferMemoryBarrierCount = 1,
+                                 .pBufferMemoryBarriers    = &resetBarrier,
+                                 .imageMemoryBarrierCount  = (uint32_t)imgBarriers.size(),
+                                 .pImageMemoryBarriers     = imgBarriers.data()};
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+        vkCmdFillBuffer(cmdBuffer, mDeviceBuffer.GetBuffer(), 0, VK_WHOLE_SIZE, 0U);
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            if(pass->Config.Type == EReductionType::MINMAX)
+            {
+                // Min word starts at the largest value
+                vkCmdFillBuffer(cmdBuffer, mDeviceBuffer.GetBuffer(), pass->ResultOffset * sizeof(uint32_t), sizeof(uint32_t), ~0U);
+            }
+        }
+
+        VkBufferMemoryBarrier2 bufferBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                             .srcStageMask        = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                                             .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                             .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                             .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                             .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                             .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                             .buffer              = mDeviceBuffer.GetBuffer(),
+                                             .offset              = 0,
+                                             .size                = VK_WHOLE_SIZE};
+        depInfo = VkDependencyInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &bufferBarrier};
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+        // Reductions. Passes only combine their results with atomics, so no barriers are required in between
+
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            VkExtent2D extent = pass->Images[set]->GetExtent2D();
+            vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pass->Pipeline);
+            VkDescriptorSet descriptorSet = pass->DescriptorSets[set].GetDescriptorSet();
+            vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pass->PipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+            vkCmdPushConstants(cmdBuffer, pass->PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstant), &pass->PushC);
+            vkCmdDispatch(cmdBuffer, (extent.width + 15) / 16, (extent.height + 15) / 16, 1);
+        }
+
+        // Copy to this frames readback slot
+
+        bufferBarrier.srcStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        bufferBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        bufferBarrier.dstStageMask  = VK_PIPELINE_STAGE_2_COPY_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+        depInfo = VkDependencyInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &bufferBarrier};
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+        VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = mResultWordCount * sizeof(uint32_t)};
+        vkCmdCopyBuffer(cmdBuffer, mDeviceBuffer.GetBuffer(), slot.Buffer.GetBuffer(), 1, &region);
+
+        bufferBarrier.srcStageMask  = VK_PIPELINE_STAGE_2_COPY_BIT;
+        bufferBarrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        bufferBarrier.dstStageMask  = VK_PIPELINE_STAGE_2_HOST_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+        bufferBarrier.buffer        = slot.Buffer.GetBuffer();
+        depInfo = VkDependencyInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &bufferBarrier};
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+        slot.FrameNumber = renderInfo.GetFrameNumber();
+        slot.Pending     = true;
+    }
+
+    void GBufferStats::ReadSlot(Slot& slot)
+    {
+        if(!!mRaster->GetAsyncCompute())
+        {
+            mRaster->GetAsyncCompute()->WaitForFrame(slot.FrameNumber);
+        }
+        std::vector<uint32_t> words(mResultWordCount);
+        void*                 data = nullptr;
+        vmaInvalidateAllocation(mContext->Allocator, slot.Buffer.GetAllocation(), 0, VK_WHOLE_SIZE);
+        slot.Buffer.Map(data);
+        memcpy(words.data(), data, words.size() * sizeof(uint32_t));
+        slot.Buffer.Unmap();
+
+        mResults.resize(mPasses.size());
+        for(uint32_t passIndex = 0; passIndex < mPasses.size(); passIndex++)
+        {
+            const Pass&      pass   = *mPasses[passIndex];
+            ReductionResult& result = mResults[passIndex];
+            const uint32_t*  begin  = words.data() + pass.ResultOffset;
+            switch(pass.Config.Type)
+            {
+                case EReductionType::MINMAX: {
+                    result.HasValues = begin[0] <= begin[1];
+                    auto decode      = [&](uint32_t bits) -> double {
+                        switch(pass.InputType)
+                        {
+                            case EInputType::FLOAT:
+                                return std::bit_cast<float>((bits & 0x80000000U) ? bits & 0x7FFFFFFFU : ~bits);
+                            case EInputType::INT:
+                                return (double)std::bit_cast<int32_t>(bits ^ 0x80000000U);
+                            default:
+                                return (double)bits;
+                        }
+                    };
+                    result.Min = result.HasValues ? decode(begin[0]) : 0.0;
+                    result.Max = result.HasValues ? decode(begin[1]) : 0.0;
+                    break;
+                }
+                case EReductionType::HISTOGRAM:
+                    result.Histogram.assign(begin, begin + pass.ResultSize);
+                    break;
+                case EReductionType::UNIQUEIDS:
+                    result.UniqueIds.clear();
+                    for(uint32_t word = 0; word < pass.ResultSize; word++)
+                    {
+                        for(uint32_t bits = begin[word]; bits != 0; bits &= bits - 1)
+                        {
+                            result.UniqueIds.push_back((int32_t)(word * 32 + std::countr_zero(bits)));
+                        }
+                    }
+                    break;
+                case EReductionType::NONFINITE:
+                    result.NonFiniteCount = begin[0];
+                    break;
+            }
+        }
+        mResultsFrameNumber = slot.FrameNumber;
+        slot.Pending        = false;
+    }
+
+    void GBufferStats::Resize(const VkExtent2D&)
+    {
+        // Raster stage has recreated its images
+        CreateDescriptorSets();
+    }
+
+    void GBufferStats::Destroy()
+    {
+        if(!mContext)
+        {
+            return;
+        }
+        for(std::unique_ptr<Pass>& pass : mPasses)
+        {
+            if(pass->Pipeline)
+            {
+                vkDestroyPipeline(mContext->Device(), pass->Pipeline, nullptr);
+                pass->Pipeline = nullptr;
+            }
+            pass->PipelineLayout.Destroy();
+            for(foray::core::DescriptorSetHelper& descriptorSet : pass->DescriptorSets)
+            {
+                descriptorSet.Destroy();
+            }
+            pass->Shader.Destroy();
+        }
+        mPasses.clear();
+        mDeviceBuffer.Destroy();
+        for(Slot& slot : mSlots)
+        {
+            slot.Buffer.Destroy();
+            slot.Pending = false;
+        }
+        mResults.clear();
+    }
+}  // namespace cgbuffer
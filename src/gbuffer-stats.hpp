@@ -0,0 +1,159 @@
+#pragma once
+#include "conf-gbuffer.hpp"
+
+namespace cgbuffer {
+
+    /// @brief Optional compute stage recorded after CRaster::RecordFrame. Reduces CRaster outputs to small statistics, which are read back without copying the images
+    /// @details
+    /// How to use: Add Reductions, Build, Record after the raster stage, Get Results
+    ///  - Add Reductions: See GBufferStats::Reduction and GBufferStats::AddReduction()
+    ///  - Build: See GBufferStats::Build()
+    ///  - Get Results: Results are copied into a host visible buffer per frame slot. GetResults() returns the newest results the GPU has finished,
+    ///    which lag READBACK_SLOT_COUNT frames behind the frame being recorded.
+    /// Whether an output is reduced as float, int or uint is taken from OutputRecipe::Type. The depth output ("<name>.Depth") is reduced as float.
+    /// With multiple CRaster output sets, the set written by the current frame is reduced.
+    /// If the raster uses async compute (see CRaster::SetAsyncCompute()), reductions are recorded into the compute queues command buffer instead of cmdBuffer.
+    class GBufferStats : public foray::stages::RenderStage
+    {
+      public:
+        /// @brief Number of result slots. Must be at least the renderloops in flight frame count
+        inline static constexpr uint32_t READBACK_SLOT_COUNT = 3;
+        inline static constexpr uint32_t MAX_HISTOGRAM_BINS  = 256;
+
+        enum class EReductionType
+        {
+            /// @brief Minimum and maximum value
+            MINMAX,
+            /// @brief Value histogram with BinCount bins equally dividing [HistogramMin, HistogramMax]. Values outside are counted in the first/last bin
+            HISTOGRAM,
+            /// @brief Bitset of all ids in [0, IdCount) present in the output. Integer outputs only
+            UNIQUEIDS,
+            /// @brief Number of pixels with a NaN or infinite component. Float outputs only
+            NONFINITE,
+        };
+
+        /// @brief Configures a single reduction
+        struct Reduction
+        {
+            /// @brief Name of the CRaster output (as passed to CRaster::AddOutput) or the depth image name
+            std::string    OutputName = "";
+            EReductionType Type       = EReductionType::MINMAX;
+            /// @brief Component of the output reduced
+            uint32_t Channel = 0;
+            /// @brief If set, the vector length over all output components is reduced instead of Channel (e.g. for motion vectors)
+            bool Magnitude = false;
+            /// @brief If set, pixels equal to the recipes ClearValue are skipped (no geometry rasterized)
+            bool IgnoreClearValue = false;
+            /// @brief HISTOGRAM: Bin count (max MAX_HISTOGRAM_BINS)
+            uint32_t BinCount = 64;
+            /// @brief HISTOGRAM: Value range
+            float HistogramMin = 0.f;
+            float HistogramMax = 1.f;
+            /// @brief UNIQUEIDS: Size of the id range tracked
+            uint32_t IdCount = 1U << 16;
+        };
+
+        /// @brief Decoded result of a single reduction
+        struct ReductionResult
+        {
+            /// @brief MINMAX: False if no value passed the filters
+            bool   HasValues = false;
+            double Min       = 0.0;
+            double Max       = 0.0;
+            /// @brief HISTOGRAM: Pixel count per bin
+            std::vector<uint32_t> Histogram;
+            /// @brief UNIQUEIDS: Sorted list of ids present
+            std::vector<int32_t> UniqueIds;
+            /// @brief NONFINITE: Pixel count
+            uint32_t NonFiniteCount = 0;
+        };
+
+        /// @brief Add a reduction. Returns the index into GetResults()
+        /// @remarks MUST be called before Build()
+        uint32_t AddReduction(const Reduction& reduction);
+
+        virtual void Build(foray::core::Context* context, CRaster* raster, std::string_view name = "GBufferStats");
+
+        /// @brief Definitions gbufstats.comp is compiled with, for every reduction valid on one of the rasters outputs or its depth
+        /// @details Used by cgbuffer-recipec to embed the variants ahead of time (see PrecompiledShaderRegistry)
+        static std::vector<std::vector<std::string>> GetShaderDefinitions(const CRaster& raster);
+
+        virtual void RecordFrame(VkCommandBuffer cmdBuffer, foray::base::FrameRenderInfo& renderInfo) override;
+
+        /// @brief Rebinds the resized raster outputs
+        virtual void Resize(const VkExtent2D& extent) override;
+
+        virtual void Destroy() override;
+
+        /// @brief Newest results read back. Empty until the first readback has completed
+        inline const std::vector<ReductionResult>& GetResults() const { return mResults; }
+        /// @brief Frame number the results returned by GetResults() were rendered in
+        inline uint64_t GetResultsFrameNumber() const { return mResultsFrameNumber; }
+
+      protected:
+        enum class EInputType
+        {
+            FLOAT,
+            INT,
+            UINT,
+        };
+
+        /// @brief Push constant layout of gbufstats.comp
+        struct PushConstant
+        {
+            uint32_t          ResultOffset = 0;
+            uint32_t          Channel      = 0;
+            uint32_t          Magnitude    = 0;
+            uint32_t          BinCount     = 0;
+            float             HistogramMin = 0.f;
+            float             HistogramMax = 0.f;
+            uint32_t          IdCount      = 0;
+            uint32_t          IgnoreClear  = 0;
+            VkClearColorValue ClearValue   = {};
+        };
+
+        struct Pass
+        {
+            Reduction                        Config;
+            EInputType                       InputType    = EInputType::FLOAT;
+            uint32_t                         ChannelCount = 1;
+            uint32_t                         ResultOffset = 0;
+            uint32_t                         ResultSize   = 0;
+            PushConstant                     PushC        = {};
+            bool                             IsDepth      = false;
+            /// @brief Reduced image and its binding, per CRaster output set
+            foray::core::ManagedImage*       Images[CRaster::MAX_OUTPUT_SETS] = {};
+            foray::core::DescriptorSetHelper DescriptorSets[CRaster::MAX_OUTPUT_SETS];
+            foray::core::ShaderModule        Shader;
+            foray::util::PipelineLayout      PipelineLayout;
+            VkPipeline                       Pipeline = nullptr;
+        };
+
+        struct Slot
+        {
+            foray::core::ManagedBuffer Buffer;
+            uint64_t                   FrameNumber = 0;
+            bool                       Pending     = false;
+        };
+
+        static EInputType               GetInputType(CRaster::FragmentOutputType type);
+        static uint32_t                 GetChannelCount(CRaster::FragmentOutputType type);
+        static std::vector<std::string> GetPassShaderDefinitions(EReductionType type, EInputType inputType, uint32_t channelCount);
+
+        void SetupPasses();
+        void CreateBuffers();
+        void CreateDescriptorSets();
+        void CreatePipelines();
+        void ReadSlot(Slot& slot);
+
+        CRaster*                           mRaster = nullptr;
+        std::string                        mName   = "";
+        std::vector<std::unique_ptr<Pass>> mPasses;
+        uint32_t                           mResultWordCount = 0;
+        foray::core::ManagedBuffer         mDeviceBuffer;
+        Slot                               mSlots[READBACK_SLOT_COUNT];
+
+        std::vector<ReductionResult> mResults;
+        uint64_t                     mResultsFrameNumber = 0;
+    };
+}  // namespace cgbuffer
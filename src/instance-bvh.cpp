@@ -0,0 +1,456 @@
+#include "instance-bvh.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <scene/components/foray_meshinstance.hpp>
+#include <scene/components/foray_transform.hpp>
+#include <scene/foray_mesh.hpp>
+#include <scene/globalcomponents/foray_drawmanager.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace cgbuffer {
+
+    namespace {
+        // One camera per lane. Masks are all-ones / all-zero bit patterns in float lanes, like the SIMD compare results.
+#if defined(__AVX2__)
+        struct Lanes
+        {
+            static constexpr uint32_t Count = 8;
+            using F                         = __m256;
+
+            static inline F   Set1(float v) { return _mm256_set1_ps(v); }
+            static inline F   Load(const float* p) { return _mm256_loadu_ps(p); }
+            static inline F   Add(F a, F b) { return _mm256_add_ps(a, b); }
+            static inline F   Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+            static inline F   Lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+            static inline F   Or(F a, F b) { return _mm256_or_ps(a, b); }
+            static inline F   Neg(F a) { return _mm256_sub_ps(_mm256_setzero_ps(), a); }
+            static inline F   Zero() { return _mm256_setzero_ps(); }
+            static inline int MoveMask(F a) { return _mm256_movemask_ps(a); }
+        };
+#elif defined(__SSE2__) || defined(_M_X64)
+        struct Lanes
+        {
+            static constexpr uint32_t Count = 4;
+            using F                         = __m128;
+
+            static inline F   Set1(float v) { return _mm_set1_ps(v); }
+            static inline F   Load(const float* p) { return _mm_loadu_ps(p); }
+            static inline F   Add(F a, F b) { return _mm_add_ps(a, b); }
+            static inline F   Mul(F a, F b) { return _mm_mul_ps(a, b); }
+            static inline F   Lt(F a, F b) { return _mm_cmplt_ps(a, b); }
+            static inline F   Or(F a, F b) { return _mm_or_ps(a, b); }
+            static inline F   Neg(F a) { return _mm_sub_ps(_mm_setzero_ps(), a); }
+            static inline F   Zero() { return _mm_setzero_ps(); }
+            static inline int MoveMask(F a) { return _mm_movemask_ps(a); }
+        };
+#else
+        struct Lanes
+        {
+            static constexpr uint32_t Count = 1;
+            using F                         = float;
+
+            static inline F   Bits(uint32_t v) { return std::bit_cast<float>(v); }
+            static inline F   Set1(float v) { return v; }
+            static inline F   Load(const float* p) { return *p; }
+            static inline F   Add(F a, F b) { return a + b; }
+            static inline F   Mul(F a, F b) { return a * b; }
+            static inline F   Lt(F a, F b) { return Bits(a < b ? ~0U : 0U); }
+            static inline F   Or(F a, F b) { return Bits(std::bit_cast<uint32_t>(a) | std::bit_cast<uint32_t>(b)); }
+            static inline F   Neg(F a) { return -a; }
+            static inline F   Zero() { return 0.f; }
+            static inline int MoveMask(F a) { return std::bit_cast<uint32_t>(a) >> 31; }
+        };
+#endif
+
+        // Frustum planes of up to Lanes::Count cameras, structure of arrays. Plane normals point inwards, AbsN holds |N| for the box extent projection
+        struct FrustumBatch
+        {
+            alignas(32) float N[6][3][Lanes::Count];
+            alignas(32) float AbsN[6][3][Lanes::Count];
+            alignas(32) float D[6][Lanes::Count];
+        };
+
+        // Gribb / Hartmann plane extraction for clip space x, y in [-w, w]. The near plane uses z >= -w, which is exact for OpenGL style projections
+        // and conservative for z in [0, w]. Planes are not normalized, as only signs are compared
+        void ExtractPlanes(const glm::mat4& m, glm::vec4 planes[6])
+        {
+            glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+            glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+            glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+            glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+            planes[0] = row3 + row0;
+            planes[1] = row3 - row0;
+            planes[2] = row3 + row1;
+            planes[3] = row3 - row1;
+            planes[4] = row3 + row2;
+            planes[5] = row3 - row2;
+        }
+
+        // Returns the lanes (cameras) the box is entirely outside of, and in partial the lanes it intersects a plane of
+        inline int TestBox(const FrustumBatch& batch, const glm::vec3& min, const glm::vec3& max, int& partial)
+        {
+            glm::vec3 center = (min + max) * 0.5f;
+            glm::vec3 extent = (max - min) * 0.5f;
+
+            Lanes::F outside   = Lanes::Zero();
+            Lanes::F intersect = Lanes::Zero();
+            for(uint32_t p = 0; p < 6; p++)
+            {
+                Lanes::F dist = Lanes::Load(batch.D[p]);
+                Lanes::F r    = Lanes::Zero();
+                for(uint32_t axis = 0; axis < 3; axis++)
+                {
+                    dist = Lanes::Add(dist, Lanes::Mul(Lanes::Load(batch.N[p][axis]), Lanes::Set1(center[axis])));
+                    r    = Lanes::Add(r, Lanes::Mul(Lanes::Load(batch.AbsN[p][axis]), Lanes::Set1(extent[axis])));
+                }
+                outside   = Lanes::Or(outside, Lanes::Lt(dist, Lanes::Neg(r)));
+                intersect = Lanes::Or(intersect, Lanes::Lt(dist, r));
+            }
+            int outsideMask = Lanes::MoveMask(outside);
+            partial         = Lanes::MoveMask(intersect) & ~outsideMask;
+            return outsideMask;
+        }
+    }  // namespace
+
+    void InstanceBvh::Build(foray::scene::Scene* scene, const MeshLods* bounds, uint32_t threadCount)
+    {
+        Destroy();
+        foray::Assert(!!bounds, "InstanceBvh requires MeshLods as source of object space bounds");
+        mScene     = scene;
+        mBounds    = bounds;
+        mPool      = std::make_unique<WorkerPool>(threadCount);
+        mSignature = 0;
+    }
+
+    uint64_t InstanceBvh::Gather()
+    {
+        // FNV-1a over the instance layout, detects added / removed / reordered instances
+        uint64_t signature = 0xCBF29CE484222325ULL;
+        auto     hash      = [&](uint64_t value) {
+            signature ^= value;
+            signature *= 0x100000001B3ULL;
+        };
+
+        auto drawDirector = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+        for(const foray::scene::gcomp::DrawDirector::DrawOp& drawOp : drawDirector->GetDrawOps())
+        {
+            hash((uint64_t)(uintptr_t)drawOp.Target);
+            hash(drawOp.TransformOffset);
+            for(foray::scene::ncomp::MeshInstance* instance : drawOp.Instances)
+            {
+                hash((uint64_t)(uintptr_t)instance);
+            }
+        }
+        return signature;
+    }
+
+    void InstanceBvh::Update()
+    {
+        foray::Assert(!!mScene, "InstanceBvh must be built before updating");
+
+        uint64_t signature = Gather();
+        mStats.Rebuilt     = signature != mSignature;
+        if(mStats.Rebuilt)
+        {
+            mSignature = signature;
+            Rebuild();
+        }
+        else
+        {
+            RefitInstances();
+            RefitNodes();
+        }
+        mStats.InstanceCount = (uint32_t)mInstances.size();
+        mStats.NodeCount     = (uint32_t)mNodes.size();
+    }
+
+    void InstanceBvh::Rebuild()
+    {
+        mInstances.clear();
+        mLocalBounds.clear();
+        mUnbounded.clear();
+        mOrder.clear();
+        mNodes.clear();
+        mTaskRoots.clear();
+        mTopNodes.clear();
+
+        // Object space bounds per mesh: Union of the primitives bounding spheres
+        auto            drawDirector = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+        const auto&     drawOps      = drawDirector->GetDrawOps();
+        constexpr float unbounded    = std::numeric_limits<float>::infinity();
+        for(uint32_t opIndex = 0; opIndex < drawOps.size(); opIndex++)
+        {
+            const foray::scene::gcomp::DrawDirector::DrawOp& drawOp = drawOps[opIndex];
+
+            Aabb        meshBounds{glm::vec3(unbounded), glm::vec3(-unbounded)};
+            const auto& primitives = drawOp.Target->GetPrimitives();
+            for(uint32_t primitiveIndex = 0; primitiveIndex < primitives.size(); primitiveIndex++)
+            {
+                const MeshLods::PrimitiveLods* lods = mBounds->Find(drawOp.Target, primitiveIndex);
+                if(!lods)
+                {
+                    meshBounds = Aabb{glm::vec3(-unbounded), glm::vec3(unbounded)};
+                    break;
+                }
+                meshBounds.Min = glm::min(meshBounds.Min, lods->Center - glm::vec3(lods->Radius));
+                meshBounds.Max = glm::max(meshBounds.Max, lods->Center + glm::vec3(lods->Radius));
+            }
+
+            for(uint32_t instanceIndex = 0; instanceIndex < drawOp.Instances.size(); instanceIndex++)
+            {
+                mInstances.push_back(Instance{.DrawOpIndex = opIndex, .InstanceIndex = instanceIndex, .TransformIndex = drawOp.TransformOffset + instanceIndex});
+                mLocalBounds.push_back(meshBounds);
+            }
+        }
+        mWorldBounds.resize(mInstances.size());
+        RefitInstances();
+
+        for(uint32_t i = 0; i < mInstances.size(); i++)
+        {
+            const Aabb& bounds = mLocalBounds[i];
+            bool        finite = std::isfinite(bounds.Min.x) && std::isfinite(bounds.Max.x) && bounds.Min.x <= bounds.Max.x;
+            (finite ? mOrder : mUnbounded).push_back(i);
+        }
+
+        if(!mOrder.empty())
+        {
+            mNodes.reserve(mOrder.size() * 2 / LEAF_SIZE + 1);
+            BuildNode(0, (uint32_t)mOrder.size(), 0);
+            // Parents precede their children, so refitting in reverse depth first order sees children first
+            std::reverse(mTopNodes.begin(), mTopNodes.end());
+            RefitNodes();
+        }
+    }
+
+    uint32_t InstanceBvh::BuildNode(uint32_t first, uint32_t count, uint32_t depth)
+    {
+        uint32_t index = (uint32_t)mNodes.size();
+        mNodes.push_back(Node{.First = first, .Count = count});
+
+        bool leaf = count <= LEAF_SIZE;
+        if((leaf && depth <= TASK_DEPTH) || depth == TASK_DEPTH)
+        {
+            mTaskRoots.push_back(index);
+        }
+        else if(depth < TASK_DEPTH)
+        {
+            mTopNodes.push_back(index);
+        }
+
+        if(!leaf)
+        {
+            // Median split along the longest axis of the centroid bounds
+            glm::vec3 centroidMin(std::numeric_limits<float>::max());
+            glm::vec3 centroidMax(std::numeric_limits<float>::lowest());
+            for(uint32_t i = first; i < first + count; i++)
+            {
+                const Aabb& bounds = mWorldBounds[mOrder[i]];
+                glm::vec3   center = (bounds.Min + bounds.Max) * 0.5f;
+                centroidMin        = glm::min(centroidMin, center);
+                centroidMax        = glm::max(centroidMax, center);
+            }
+            glm::vec3 size = centroidMax - centroidMin;
+            int       axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+            uint32_t half = count / 2;
+            std::nth_element(mOrder.begin() + first, mOrder.begin() + first + half, mOrder.begin() + first + count, [&](uint32_t a, uint32_t b) {
+                return mWorldBounds[a].Min[axis] + mWorldBounds[a].Max[axis] < mWorldBounds[b].Min[axis] + mWorldBounds[b].Max[axis];
+            });
+
+            BuildNode(first, half, depth + 1);
+            uint32_t right      = BuildNode(first + half, count - half, depth + 1);
+            mNodes[index].Right = right;
+        }
+        mNodes[index].End = (uint32_t)mNodes.size();
+        return index;
+    }
+
+    void InstanceBvh::RefitInstances()
+    {
+        constexpr uint32_t chunkSize  = 256;
+        uint32_t           chunkCount = ((uint32_t)mInstances.size() + chunkSize - 1) / chunkSize;
+
+        auto        drawDirector = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+        const auto& drawOps      = drawDirector->GetDrawOps();
+
+        mPool->ParallelFor(chunkCount, [&](uint32_t chunkIndex, uint32_t) {
+            uint32_t end = std::min((uint32_t)mInstances.size(), (chunkIndex + 1) * chunkSize);
+            for(uint32_t i = chunkIndex * chunkSize; i < end; i++)
+            {
+                const Instance&  instance = mInstances[i];
+                const glm::mat4& model    = drawOps[instance.DrawOpIndex].Instances[instance.InstanceIndex]->GetNode()->GetTransform()->GetGlobalMatrix();
+
+                // Transformed box (Arvo): Center is transformed, the extent is projected onto the absolute basis vectors
+                const Aabb& local  = mLocalBounds[i];
+                glm::vec3   center = glm::vec3(model * glm::vec4((local.Min + local.Max) * 0.5f, 1.f));
+                glm::vec3   extent = (local.Max - local.Min) * 0.5f;
+                glm::vec3   world  = glm::abs(glm::vec3(model[0])) * extent.x + glm::abs(glm::vec3(model[1])) * extent.y + glm::abs(glm::vec3(model[2])) * extent.z;
+                mWorldBounds[i]    = Aabb{center - world, center + world};
+            }
+        });
+    }
+
+    void InstanceBvh::RefitNodes()
+    {
+        mPool->ParallelFor((uint32_t)mTaskRoots.size(), [&](uint32_t rootIndex, uint32_t) { RefitRange(mTaskRoots[rootIndex]); });
+        for(uint32_t index : mTopNodes)
+        {
+            Node& node      = mNodes[index];
+            node.Bounds.Min = glm::min(mNodes[index + 1].Bounds.Min, mNodes[node.Right].Bounds.Min);
+            node.Bounds.Max = glm::max(mNodes[index + 1].Bounds.Max, mNodes[node.Right].Bounds.Max);
+        }
+    }
+
+    void InstanceBvh::RefitRange(uint32_t root)
+    {
+        for(uint32_t index = mNodes[root].End; index-- > root;)
+        {
+            Node& node = mNodes[index];
+            if(node.Right == 0)
+            {
+                node.Bounds = mWorldBounds[mOrder[node.First]];
+                for(uint32_t i = node.First + 1; i < node.First + node.Count; i++)
+                {
+                    node.Bounds.Min = glm::min(node.Bounds.Min, mWorldBounds[mOrder[i]].Min);
+                    node.Bounds.Max = glm::max(node.Bounds.Max, mWorldBounds[mOrder[i]].Max);
+                }
+            }
+            else
+            {
+                node.Bounds.Min = glm::min(mNodes[index + 1].Bounds.Min, mNodes[node.Right].Bounds.Min);
+                node.Bounds.Max = glm::max(mNodes[index + 1].Bounds.Max, mNodes[node.Right].Bounds.Max);
+            }
+        }
+    }
+
+    void InstanceBvh::Query(std::span<const glm::mat4> projectionViews, std::vector<std::vector<uint32_t>>& visible)
+    {
+        uint32_t cameraCount = (uint32_t)projectionViews.size();
+        uint32_t batchCount  = (cameraCount + Lanes::Count - 1) / Lanes::Count;
+        uint32_t rootCount   = (uint32_t)mTaskRoots.size();
+
+        visible.resize(cameraCount);
+
+        // Every task (camera batch x subtree) collects into its own lists, concatenated per camera afterwards
+        mTaskResults.resize((size_t)batchCount * rootCount * Lanes::Count);
+        mPool->ParallelFor(batchCount * rootCount, [&](uint32_t task, uint32_t) {
+            uint32_t batch = task / rootCount;
+            uint32_t root  = task % rootCount;
+            QueryTask(projectionViews.data() + batch * Lanes::Count, std::min(Lanes::Count, cameraCount - batch * Lanes::Count), mTaskRoots[root],
+                      &mTaskResults[(size_t)task * Lanes::Count]);
+        });
+
+        mPool->ParallelFor(cameraCount, [&](uint32_t camera, uint32_t) {
+            std::vector<uint32_t>& result = visible[camera];
+            result.assign(mUnbounded.begin(), mUnbounded.end());
+            uint32_t batch = camera / Lanes::Count;
+            uint32_t lane  = camera % Lanes::Count;
+            for(uint32_t root = 0; root < rootCount; root++)
+            {
+                const std::vector<uint32_t>& taskResult = mTaskResults[((size_t)batch * rootCount + root) * Lanes::Count + lane];
+                result.insert(result.end(), taskResult.begin(), taskResult.end());
+            }
+            // Ascending instance order keeps draw list gathering deterministic
+            std::sort(result.begin(), result.end());
+        });
+    }
+
+    void InstanceBvh::QueryTask(const glm::mat4* projectionViews, uint32_t cameraCount, uint32_t root, std::vector<uint32_t>* visible) const
+    {
+        FrustumBatch batch{};
+        for(uint32_t lane = 0; lane < Lanes::Count; lane++)
+        {
+            visible[lane].clear();
+            // Unused lanes repeat the last camera, their results are ignored
+            glm::vec4 planes[6];
+            ExtractPlanes(projectionViews[std::min(lane, cameraCount - 1)], planes);
+            for(uint32_t p = 0; p < 6; p++)
+            {
+                for(uint32_t axis = 0; axis < 3; axis++)
+                {
+                    batch.N[p][axis][lane]    = planes[p][axis];
+                    batch.AbsN[p][axis][lane] = std::abs(planes[p][axis]);
+                }
+                batch.D[p][lane] = planes[p].w;
+            }
+        }
+
+        auto appendRange = [&](uint32_t first, uint32_t count, int mask) {
+            for(uint32_t lane = 0; lane < cameraCount; lane++)
+            {
+                if(mask & (1 << lane))
+                {
+                    visible[lane].insert(visible[lane].end(), mOrder.begin() + first, mOrder.begin() + first + count);
+                }
+            }
+        };
+
+        struct Entry
+        {
+            uint32_t Node;
+            int      Mask;
+        };
+        Entry    stack[64];
+        uint32_t stackSize = 0;
+        stack[stackSize++] = Entry{root, (1 << cameraCount) - 1};
+
+        while(stackSize > 0)
+        {
+            Entry       entry = stack[--stackSize];
+            const Node& node  = mNodes[entry.Node];
+
+            int partial = 0;
+            int outside = TestBox(batch, node.Bounds.Min, node.Bounds.Max, partial);
+            int active  = entry.Mask & ~outside;
+            partial &= active;
+
+            // Cameras containing the node entirely take its whole instance range without further tests
+            appendRange(node.First, node.Count, active & ~partial);
+            if(!partial)
+            {
+                continue;
+            }
+
+            if(node.Right == 0)
+            {
+                for(uint32_t i = node.First; i < node.First + node.Count; i++)
+                {
+                    const Aabb& bounds = mWorldBounds[mOrder[i]];
+                    int         unused = 0;
+                    int         mask   = partial & ~TestBox(batch, bounds.Min, bounds.Max, unused);
+                    appendRange(i, 1, mask);
+                }
+            }
+            else
+            {
+                stack[stackSize++] = Entry{node.Right, partial};
+                stack[stackSize++] = Entry{entry.Node + 1, partial};
+            }
+        }
+    }
+
+    void InstanceBvh::Destroy()
+    {
+        mPool      = nullptr;
+        mScene     = nullptr;
+        mBounds    = nullptr;
+        mSignature = 0;
+        mStats     = Stats{};
+        mInstances.clear();
+        mLocalBounds.clear();
+        mWorldBounds.clear();
+        mUnbounded.clear();
+        mOrder.clear();
+        mNodes.clear();
+        mTaskRoots.clear();
+        mTopNodes.clear();
+        mTaskResults.clear();
+    }
+}  // namespace cgbuffer
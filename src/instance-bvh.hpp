@@ -0,0 +1,111 @@
+#pragma once
+#include "mesh-lod.hpp"
+#include "worker-pool.hpp"
+#include <span>
+
+namespace cgbuffer {
+
+    /// @brief Bounding volume hierarchy over the mesh instances of the scenes DrawDirector, for frustum culling many cameras per frame
+    /// @details
+    /// How to use: Build, Update every frame, Query, pass the visible lists to CRaster::SetVisibleInstances()
+    ///  - Build: Binds the scene and the object space bounds (bounding spheres of MeshLods) and allocates the worker threads
+    ///  - Update: Refits the node bounds to the current transforms in parallel. The topology is rebuilt only if the DrawDirectors instances changed
+    ///  - Query: Culls the hierarchy against several camera frustums at once (one camera per SIMD lane, 8 with AVX2, 4 with SSE2),
+    ///    parallelized over camera batches and subtrees. Returns one sorted list of visible instance indices per camera
+    /// Instances of meshes without bounds (not indexed, or missing from the MeshLods) are reported visible for every camera.
+    class InstanceBvh
+    {
+      public:
+        /// @brief Max instances per leaf
+        inline static constexpr uint32_t LEAF_SIZE = 4;
+        /// @brief Depth of the subtree roots refits and queries are parallelized over (up to 2^depth tasks)
+        inline static constexpr uint32_t TASK_DEPTH = 5;
+
+        /// @brief Mesh instance, in DrawDirector draw op order
+        struct Instance
+        {
+            uint32_t DrawOpIndex    = 0;
+            uint32_t InstanceIndex  = 0;
+            uint32_t TransformIndex = 0;
+        };
+
+        /// @brief Counters of the last Update()
+        struct Stats
+        {
+            uint32_t InstanceCount = 0;
+            uint32_t NodeCount     = 0;
+            /// @brief True if the topology was rebuilt instead of refitted
+            bool Rebuilt = false;
+        };
+
+        InstanceBvh() = default;
+        InstanceBvh(const InstanceBvh&)            = delete;
+        InstanceBvh& operator=(const InstanceBvh&) = delete;
+
+        /// @param bounds Source of the object space bounds. Must outlive the hierarchy
+        /// @param threadCount Worker count including the calling thread. 0 selects std::thread::hardware_concurrency()
+        void Build(foray::scene::Scene* scene, const MeshLods* bounds, uint32_t threadCount = 0);
+
+        /// @brief Refits (or rebuilds) to the current transforms. Call after the scene has been updated for the frame
+        void Update();
+
+        /// @brief Frustum culls the instances for every camera
+        /// @param projectionViews ProjectionView matrix per camera
+        /// @param visible Resized to one list per camera, filled with ascending indices into GetInstances()
+        void Query(std::span<const glm::mat4> projectionViews, std::vector<std::vector<uint32_t>>& visible);
+
+        inline const std::vector<Instance>& GetInstances() const { return mInstances; }
+        inline const Stats&                 GetStats() const { return mStats; }
+
+        void Destroy();
+
+      protected:
+        struct Aabb
+        {
+            glm::vec3 Min = glm::vec3(0.f);
+            glm::vec3 Max = glm::vec3(0.f);
+        };
+
+        /// @brief Nodes are stored in depth first order: The left child directly follows its parent, a subtree spans [node, End)
+        struct Node
+        {
+            Aabb     Bounds;
+            /// @brief Range in mOrder covered by the subtree
+            uint32_t First = 0;
+            uint32_t Count = 0;
+            /// @brief Index of the right child. 0 for leaves
+            uint32_t Right = 0;
+            uint32_t End   = 0;
+        };
+
+        uint64_t Gather();
+        void     Rebuild();
+        uint32_t BuildNode(uint32_t first, uint32_t count, uint32_t depth);
+        void     RefitInstances();
+        void     RefitNodes();
+        void     RefitRange(uint32_t root);
+        void     QueryTask(const glm::mat4* projectionViews, uint32_t cameraCount, uint32_t root, std::vector<uint32_t>* visible) const;
+
+        foray::scene::Scene*        mScene  = nullptr;
+        const MeshLods*             mBounds = nullptr;
+        std::unique_ptr<WorkerPool> mPool;
+        uint64_t                    mSignature = 0;
+        Stats                       mStats;
+
+        std::vector<Instance> mInstances;
+        /// @brief Per instance: Object space bounds (of its mesh), world space bounds
+        std::vector<Aabb>     mLocalBounds;
+        std::vector<Aabb>     mWorldBounds;
+        /// @brief Instances without bounds, visible to every camera
+        std::vector<uint32_t> mUnbounded;
+        /// @brief Instance indices in leaf order
+        std::vector<uint32_t> mOrder;
+        std::vector<Node>     mNodes;
+        /// @brief Subtrees refitted and queried in parallel, and the nodes above them (refitted last, in reverse depth first order)
+        std::vector<uint32_t> mTaskRoots;
+        std::vector<uint32_t> mTopNodes;
+
+        /// @brief Per query task and camera
+        std::vector<std::vector<uint32_t>> mTaskResults;
+    };
+}  // namespace cgbuffer
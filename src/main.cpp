@@ -1,8 +1,16 @@
+#include "backend-comparison.hpp"
 #include "conf-gbuffer.hpp"
+#include "recipe-file.hpp"
+#include "scene-cache.hpp"
+#include <scene/globalcomponents/foray_cameramanager.hpp>
 
 namespace cgbuffer {
     class GBufferTestApp : public foray::base::DefaultAppBase
     {
+      public:
+        /// @brief Renders the first frames camera with CRaster and CpuRaster once and logs how far the outputs differ (see BackendComparison)
+        inline void SetCompareBackends(bool compare) { mCompareBackends = compare; }
+
       protected:
         virtual void ApiBeforeInit() override;
         virtual void ApiBeforeDeviceSelection(vkb::PhysicalDeviceSelector& pds) override;
@@ -14,14 +22,25 @@ namespace cgbuffer {
         virtual void ApiDestroy() override;
 
         CRaster                              mGBufferStage;
+        MeshLods                             mMeshLods;
+        InstanceBvh                          mInstanceBvh;
+        std::vector<std::vector<uint32_t>>   mVisibleInstances;
         foray::stages::ImageToSwapchainStage mSwapCopy;
+        AsyncCompute                         mAsyncCompute;
+        SceneCache                           mSceneCache;
         struct
         {
             VkPhysicalDeviceBufferDeviceAddressFeatures   BufferDeviceAdressFeatures = {};
             VkPhysicalDeviceDescriptorIndexingFeaturesEXT DescriptorIndexingFeatures = {};
             VkPhysicalDeviceSynchronization2Features      Sync2FEatures              = {};
+            VkPhysicalDeviceTimelineSemaphoreFeatures     TimelineSemaphoreFeatures  = {};
         } mDeviceFeatures = {};
         std::unique_ptr<foray::scene::Scene> mScene;
+        RecipeFile                           mRecipe;
+        bool                                 mCompareBackends = false;
+
+        /// @brief Frames the renderloop of DefaultAppBase keeps in flight
+        inline static constexpr uint32_t FRAMES_IN_FLIGHT = 2;
     };
 
     void GBufferTestApp::ApiBeforeInit()
@@ -61,6 +80,9 @@ namespace cgbuffer {
                                                     VK_KHR_RELAXED_BLOCK_LAYOUT_EXTENSION_NAME, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME};
         deviceSelector.add_required_extensions(requiredExtensions);
 
+        // Lets AsyncCompute compare timestamps of the graphics and compute queue
+        deviceSelector.add_desired_extension(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+
         // Enable samplerAnisotropy
         VkPhysicalDeviceFeatures deviceFeatures{};
         deviceFeatures.samplerAnisotropy = VK_TRUE;
@@ -77,17 +99,22 @@ namespace cgbuffer {
 
         mDeviceFeatures.Sync2FEatures = {.sType = VkStructureType::VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES, .synchronization2 = VK_TRUE};
 
+        mDeviceFeatures.TimelineSemaphoreFeatures = {.sType = VkStructureType::VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES, .timelineSemaphore = VK_TRUE};
+
         deviceBuilder.add_pNext(&mDeviceFeatures.BufferDeviceAdressFeatures);
         deviceBuilder.add_pNext(&mDeviceFeatures.DescriptorIndexingFeatures);
         deviceBuilder.add_pNext(&mDeviceFeatures.Sync2FEatures);
+        deviceBuilder.add_pNext(&mDeviceFeatures.TimelineSemaphoreFeatures);
     }
     void GBufferTestApp::ApiInit()
     {
         mScene = std::make_unique<foray::scene::Scene>(&mContext);
 
-        foray::gltf::ModelConverter converter(mScene.get());
-        converter.LoadGltfModel(SCENE_DIR);
+        // Loaded from a binary cache next to the glTF if it is up to date, the cache is (re)written otherwise
+        mSceneCache.Load(&mContext, mScene.get(), SCENE_DIR, std::string(SCENE_DIR) + ".cgbcache");
         mScene->UseDefaultCamera(true);
+        mMeshLods.Build(&mContext, mScene.get());
+        mInstanceBvh.Build(mScene.get(), &mMeshLods);
 
         CRaster::OutputRecipe flatRedOnBlack{.Type = CRaster::FragmentOutputType::VEC4, .ImageFormat = VkFormat::VK_FORMAT_R16G16B16A16_SFLOAT, .Result = "1, 0, 0, 1"};
         // mGBufferStage.AddOutput("flatRedOnBlack", flatRedOnBlack);
@@ -99,15 +126,22 @@ namespace cgbuffer {
         normalMapping.EnableBuiltInFeature(CRaster::BuiltInFeaturesFlagBits::NORMALMAPPING);
         // mGBufferStage.AddOutput("normalMapping", normalMapping);
         // mGBufferStage.AddOutput("albedo", CRaster::Templates::Albedo);
-        mGBufferStage.AddOutput("pos", CRaster::Templates::WorldPos);
-        mGBufferStage.AddOutput("normal", CRaster::Templates::WorldNormal);
-        mGBufferStage.AddOutput("motion", CRaster::Templates::WorldMotion);
-        mGBufferStage.AddOutput("scrmotion", CRaster::Templates::ScreenMotion);
-        mGBufferStage.AddOutput("matid", CRaster::Templates::MaterialId);
-        mGBufferStage.AddOutput("meshid", CRaster::Templates::MeshInstanceId);
-        mGBufferStage.AddOutput("uv", CRaster::Templates::UV);
-        mGBufferStage.AddOutput("depth", CRaster::Templates::DepthAndDerivative);
-        mGBufferStage.EnableBuiltInFeature(CRaster::BuiltInFeaturesFlagBits::ALPHATEST);
+
+        // Layout is described by recipes/default.json. If compiled ahead of time (CGBUFFER_RECIPE_FILES), the embedded copy is used
+        if(!RecipeFile::LoadEmbedded("default", mRecipe))
+        {
+            mRecipe = RecipeFile::Load("recipes/default.json");
+        }
+        mRecipe.ApplyTo(mGBufferStage);
+        mGBufferStage.SetSortDraws(true);
+        mGBufferStage.SetMeshLods(&mMeshLods);
+
+        // Depth derived outputs are evaluated on the compute queue, overlapping with the next frame (if the device has a separate compute queue family).
+        // The next frame only starts rasterizing before the compute work has finished if it writes another output set.
+        // No graphics work reads the outputs evaluated on the compute queue, so they are not returned to the graphics queue
+        mAsyncCompute.Create(&mContext);
+        mGBufferStage.SetOutputSetCount(FRAMES_IN_FLIGHT, FRAMES_IN_FLIGHT);
+        mGBufferStage.SetAsyncCompute(&mAsyncCompute, VK_PIPELINE_STAGE_2_NONE);
 
         mGBufferStage.Build(&mContext, mScene.get());
 
@@ -122,14 +156,38 @@ namespace cgbuffer {
     {
         foray::core::DeviceSyncCommandBuffer& cb = renderInfo.GetPrimaryCommandBuffer();
         cb.Begin();
+        mAsyncCompute.BeginFrame(cb, renderInfo.GetFrameNumber());
         mScene->Update(renderInfo, cb);
 
+        // Single camera here. Further cameras (probes, captures) are culled in the same query, one list each
+        auto      cameraManager  = mScene->GetComponent<foray::scene::gcomp::CameraManager>();
+        glm::mat4 projectionView = cameraManager->GetUbo().GetData().ProjectionViewMatrix;
+        if(mCompareBackends)
+        {
+            // Renders and reads back synchronously, independent of the frame being recorded
+            mCompareBackends = false;
+            const auto&         ubo = cameraManager->GetUbo().GetData();
+            CRaster::PoseCamera camera{.ViewMatrix = ubo.ViewMatrix, .ProjectionMatrix = ubo.ProjectionMatrix};
+            BackendComparison   comparison;
+            comparison.Build(&mContext, mScene.get(), mRecipe, mGBufferStage.GetRenderExtent());
+            comparison.Run(std::span<const CRaster::PoseCamera>(&camera, 1));
+            comparison.LogResults();
+            comparison.Destroy();
+        }
+        mInstanceBvh.Update();
+        mInstanceBvh.Query(std::span<const glm::mat4>(&projectionView, 1), mVisibleInstances);
+        mGBufferStage.SetVisibleInstances(&mInstanceBvh, &mVisibleInstances[0]);
+
         mGBufferStage.RecordFrame(cb, renderInfo);
+        // Every frame writes another output set
+        mSwapCopy.SetSrcImage(mGBufferStage.GetImageOutput("normal"));
         mSwapCopy.RecordFrame(cb, renderInfo);
 
         renderInfo.PrepareSwapchainImageForPresent(cb);
+        mAsyncCompute.EndFrame(cb);
         cb.End();
         cb.Submit();
+        mAsyncCompute.Submit();
     }
     void GBufferTestApp::ApiOnEvent(const foray::osi::Event* event)
     {
@@ -140,6 +198,10 @@ namespace cgbuffer {
         mScene = nullptr;
         mGBufferStage.Destroy();
         mSwapCopy.Destroy();
+        mAsyncCompute.Destroy();
+        mInstanceBvh.Destroy();
+        mMeshLods.Destroy();
+        mSceneCache.Destroy();
     }
 }  // namespace cgbuffer
 
@@ -147,5 +209,12 @@ int main(int argc, char** argv)
 {
     foray::osi::OverrideCurrentWorkingDirectory(CWD_OVERRIDE);
     cgbuffer::GBufferTestApp testApp;
+    for(int i = 1; i < argc; i++)
+    {
+        if(std::string_view(argv[i]) == "--compare-backends")
+        {
+            testApp.SetCompareBackends(true);
+        }
+    }
     return testApp.Run();
 }
\ No newline at end of file
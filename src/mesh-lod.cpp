@@ -0,0 +1,364 @@
+#include "mesh-lod.hpp"
+#include "worker-pool.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <scene/foray_mesh.hpp>
+#include <scene/globalcomponents/foray_drawmanager.hpp>
+#include <scene/globalcomponents/foray_geometrymanager.hpp>
+
+namespace cgbuffer {
+
+    void MeshLods::SimplifyClustered(std::span<const glm::vec3> positions,
+                                     std::span<const uint32_t>  indices,
+                                     const glm::vec3&           boundsMin,
+                                     const glm::vec3&           boundsMax,
+                                     uint32_t                   gridResolution,
+                                     std::vector<uint32_t>&     out)
+    {
+        out.clear();
+
+        glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(1e-20f));
+        glm::vec3 scale  = glm::vec3((float)gridResolution) / extent;
+
+        auto cellOf = [&](const glm::vec3& pos) {
+            glm::uvec3 cell = glm::uvec3(glm::clamp(glm::ivec3((pos - boundsMin) * scale), glm::ivec3(0), glm::ivec3((int32_t)gridResolution - 1)));
+            return (uint64_t)cell.x + (uint64_t)gridResolution * ((uint64_t)cell.y + (uint64_t)gridResolution * (uint64_t)cell.z);
+        };
+
+        // Pass 1: Cluster means
+        struct Cluster
+        {
+            glm::vec3 Sum            = glm::vec3(0.f);
+            uint32_t  Count          = 0;
+            uint32_t  Representative = ~0U;
+            float     BestDistance   = 0.f;
+        };
+        std::unordered_map<uint64_t, Cluster> clusters;
+        clusters.reserve(indices.size() / 3);
+
+        std::vector<uint32_t> vertices(indices.begin(), indices.end());
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+
+        for(uint32_t vertex : vertices)
+        {
+            Cluster& cluster = clusters[cellOf(positions[vertex])];
+            cluster.Sum += positions[vertex];
+            cluster.Count++;
+        }
+
+        // Pass 2: Source vertex closest to the mean represents the cluster, keeping its attributes
+        std::unordered_map<uint32_t, uint32_t> remap;
+        remap.reserve(vertices.size());
+        for(uint32_t vertex : vertices)
+        {
+            Cluster&  cluster  = clusters[cellOf(positions[vertex])];
+            glm::vec3 delta    = positions[vertex] - cluster.Sum / (float)cluster.Count;
+            float     distance = glm::dot(delta, delta);
+            if(cluster.Representative == ~0U || distance < cluster.BestDistance)
+            {
+                cluster.Representative = vertex;
+                cluster.BestDistance   = distance;
+            }
+        }
+        for(uint32_t vertex : vertices)
+        {
+            remap[vertex] = clusters[cellOf(positions[vertex])].Representative;
+        }
+
+        // Pass 3: Remap triangles, drop collapsed ones, deduplicate (rotated so the smallest index comes first, which preserves winding)
+        std::vector<std::array<uint32_t, 3>> triangles;
+        triangles.reserve(indices.size() / 3);
+        for(size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            std::array<uint32_t, 3> tri{remap[indices[i]], remap[indices[i + 1]], remap[indices[i + 2]]};
+            if(tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2])
+            {
+                continue;
+            }
+            while(tri[0] > tri[1] || tri[0] > tri[2])
+            {
+                tri = {tri[1], tri[2], tri[0]};
+            }
+            triangles.push_back(tri);
+        }
+        std::sort(triangles.begin(), triangles.end());
+        triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+
+        out.reserve(triangles.size() * 3);
+        for(const std::array<uint32_t, 3>& tri : triangles)
+        {
+            out.insert(out.end(), tri.begin(), tri.end());
+        }
+    }
+
+    void MeshLods::Build(foray::core::Context* context, foray::scene::Scene* scene, const Config& config)
+    {
+        Destroy();
+        mContext = context;
+        mConfig  = config;
+        FORAY_ASSERTFMT(config.LodCount >= 1 && config.LodCount <= MAX_LOD_COUNT, "LOD count must be in [1, {}]", MAX_LOD_COUNT);
+
+        auto geometryStore = scene->GetComponent<foray::scene::gcomp::GeometryStore>();
+        auto drawDirector  = scene->GetComponent<foray::scene::gcomp::DrawDirector>();
+
+        std::vector<uint8_t> vertexBytes;
+        std::vector<uint8_t> indexBytes;
+        Download(geometryStore->GetVerticesBuffer(), vertexBytes);
+        Download(geometryStore->GetIndicesBuffer(), indexBytes);
+
+        std::span<const foray::scene::Vertex> vertices(reinterpret_cast<const foray::scene::Vertex*>(vertexBytes.data()), vertexBytes.size() / sizeof(foray::scene::Vertex));
+        std::span<const uint32_t>             sourceIndices(reinterpret_cast<const uint32_t*>(indexBytes.data()), indexBytes.size() / sizeof(uint32_t));
+
+        std::vector<glm::vec3> positions(vertices.size());
+        for(size_t i = 0; i < vertices.size(); i++)
+        {
+            positions[i] = vertices[i].Pos;
+        }
+
+        struct Job
+        {
+            const foray::scene::Primitive* Primitive = nullptr;
+            uint32_t                       Slot      = 0;
+        };
+        std::vector<Job> jobs;
+        for(const foray::scene::gcomp::DrawDirector::DrawOp& drawOp : drawDirector->GetDrawOps())
+        {
+            if(mMeshOffsets.contains(drawOp.Target))
+            {
+                continue;
+            }
+            const std::vector<foray::scene::Primitive>& primitives = drawOp.Target->GetPrimitives();
+            mMeshOffsets[drawOp.Target]                            = (uint32_t)mPrimitives.size();
+            for(const foray::scene::Primitive& primitive : primitives)
+            {
+                jobs.push_back(Job{.Primitive = &primitive, .Slot = (uint32_t)mPrimitives.size()});
+                mPrimitives.push_back(PrimitiveLods{});
+            }
+        }
+
+        // Simplify in parallel into per primitive index lists, concatenated afterwards in primitive order
+        std::vector<std::vector<uint32_t>> levelIndices(jobs.size() * config.LodCount);
+
+        WorkerPool pool(config.ThreadCount);
+        pool.ParallelFor((uint32_t)jobs.size(), [&](uint32_t jobIndex, uint32_t) {
+            const foray::scene::Primitive& primitive = *jobs[jobIndex].Primitive;
+            PrimitiveLods&                 lods      = mPrimitives[jobs[jobIndex].Slot];
+            if(primitive.Type != foray::scene::Primitive::EType::Index || primitive.VertexOrIndexCount < 3)
+            {
+                return;
+            }
+
+            std::span<const uint32_t> source = sourceIndices.subspan(primitive.First, primitive.VertexOrIndexCount);
+
+            glm::vec3 boundsMin = glm::vec3(std::numeric_limits<float>::max());
+            glm::vec3 boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+            for(uint32_t index : source)
+            {
+                boundsMin = glm::min(boundsMin, positions[index]);
+                boundsMax = glm::max(boundsMax, positions[index]);
+            }
+            lods.Center = (boundsMin + boundsMax) * 0.5f;
+            for(uint32_t index : source)
+            {
+                lods.Radius = std::max(lods.Radius, glm::distance(lods.Center, positions[index]));
+            }
+
+            std::vector<uint32_t>* levels = &levelIndices[jobIndex * config.LodCount];
+            levels[0].assign(source.begin(), source.end());
+            lods.LevelCount = 1;
+
+            std::vector<uint32_t> candidate;
+            while(lods.LevelCount < config.LodCount)
+            {
+                size_t previousTriangles = levels[lods.LevelCount - 1].size() / 3;
+                if(previousTriangles <= config.MinTriangleCount)
+                {
+                    break;
+                }
+                size_t targetTriangles = std::max<size_t>((size_t)((float)previousTriangles * config.TriangleRatio), 1);
+
+                // Triangle count grows with the grid resolution. Find the finest grid meeting the target
+                uint32_t               low  = 1;
+                uint32_t               high = 1024;
+                std::vector<uint32_t>& best = levels[lods.LevelCount];
+                best.clear();
+                while(low <= high)
+                {
+                    uint32_t resolution = (low + high) / 2;
+                    SimplifyClustered(positions, source, boundsMin, boundsMax, resolution, candidate);
+                    if(candidate.size() / 3 <= targetTriangles)
+                    {
+                        std::swap(best, candidate);
+                        low = resolution + 1;
+                    }
+                    else
+                    {
+                        high = resolution - 1;
+                    }
+                }
+                if(best.empty() || best.size() >= levels[lods.LevelCount - 1].size())
+                {
+                    best.clear();
+                    break;
+                }
+                lods.LevelCount++;
+            }
+        });
+
+        std::vector<uint32_t> lodIndices;
+        mTriangleCounts.assign(config.LodCount, 0);
+        for(uint32_t jobIndex = 0; jobIndex < jobs.size(); jobIndex++)
+        {
+            PrimitiveLods& lods = mPrimitives[jobs[jobIndex].Slot];
+            for(uint32_t level = 0; level < lods.LevelCount; level++)
+            {
+                std::vector<uint32_t>& indices = levelIndices[jobIndex * config.LodCount + level];
+                lods.Levels[level]             = Lod{.FirstIndex = (uint32_t)lodIndices.size(), .IndexCount = (uint32_t)indices.size()};
+                lodIndices.insert(lodIndices.end(), indices.begin(), indices.end());
+                mTriangleCounts[level] += indices.size() / 3;
+            }
+        }
+
+        if(!lodIndices.empty())
+        {
+            Upload(lodIndices);
+        }
+        std::string levelCounts;
+        for(uint64_t count : mTriangleCounts)
+        {
+            levelCounts += fmt::format("{}{}", levelCounts.empty() ? "" : ", ", count);
+        }
+        foray::logger()->info("MeshLods: {} primitives, triangles per level: {}", mPrimitives.size(), levelCounts);
+    }
+
+    const MeshLods::PrimitiveLods* MeshLods::Find(const foray::scene::Mesh* mesh, uint32_t primitiveIndex) const
+    {
+        auto iter = mMeshOffsets.find(mesh);
+        if(iter == mMeshOffsets.end())
+        {
+            return nullptr;
+        }
+        const PrimitiveLods& lods = mPrimitives[iter->second + primitiveIndex];
+        return lods.LevelCount > 0 ? &lods : nullptr;
+    }
+
+    uint32_t MeshLods::SelectLod(const PrimitiveLods& lods, const glm::vec3& center, float radius, const glm::mat4& viewMatrix, float projectionScale, uint32_t previousLevel) const
+    {
+        float distance = glm::length(glm::vec3(viewMatrix * glm::vec4(center, 1.f)));
+        if(distance <= radius || radius <= 0.f)
+        {
+            return 0;
+        }
+
+        // Projected diameter in pixels, and the continuous level it maps to (level n covers [FullDetailPixels / 2^(n+1), FullDetailPixels / 2^n])
+        float pixels = 2.f * radius * projectionScale / distance;
+        float level  = std::log2(mConfig.FullDetailPixels / pixels);
+
+        uint32_t maxLevel = lods.LevelCount - 1;
+        if(previousLevel <= maxLevel && level > (float)previousLevel - mConfig.Hysteresis && level < (float)previousLevel + 1.f + mConfig.Hysteresis)
+        {
+            return previousLevel;
+        }
+        return std::min(maxLevel, (uint32_t)std::max(0.f, std::floor(level)));
+    }
+
+    void MeshLods::Download(foray::core::ManagedBuffer& source, std::vector<uint8_t>& out)
+    {
+        VkDeviceSize size = source.GetSize();
+        out.resize((size_t)size);
+        if(size == 0)
+        {
+            return;
+        }
+
+        foray::core::ManagedBuffer             staging;
+        foray::core::ManagedBuffer::CreateInfo stagingCi(VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                         VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, "MeshLods.Download");
+        staging.Create(mContext, stagingCi);
+
+        foray::core::HostSyncCommandBuffer cmdBuffer;
+        cmdBuffer.Create(mContext);
+        cmdBuffer.Begin();
+        VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = size};
+        vkCmdCopyBuffer(cmdBuffer.GetCommandBuffer(), source.GetBuffer(), staging.GetBuffer(), 1, &region);
+        VkBufferMemoryBarrier2 hostBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                           .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                           .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                           .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                           .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+                                           .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                           .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                           .buffer              = staging.GetBuffer(),
+                                           .offset              = 0,
+                                           .size                = VK_WHOLE_SIZE};
+        VkDependencyInfo       depInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &hostBarrier};
+        vkCmdPipelineBarrier2(cmdBuffer.GetCommandBuffer(), &depInfo);
+        cmdBuffer.End();
+        cmdBuffer.Submit();
+        cmdBuffer.WaitForCompletion();
+
+        void* data = nullptr;
+        vmaInvalidateAllocation(mContext->Allocator, staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+        staging.Map(data);
+        memcpy(out.data(), data, (size_t)size);
+        staging.Unmap();
+
+        cmdBuffer.Destroy();
+        staging.Destroy();
+    }
+
+    void MeshLods::Upload(const std::vector<uint32_t>& indices)
+    {
+        VkDeviceSize size = indices.size() * sizeof(uint32_t);
+
+        foray::core::ManagedBuffer::CreateInfo bufferCi(VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0,
+                                                        "MeshLods.Indices");
+        mIndexBuffer.Create(mContext, bufferCi);
+
+        foray::core::ManagedBuffer             staging;
+        foray::core::ManagedBuffer::CreateInfo stagingCi(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                         VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, "MeshLods.Upload");
+        staging.Create(mContext, stagingCi);
+        void* data = nullptr;
+        staging.Map(data);
+        memcpy(data, indices.data(), (size_t)size);
+        vmaFlushAllocation(mContext->Allocator, staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+        staging.Unmap();
+
+        foray::core::HostSyncCommandBuffer cmdBuffer;
+        cmdBuffer.Create(mContext);
+        cmdBuffer.Begin();
+        VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = size};
+        vkCmdCopyBuffer(cmdBuffer.GetCommandBuffer(), staging.GetBuffer(), mIndexBuffer.GetBuffer(), 1, &region);
+        VkBufferMemoryBarrier2 indexBarrier{.sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                            .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                            .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                            .dstStageMask        = VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT,
+                                            .dstAccessMask       = VK_ACCESS_2_INDEX_READ_BIT,
+                                            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                            .buffer              = mIndexBuffer.GetBuffer(),
+                                            .offset              = 0,
+                                            .size                = VK_WHOLE_SIZE};
+        VkDependencyInfo       depInfo{.sType = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &indexBarrier};
+        vkCmdPipelineBarrier2(cmdBuffer.GetCommandBuffer(), &depInfo);
+        cmdBuffer.End();
+        cmdBuffer.Submit();
+        cmdBuffer.WaitForCompletion();
+
+        cmdBuffer.Destroy();
+        staging.Destroy();
+    }
+
+    void MeshLods::Destroy()
+    {
+        mIndexBuffer.Destroy();
+        mPrimitives.clear();
+        mMeshOffsets.clear();
+        mTriangleCounts.clear();
+    }
+}  // namespace cgbuffer
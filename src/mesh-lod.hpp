@@ -0,0 +1,95 @@
+#pragma once
+#include <foray_api.hpp>
+#include <span>
+#include <unordered_map>
+
+namespace cgbuffer {
+
+    /// @brief Simplified index buffers (LOD chain) for every indexed primitive of a scene, selected per instance by the DrawList
+    /// @details
+    /// How to use: Load the scene, Build, pass to CRaster::SetMeshLods()
+    ///  - Build: Call after foray::gltf::ModelConverter has loaded the scene. Downloads the geometry store once, simplifies all primitives
+    ///    in parallel and uploads one index buffer holding every level (including a copy of the source indices as level 0)
+    /// Levels are generated by vertex clustering. Simplified triangles reference the source vertices, so the vertex buffer is shared,
+    /// and mesh instance ids, material ids and motion vectors (same transforms, same vertex attributes) stay stable across LOD switches.
+    /// A level is selected per instance from the projected size of the primitives bounding sphere, see MeshLods::SelectLod().
+    class MeshLods
+    {
+      public:
+        inline static constexpr uint32_t MAX_LOD_COUNT = 6;
+
+        struct Config
+        {
+            /// @brief Number of levels including the source level 0 (max MAX_LOD_COUNT)
+            uint32_t LodCount = 4;
+            /// @brief Target triangle count of a level relative to the previous one
+            float TriangleRatio = 0.25f;
+            /// @brief Primitives (or levels) with less triangles are not simplified further
+            uint32_t MinTriangleCount = 64;
+            /// @brief Bounding sphere diameter in pixels down to which level 0 is used. Every further level halves the threshold
+            float FullDetailPixels = 256.f;
+            /// @brief Fraction of a level a projected size has to leave the current levels range by before switching. Avoids flickering between levels
+            float Hysteresis = 0.15f;
+            /// @brief Worker count for simplification. 0 selects std::thread::hardware_concurrency()
+            uint32_t ThreadCount = 0;
+        };
+
+        struct Lod
+        {
+            /// @brief First index into GetIndexBuffer()
+            uint32_t FirstIndex = 0;
+            uint32_t IndexCount = 0;
+        };
+
+        /// @brief LOD chain and object space bounding sphere of a single primitive
+        struct PrimitiveLods
+        {
+            glm::vec3 Center     = glm::vec3(0.f);
+            float     Radius     = 0.f;
+            uint32_t  LevelCount = 0;
+            Lod       Levels[MAX_LOD_COUNT];
+        };
+
+        /// @brief Downloads the geometry store and builds the LOD chains of all meshes drawn by the scenes DrawDirector
+        void Build(foray::core::Context* context, foray::scene::Scene* scene, const Config& config = Config());
+
+        /// @brief LOD chain of a primitive. nullptr for primitives added after Build() or drawn non indexed
+        const PrimitiveLods* Find(const foray::scene::Mesh* mesh, uint32_t primitiveIndex) const;
+
+        /// @brief Selects the level for a bounding sphere
+        /// @param center World space sphere center
+        /// @param radius World space sphere radius
+        /// @param viewMatrix Camera view matrix
+        /// @param projectionScale ProjectionMatrix[1][1] times half the viewport height in pixels
+        /// @param previousLevel Level selected last frame, for hysteresis. ~0U if unknown
+        uint32_t SelectLod(const PrimitiveLods& lods, const glm::vec3& center, float radius, const glm::mat4& viewMatrix, float projectionScale, uint32_t previousLevel) const;
+
+        /// @brief Simplifies a triangle list by clustering its vertices on a regular grid spanning [boundsMin, boundsMax]
+        /// @details Every cluster is represented by the source vertex closest to the clusters mean, so no vertices are created.
+        /// Degenerate and duplicate triangles are removed, winding is preserved.
+        static void SimplifyClustered(std::span<const glm::vec3> positions,
+                                      std::span<const uint32_t>  indices,
+                                      const glm::vec3&           boundsMin,
+                                      const glm::vec3&           boundsMax,
+                                      uint32_t                   gridResolution,
+                                      std::vector<uint32_t>&     out);
+
+        inline VkBuffer GetIndexBuffer() const { return mIndexBuffer.GetBuffer(); }
+        inline bool     Exists() const { return !!mIndexBuffer.GetBuffer(); }
+        /// @brief Triangle count summed over all primitives, per level
+        inline const std::vector<uint64_t>& GetTriangleCounts() const { return mTriangleCounts; }
+
+        void Destroy();
+
+      protected:
+        void Download(foray::core::ManagedBuffer& source, std::vector<uint8_t>& out);
+        void Upload(const std::vector<uint32_t>& indices);
+
+        foray::core::Context*                                   mContext = nullptr;
+        Config                                                  mConfig;
+        std::vector<PrimitiveLods>                              mPrimitives;
+        std::unordered_map<const foray::scene::Mesh*, uint32_t> mMeshOffsets;
+        std::vector<uint64_t>                                   mTriangleCounts;
+        foray::core::ManagedBuffer                              mIndexBuffer;
+    };
+}  // namespace cgbuffer
@@ -0,0 +1,55 @@
+#include "precompiled-shaders.hpp"
+
+namespace cgbuffer {
+    std::vector<const PrecompiledShaders*>& PrecompiledShaderRegistry::GetEntries()
+    {
+        // Function local, as generated sources register before main() in unspecified order
+        static std::vector<const PrecompiledShaders*> entries;
+        return entries;
+    }
+
+    bool PrecompiledShaderRegistry::Register(const PrecompiledShaders* shaders)
+    {
+        GetEntries().push_back(shaders);
+        return true;
+    }
+
+    const PrecompiledShaders* PrecompiledShaderRegistry::Find(const std::vector<std::string>& definitions, std::string_view shader)
+    {
+        std::string joined = JoinDefinitions(definitions);
+        for(const PrecompiledShaders* entry : GetEntries())
+        {
+            if(entry->Shader == shader && entry->Definitions == joined)
+            {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    const PrecompiledShaders* PrecompiledShaderRegistry::FindByName(std::string_view name)
+    {
+        for(const PrecompiledShaders* entry : GetEntries())
+        {
+            if(entry->Name == name)
+            {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    std::string PrecompiledShaderRegistry::JoinDefinitions(const std::vector<std::string>& definitions)
+    {
+        std::string joined;
+        for(const std::string& definition : definitions)
+        {
+            if(!joined.empty())
+            {
+                joined.push_back('\n');
+            }
+            joined.append(definition);
+        }
+        return joined;
+    }
+}  // namespace cgbuffer
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cgbuffer {
+
+    /// @brief CRaster shaders compiled ahead of time from a recipe file by cgbuffer-recipec, embedded into the binary
+    struct PrecompiledShaders
+    {
+        /// @brief Name of the recipe
+        std::string_view Name;
+        /// @brief Shader the entry was compiled from: "cgbuf" for the vertex and fragment shader pair, otherwise the file name of a compute shader
+        std::string_view Shader;
+        /// @brief Definitions of one pass (see CRaster::GetShaderDefinitions()) the shaders were compiled with, joined by '\n'. Identifies the pipeline variant
+        std::string_view Definitions;
+        /// @brief Contents of the recipe file, so the layout can be configured without the file on disk (see RecipeFile::LoadEmbedded())
+        std::string_view RecipeJson;
+        std::span<const uint32_t> VertexSpirv;
+        std::span<const uint32_t> FragmentSpirv;
+        /// @brief Set instead of VertexSpirv and FragmentSpirv for compute shader entries
+        std::span<const uint32_t> ComputeSpirv;
+    };
+
+    /// @brief Lookup of all PrecompiledShaders linked into the binary
+    /// @details Generated sources register their entry during static initialization. CRaster::Build() looks up its pipeline variant
+    /// and only falls back to runtime shader compilation if none was embedded.
+    class PrecompiledShaderRegistry
+    {
+      public:
+        /// @brief Adds an entry. Returns true, so generated sources can register while initializing a static
+        static bool Register(const PrecompiledShaders* shaders);
+
+        /// @brief Finds the entry of a shader compiled with exactly these definitions. Returns nullptr if none is embedded
+        static const PrecompiledShaders* Find(const std::vector<std::string>& definitions, std::string_view shader = "cgbuf");
+        /// @brief Finds an entry by recipe name. Returns nullptr if none is embedded
+        static const PrecompiledShaders* FindByName(std::string_view name);
+
+        /// @brief Joins definitions the way PrecompiledShaders::Definitions stores them
+        static std::string JoinDefinitions(const std::vector<std::string>& definitions);
+
+      protected:
+        static std::vector<const PrecompiledShaders*>& GetEntries();
+    };
+}  // namespace cgbuffer
@@ -0,0 +1,289 @@
+#include "recipe-file.hpp"
+#include "precompiled-shaders.hpp"
+#include <fstream>
+#include <sstream>
+#include <tinygltf/json.hpp>
+
+namespace cgbuffer {
+
+    namespace {
+        template <typename T>
+        struct NamedValue
+        {
+            std::string_view Name;
+            T                Value;
+        };
+
+        // clang-format off
+        const NamedValue<CRaster::FragmentInputFlagBits> FRAGMENT_INPUTS[] = {
+            {"WORLDPOS", CRaster::FragmentInputFlagBits::WORLDPOS},
+            {"WORLDPOSOLD", CRaster::FragmentInputFlagBits::WORLDPOSOLD},
+            {"DEVICEPOS", CRaster::FragmentInputFlagBits::DEVICEPOS},
+            {"DEVICEPOSOLD", CRaster::FragmentInputFlagBits::DEVICEPOSOLD},
+            {"NORMAL", CRaster::FragmentInputFlagBits::NORMAL},
+            {"TANGENT", CRaster::FragmentInputFlagBits::TANGENT},
+            {"UV", CRaster::FragmentInputFlagBits::UV},
+            {"MESHID", CRaster::FragmentInputFlagBits::MESHID},
+        };
+
+        const NamedValue<CRaster::BuiltInFeaturesFlagBits> BUILTIN_FEATURES[] = {
+            {"MATERIALPROBE", CRaster::BuiltInFeaturesFlagBits::MATERIALPROBE},
+            {"MATERIALPROBEALPHA", CRaster::BuiltInFeaturesFlagBits::MATERIALPROBEALPHA},
+            {"ALPHATEST", CRaster::BuiltInFeaturesFlagBits::ALPHATEST},
+            {"NORMALMAPPING", CRaster::BuiltInFeaturesFlagBits::NORMALMAPPING},
+        };
+
+        const NamedValue<CRaster::FragmentOutputType> OUTPUT_TYPES[] = {
+            {"FLOAT", CRaster::FragmentOutputType::FLOAT},
+            {"INT", CRaster::FragmentOutputType::INT},
+            {"UINT", CRaster::FragmentOutputType::UINT},
+            {"VEC2", CRaster::FragmentOutputType::VEC2},
+            {"VEC3", CRaster::FragmentOutputType::VEC3},
+            {"VEC4", CRaster::FragmentOutputType::VEC4},
+            {"IVEC2", CRaster::FragmentOutputType::IVEC2},
+            {"IVEC3", CRaster::FragmentOutputType::IVEC3},
+            {"IVEC4", CRaster::FragmentOutputType::IVEC4},
+            {"UVEC2", CRaster::FragmentOutputType::UVEC2},
+            {"UVEC3", CRaster::FragmentOutputType::UVEC3},
+            {"UVEC4", CRaster::FragmentOutputType::UVEC4},
+        };
+
+        const NamedValue<const CRaster::OutputRecipe*> TEMPLATES[] = {
+            {"WorldPos", &CRaster::Templates::WorldPos},
+            {"WorldNormal", &CRaster::Templates::WorldNormal},
+            {"VertexNormal", &CRaster::Templates::VertexNormal},
+            {"Albedo", &CRaster::Templates::Albedo},
+            {"MaterialId", &CRaster::Templates::MaterialId},
+            {"MeshInstanceId", &CRaster::Templates::MeshInstanceId},
+            {"UV", &CRaster::Templates::UV},
+            {"ScreenMotion", &CRaster::Templates::ScreenMotion},
+            {"WorldMotion", &CRaster::Templates::WorldMotion},
+            {"DepthAndDerivative", &CRaster::Templates::DepthAndDerivative},
+            {"DerivedWorldPos", &CRaster::Templates::DerivedWorldPos},
+            {"DerivedDepthAndDerivative", &CRaster::Templates::DerivedDepthAndDerivative},
+            {"DerivedScreenMotion", &CRaster::Templates::DerivedScreenMotion},
+        };
+
+        const NamedValue<CRaster::DerivedOutput> DERIVED_OUTPUTS[] = {
+            {"NONE", CRaster::DerivedOutput::NONE},
+            {"WORLDPOS", CRaster::DerivedOutput::WORLDPOS},
+            {"DEPTHANDDERIVATIVE", CRaster::DerivedOutput::DEPTHANDDERIVATIVE},
+            {"SCREENMOTION", CRaster::DerivedOutput::SCREENMOTION},
+        };
+
+        const NamedValue<VkFormat> FORMATS[] = {
+            {"R8_UNORM", VK_FORMAT_R8_UNORM},
+            {"R8_SNORM", VK_FORMAT_R8_SNORM},
+            {"R8_UINT", VK_FORMAT_R8_UINT},
+            {"R8_SINT", VK_FORMAT_R8_SINT},
+            {"R8G8_UNORM", VK_FORMAT_R8G8_UNORM},
+            {"R8G8_SNORM", VK_FORMAT_R8G8_SNORM},
+            {"R8G8_UINT", VK_FORMAT_R8G8_UINT},
+            {"R8G8_SINT", VK_FORMAT_R8G8_SINT},
+            {"R8G8B8A8_UNORM", VK_FORMAT_R8G8B8A8_UNORM},
+            {"R8G8B8A8_SNORM", VK_FORMAT_R8G8B8A8_SNORM},
+            {"R8G8B8A8_UINT", VK_FORMAT_R8G8B8A8_UINT},
+            {"R8G8B8A8_SINT", VK_FORMAT_R8G8B8A8_SINT},
+            {"R8G8B8A8_SRGB", VK_FORMAT_R8G8B8A8_SRGB},
+            {"A2B10G10R10_UNORM_PACK32", VK_FORMAT_A2B10G10R10_UNORM_PACK32},
+            {"B10G11R11_UFLOAT_PACK32", VK_FORMAT_B10G11R11_UFLOAT_PACK32},
+            {"R16_UNORM", VK_FORMAT_R16_UNORM},
+            {"R16_SNORM", VK_FORMAT_R16_SNORM},
+            {"R16_UINT", VK_FORMAT_R16_UINT},
+            {"R16_SINT", VK_FORMAT_R16_SINT},
+            {"R16_SFLOAT", VK_FORMAT_R16_SFLOAT},
+            {"R16G16_UNORM", VK_FORMAT_R16G16_UNORM},
+            {"R16G16_SNORM", VK_FORMAT_R16G16_SNORM},
+            {"R16G16_UINT", VK_FORMAT_R16G16_UINT},
+            {"R16G16_SINT", VK_FORMAT_R16G16_SINT},
+            {"R16G16_SFLOAT", VK_FORMAT_R16G16_SFLOAT},
+            {"R16G16B16A16_UNORM", VK_FORMAT_R16G16B16A16_UNORM},
+            {"R16G16B16A16_SNORM", VK_FORMAT_R16G16B16A16_SNORM},
+            {"R16G16B16A16_UINT", VK_FORMAT_R16G16B16A16_UINT},
+            {"R16G16B16A16_SINT", VK_FORMAT_R16G16B16A16_SINT},
+            {"R16G16B16A16_SFLOAT", VK_FORMAT_R16G16B16A16_SFLOAT},
+            {"R32_UINT", VK_FORMAT_R32_UINT},
+            {"R32_SINT", VK_FORMAT_R32_SINT},
+            {"R32_SFLOAT", VK_FORMAT_R32_SFLOAT},
+            {"R32G32_UINT", VK_FORMAT_R32G32_UINT},
+            {"R32G32_SINT", VK_FORMAT_R32G32_SINT},
+            {"R32G32_SFLOAT", VK_FORMAT_R32G32_SFLOAT},
+            {"R32G32B32A32_UINT", VK_FORMAT_R32G32B32A32_UINT},
+            {"R32G32B32A32_SINT", VK_FORMAT_R32G32B32A32_SINT},
+            {"R32G32B32A32_SFLOAT", VK_FORMAT_R32G32B32A32_SFLOAT},
+        };
+        // clang-format on
+
+        template <typename T, size_t N>
+        T Lookup(const NamedValue<T> (&table)[N], const nlohmann::json& value, std::string_view what, std::string_view source)
+        {
+            FORAY_ASSERTFMT(value.is_string(), "{}: Expected {} name (string)", source, what);
+            std::string name = value.get<std::string>();
+            for(const NamedValue<T>& entry : table)
+            {
+                if(entry.Name == name)
+                {
+                    return entry.Value;
+                }
+            }
+            FORAY_THROWFMT("{}: Unknown {} \"{}\"", source, what, name);
+        }
+
+        bool IsSignedIntegerType(CRaster::FragmentOutputType type)
+        {
+            switch(type)
+            {
+                case CRaster::FragmentOutputType::INT:
+                case CRaster::FragmentOutputType::IVEC2:
+                case CRaster::FragmentOutputType::IVEC3:
+                case CRaster::FragmentOutputType::IVEC4:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        bool IsUnsignedIntegerType(CRaster::FragmentOutputType type)
+        {
+            switch(type)
+            {
+                case CRaster::FragmentOutputType::UINT:
+                case CRaster::FragmentOutputType::UVEC2:
+                case CRaster::FragmentOutputType::UVEC3:
+                case CRaster::FragmentOutputType::UVEC4:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        CRaster::OutputRecipe ParseOutput(const nlohmann::json& output, std::string_view source)
+        {
+            CRaster::OutputRecipe recipe;
+            if(output.contains("template"))
+            {
+                recipe = *Lookup(TEMPLATES, output["template"], "template", source);
+            }
+            if(output.contains("type"))
+            {
+                recipe.Type = Lookup(OUTPUT_TYPES, output["type"], "output type", source);
+            }
+            if(output.contains("format"))
+            {
+                recipe.ImageFormat = Lookup(FORMATS, output["format"], "format", source);
+            }
+            // Replace the templates flags, so a recipe can also remove inputs and features
+            if(output.contains("inputs"))
+            {
+                recipe.FragmentInputFlags = 0;
+                for(const nlohmann::json& input : output["inputs"])
+                {
+                    recipe.AddFragmentInput(Lookup(FRAGMENT_INPUTS, input, "fragment input", source));
+                }
+            }
+            if(output.contains("features"))
+            {
+                recipe.BuiltInFeaturesFlags = 0;
+                for(const nlohmann::json& feature : output["features"])
+                {
+                    recipe.EnableBuiltInFeature(Lookup(BUILTIN_FEATURES, feature, "built-in feature", source));
+                }
+            }
+            if(output.contains("clear"))
+            {
+                const nlohmann::json& clear = output["clear"];
+                FORAY_ASSERTFMT(clear.is_array() && clear.size() <= 4, "{}: \"clear\" must be an array of up to 4 numbers", source);
+                recipe.ClearValue = {};
+                for(uint32_t i = 0; i < clear.size(); i++)
+                {
+                    if(IsSignedIntegerType(recipe.Type))
+                    {
+                        FORAY_ASSERTFMT(clear[i].is_number_integer(), "{}: \"clear\" of an int output must contain integers", source);
+                        recipe.ClearValue.int32[i] = clear[i].get<int32_t>();
+                    }
+                    else if(IsUnsignedIntegerType(recipe.Type))
+                    {
+                        FORAY_ASSERTFMT(clear[i].is_number_unsigned(), "{}: \"clear\" of a uint output must contain non negative integers", source);
+                        recipe.ClearValue.uint32[i] = clear[i].get<uint32_t>();
+                    }
+                    else
+                    {
+                        recipe.ClearValue.float32[i] = clear[i].get<float>();
+                    }
+                }
+            }
+            if(output.contains("calculation"))
+            {
+                recipe.Calculation = output["calculation"].get<std::string>();
+            }
+            if(output.contains("result"))
+            {
+                recipe.Result = output["result"].get<std::string>();
+            }
+            if(output.contains("derived"))
+            {
+                recipe.Derived = Lookup(DERIVED_OUTPUTS, output["derived"], "derived output", source);
+            }
+            FORAY_ASSERTFMT(recipe.ImageFormat != VK_FORMAT_UNDEFINED, "{}: Output requires a \"format\" or \"template\"", source);
+            return recipe;
+        }
+    }  // namespace
+
+    RecipeFile RecipeFile::Load(std::string_view path)
+    {
+        std::ifstream file{std::string(path)};
+        FORAY_ASSERTFMT(file.good(), "Failed to open recipe file \"{}\"", path);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        return Parse(contents.str(), path);
+    }
+
+    RecipeFile RecipeFile::Parse(std::string_view json, std::string_view source)
+    {
+        nlohmann::json root = nlohmann::json::parse(json.begin(), json.end(), nullptr, false);
+        FORAY_ASSERTFMT(!root.is_discarded() && root.is_object(), "{}: Recipe is not a valid json object", source);
+
+        RecipeFile result;
+        result.Name = root.value("name", "");
+        if(root.contains("features"))
+        {
+            for(const nlohmann::json& feature : root["features"])
+            {
+                result.BuiltInFeaturesFlags |= (uint32_t)Lookup(BUILTIN_FEATURES, feature, "built-in feature", source);
+            }
+        }
+        FORAY_ASSERTFMT(root.contains("outputs") && root["outputs"].is_array(), "{}: Recipe requires an \"outputs\" array", source);
+        for(const nlohmann::json& output : root["outputs"])
+        {
+            FORAY_ASSERTFMT(output.contains("name") && output["name"].is_string(), "{}: Output requires a \"name\"", source);
+            result.Outputs.push_back(NamedOutput{.Name = output["name"].get<std::string>(), .Recipe = ParseOutput(output, source)});
+        }
+        return result;
+    }
+
+    bool RecipeFile::LoadEmbedded(std::string_view name, RecipeFile& out)
+    {
+        const PrecompiledShaders* embedded = PrecompiledShaderRegistry::FindByName(name);
+        if(!embedded)
+        {
+            return false;
+        }
+        out = Parse(embedded->RecipeJson, fmt::format("<embedded {}>", name));
+        return true;
+    }
+
+    void RecipeFile::ApplyTo(CRaster& raster) const
+    {
+        for(uint32_t flag = 1; flag < (uint32_t)CRaster::BuiltInFeaturesFlagBits::MAXENUM; flag = flag << 1)
+        {
+            if((BuiltInFeaturesFlags & flag) > 0)
+            {
+                raster.EnableBuiltInFeature((CRaster::BuiltInFeaturesFlagBits)flag);
+            }
+        }
+        for(const NamedOutput& output : Outputs)
+        {
+            raster.AddOutput(output.Name, output.Recipe);
+        }
+    }
+}  // namespace cgbuffer
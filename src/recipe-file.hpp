@@ -0,0 +1,49 @@
+#pragma once
+#include "conf-gbuffer.hpp"
+
+namespace cgbuffer {
+
+    /// @brief Data driven CRaster layout, loaded from a json recipe file instead of being configured in code
+    /// @details
+    /// File layout (enum values are spelled like their C++ counterparts, formats without the VK_FORMAT_ prefix):
+    /// {
+    ///     "name": "default",
+    ///     "features": ["ALPHATEST"],
+    ///     "outputs": [
+    ///         {"name": "pos", "template": "WorldPos"},
+    ///         {"name": "custom", "type": "VEC4", "format": "R16G16B16A16_SFLOAT", "inputs": ["NORMAL"], "features": ["NORMALMAPPING"],
+    ///          "clear": [0, 0, 0, 1], "calculation": "vec3 diff = abs(Normal - normalMapped);", "result": "diff, 1"}
+    ///     ]
+    /// }
+    ///  - "features": Global built-in features (see CRaster::EnableBuiltInFeature())
+    ///  - "template": Starts from one of CRaster::Templates, all other keys of the output override the template
+    ///  - "inputs", "features": Replace the fragment inputs and built-in features of the template (an empty array removes all of them)
+    ///  - "clear": Interpreted as int, uint or float depending on "type"
+    ///  - "derived": CRaster::DerivedOutput value, reconstructs the output from depth instead of rasterizing it (see the Derived* templates)
+    /// Recipe files listed in the CGBUFFER_RECIPE_FILES cmake option are compiled to SPIR-V at build time and embedded (see PrecompiledShaderRegistry).
+    struct RecipeFile
+    {
+        struct NamedOutput
+        {
+            std::string           Name;
+            CRaster::OutputRecipe Recipe;
+        };
+
+        std::string Name = "";
+        /// @brief Flags of CRaster::BuiltInFeaturesFlagBits values, enabled regardless of outputs
+        uint32_t                 BuiltInFeaturesFlags = 0;
+        std::vector<NamedOutput> Outputs;
+
+        /// @brief Loads and parses a recipe file. Throws on malformed files
+        static RecipeFile Load(std::string_view path);
+        /// @brief Parses recipe file contents. Throws on malformed content
+        /// @param source Used in error messages only
+        static RecipeFile Parse(std::string_view json, std::string_view source = "");
+        /// @brief Parses the recipe embedded at build time. Returns false if no recipe of that name was compiled in
+        static bool LoadEmbedded(std::string_view name, RecipeFile& out);
+
+        /// @brief Adds all outputs and enables the global features
+        /// @remarks MUST be called before CRaster::Build()
+        void ApplyTo(CRaster& raster) const;
+    };
+}  // namespace cgbuffer
@@ -0,0 +1,1003 @@
+#include "scene-cache.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <scene/components/foray_meshinstance.hpp>
+#include <scene/components/foray_transform.hpp>
+#include <scene/foray_mesh.hpp>
+#include <scene/globalcomponents/foray_drawmanager.hpp>
+#include <scene/globalcomponents/foray_geometrymanager.hpp>
+#include <scene/globalcomponents/foray_materialmanager.hpp>
+#include <scene/globalcomponents/foray_texturemanager.hpp>
+#include <tinygltf/tiny_gltf.h>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cgbuffer {
+
+    namespace {
+        constexpr char MAGIC[8] = {'C', 'G', 'B', 'S', 'C', 'E', 'N', 'E'};
+
+        /// @brief Sections start on page boundaries of the mapping
+        constexpr uint64_t SECTION_ALIGNMENT = 4096;
+        /// @brief Staging offsets are aligned to the largest texel size stored
+        constexpr VkDeviceSize STAGING_ALIGNMENT = 16;
+        /// @brief Largest copy handed to a single worker, so few large regions still spread across all workers
+        constexpr VkDeviceSize COPY_GRAIN = 1ULL << 20;
+
+        inline uint64_t AlignUp(uint64_t value, uint64_t alignment)
+        {
+            return (value + alignment - 1) & ~(alignment - 1);
+        }
+
+        uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+        {
+            // FNV-1a
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+            for(size_t i = 0; i < size; i++)
+            {
+                hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+            }
+            return hash;
+        }
+
+        template <typename T>
+        std::span<const T> AsSpan(std::span<const uint8_t> bytes)
+        {
+            return std::span<const T>(reinterpret_cast<const T*>(bytes.data()), bytes.size() / sizeof(T));
+        }
+
+        template <typename T>
+        void Append(std::vector<uint8_t>& out, const std::vector<T>& values)
+        {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values.data());
+            out.insert(out.end(), bytes, bytes + values.size() * sizeof(T));
+        }
+
+        uint32_t GetTextureTexelSize(VkFormat format)
+        {
+            switch(format)
+            {
+                case VK_FORMAT_R8_UNORM:
+                case VK_FORMAT_R8_SRGB:
+                    return 1;
+                case VK_FORMAT_R8G8_UNORM:
+                case VK_FORMAT_R8G8_SRGB:
+                case VK_FORMAT_R16_UNORM:
+                case VK_FORMAT_R16_SFLOAT:
+                    return 2;
+                case VK_FORMAT_R8G8B8A8_UNORM:
+                case VK_FORMAT_R8G8B8A8_SRGB:
+                case VK_FORMAT_B8G8R8A8_UNORM:
+                case VK_FORMAT_B8G8R8A8_SRGB:
+                case VK_FORMAT_R16G16_UNORM:
+                case VK_FORMAT_R16G16_SFLOAT:
+                case VK_FORMAT_R32_SFLOAT:
+                    return 4;
+                case VK_FORMAT_R16G16B16A16_UNORM:
+                case VK_FORMAT_R16G16B16A16_SFLOAT:
+                case VK_FORMAT_R32G32_SFLOAT:
+                    return 8;
+                case VK_FORMAT_R32G32B32A32_SFLOAT:
+                    return 16;
+                default:
+                    return 0;
+            }
+        }
+
+        VkImageMemoryBarrier2 MakeImageBarrier(foray::core::ManagedImage* image,
+                                               VkPipelineStageFlags2      srcStage,
+                                               VkAccessFlags2             srcAccess,
+                                               VkPipelineStageFlags2      dstStage,
+                                               VkAccessFlags2             dstAccess,
+                                               VkImageLayout              oldLayout,
+                                               VkImageLayout              newLayout)
+        {
+            return VkImageMemoryBarrier2{.sType               = VkStructureType::VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                         .srcStageMask        = srcStage,
+                                         .srcAccessMask       = srcAccess,
+                                         .dstStageMask        = dstStage,
+                                         .dstAccessMask       = dstAccess,
+                                         .oldLayout           = oldLayout,
+                                         .newLayout           = newLayout,
+                                         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                         .image               = image->GetImage(),
+                                         .subresourceRange    = VkImageSubresourceRange{.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                                                                                        .baseMipLevel   = 0,
+                                                                                        .levelCount     = VK_REMAINING_MIP_LEVELS,
+                                                                                        .baseArrayLayer = 0,
+                                                                                        .layerCount     = 1}};
+        }
+    }  // namespace
+
+    MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+#ifdef _WIN32
+    bool MappedFile::Open(const std::filesystem::path& path)
+    {
+        Close();
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        mFile = file;
+        LARGE_INTEGER size{};
+        if(!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+        mMapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(!mMapping)
+        {
+            Close();
+            return false;
+        }
+        mData = reinterpret_cast<const uint8_t*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+        if(!mData)
+        {
+            Close();
+            return false;
+        }
+        mSize = (size_t)size.QuadPart;
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+        if(mData)
+        {
+            UnmapViewOfFile(mData);
+        }
+        if(mMapping)
+        {
+            CloseHandle(mMapping);
+        }
+        if(mFile)
+        {
+            CloseHandle(mFile);
+        }
+        mData    = nullptr;
+        mSize    = 0;
+        mMapping = nullptr;
+        mFile    = nullptr;
+    }
+#else
+    bool MappedFile::Open(const std::filesystem::path& path)
+    {
+        Close();
+        mFd = open(path.c_str(), O_RDONLY);
+        if(mFd < 0)
+        {
+            return false;
+        }
+        struct stat info{};
+        if(fstat(mFd, &info) != 0 || info.st_size == 0)
+        {
+            Close();
+            return false;
+        }
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, mFd, 0);
+        if(data == MAP_FAILED)
+        {
+            Close();
+            return false;
+        }
+        // The whole file is read right away, by several workers at once
+        madvise(data, (size_t)info.st_size, MADV_WILLNEED);
+        mData = reinterpret_cast<const uint8_t*>(data);
+        mSize = (size_t)info.st_size;
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+        if(mData)
+        {
+            munmap(const_cast<uint8_t*>(mData), mSize);
+        }
+        if(mFd >= 0)
+        {
+            close(mFd);
+        }
+        mData = nullptr;
+        mSize = 0;
+        mFd   = -1;
+    }
+#endif
+
+    void SceneCache::Load(foray::core::Context* context, foray::scene::Scene* scene, std::string_view scenePath, const std::filesystem::path& cachePath, uint32_t threadCount)
+    {
+        mContext = context;
+        mScene   = scene;
+        mStats   = Stats{};
+        mPool    = std::make_unique<WorkerPool>(threadCount);
+
+        auto begin = std::chrono::steady_clock::now();
+
+        uint64_t stamp = StampSources(std::filesystem::path(scenePath), cachePath);
+        mStats.Hit     = TryLoad(cachePath, stamp);
+        if(!mStats.Hit)
+        {
+            // Converted into a scene of its own and only read back. The scene is restored from the captured sections as on a hit,
+            // so it is the same static snapshot on every run. Textures are decoded by the ModelConverter
+            Sections sections;
+            bool     captured = false;
+            {
+                foray::scene::Scene         converted(mContext);
+                foray::gltf::ModelConverter converter(&converted);
+                converter.LoadGltfModel(std::string(scenePath));
+                mScene   = &converted;
+                captured = Capture(std::filesystem::path(scenePath), sections);
+                mScene   = scene;
+            }
+
+            if(captured)
+            {
+                Write(cachePath, stamp, sections);
+                std::span<const uint8_t> views[(size_t)ESection::Count];
+                for(size_t i = 0; i < (size_t)ESection::Count; i++)
+                {
+                    views[i] = sections[i];
+                }
+                Restore(views);
+            }
+            else
+            {
+                foray::logger()->warn("SceneCache: \"{}\" can not be cached, loading it with node hierarchy and animations", std::string(scenePath));
+                foray::gltf::ModelConverter converter(mScene);
+                converter.LoadGltfModel(std::string(scenePath));
+            }
+        }
+
+        // Workers are only used while loading
+        mPool.reset();
+
+        mStats.LoadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        foray::logger()->info("SceneCache: {} \"{}\" in {:.1f} ms ({:.1f} MiB, {} staging batches)", mStats.Hit ? "Loaded" : "Created", cachePath.string(), mStats.LoadMs,
+                              (double)mStats.FileBytes / (1024.0 * 1024.0), mStats.BatchCount);
+    }
+
+    uint64_t SceneCache::StampSources(const std::filesystem::path& scenePath, const std::filesystem::path& cachePath)
+    {
+        struct Source
+        {
+            std::string Path;
+            uint64_t    Size = 0;
+            int64_t     Time = 0;
+        };
+
+        // Textures and buffers are referenced relative to the glTF, so every file next to it counts
+        std::filesystem::path directory = scenePath.parent_path();
+        std::filesystem::path cacheName = cachePath.filename();
+        std::filesystem::path tempName  = cacheName;
+        tempName += ".tmp";
+
+        std::vector<Source> sources;
+        std::error_code     error;
+        for(const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(directory, error))
+        {
+            if(!entry.is_regular_file() || entry.path().filename() == cacheName || entry.path().filename() == tempName)
+            {
+                continue;
+            }
+            sources.push_back(Source{.Path = std::filesystem::relative(entry.path(), directory).generic_string(),
+                                     .Size = (uint64_t)entry.file_size(),
+                                     .Time = (int64_t)entry.last_write_time().time_since_epoch().count()});
+        }
+        // Iteration order is unspecified
+        std::sort(sources.begin(), sources.end(), [](const Source& a, const Source& b) { return a.Path < b.Path; });
+
+        uint64_t hash       = 0xCBF29CE484222325ULL;
+        uint32_t version    = VERSION;
+        uint32_t vertexSize = (uint32_t)sizeof(foray::scene::Vertex);
+        hash                = HashBytes(hash, &version, sizeof(version));
+        hash                = HashBytes(hash, &vertexSize, sizeof(vertexSize));
+        for(const Source& source : sources)
+        {
+            hash = HashBytes(hash, source.Path.data(), source.Path.size());
+            hash = HashBytes(hash, &source.Size, sizeof(source.Size));
+            hash = HashBytes(hash, &source.Time, sizeof(source.Time));
+        }
+        return hash;
+    }
+
+    VkDeviceSize SceneCache::GetMipSize(VkFormat format, uint32_t width, uint32_t height, uint32_t mipLevel)
+    {
+        return (VkDeviceSize)std::max(1U, width >> mipLevel) * std::max(1U, height >> mipLevel) * GetTextureTexelSize(format);
+    }
+
+    bool SceneCache::TryLoad(const std::filesystem::path& cachePath, uint64_t stamp)
+    {
+        MappedFile file;
+        if(!file.Open(cachePath))
+        {
+            return false;
+        }
+        std::span<const uint8_t> data = file.GetData();
+
+        FileHeader header;
+        if(data.size() < sizeof(header))
+        {
+            foray::logger()->warn("SceneCache: \"{}\" is truncated, recreating", cachePath.string());
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        if(memcmp(header.Magic, MAGIC, sizeof(MAGIC)) != 0 || header.Version != VERSION || header.VertexSize != sizeof(foray::scene::Vertex))
+        {
+            foray::logger()->info("SceneCache: \"{}\" was written by a different version, recreating", cachePath.string());
+            return false;
+        }
+        if(header.SourceStamp != stamp)
+        {
+            foray::logger()->info("SceneCache: \"{}\" is outdated, recreating", cachePath.string());
+            return false;
+        }
+
+        std::span<const uint8_t> sections[(size_t)ESection::Count];
+        for(size_t i = 0; i < (size_t)ESection::Count; i++)
+        {
+            const SectionEntry& entry = header.Sections[i];
+            if(entry.Offset % SECTION_ALIGNMENT != 0 || entry.Offset > data.size() || entry.Size > data.size() - entry.Offset)
+            {
+                foray::logger()->warn("SceneCache: \"{}\" is truncated, recreating", cachePath.string());
+                return false;
+            }
+            sections[i] = data.subspan((size_t)entry.Offset, (size_t)entry.Size);
+        }
+        if(!Validate(sections))
+        {
+            foray::logger()->warn("SceneCache: \"{}\" is inconsistent, recreating", cachePath.string());
+            return false;
+        }
+
+        mStats.FileBytes = data.size();
+        Restore(sections);
+        return true;
+    }
+
+    bool SceneCache::Validate(const std::span<const uint8_t>* sections)
+    {
+        auto sizeMatches = [&](ESection section, size_t elementSize) { return sections[(size_t)section].size() % elementSize == 0; };
+        if(!sizeMatches(ESection::Vertices, sizeof(foray::scene::Vertex)) || !sizeMatches(ESection::Indices, sizeof(uint32_t)) || !sizeMatches(ESection::Meshes, sizeof(MeshEntry))
+           || !sizeMatches(ESection::Primitives, sizeof(PrimitiveEntry)) || !sizeMatches(ESection::Instances, sizeof(InstanceEntry))
+           || !sizeMatches(ESection::Textures, sizeof(TextureEntry)))
+        {
+            return false;
+        }
+
+        std::span<const MeshEntry>     meshes     = AsSpan<MeshEntry>(sections[(size_t)ESection::Meshes]);
+        std::span<const InstanceEntry> instances  = AsSpan<InstanceEntry>(sections[(size_t)ESection::Instances]);
+        std::span<const TextureEntry>  textures   = AsSpan<TextureEntry>(sections[(size_t)ESection::Textures]);
+        size_t                         primitives = sections[(size_t)ESection::Primitives].size() / sizeof(PrimitiveEntry);
+        size_t                         texels     = sections[(size_t)ESection::Texels].size();
+
+        for(const MeshEntry& mesh : meshes)
+        {
+            if((size_t)mesh.FirstPrimitive + mesh.PrimitiveCount > primitives)
+            {
+                return false;
+            }
+        }
+        for(const InstanceEntry& instance : instances)
+        {
+            if(instance.MeshIndex >= meshes.size())
+            {
+                return false;
+            }
+        }
+        for(const TextureEntry& texture : textures)
+        {
+            VkDeviceSize chainSize = 0;
+            for(uint32_t mipLevel = 0; mipLevel < texture.MipLevels; mipLevel++)
+            {
+                chainSize += GetMipSize((VkFormat)texture.Format, texture.Width, texture.Height, mipLevel);
+            }
+            if(texture.MipLevels == 0 || chainSize == 0 || chainSize != texture.TexelSize || texture.TexelOffset > texels || texture.TexelSize > texels - texture.TexelOffset)
+            {
+                return false;
+            }
+            const SamplerEntry& sampler = texture.Sampler;
+            if(sampler.MagFilter > VK_FILTER_LINEAR || sampler.MinFilter > VK_FILTER_LINEAR || sampler.MipmapMode > VK_SAMPLER_MIPMAP_MODE_LINEAR
+               || std::max({sampler.AddressModeU, sampler.AddressModeV, sampler.AddressModeW}) > VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void SceneCache::Restore(const std::span<const uint8_t>* sections)
+    {
+        auto geometryStore = mScene->GetComponent<foray::scene::gcomp::GeometryStore>();
+        auto materials     = mScene->GetComponent<foray::scene::gcomp::MaterialManager>();
+        auto textures      = mScene->GetComponent<foray::scene::gcomp::TextureManager>();
+        auto drawDirector  = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+
+        // All resources are created first, then filled from the mapping in one batched transfer. The mapping outlives the transfer (see TryLoad())
+
+        std::vector<Region>                     regions;
+        std::vector<foray::core::ManagedImage*> images;
+
+        auto createBuffer = [&](foray::core::ManagedBuffer& buffer, VkBufferUsageFlags usage, std::span<const uint8_t> bytes, std::string_view name) {
+            if(bytes.empty())
+            {
+                return;
+            }
+            foray::core::ManagedBuffer::CreateInfo ci(usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, bytes.size(), VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0, name);
+            buffer.Create(mContext, ci);
+            // Only read from on upload
+            regions.push_back(Region{.Host = const_cast<uint8_t*>(bytes.data()), .Size = bytes.size(), .Buffer = buffer.GetBuffer()});
+        };
+
+        createBuffer(geometryStore->GetVerticesBuffer(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                     sections[(size_t)ESection::Vertices], "Vertices");
+        createBuffer(geometryStore->GetIndicesBuffer(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                     sections[(size_t)ESection::Indices], "Indices");
+        createBuffer(materials->GetBuffer(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, sections[(size_t)ESection::Materials], "Materials");
+
+        std::span<const TextureEntry> textureEntries = AsSpan<TextureEntry>(sections[(size_t)ESection::Textures]);
+        std::span<const uint8_t>      texels         = sections[(size_t)ESection::Texels];
+        for(uint32_t textureIndex = 0; textureIndex < textureEntries.size(); textureIndex++)
+        {
+            const TextureEntry& entry  = textureEntries[textureIndex];
+            VkFormat            format = (VkFormat)entry.Format;
+
+            std::unique_ptr<foray::core::ManagedImage> image = std::make_unique<foray::core::ManagedImage>();
+            foray::core::ManagedImage::CreateInfo      ci(VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, format,
+                                                          VkExtent2D{entry.Width, entry.Height}, fmt::format("SceneCache.Texture.{}", textureIndex));
+            ci.ImageCI.mipLevels                       = entry.MipLevels;
+            ci.ImageViewCI.subresourceRange.levelCount = entry.MipLevels;
+            image->Create(mContext, ci);
+
+            VkDeviceSize mipOffset = entry.TexelOffset;
+            for(uint32_t mipLevel = 0; mipLevel < entry.MipLevels; mipLevel++)
+            {
+                VkDeviceSize mipSize = GetMipSize(format, entry.Width, entry.Height, mipLevel);
+                regions.push_back(Region{.Host = const_cast<uint8_t*>(texels.data() + mipOffset), .Size = mipSize, .Image = image.get(), .MipLevel = mipLevel});
+                mipOffset += mipSize;
+            }
+
+            const SamplerEntry& sampler = entry.Sampler;
+            // Without mipmapping only level 0 is sampled (maxLod 0.25 as recommended by the glTF specification)
+            VkSamplerCreateInfo samplerCi{.sType            = VkStructureType::VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+                                          .magFilter        = (VkFilter)sampler.MagFilter,
+                                          .minFilter        = (VkFilter)sampler.MinFilter,
+                                          .mipmapMode       = (VkSamplerMipmapMode)sampler.MipmapMode,
+                                          .addressModeU     = (VkSamplerAddressMode)sampler.AddressModeU,
+                                          .addressModeV     = (VkSamplerAddressMode)sampler.AddressModeV,
+                                          .addressModeW     = (VkSamplerAddressMode)sampler.AddressModeW,
+                                          .anisotropyEnable = sampler.Anisotropy > 0 ? VK_TRUE : VK_FALSE,
+                                          .maxAnisotropy    = sampler.Anisotropy > 0 ? mContext->VkbPhysicalDevice->properties.limits.maxSamplerAnisotropy : 1.f,
+                                          .minLod           = 0.f,
+                                          .maxLod           = sampler.Mipmapped > 0 ? VK_LOD_CLAMP_NONE : 0.25f};
+            textures->GetTextures().emplace_back(mContext, image.get(), samplerCi);
+            images.push_back(image.get());
+            mTextures.push_back(std::move(image));
+        }
+
+        Transfer(EDirection::Upload, regions, images, VK_IMAGE_LAYOUT_UNDEFINED);
+
+        // Scene graph: Meshes in cache order, one node per instance
+
+        std::span<const MeshEntry>      meshEntries      = AsSpan<MeshEntry>(sections[(size_t)ESection::Meshes]);
+        std::span<const PrimitiveEntry> primitiveEntries = AsSpan<PrimitiveEntry>(sections[(size_t)ESection::Primitives]);
+        std::span<const InstanceEntry>  instanceEntries  = AsSpan<InstanceEntry>(sections[(size_t)ESection::Instances]);
+
+        std::vector<foray::scene::Mesh*> meshes;
+        for(const MeshEntry& entry : meshEntries)
+        {
+            std::unique_ptr<foray::scene::Mesh> mesh = std::make_unique<foray::scene::Mesh>();
+            for(const PrimitiveEntry& primitiveEntry : primitiveEntries.subspan(entry.FirstPrimitive, entry.PrimitiveCount))
+            {
+                foray::scene::Primitive primitive;
+                primitive.Type               = (foray::scene::Primitive::EType)primitiveEntry.Type;
+                primitive.First              = primitiveEntry.First;
+                primitive.VertexOrIndexCount = primitiveEntry.Count;
+                primitive.MaterialIndex      = primitiveEntry.MaterialIndex;
+                mesh->GetPrimitives().push_back(primitive);
+            }
+            meshes.push_back(mesh.get());
+            geometryStore->GetMeshes().push_back(std::move(mesh));
+        }
+
+        for(const InstanceEntry& entry : instanceEntries)
+        {
+            foray::scene::Node* node = mScene->MakeNode();
+            node->GetTransform()->SetLocalMatrix(entry.Transform);
+            node->MakeComponent<foray::scene::ncomp::MeshInstance>()->SetMesh(meshes[entry.MeshIndex]);
+        }
+        drawDirector->InitOrUpdate();
+    }
+
+    std::vector<SceneCache::SamplerEntry> SceneCache::ReadSamplers(const std::filesystem::path& scenePath)
+    {
+        // Only the texture and sampler declarations are read, images are not decoded
+        tinygltf::TinyGLTF loader;
+        loader.SetImageLoader([](tinygltf::Image*, const int, std::string*, std::string*, int, int, const unsigned char*, int, void*) { return true; }, nullptr);
+        tinygltf::Model model;
+        std::string     error;
+        std::string     warning;
+        bool            loaded = scenePath.extension() == ".glb" ? loader.LoadBinaryFromFile(&model, &error, &warning, scenePath.string())
+                                                                  : loader.LoadASCIIFromFile(&model, &error, &warning, scenePath.string());
+        if(!loaded)
+        {
+            foray::logger()->warn("SceneCache: Failed to read samplers of \"{}\": {}", scenePath.string(), error);
+            return {};
+        }
+
+        auto addressMode = [](int wrap) {
+            switch(wrap)
+            {
+                case TINYGLTF_TEXTURE_WRAP_CLAMP_TO_EDGE:
+                    return VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+                case TINYGLTF_TEXTURE_WRAP_MIRRORED_REPEAT:
+                    return VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
+                default:
+                    return VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            }
+        };
+
+        std::vector<SamplerEntry> samplers;
+        for(const tinygltf::Texture& texture : model.textures)
+        {
+            SamplerEntry& entry = samplers.emplace_back();
+            if(texture.sampler < 0 || texture.sampler >= (int)model.samplers.size())
+            {
+                continue;
+            }
+            const tinygltf::Sampler& sampler = model.samplers[texture.sampler];
+            entry.MagFilter                  = sampler.magFilter == TINYGLTF_TEXTURE_FILTER_NEAREST ? VK_FILTER_NEAREST : VK_FILTER_LINEAR;
+            switch(sampler.minFilter)
+            {
+                case TINYGLTF_TEXTURE_FILTER_NEAREST:
+                    entry.MinFilter = VK_FILTER_NEAREST;
+                    entry.Mipmapped = 0;
+                    break;
+                case TINYGLTF_TEXTURE_FILTER_LINEAR:
+                    entry.Mipmapped = 0;
+                    break;
+                case TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_NEAREST:
+                    entry.MinFilter  = VK_FILTER_NEAREST;
+                    entry.MipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+                    break;
+                case TINYGLTF_TEXTURE_FILTER_LINEAR_MIPMAP_NEAREST:
+                    entry.MipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+                    break;
+                case TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_LINEAR:
+                    entry.MinFilter = VK_FILTER_NEAREST;
+                    break;
+                default:  // LINEAR_MIPMAP_LINEAR or undefined
+                    break;
+            }
+            entry.AddressModeU = addressMode(sampler.wrapS);
+            entry.AddressModeV = addressMode(sampler.wrapT);
+            // Anisotropic filtering would blur textures meant to be sampled with nearest filtering (e.g. pixel art, lookup tables)
+            entry.Anisotropy = entry.MagFilter == VK_FILTER_LINEAR && entry.MinFilter == VK_FILTER_LINEAR ? 1 : 0;
+        }
+        return samplers;
+    }
+
+    bool SceneCache::Capture(const std::filesystem::path& scenePath, Sections& sections)
+    {
+        auto geometryStore = mScene->GetComponent<foray::scene::gcomp::GeometryStore>();
+        auto materials     = mScene->GetComponent<foray::scene::gcomp::MaterialManager>();
+        auto textures      = mScene->GetComponent<foray::scene::gcomp::TextureManager>();
+        auto drawDirector  = mScene->GetComponent<foray::scene::gcomp::DrawDirector>();
+
+        // Meshes are numbered in draw op order, instances are flattened to their global transform
+
+        std::unordered_map<const foray::scene::Mesh*, uint32_t> meshIndices;
+        std::vector<MeshEntry>                                  meshes;
+        std::vector<PrimitiveEntry>                             primitives;
+        std::vector<InstanceEntry>                              instances;
+        for(const foray::scene::gcomp::DrawDirector::DrawOp& drawOp : drawDirector->GetDrawOps())
+        {
+            auto [iter, inserted] = meshIndices.try_emplace(drawOp.Target, (uint32_t)meshes.size());
+            if(inserted)
+            {
+                const std::vector<foray::scene::Primitive>& meshPrimitives = drawOp.Target->GetPrimitives();
+                meshes.push_back(MeshEntry{.FirstPrimitive = (uint32_t)primitives.size(), .PrimitiveCount = (uint32_t)meshPrimitives.size()});
+                for(const foray::scene::Primitive& primitive : meshPrimitives)
+                {
+                    primitives.push_back(PrimitiveEntry{.Type = (uint32_t)primitive.Type, .First = primitive.First, .Count = primitive.VertexOrIndexCount, .MaterialIndex = primitive.MaterialIndex});
+                }
+            }
+            for(foray::scene::ncomp::MeshInstance* instance : drawOp.Instances)
+            {
+                instances.push_back(InstanceEntry{.Transform = instance->GetNode()->GetTransform()->GetGlobalMatrix(), .MeshIndex = iter->second});
+            }
+        }
+        Append(sections[(size_t)ESection::Meshes], meshes);
+        Append(sections[(size_t)ESection::Primitives], primitives);
+        Append(sections[(size_t)ESection::Instances], instances);
+
+        // GPU resources are read back into the sections in one batched transfer
+
+        std::vector<Region>                     regions;
+        std::vector<foray::core::ManagedImage*> images;
+
+        auto readBuffer = [&](foray::core::ManagedBuffer& buffer, ESection section) {
+            std::vector<uint8_t>& out = sections[(size_t)section];
+            out.resize((size_t)buffer.GetSize());
+            if(!out.empty())
+            {
+                regions.push_back(Region{.Host = out.data(), .Size = out.size(), .Buffer = buffer.GetBuffer()});
+            }
+        };
+        readBuffer(geometryStore->GetVerticesBuffer(), ESection::Vertices);
+        readBuffer(geometryStore->GetIndicesBuffer(), ESection::Indices);
+        readBuffer(materials->GetBuffer(), ESection::Materials);
+
+        std::vector<SamplerEntry> samplers = ReadSamplers(scenePath);
+        if(samplers.size() != textures->GetTextures().size())
+        {
+            foray::logger()->warn("SceneCache: {} texture samplers declared for {} textures loaded, caching all textures with the default sampler", samplers.size(),
+                                  textures->GetTextures().size());
+            samplers.assign(textures->GetTextures().size(), SamplerEntry{});
+        }
+
+        std::vector<TextureEntry> textureEntries;
+        VkDeviceSize              texelSize = 0;
+        for(foray::core::CombinedImageSampler& texture : textures->GetTextures())
+        {
+            foray::core::ManagedImage* image  = texture.GetManagedImage();
+            VkExtent2D                 extent = image->GetExtent2D();
+            TextureEntry entry{.Format = (uint32_t)image->GetFormat(), .Width = extent.width, .Height = extent.height, .MipLevels = image->GetCreateInfo().ImageCI.mipLevels, .TexelOffset = texelSize};
+            if(GetTextureTexelSize(image->GetFormat()) == 0)
+            {
+                foray::logger()->warn("SceneCache: Texture format {} is not supported, cache is not written", (uint32_t)image->GetFormat());
+                return false;
+            }
+            for(uint32_t mipLevel = 0; mipLevel < entry.MipLevels; mipLevel++)
+            {
+                entry.TexelSize += GetMipSize(image->GetFormat(), extent.width, extent.height, mipLevel);
+            }
+            texelSize = AlignUp(texelSize + entry.TexelSize, STAGING_ALIGNMENT);
+            entry.Sampler = samplers[textureEntries.size()];
+            textureEntries.push_back(entry);
+            images.push_back(image);
+        }
+        Append(sections[(size_t)ESection::Textures], textureEntries);
+
+        std::vector<uint8_t>& texels = sections[(size_t)ESection::Texels];
+        texels.resize((size_t)texelSize);
+        for(size_t textureIndex = 0; textureIndex < images.size(); textureIndex++)
+        {
+            const TextureEntry& entry     = textureEntries[textureIndex];
+            VkDeviceSize        mipOffset = entry.TexelOffset;
+            for(uint32_t mipLevel = 0; mipLevel < entry.MipLevels; mipLevel++)
+            {
+                VkDeviceSize mipSize = GetMipSize((VkFormat)entry.Format, entry.Width, entry.Height, mipLevel);
+                regions.push_back(Region{.Host = texels.data() + mipOffset, .Size = mipSize, .Image = images[textureIndex], .MipLevel = mipLevel});
+                mipOffset += mipSize;
+            }
+        }
+
+        Transfer(EDirection::Download, regions, images, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        return true;
+    }
+
+    void SceneCache::Write(const std::filesystem::path& cachePath, uint64_t stamp, const Sections& sections)
+    {
+        FileHeader header;
+        memcpy(header.Magic, MAGIC, sizeof(MAGIC));
+        header.Version     = VERSION;
+        header.VertexSize  = (uint32_t)sizeof(foray::scene::Vertex);
+        header.SourceStamp = stamp;
+
+        uint64_t offset = AlignUp(sizeof(header), SECTION_ALIGNMENT);
+        for(size_t i = 0; i < (size_t)ESection::Count; i++)
+        {
+            header.Sections[i] = SectionEntry{.Offset = offset, .Size = sections[i].size()};
+            offset             = AlignUp(offset + sections[i].size(), SECTION_ALIGNMENT);
+        }
+
+        // Written to a temporary file and renamed, so an interrupted write never leaves a cache file behind that looks valid
+        std::filesystem::path tempPath = cachePath;
+        tempPath += ".tmp";
+        uint64_t position = 0;
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            static const char padding[SECTION_ALIGNMENT] = {};
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            position = sizeof(header);
+            for(size_t i = 0; i < (size_t)ESection::Count; i++)
+            {
+                file.write(padding, (std::streamsize)(header.Sections[i].Offset - position));
+                file.write(reinterpret_cast<const char*>(sections[i].data()), (std::streamsize)sections[i].size());
+                position = header.Sections[i].Offset + header.Sections[i].Size;
+            }
+            if(!file)
+            {
+                foray::logger()->warn("SceneCache: Failed to write \"{}\"", tempPath.string());
+                file.close();
+                std::error_code error;
+                std::filesystem::remove(tempPath, error);
+                return;
+            }
+        }
+
+        std::error_code error;
+        std::filesystem::rename(tempPath, cachePath, error);
+        if(error)
+        {
+            foray::logger()->warn("SceneCache: Failed to replace \"{}\": {}", cachePath.string(), error.message());
+            std::filesystem::remove(tempPath, error);
+            return;
+        }
+        mStats.FileBytes = position;
+    }
+
+    void SceneCache::Transfer(EDirection direction, std::vector<Region>& regions, const std::vector<foray::core::ManagedImage*>& images, VkImageLayout oldLayout)
+    {
+        bool upload = direction == EDirection::Upload;
+
+        // Batches: Buffer ranges are split to fill the remaining room of a batch, mip levels are copied whole (the batch size grows to fit the largest)
+
+        struct Chunk
+        {
+            const Region* Source        = nullptr;
+            VkDeviceSize  RegionOffset  = 0;
+            VkDeviceSize  StagingOffset = 0;
+            VkDeviceSize  Size          = 0;
+        };
+
+        VkDeviceSize batchSize = BATCH_SIZE;
+        for(const Region& region : regions)
+        {
+            if(!!region.Image)
+            {
+                batchSize = std::max(batchSize, region.Size);
+            }
+        }
+
+        std::vector<std::vector<Chunk>> batches(1);
+        VkDeviceSize                    stagingSize = 0;
+        VkDeviceSize                    fill        = 0;
+        for(const Region& region : regions)
+        {
+            VkDeviceSize done = 0;
+            while(done < region.Size)
+            {
+                VkDeviceSize offset = AlignUp(fill, STAGING_ALIGNMENT);
+                VkDeviceSize room   = offset < batchSize ? batchSize - offset : 0;
+                VkDeviceSize size   = !!region.Image ? region.Size : std::min(room, region.Size - done);
+                if(size == 0 || size > room)
+                {
+                    batches.emplace_back();
+                    fill = 0;
+                    continue;
+                }
+                batches.back().push_back(Chunk{.Source = &region, .RegionOffset = done, .StagingOffset = offset, .Size = size});
+                fill        = offset + size;
+                done        = done + size;
+                stagingSize = std::max(stagingSize, fill);
+            }
+        }
+        if(stagingSize == 0)
+        {
+            return;
+        }
+
+        struct Slot
+        {
+            foray::core::ManagedBuffer         Staging;
+            foray::core::HostSyncCommandBuffer CmdBuffer;
+            uint32_t                           Batch    = 0;
+            bool                               InFlight = false;
+        };
+        Slot slots[2];
+        for(uint32_t slotIndex = 0; slotIndex < 2; slotIndex++)
+        {
+            foray::core::ManagedBuffer::CreateInfo stagingCi(upload ? VK_BUFFER_USAGE_TRANSFER_SRC_BIT : VK_BUFFER_USAGE_TRANSFER_DST_BIT, stagingSize,
+                                                             VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                                             upload ? VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT : VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+                                                             fmt::format("SceneCache.Staging.{}", slotIndex));
+            slots[slotIndex].Staging.Create(mContext, stagingCi);
+            slots[slotIndex].CmdBuffer.Create(mContext);
+        }
+
+        // Host side: Chunks are copied between the regions and staging memory by all workers
+        auto copyBatch = [&](Slot& slot, uint32_t batchIndex) {
+            struct Copy
+            {
+                uint8_t*     Host    = nullptr;
+                uint8_t*     Staging = nullptr;
+                VkDeviceSize Size    = 0;
+            };
+
+            void* mapped = nullptr;
+            if(!upload)
+            {
+                vmaInvalidateAllocation(mContext->Allocator, slot.Staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+            }
+            slot.Staging.Map(mapped);
+
+            std::vector<Copy> copies;
+            for(const Chunk& chunk : batches[batchIndex])
+            {
+                for(VkDeviceSize offset = 0; offset < chunk.Size; offset += COPY_GRAIN)
+                {
+                    copies.push_back(Copy{.Host    = chunk.Source->Host + chunk.RegionOffset + offset,
+                                          .Staging = reinterpret_cast<uint8_t*>(mapped) + chunk.StagingOffset + offset,
+                                          .Size    = std::min(COPY_GRAIN, chunk.Size - offset)});
+                }
+            }
+            mPool->ParallelFor((uint32_t)copies.size(), [&](uint32_t copyIndex, uint32_t) {
+                const Copy& copy = copies[copyIndex];
+                if(upload)
+                {
+                    memcpy(copy.Staging, copy.Host, (size_t)copy.Size);
+                }
+                else
+                {
+                    memcpy(copy.Host, copy.Staging, (size_t)copy.Size);
+                }
+            });
+
+            if(upload)
+            {
+                vmaFlushAllocation(mContext->Allocator, slot.Staging.GetAllocation(), 0, VK_WHOLE_SIZE);
+            }
+            slot.Staging.Unmap();
+        };
+
+        // Device side: Images are transitioned by the first batch and returned to shader reads by the last. Batches execute in submission order on the same queue
+        VkImageLayout  transferLayout = upload ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        VkAccessFlags2 transferAccess = upload ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_TRANSFER_READ_BIT;
+        auto recordBatch = [&](Slot& slot, uint32_t batchIndex) {
+            slot.CmdBuffer.Begin();
+            VkCommandBuffer cmdBuffer = slot.CmdBuffer.GetCommandBuffer();
+
+            if(batchIndex == 0)
+            {
+                std::vector<VkImageMemoryBarrier2> imgBarriers;
+                for(foray::core::ManagedImage* image : images)
+                {
+                    imgBarriers.push_back(MakeImageBarrier(image, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_2_COPY_BIT, transferAccess,
+                                                           oldLayout, transferLayout));
+                }
+                VkMemoryBarrier2 memBarrier{.sType         = VkStructureType::VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                                            .srcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                            .srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                            .dstStageMask  = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                            .dstAccessMask = transferAccess};
+                VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                         .memoryBarrierCount      = 1,
+                                         .pMemoryBarriers         = &memBarrier,
+                                         .imageMemoryBarrierCount = (uint32_t)imgBarriers.size(),
+                                         .pImageMemoryBarriers    = imgBarriers.data()};
+                vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+            }
+
+            for(const Chunk& chunk : batches[batchIndex])
+            {
+                const Region& region = *chunk.Source;
+                if(!!region.Image)
+                {
+                    VkExtent2D        extent = region.Image->GetExtent2D();
+                    VkBufferImageCopy copy{.bufferOffset      = chunk.StagingOffset,
+                                           .bufferRowLength   = 0,
+                                           .bufferImageHeight = 0,
+                                           .imageSubresource  = VkImageSubresourceLayers{.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .mipLevel = region.MipLevel, .baseArrayLayer = 0, .layerCount = 1},
+                                           .imageOffset       = VkOffset3D{},
+                                           .imageExtent       = VkExtent3D{std::max(1U, extent.width >> region.MipLevel), std::max(1U, extent.height >> region.MipLevel), 1}};
+                    if(upload)
+                    {
+                        vkCmdCopyBufferToImage(cmdBuffer, slot.Staging.GetBuffer(), region.Image->GetImage(), transferLayout, 1, &copy);
+                    }
+                    else
+                    {
+                        vkCmdCopyImageToBuffer(cmdBuffer, region.Image->GetImage(), transferLayout, slot.Staging.GetBuffer(), 1, &copy);
+                    }
+                }
+                else
+                {
+                    if(upload)
+                    {
+                        VkBufferCopy copy{.srcOffset = chunk.StagingOffset, .dstOffset = region.BufferOffset + chunk.RegionOffset, .size = chunk.Size};
+                        vkCmdCopyBuffer(cmdBuffer, slot.Staging.GetBuffer(), region.Buffer, 1, &copy);
+                    }
+                    else
+                    {
+                        VkBufferCopy copy{.srcOffset = region.BufferOffset + chunk.RegionOffset, .dstOffset = chunk.StagingOffset, .size = chunk.Size};
+                        vkCmdCopyBuffer(cmdBuffer, region.Buffer, slot.Staging.GetBuffer(), 1, &copy);
+                    }
+                }
+            }
+
+            std::vector<VkImageMemoryBarrier2> imgBarriers;
+            if(batchIndex + 1 == batches.size())
+            {
+                for(foray::core::ManagedImage* image : images)
+                {
+                    imgBarriers.push_back(MakeImageBarrier(image, VK_PIPELINE_STAGE_2_COPY_BIT, transferAccess, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                                                           transferLayout, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL));
+                }
+            }
+            // Uploads become visible to all later reads, downloads to the host
+            VkMemoryBarrier2 memBarrier{.sType         = VkStructureType::VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                                        .srcStageMask  = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                        .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                        .dstStageMask  = upload ? VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT : VK_PIPELINE_STAGE_2_HOST_BIT,
+                                        .dstAccessMask = upload ? VK_ACCESS_2_MEMORY_READ_BIT : VK_ACCESS_2_HOST_READ_BIT};
+            VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                     .memoryBarrierCount      = 1,
+                                     .pMemoryBarriers         = &memBarrier,
+                                     .imageMemoryBarrierCount = (uint32_t)imgBarriers.size(),
+                                     .pImageMemoryBarriers    = imgBarriers.data()};
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+
+            slot.CmdBuffer.End();
+            slot.CmdBuffer.Submit();
+            slot.Batch    = batchIndex;
+            slot.InFlight = true;
+        };
+
+        auto retire = [&](Slot& slot) {
+            slot.CmdBuffer.WaitForCompletion();
+            if(!upload)
+            {
+                copyBatch(slot, slot.Batch);
+            }
+            slot.InFlight = false;
+        };
+
+        // Workers fill (or drain) one slot while the GPU copies the other
+        for(uint32_t batchIndex = 0; batchIndex < batches.size(); batchIndex++)
+        {
+            Slot& slot = slots[batchIndex % 2];
+            if(slot.InFlight)
+            {
+                retire(slot);
+            }
+            if(upload)
+            {
+                copyBatch(slot, batchIndex);
+            }
+            recordBatch(slot, batchIndex);
+        }
+        uint32_t batchCount = (uint32_t)batches.size();
+        for(uint32_t batchIndex = batchCount > 2 ? batchCount - 2 : 0; batchIndex < batchCount; batchIndex++)
+        {
+            if(slots[batchIndex % 2].InFlight)
+            {
+                retire(slots[batchIndex % 2]);
+            }
+        }
+
+        for(Slot& slot : slots)
+        {
+            slot.CmdBuffer.Destroy();
+            slot.Staging.Destroy();
+        }
+        mStats.BatchCount += batchCount;
+    }
+
+    void SceneCache::Destroy()
+    {
+        for(std::unique_ptr<foray::core::ManagedImage>& texture : mTextures)
+        {
+            texture->Destroy();
+        }
+        mTextures.clear();
+        mPool.reset();
+    }
+}  // namespace cgbuffer
@@ -0,0 +1,201 @@
+#pragma once
+#include "worker-pool.hpp"
+#include <filesystem>
+#include <foray_api.hpp>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace cgbuffer {
+
+    /// @brief Read only memory mapping of a whole file
+    class MappedFile
+    {
+      public:
+        MappedFile() = default;
+        ~MappedFile();
+
+        MappedFile(const MappedFile&)            = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        /// @brief Maps the file. Returns false if it does not exist or can not be mapped
+        bool Open(const std::filesystem::path& path);
+        void Close();
+
+        inline std::span<const uint8_t> GetData() const { return std::span<const uint8_t>(mData, mSize); }
+
+      protected:
+        const uint8_t* mData = nullptr;
+        size_t         mSize = 0;
+#ifdef _WIN32
+        void* mFile    = nullptr;
+        void* mMapping = nullptr;
+#else
+        int mFd = -1;
+#endif
+    };
+
+    /// @brief Binary cache of a loaded scene, stored in the layout it is uploaded to the GPU in
+    /// @details
+    /// How to use: Load instead of foray::gltf::ModelConverter, Destroy after the scene has been destroyed
+    ///  - Load: If the cache file exists and was written from the current versions of the scene files, it is memory mapped and uploaded
+    ///    directly (vertex/index buffers, material buffer, texture mip chains). Otherwise the scene is loaded into a temporary scene with the ModelConverter,
+    ///    read back, written to the cache file for the next run and restored from the read back data
+    /// Uploads go through two staging buffers of BATCH_SIZE: Workers copy the next batch out of the mapping while the GPU copies the previous one.
+    /// On a miss, textures are decoded serially by the ModelConverter, only read back and packing are batched.
+    /// The cache holds a static snapshot of the scene: Node hierarchies are flattened to one node per mesh instance (with its global transform at load time),
+    /// animations and glTF cameras are not stored. A miss restores the same snapshot, so the scene behaves the same on every run.
+    /// Only scenes with texture formats the cache does not store keep their hierarchy and animations (loaded directly, not cached). Sampler state (filters, mipmapping, wrap modes) is stored per texture as declared in the glTF file.
+    /// The cache is invalidated by any change (size, modification time) of a file in the scenes directory, and by a change of VERSION or the vertex layout.
+    class SceneCache
+    {
+      public:
+        /// @brief Incremented with every change to the file layout
+        inline static constexpr uint32_t VERSION = 2;
+        /// @brief Size of a single staging buffer. Raised to the size of the largest texture mip level if that is larger
+        inline static constexpr VkDeviceSize BATCH_SIZE = 64ULL << 20;
+
+        struct Stats
+        {
+            /// @brief True if the scene was loaded from the cache file
+            bool Hit = false;
+            /// @brief Wall time of Load(), including writing the cache file on a miss
+            double   LoadMs     = 0.0;
+            uint64_t FileBytes  = 0;
+            uint32_t BatchCount = 0;
+        };
+
+        /// @param scenePath glTF file
+        /// @param cachePath Cache file, (re)written if missing or outdated
+        /// @param threadCount Workers copying between the file and staging memory. 0 selects std::thread::hardware_concurrency()
+        void Load(foray::core::Context* context, foray::scene::Scene* scene, std::string_view scenePath, const std::filesystem::path& cachePath, uint32_t threadCount = 0);
+
+        inline const Stats& GetStats() const { return mStats; }
+
+        void Destroy();
+
+      protected:
+        enum class ESection : uint32_t
+        {
+            Vertices,
+            Indices,
+            Materials,
+            Meshes,
+            Primitives,
+            Instances,
+            Textures,
+            Texels,
+            Count
+        };
+
+        struct SectionEntry
+        {
+            /// @brief Aligned to SECTION_ALIGNMENT, so sections can be copied from the mapping page by page
+            uint64_t Offset = 0;
+            uint64_t Size   = 0;
+        };
+
+        struct FileHeader
+        {
+            char         Magic[8]{};
+            uint32_t     Version     = 0;
+            uint32_t     VertexSize  = 0;
+            uint64_t     SourceStamp = 0;
+            SectionEntry Sections[(size_t)ESection::Count];
+        };
+
+        struct MeshEntry
+        {
+            uint32_t FirstPrimitive = 0;
+            uint32_t PrimitiveCount = 0;
+        };
+
+        struct PrimitiveEntry
+        {
+            uint32_t Type          = 0;
+            uint32_t First         = 0;
+            uint32_t Count         = 0;
+            int32_t  MaterialIndex = -1;
+        };
+
+        struct InstanceEntry
+        {
+            glm::mat4 Transform = glm::mat4(1.f);
+            uint32_t  MeshIndex = 0;
+            uint32_t  Padding[3]{};
+        };
+
+        /// @brief Sampler of a texture, translated from its glTF sampler. Defaults to a trilinear, repeating sampler
+        struct SamplerEntry
+        {
+            uint32_t MagFilter    = VK_FILTER_LINEAR;
+            uint32_t MinFilter    = VK_FILTER_LINEAR;
+            uint32_t MipmapMode   = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+            uint32_t AddressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            uint32_t AddressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            uint32_t AddressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            /// @brief 0 if the glTF min filter does not use mip levels, sampling level 0 only
+            uint32_t Mipmapped = 1;
+            /// @brief 1 to enable anisotropic filtering with the devices maximum anisotropy
+            uint32_t Anisotropy = 1;
+        };
+
+        struct TextureEntry
+        {
+            uint32_t     Format      = 0;
+            uint32_t     Width       = 0;
+            uint32_t     Height      = 0;
+            uint32_t     MipLevels   = 0;
+            /// @brief Offset of the mip chain (level 0 first, tightly packed) in the texel section
+            uint64_t     TexelOffset = 0;
+            uint64_t     TexelSize   = 0;
+            SamplerEntry Sampler;
+        };
+
+        /// @brief Bytes of the cache file and their GPU counterpart: A range of a buffer, or a whole mip level of an image
+        struct Region
+        {
+            uint8_t*                   Host         = nullptr;
+            VkDeviceSize               Size         = 0;
+            VkBuffer                   Buffer       = nullptr;
+            VkDeviceSize               BufferOffset = 0;
+            foray::core::ManagedImage* Image        = nullptr;
+            uint32_t                   MipLevel     = 0;
+        };
+
+        enum class EDirection
+        {
+            Upload,
+            Download
+        };
+
+        using Sections = std::vector<uint8_t>[(size_t)ESection::Count];
+
+        /// @brief Hash of the path, size and modification time of every file in the scenes directory (except the cache file), VERSION and the vertex layout
+        static uint64_t     StampSources(const std::filesystem::path& scenePath, const std::filesystem::path& cachePath);
+        /// @brief Returns 0 for formats the cache does not store (block compressed, packed)
+        static VkDeviceSize GetMipSize(VkFormat format, uint32_t width, uint32_t height, uint32_t mipLevel);
+
+        /// @brief Checks all cross references between sections, so Restore() can not index out of bounds
+        static bool Validate(const std::span<const uint8_t>* sections);
+        /// @brief Sampler of every texture of the glTF file, in the order of its textures array (the order the ModelConverter creates them in).
+        /// Returns an empty list if the file can not be parsed
+        static std::vector<SamplerEntry> ReadSamplers(const std::filesystem::path& scenePath);
+
+        bool TryLoad(const std::filesystem::path& cachePath, uint64_t stamp);
+        void Restore(const std::span<const uint8_t>* sections);
+        bool Capture(const std::filesystem::path& scenePath, Sections& sections);
+        void Write(const std::filesystem::path& cachePath, uint64_t stamp, const Sections& sections);
+
+        /// @brief Copies regions between host memory and the GPU in staging batches. Images (all mip levels) are transitioned from oldLayout
+        /// before the first batch and to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL after the last one
+        void Transfer(EDirection direction, std::vector<Region>& regions, const std::vector<foray::core::ManagedImage*>& images, VkImageLayout oldLayout);
+
+        foray::core::Context*                                   mContext = nullptr;
+        foray::scene::Scene*                                    mScene   = nullptr;
+        std::unique_ptr<WorkerPool>                             mPool;
+        std::vector<std::unique_ptr<foray::core::ManagedImage>> mTextures;
+        Stats                                                   mStats;
+    };
+}  // namespace cgbuffer
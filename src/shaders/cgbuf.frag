@@ -5,6 +5,11 @@
 #define INTERFACEMODE in
 #include "shaderinterface.glsl"
 
+#if DEPTH_EQUAL_PASS
+// Additional pass of a split layout, or depth shared from a pre-pass: Depth is final, so test before shading even if fragments may discard
+layout(early_fragment_tests) in;
+#endif
+
 #if OUT_0
 layout(location = 0) out OUT_0_TYPE out0;
 #endif
@@ -82,7 +87,7 @@ void main()
         #define EXISTS_ISOPAQUE 1
     #endif
 #endif
-#if ALPHATEST
+#if ALPHATEST && !DEPTH_EQUAL_PASS
     if (!isOpaque)
     {
         discard;
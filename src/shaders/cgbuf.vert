@@ -9,6 +9,9 @@ layout(location = 3) in vec2 inUV;            // UV coordinates
 #define INTERFACEMODE out
 #include "shaderinterface.glsl"
 
+// Split layouts depth test against positions of another pipeline variant with VK_COMPARE_OP_EQUAL
+invariant gl_Position;
+
 #include "bindpoints.glsl"
 #include "common/gltf_pushc.glsl"
 #include "common/camera.glsl"
@@ -29,11 +32,12 @@ void main()
 #if INTERFACE_WORLDPOSOLD
     WorldPosOld     = (ModelMatPrev * vec4(inPos, 1.f)).xyz;
 #endif
-#ifndef INTERFACE_DEVICEPOS
-    vec4 DevicePos;
+    // In tiled mode, only ProjectionMatrix is cropped to the tile. Device positions stay those of the full output, so motion matches untiled renders
+    vec4 worldPos = ModelMat * vec4(inPos, 1.f);
+    gl_Position     = Camera.ProjectionMatrix * (Camera.ViewMatrix * worldPos);
+#if INTERFACE_DEVICEPOS
+    DevicePos    = Camera.ProjectionViewMatrix * worldPos;
 #endif
-    DevicePos    = Camera.ProjectionViewMatrix * ModelMat * vec4(inPos, 1.f);
-    gl_Position     = DevicePos;
 #if INTERFACE_DEVICEPOSOLD
     DevicePosOld = Camera.PreviousProjectionViewMatrix * ModelMatPrev * vec4(inPos, 1.f);
 #endif
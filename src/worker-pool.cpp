@@ -0,0 +1,97 @@
+#include "worker-pool.hpp"
+#include <algorithm>
+
+namespace cgbuffer {
+
+    WorkerPool::WorkerPool(uint32_t threadCount)
+    {
+        mThreadCount = threadCount > 0 ? threadCount : std::max(1U, std::thread::hardware_concurrency());
+        mRanges      = std::make_unique<Range[]>(mThreadCount);
+        for(uint32_t workerIndex = 1; workerIndex < mThreadCount; workerIndex++)
+        {
+            mThreads.emplace_back(&WorkerPool::WorkerMain, this, workerIndex);
+        }
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mShutdown = true;
+        }
+        mWake.notify_all();
+        for(std::thread& thread : mThreads)
+        {
+            thread.join();
+        }
+    }
+
+    void WorkerPool::ParallelFor(uint32_t count, const std::function<void(uint32_t, uint32_t)>& func)
+    {
+        if(count == 0)
+        {
+            return;
+        }
+        uint32_t slice = (count + mThreadCount - 1) / mThreadCount;
+        for(uint32_t workerIndex = 0; workerIndex < mThreadCount; workerIndex++)
+        {
+            uint32_t begin = std::min(workerIndex * slice, count);
+            mRanges[workerIndex].Next.store(begin, std::memory_order_relaxed);
+            mRanges[workerIndex].End = std::min(begin + slice, count);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJob     = &func;
+            mPending = mThreadCount - 1;
+            mGeneration++;
+        }
+        mWake.notify_all();
+        RunRanges(0);
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDone.wait(lock, [this] { return mPending == 0; });
+        mJob = nullptr;
+    }
+
+    void WorkerPool::WorkerMain(uint32_t workerIndex)
+    {
+        uint64_t generation = 0;
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mWake.wait(lock, [&] { return mShutdown || mGeneration != generation; });
+                if(mShutdown)
+                {
+                    return;
+                }
+                generation = mGeneration;
+            }
+            RunRanges(workerIndex);
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if(--mPending == 0)
+                {
+                    mDone.notify_one();
+                }
+            }
+        }
+    }
+
+    void WorkerPool::RunRanges(uint32_t workerIndex)
+    {
+        // Own range first, then steal from the others
+        for(uint32_t offset = 0; offset < mThreadCount; offset++)
+        {
+            Range& range = mRanges[(workerIndex + offset) % mThreadCount];
+            while(true)
+            {
+                uint32_t index = range.Next.fetch_add(1, std::memory_order_relaxed);
+                if(index >= range.End)
+                {
+                    break;
+                }
+                (*mJob)(index, workerIndex);
+            }
+        }
+    }
+}  // namespace cgbuffer
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cgbuffer {
+
+    /// @brief Fixed size thread pool executing index ranges
+    /// @details Every worker starts on its own contiguous slice of the index range and steals from the other slices once it runs dry.
+    /// The calling thread participates as worker 0.
+    class WorkerPool
+    {
+      public:
+        /// @param threadCount Total worker count including the calling thread. 0 selects std::thread::hardware_concurrency()
+        explicit WorkerPool(uint32_t threadCount = 0);
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool&)            = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        inline uint32_t GetThreadCount() const { return mThreadCount; }
+
+        /// @brief Invokes func(index, workerIndex) for every index in [0, count). Blocks until all invocations have returned
+        void ParallelFor(uint32_t count, const std::function<void(uint32_t, uint32_t)>& func);
+
+      protected:
+        struct alignas(64) Range
+        {
+            std::atomic<uint32_t> Next = 0;
+            uint32_t              End  = 0;
+        };
+
+        void WorkerMain(uint32_t workerIndex);
+        void RunRanges(uint32_t workerIndex);
+
+        uint32_t                                       mThreadCount = 0;
+        std::vector<std::thread>                       mThreads;
+        std::unique_ptr<Range[]>                       mRanges;
+        const std::function<void(uint32_t, uint32_t)>* mJob = nullptr;
+        std::mutex                                     mMutex;
+        std::condition_variable                        mWake;
+        std::condition_variable                        mDone;
+        uint64_t                                       mGeneration = 0;
+        uint32_t                                       mPending    = 0;
+        bool                                           mShutdown   = false;
+    };
+}  // namespace cgbuffer
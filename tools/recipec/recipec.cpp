@@ -0,0 +1,263 @@
+// cgbuffer-recipec: Compiles a CRaster recipe file to SPIR-V ahead of time and writes a C++ source embedding the result
+// Usage: cgbuffer-recipec <recipe.json> <output.cpp> <glslc> <cgbuf shader dir> <foray shader dir>
+
+#include "depth-prepass.hpp"
+#include "gbuffer-stats.hpp"
+#include "precompiled-shaders.hpp"
+#include "recipe-file.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace cgbuffer {
+    namespace {
+        std::string ReadText(const std::filesystem::path& path)
+        {
+            std::ifstream file(path);
+            FORAY_ASSERTFMT(file.good(), "Failed to open \"{}\"", path.string());
+            std::stringstream contents;
+            contents << file.rdbuf();
+            return contents.str();
+        }
+
+        /// @brief Writes the shader with the definitions pasted as #define lines after #version, so expressions do not need to survive command line quoting
+        void WriteVariantSource(const std::filesystem::path& shaderPath, const std::vector<std::string>& definitions, const std::filesystem::path& outPath)
+        {
+            std::string source     = ReadText(shaderPath);
+            size_t      versionEnd = source.find('\n');
+            FORAY_ASSERTFMT(versionEnd != std::string::npos, "\"{}\" does not start with a #version line", shaderPath.string());
+
+            std::ofstream out(outPath);
+            out << source.substr(0, versionEnd + 1);
+            for(const std::string& definition : definitions)
+            {
+                size_t      split = definition.find('=');
+                std::string name  = definition.substr(0, split);
+                std::string value = split == std::string::npos ? "1" : definition.substr(split + 1);
+                if(value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                {
+                    value = value.substr(1, value.size() - 2);
+                }
+                out << "#define " << name << " " << value << "\n";
+            }
+            out << "#line 2\n" << source.substr(versionEnd + 1);
+        }
+
+        std::vector<uint32_t> CompileVariant(const std::string&              glslc,
+                                             const std::filesystem::path&    sourcePath,
+                                             const std::filesystem::path&    spirvPath,
+                                             const std::vector<std::string>& includeDirs)
+        {
+            std::string command = fmt::format("\"{}\" --target-env=vulkan1.3 -O", glslc);
+            for(const std::string& dir : includeDirs)
+            {
+                command += fmt::format(" -I \"{}\"", dir);
+            }
+            command += fmt::format(" -o \"{}\" \"{}\"", spirvPath.string(), sourcePath.string());
+            FORAY_ASSERTFMT(std::system(command.c_str()) == 0, "Shader compilation failed: {}", command);
+
+            std::ifstream file(spirvPath, std::ios::binary | std::ios::ate);
+            FORAY_ASSERTFMT(file.good(), "Failed to open \"{}\"", spirvPath.string());
+            size_t size = (size_t)file.tellg();
+            FORAY_ASSERTFMT(size % sizeof(uint32_t) == 0, "\"{}\" is not a SPIR-V binary", spirvPath.string());
+            std::vector<uint32_t> words(size / sizeof(uint32_t));
+            file.seekg(0);
+            file.read(reinterpret_cast<char*>(words.data()), size);
+            return words;
+        }
+
+        void WriteWords(std::ostream& out, std::string_view name, const std::vector<uint32_t>& words)
+        {
+            out << "    const uint32_t " << name << "[] = {";
+            for(size_t i = 0; i < words.size(); i++)
+            {
+                out << (i % 8 == 0 ? "\n        " : " ") << fmt::format("0x{:08x},", words[i]);
+            }
+            out << "\n    };\n";
+        }
+
+        /// @brief Writes text as adjacent string literals, one per line, to stay below compiler literal length limits
+        void WriteString(std::ostream& out, std::string_view name, std::string_view text)
+        {
+            out << "    const char " << name << "[] =";
+            std::string line;
+            for(size_t i = 0; i <= text.size(); i++)
+            {
+                if(i == text.size() || text[i] == '\n')
+                {
+                    out << "\n        \"" << line << (i == text.size() ? "\"" : "\\n\"");
+                    line.clear();
+                    continue;
+                }
+                char c = text[i];
+                switch(c)
+                {
+                    case '"':
+                        line += "\\\"";
+                        break;
+                    case '\\':
+                        line += "\\\\";
+                        break;
+                    case '\r':
+                        break;
+                    case '\t':
+                        line += "\\t";
+                        break;
+                    default:
+                        line += c;
+                        break;
+                }
+            }
+            out << ";\n";
+        }
+
+        /// @brief Compiles one variant of a compute shader per definition set and writes its registered entries
+        void WriteComputeEntries(std::ostream&                                out,
+                                 const std::string&                           glslc,
+                                 const std::filesystem::path&                 shaderDir,
+                                 const std::filesystem::path&                 workDir,
+                                 const std::vector<std::string>&              includeDirs,
+                                 std::string_view                             shader,
+                                 std::string_view                             prefix,
+                                 const std::vector<std::vector<std::string>>& variants)
+        {
+            for(uint32_t variant = 0; variant < variants.size(); variant++)
+            {
+                std::filesystem::path source = workDir / fmt::format("{}.{}.comp", prefix, variant);
+                WriteVariantSource(shaderDir / shader, variants[variant], source);
+                std::vector<uint32_t> spirv = CompileVariant(glslc, source, workDir / fmt::format("{}.{}.comp.spv", prefix, variant), includeDirs);
+
+                out << "\n";
+                WriteWords(out, fmt::format("{}Spirv{}", prefix, variant), spirv);
+                WriteString(out, fmt::format("{}Definitions{}", prefix, variant), PrecompiledShaderRegistry::JoinDefinitions(variants[variant]));
+                out << fmt::format("    const cgbuffer::PrecompiledShaders {0}Shaders{1}{{.Name         = Name,\n"
+                                   "                                                 .Shader       = \"{2}\",\n"
+                                   "                                                 .Definitions  = {0}Definitions{1},\n"
+                                   "                                                 .RecipeJson   = RecipeJson,\n"
+                                   "                                                 .ComputeSpirv = {0}Spirv{1}}};\n"
+                                   "    [[maybe_unused]] const bool {0}Registered{1} = cgbuffer::PrecompiledShaderRegistry::Register(&{0}Shaders{1});\n",
+                                   prefix, variant, shader);
+            }
+        }
+
+        int Run(int argc, char** argv)
+        {
+            if(argc != 6)
+            {
+                std::cerr << "Usage: cgbuffer-recipec <recipe.json> <output.cpp> <glslc> <cgbuf shader dir> <foray shader dir>\n";
+                return 1;
+            }
+            std::filesystem::path recipePath(argv[1]);
+            std::filesystem::path outputPath(argv[2]);
+            std::string           glslc(argv[3]);
+            std::filesystem::path shaderDir(argv[4]);
+            std::string           forayShaderDir(argv[5]);
+
+            std::string recipeJson = ReadText(recipePath);
+            RecipeFile  recipe     = RecipeFile::Parse(recipeJson, recipePath.string());
+            if(recipe.Name.empty())
+            {
+                recipe.Name = recipePath.stem().string();
+            }
+
+            // Definitions are computed by the same code CRaster::Build() uses, so the embedded variants are found at runtime.
+            // How outputs are split into passes depends on the devices color attachment limit, so variants for common limits are compiled
+            CRaster raster;
+            recipe.ApplyTo(raster);
+            std::vector<std::string> variants;
+            auto                     addVariants = [&](const CRaster& source, uint32_t maxColorAttachments) {
+                for(const std::vector<std::string>& definitions : source.GetShaderDefinitions(maxColorAttachments))
+                {
+                    std::string joined = PrecompiledShaderRegistry::JoinDefinitions(definitions);
+                    if(std::find(variants.begin(), variants.end(), joined) == variants.end())
+                    {
+                        variants.push_back(joined);
+                    }
+                }
+            };
+
+            // Variants writing depth and variants reading it from a depth pre-pass (the source is only referenced, never built)
+            DepthPrepass prepass;
+            for(CRaster* depthSource : {(CRaster*)nullptr, (CRaster*)&prepass})
+            {
+                raster.SetDepthSource(depthSource);
+                for(uint32_t maxColorAttachments : {4U, 8U, CRaster::MAX_PASS_OUTPUT_COUNT})
+                {
+                    addVariants(raster, maxColorAttachments);
+                }
+            }
+
+            // The depth pre-pass itself, with and without alpha test
+            addVariants(prepass, CRaster::MAX_PASS_OUTPUT_COUNT);
+            prepass.EnableBuiltInFeature(CRaster::BuiltInFeaturesFlagBits::ALPHATEST);
+            addVariants(prepass, CRaster::MAX_PASS_OUTPUT_COUNT);
+
+            std::filesystem::path workDir = outputPath.parent_path() / (recipe.Name + ".spv");
+            std::filesystem::create_directories(workDir);
+            std::vector<std::string> includeDirs{shaderDir.string(), forayShaderDir};
+
+            std::ofstream out(outputPath);
+            out << "// Generated by cgbuffer-recipec from " << recipePath.filename().string() << ". Do not edit.\n";
+            out << "#include \"precompiled-shaders.hpp\"\n\n";
+            out << "namespace {\n";
+            WriteString(out, "Name", recipe.Name);
+            WriteString(out, "RecipeJson", recipeJson);
+
+            const char* stages[2] = {"vert", "frag"};
+            for(uint32_t variant = 0; variant < variants.size(); variant++)
+            {
+                std::vector<std::string> definitions;
+                std::stringstream        lines(variants[variant]);
+                for(std::string line; std::getline(lines, line);)
+                {
+                    definitions.push_back(line);
+                }
+
+                std::vector<uint32_t> spirv[2];
+                for(uint32_t i = 0; i < 2; i++)
+                {
+                    std::filesystem::path source = workDir / fmt::format("cgbuf.{}.{}", variant, stages[i]);
+                    WriteVariantSource(shaderDir / fmt::format("cgbuf.{}", stages[i]), definitions, source);
+                    spirv[i] = CompileVariant(glslc, source, workDir / fmt::format("cgbuf.{}.{}.spv", variant, stages[i]), includeDirs);
+                }
+
+                out << "\n";
+                WriteWords(out, fmt::format("VertexSpirv{}", variant), spirv[0]);
+                WriteWords(out, fmt::format("FragmentSpirv{}", variant), spirv[1]);
+                WriteString(out, fmt::format("Definitions{}", variant), variants[variant]);
+                out << fmt::format("    const cgbuffer::PrecompiledShaders Shaders{0}{{.Name          = Name,\n"
+                                   "                                                 .Shader        = \"cgbuf\",\n"
+                                   "                                                 .Definitions   = Definitions{0},\n"
+                                   "                                                 .RecipeJson    = RecipeJson,\n"
+                                   "                                                 .VertexSpirv   = VertexSpirv{0},\n"
+                                   "                                                 .FragmentSpirv = FragmentSpirv{0}}};\n"
+                                   "    [[maybe_unused]] const bool Registered{0} = cgbuffer::PrecompiledShaderRegistry::Register(&Shaders{0});\n",
+                                   variant);
+            }
+
+            // Derived outputs, for either split between the graphics and the compute queue
+            WriteComputeEntries(out, glslc, shaderDir, workDir, includeDirs, "cgbufderive.comp", "Derive", raster.GetDeriveShaderDefinitions());
+            // Every reduction GBufferStats may record on the outputs
+            WriteComputeEntries(out, glslc, shaderDir, workDir, includeDirs, "gbufstats.comp", "Stats", GBufferStats::GetShaderDefinitions(raster));
+            out << "}  // namespace\n";
+            FORAY_ASSERTFMT(out.good(), "Failed to write \"{}\"", outputPath.string());
+            return 0;
+        }
+    }  // namespace
+}  // namespace cgbuffer
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return cgbuffer::Run(argc, argv);
+    }
+    catch(const std::exception& ex)
+    {
+        std::cerr << "cgbuffer-recipec: " << ex.what() << "\n";
+        return 1;
+    }
+}